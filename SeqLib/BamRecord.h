@@ -8,6 +8,8 @@
 #include <sstream>
 #include <cassert>
 #include <algorithm>
+#include <iterator>
+#include <cstring>
 
 extern "C" {
 #include "htslib/htslib/hts.h"
@@ -46,6 +48,49 @@ static const uint8_t CIGTAB[255] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
 
 namespace SeqLib {
 
+/** Decode a 4-bit packed BAM sequence into ACTGN characters
+ *
+ * Uses an SSSE3 or AVX2 kernel when the CPU supports it (selected once
+ * at runtime), otherwise falls back to a BASES table lookup.
+ * @param p Packed sequence, as from bam_get_seq
+ * @param len Number of bases to decode
+ * @param out Buffer of at least len bytes. Not null-terminated.
+ */
+void DecodeBamSequence(const uint8_t* p, int32_t len, char* out);
+
+/** Convert raw BAM phred scores to characters by adding an offset
+ *
+ * Vectorized in the same way as DecodeBamSequence
+ * @param q Raw quality scores, as from bam_get_qual
+ * @param len Number of scores to convert
+ * @param out Buffer of at least len bytes. Not null-terminated.
+ * @param offset Encoding offset for phred quality scores (eg 33)
+ */
+void DecodeBamQualities(const uint8_t* q, int32_t len, char* out, int offset);
+
+/** Append the decimal form of an integer to a kstring
+ *
+ * Converts two digits at a time from a lookup table, without the
+ * locale handling of std::stringstream.
+ */
+void AppendDecimal(kstring_t* s, int64_t v);
+
+/** Append the decimal form of an integer to a string */
+void AppendDecimal(std::string& s, int64_t v);
+
+/** Append raw sam.h cigar ops as text (eg 35M25S) to a kstring, or "*" if n is 0 */
+void AppendCigarString(const uint32_t* c, size_t n, kstring_t* s);
+
+/** Append one alignment as a line of SAM text (no trailing newline)
+ *
+ * Writes the same fields, in the same format, as htslib sam_format1.
+ * @param b Alignment to format
+ * @param h Header to look up reference names. If NULL, a reference is written 
+ * as its id + 1 (as in BamRecord::ChrName())
+ * @param s kstring to append to. It is grown as needed, but not cleared
+ */
+void FormatSamRecord(const bam1_t* b, const bam_hdr_t* h, kstring_t* s);
+
 /** Basic container for a single cigar operation
  *
  * Stores a single cigar element in a compact 32bit form (same as HTSlib).
@@ -95,48 +140,88 @@ class CigarField {
 
  private:
 
+  // only for the inline storage of Cigar
+  CigarField() : data(0) {}
+
   // first 4 bits hold op, last 28 hold len
   uint32_t data;
   
 };
 
+/** Parse a CIGAR string (eg 54M46S) into raw sam.h cigar ops
+ *
+ * Single pass, and does no allocation. If the string has more than
+ * max_ops ops, only the first max_ops are written, but the full count
+ * is still returned (so a caller can size a buffer and call again).
+ * @param cig CIGAR string, or "*" for no ops. Does not need to be null-terminated
+ * @param len Number of characters in cig
+ * @param out Buffer of at least max_ops ops to write to
+ * @param max_ops Capacity of out
+ * @return Number of ops in the string
+ * @exception Throws an invalid_argument if the string is not a valid CIGAR
+ */
+size_t ParseCigarString(const char* cig, size_t len, uint32_t* out, size_t max_ops);
+
 /** CIGAR for a single gapped alignment
  *
- * Constructed as a vector of CigarField objects. 
+ * Stored as a contiguous array of CigarField objects. CIGARs of up to
+ * INLINE_OPS ops (the vast majority of short-read alignments) are kept
+ * inside the object itself, so building one does not touch the heap.
  */
  class Cigar {
 
  public:
 
+   static const size_t INLINE_OPS = 8; ///< Number of ops stored without a heap allocation
+
    /** Construct an empty CIGAR */
-   Cigar() {} 
+   Cigar() : m_data(m_inline), m_size(0), m_capacity(INLINE_OPS) {} 
 
    /** Construct from a CIGAR string 
-    * @param cig CIGAR string, e.g. 54M46S
+    * @param cig CIGAR string, e.g. 54M46S. "*" (as in SAM) gives an empty CIGAR
+    * @exception Throws an invalid_argument if the string is not a valid CIGAR
     */
    Cigar(const std::string& cig);
 
-   typedef std::vector<CigarField>::iterator iterator; ///< Iterator for move between CigarField ops
-   typedef std::vector<CigarField>::const_iterator const_iterator; ///< Iterator (const) for move between CigarField ops
-   iterator begin() { return m_data.begin(); } ///< Iterator (aka std::vector<CigarField>.begin()
-   iterator end()   { return m_data.end(); } ///< Iterator (aka std::vector<CigarField>.end()
-   const_iterator begin() const { return m_data.begin(); } ///< Iterator (aka std::vector<CigarField>.begin()
-   const_iterator end() const   { return m_data.end(); } ///< Iterator (aka std::vector<CigarField>.end() 
+   /** Construct from n raw sam.h cigar ops (eg from bam_get_cigar) */
+   Cigar(const uint32_t* c, size_t n);
+
+   Cigar(const Cigar& c);
+
+   Cigar& operator=(const Cigar& c);
+
+#ifdef HAVE_C11
+   Cigar(Cigar&& c) noexcept;
+
+   Cigar& operator=(Cigar&& c) noexcept;
+#endif
+
+   ~Cigar() { if (m_data != m_inline) delete[] m_data; }
+
+   typedef CigarField* iterator; ///< Iterator for move between CigarField ops
+   typedef const CigarField* const_iterator; ///< Iterator (const) for move between CigarField ops
+   iterator begin() { return m_data; } ///< Iterator to the first op
+   iterator end()   { return m_data + m_size; } ///< Iterator to one past the last op
+   const_iterator begin() const { return m_data; } ///< Iterator to the first op
+   const_iterator end() const   { return m_data + m_size; } ///< Iterator to one past the last op
 
    /** Const reference to last cigar op */
-   inline const CigarField& back() const { return m_data.back(); }
+   inline const CigarField& back() const { return m_data[m_size - 1]; }
 
    /** Reference to last cigar op */
-   inline CigarField& back() { return m_data.back(); }
+   inline CigarField& back() { return m_data[m_size - 1]; }
 
    /** Const reference to first cigar op */
-   inline const CigarField& front() const { return m_data.front(); }
+   inline const CigarField& front() const { return m_data[0]; }
 
    /** Reference to first cigar op */
-   inline CigarField& front() { return m_data.front(); }
+   inline CigarField& front() { return m_data[0]; }
 
    /** Returns the number of cigar ops */
-   inline size_t size() const { return m_data.size(); }
+   inline size_t size() const { return m_size; }
+
+   /** Return true if there are no cigar ops */
+   inline bool empty() const { return !m_size; }
 
    /** Returns the i'th cigar op */
    inline CigarField& operator[](size_t i) { return m_data[i]; }
@@ -147,8 +232,7 @@ class CigarField {
    /** Return the sum of all of the lengths for all kinds */
    inline int TotalLength() const {
      int t = 0;
-     for (Cigar::const_iterator c = m_data.begin(); c != m_data.end(); ++c)
-       //for (auto& c : m_data)
+     for (Cigar::const_iterator c = begin(); c != end(); ++c)
        t += c->Length();
      return t;
    }
@@ -156,7 +240,7 @@ class CigarField {
    /** Return the number of query-consumed bases */
    inline int NumQueryConsumed() const {
      int out = 0;
-     for (Cigar::const_iterator c = m_data.begin(); c != m_data.end(); ++c)
+     for (Cigar::const_iterator c = begin(); c != end(); ++c)
        if (c->ConsumesQuery())
 	 out += c->Length();
      return out;
@@ -165,8 +249,7 @@ class CigarField {
    /** Return the number of reference-consumed bases */
    inline int NumReferenceConsumed() const {
      int out = 0;
-     //    for (auto& c : m_data)
-     for (Cigar::const_iterator c = m_data.begin(); c != m_data.end(); ++c)
+     for (Cigar::const_iterator c = begin(); c != end(); ++c)
        if (c->ConsumesReference())
 	 out += c->Length();
      return out;
@@ -174,9 +257,17 @@ class CigarField {
 
    /** Add a new cigar op */
    inline void add(const CigarField& c) { 
-     m_data.push_back(c); 
+     if (m_size == m_capacity)
+       reserve(m_capacity * 2);
+     m_data[m_size++] = c; 
    }
 
+   /** Make room for at least n ops without further allocation */
+   void reserve(size_t n);
+
+   /** Remove all of the ops (keeps the capacity) */
+   void clear() { m_size = 0; }
+
    /** Return whether two Cigar objects are equivalent */
    bool operator==(const Cigar& c) const;
    
@@ -186,15 +277,594 @@ class CigarField {
   /** Print cigar string (eg 35M25S) */
   friend std::ostream& operator<<(std::ostream& out, const Cigar& c);
   
-   
  private:
-   
-   std::vector<CigarField> m_data; // should make this simpler
+
+   CigarField* m_data; // points to m_inline, or to the heap once grown
+   uint32_t m_size;
+   uint32_t m_capacity;
+   CigarField m_inline[INLINE_OPS];
+
+   // copy n raw ops in, replacing the current contents
+   void assign(const uint32_t* c, size_t n);
 
  };
 
  typedef SeqHashMap<std::string, size_t> CigarMap;
 
+/** Read-only view of the read name held in a bam1_t
+ *
+ * Pointer + length only, no copy. Only valid as long as the underlying
+ * BamRecord is alive and its name is not modified.
+ */
+class QnameView {
+
+ public:
+
+  typedef const char* const_iterator; ///< Iterator over the characters of the name
+
+  /** Construct an empty view */
+  QnameView() : m_data(NULL), m_len(0) {}
+
+  /** Construct a view over len characters starting at d */
+  QnameView(const char* d, size_t len) : m_data(d), m_len(len) {}
+
+  const_iterator begin() const { return m_data; } ///< Iterator to first character
+  const_iterator end() const { return m_data + m_len; } ///< Iterator to one past last character
+
+  /** Return the number of characters (not including the null terminator) */
+  inline size_t size() const { return m_len; }
+
+  /** Return true if the name is empty */
+  inline bool empty() const { return !m_len; }
+
+  /** Return the i'th character */
+  inline char operator[](size_t i) const { return m_data[i]; }
+
+  /** Return a pointer to the null-terminated name */
+  inline const char* data() const { return m_data; }
+
+  /** Return an owning copy of the name */
+  inline std::string str() const { return std::string(m_data, m_len); }
+
+  /** Compare to a string without allocating */
+  inline bool operator==(const std::string& s) const { return s.size() == m_len && !s.compare(0, m_len, m_data, m_len); }
+
+  /** Compare to a string without allocating */
+  inline bool operator!=(const std::string& s) const { return !(*this == s); }
+
+  /** Compare two names without allocating */
+  inline bool operator==(const QnameView& v) const { return v.m_len == m_len && std::equal(begin(), end(), v.begin()); }
+
+  /** Compare two names without allocating */
+  inline bool operator!=(const QnameView& v) const { return !(*this == v); }
+
+ private:
+
+  const char* m_data;
+  size_t m_len;
+
+};
+
+/** Read-only view of the raw cigar ops held in a bam1_t
+ *
+ * Iterating yields CigarField objects decoded on the fly from the
+ * packed uint32_t ops, so no std::vector is built. Only valid as long as 
+ * the underlying BamRecord is alive and its cigar is not modified.
+ */
+class CigarView {
+
+ public:
+
+  /** Iterator over the cigar ops of a CigarView */
+  class const_iterator {
+  public:
+    typedef std::random_access_iterator_tag iterator_category; ///< Iterator traits
+    typedef CigarField value_type; ///< Iterator traits
+    typedef std::ptrdiff_t difference_type; ///< Iterator traits
+    typedef const CigarField* pointer; ///< Iterator traits
+    typedef CigarField reference; ///< Iterator traits (returned by value)
+
+    const_iterator() : m_p(NULL) {} 
+    explicit const_iterator(const uint32_t* p) : m_p(p) {} 
+
+    CigarField operator*() const { return CigarField(*m_p); } 
+    CigarField operator[](difference_type n) const { return CigarField(m_p[n]); } 
+    const_iterator& operator++() { ++m_p; return *this; } 
+    const_iterator operator++(int) { const_iterator t = *this; ++m_p; return t; } 
+    const_iterator& operator--() { --m_p; return *this; } 
+    const_iterator operator--(int) { const_iterator t = *this; --m_p; return t; } 
+    const_iterator& operator+=(difference_type n) { m_p += n; return *this; } 
+    const_iterator& operator-=(difference_type n) { m_p -= n; return *this; } 
+    const_iterator operator+(difference_type n) const { return const_iterator(m_p + n); } 
+    const_iterator operator-(difference_type n) const { return const_iterator(m_p - n); } 
+    difference_type operator-(const const_iterator& o) const { return m_p - o.m_p; } 
+    bool operator==(const const_iterator& o) const { return m_p == o.m_p; } 
+    bool operator!=(const const_iterator& o) const { return m_p != o.m_p; } 
+    bool operator<(const const_iterator& o) const { return m_p < o.m_p; } 
+
+  private:
+    const uint32_t* m_p;
+  };
+
+  /** Construct an empty view */
+  CigarView() : m_data(NULL), m_len(0) {}
+
+  /** Construct a view over n raw sam.h cigar ops */
+  CigarView(const uint32_t* d, size_t n) : m_data(d), m_len(n) {}
+
+  const_iterator begin() const { return const_iterator(m_data); } ///< Iterator to first cigar op
+  const_iterator end() const { return const_iterator(m_data + m_len); } ///< Iterator to one past last cigar op
+
+  /** Returns the number of cigar ops */
+  inline size_t size() const { return m_len; }
+
+  /** Return true if there are no cigar ops */
+  inline bool empty() const { return !m_len; }
+
+  /** Returns the i'th cigar op */
+  inline CigarField operator[](size_t i) const { return CigarField(m_data[i]); }
+
+  /** Returns the first cigar op */
+  inline CigarField front() const { return CigarField(m_data[0]); }
+
+  /** Returns the last cigar op */
+  inline CigarField back() const { return CigarField(m_data[m_len - 1]); }
+
+  /** Return a pointer to the raw sam.h cigar ops */
+  inline const uint32_t* data() const { return m_data; }
+
+  /** Return the number of query-consumed bases */
+  inline int NumQueryConsumed() const {
+    int out = 0;
+    for (size_t i = 0; i < m_len; ++i)
+      if (bam_cigar_type(bam_cigar_op(m_data[i]))&1)
+	out += bam_cigar_oplen(m_data[i]);
+    return out;
+  }
+
+  /** Return the number of reference-consumed bases */
+  inline int NumReferenceConsumed() const {
+    int out = 0;
+    for (size_t i = 0; i < m_len; ++i)
+      if (bam_cigar_type(bam_cigar_op(m_data[i]))&2)
+	out += bam_cigar_oplen(m_data[i]);
+    return out;
+  }
+
+  /** Return an owning Cigar copy of the ops */
+  Cigar AsCigar() const { return Cigar(m_data, m_len); }
+
+  /** Compare to a Cigar without copying the ops */
+  inline bool operator==(const Cigar& c) const {
+    if (c.size() != m_len)
+      return false;
+    for (size_t i = 0; i < m_len; ++i)
+      if (c[i].raw() != m_data[i])
+	return false;
+    return true;
+  }
+
+  /** Compare to a Cigar without copying the ops */
+  inline bool operator!=(const Cigar& c) const { return !(*this == c); }
+
+ private:
+
+  const uint32_t* m_data;
+  size_t m_len;
+
+};
+
+/** Read-only view of the 4-bit packed sequence held in a bam1_t
+ *
+ * Bases are decoded to ACTGN on access, one at a time, without 
+ * building a string. Only valid as long as the underlying BamRecord 
+ * is alive and its sequence is not modified.
+ */
+class SequenceView {
+
+ public:
+
+  /** Iterator over the bases of a SequenceView */
+  class const_iterator {
+  public:
+    typedef std::random_access_iterator_tag iterator_category; ///< Iterator traits
+    typedef char value_type; ///< Iterator traits
+    typedef std::ptrdiff_t difference_type; ///< Iterator traits
+    typedef const char* pointer; ///< Iterator traits
+    typedef char reference; ///< Iterator traits (returned by value)
+
+    const_iterator() : m_p(NULL), m_i(0) {} 
+    const_iterator(const uint8_t* p, int32_t i) : m_p(p), m_i(i) {} 
+
+    char operator*() const { return BASES[bam_seqi(m_p, m_i)]; } 
+    char operator[](difference_type n) const { return BASES[bam_seqi(m_p, m_i + n)]; } 
+    const_iterator& operator++() { ++m_i; return *this; } 
+    const_iterator operator++(int) { const_iterator t = *this; ++m_i; return t; } 
+    const_iterator& operator--() { --m_i; return *this; } 
+    const_iterator operator--(int) { const_iterator t = *this; --m_i; return t; } 
+    const_iterator& operator+=(difference_type n) { m_i += n; return *this; } 
+    const_iterator& operator-=(difference_type n) { m_i -= n; return *this; } 
+    const_iterator operator+(difference_type n) const { return const_iterator(m_p, m_i + n); } 
+    const_iterator operator-(difference_type n) const { return const_iterator(m_p, m_i - n); } 
+    difference_type operator-(const const_iterator& o) const { return m_i - o.m_i; } 
+    bool operator==(const const_iterator& o) const { return m_i == o.m_i && m_p == o.m_p; } 
+    bool operator!=(const const_iterator& o) const { return !(*this == o); } 
+    bool operator<(const const_iterator& o) const { return m_i < o.m_i; } 
+
+  private:
+    const uint8_t* m_p;
+    int32_t m_i;
+  };
+
+  /** Construct an empty view */
+  SequenceView() : m_data(NULL), m_len(0) {}
+
+  /** Construct a view over len bases of packed (bam_get_seq) sequence */
+  SequenceView(const uint8_t* d, int32_t len) : m_data(d), m_len(len) {}
+
+  const_iterator begin() const { return const_iterator(m_data, 0); } ///< Iterator to first base
+  const_iterator end() const { return const_iterator(m_data, m_len); } ///< Iterator to one past last base
+
+  /** Returns the number of bases */
+  inline size_t size() const { return m_len; }
+
+  /** Return true if there are no bases */
+  inline bool empty() const { return !m_len; }
+
+  /** Returns the i'th base as a character (ACTGN) */
+  inline char operator[](size_t i) const { return BASES[bam_seqi(m_data, i)]; }
+
+  /** Returns the i'th base as its raw 4-bit code (1=A, 2=C, 4=G, 8=T, 15=N) */
+  inline uint8_t Code(size_t i) const { return bam_seqi(m_data, i); }
+
+  /** Return a pointer to the packed sequence (two bases per byte) */
+  inline const uint8_t* data() const { return m_data; }
+
+  /** Decode the bases into a caller-provided buffer of at least size() bytes.
+   * @note See DecodeBamSequence
+   */
+  inline void Decode(char* out) const { DecodeBamSequence(m_data, m_len, out); }
+
+  /** Return an owning copy of the sequence */
+  std::string str() const {
+    std::string out(m_len, 'N');
+    if (m_len)
+      Decode(&out[0]);
+    return out;
+  }
+
+ private:
+
+  const uint8_t* m_data;
+  int32_t m_len;
+
+};
+
+/** Read-only view of the raw (un-offset) phred scores held in a bam1_t
+ *
+ * Only valid as long as the underlying BamRecord is alive and its 
+ * qualities are not modified.
+ */
+class QualityView {
+
+ public:
+
+  typedef const uint8_t* const_iterator; ///< Iterator over the raw phred scores
+
+  /** Construct an empty view */
+  QualityView() : m_data(NULL), m_len(0) {}
+
+  /** Construct a view over len raw (bam_get_qual) phred scores */
+  QualityView(const uint8_t* d, int32_t len) : m_data(d), m_len(len) {}
+
+  const_iterator begin() const { return m_data; } ///< Iterator to first score
+  const_iterator end() const { return m_data + m_len; } ///< Iterator to one past last score
+
+  /** Returns the number of quality scores */
+  inline size_t size() const { return m_len; }
+
+  /** Return true if there are no quality scores */
+  inline bool empty() const { return !m_len; }
+
+  /** Return true if the qualities are absent from the record (stored as 0xff) */
+  inline bool Missing() const { return !m_len || m_data[0] == 0xff; }
+
+  /** Returns the i'th raw phred score */
+  inline uint8_t operator[](size_t i) const { return m_data[i]; }
+
+  /** Return a pointer to the raw phred scores */
+  inline const uint8_t* data() const { return m_data; }
+
+  /** Return an owning copy of the scores, converted with an offset
+   * @param offset Encoding offset for phred quality scores. Default 33
+   */
+  std::string str(int offset = 33) const {
+    std::string out(m_len, ' ');
+    if (m_len)
+      DecodeBamQualities(m_data, m_len, &out[0], offset);
+    return out;
+  }
+
+ private:
+
+  const uint8_t* m_data;
+  int32_t m_len;
+
+};
+
+/** Summary statistics of a CIGAR, gathered in a single pass over the raw ops
+ *
+ * Clip counts follow BamRecord::AlignmentPosition / AlignmentEndPosition, where
+ * leading and trailing runs of both S and H ops count as clipped.
+ */
+struct CigarSummary {
+
+  /** Construct an all-zero summary (eg for an empty CIGAR) */
+  CigarSummary() : num_soft_clip(0), num_hard_clip(0), leading_clip(0), trailing_clip(0),
+    max_insertion(0), max_deletion(0), num_match(0), num_aligned(0),
+    query_consumed(0), reference_consumed(0) {}
+
+  /** Summarize n raw sam.h cigar ops */
+  CigarSummary(const uint32_t* c, size_t n);
+
+  int32_t num_soft_clip;      ///< Sum of S op lengths
+  int32_t num_hard_clip;      ///< Sum of H op lengths
+  int32_t leading_clip;       ///< S and H bases before the first non-clip op
+  int32_t trailing_clip;      ///< S and H bases after the last non-clip op
+  uint32_t max_insertion;     ///< Longest single I op
+  uint32_t max_deletion;      ///< Longest single D op
+  uint32_t num_match;         ///< Sum of M op lengths
+  int32_t num_aligned;        ///< Sum of M, I, D, = and X op lengths
+  int32_t query_consumed;     ///< Sum of M, I, S, = and X op lengths
+  int32_t reference_consumed; ///< Sum of M, D, N, = and X op lengths
+
+  /** Get the number of clipped bases (hard clipped and soft clipped) */
+  inline int32_t NumClip() const { return num_soft_clip + num_hard_clip; }
+
+};
+
+/** Find several aux tags in a single pass over the aux data of a record
+ * @param b Record to search
+ * @param tags Array of n two-character tag names
+ * @param n Number of tags
+ * @param out Array of n pointers, filled as bam_aux_get would (NULL if a tag is absent)
+ */
+void FindBamTags(const bam1_t* b, const char* const* tags, size_t n, uint8_t** out);
+
+/** Table of aux tag offsets for a single record
+ *
+ * Built in one pass over the aux data, so that repeated tag lookups compare 
+ * 16-bit keys instead of re-walking the aux block. Offsets are relative to 
+ * bam_get_aux, so edits to the name, cigar or sequence leave it valid, while
+ * edits to the tags require a rebuild. See BamRecord::IndexTags.
+ */
+struct TagIndex {
+
+  static const int MAX_TAGS = 32; ///< Records with more tags fall back to bam_aux_get for the rest
+
+  TagIndex() : n(0), overflow(false) {}
+
+  /** Scan the aux data of b and record the offset of each tag */
+  void Build(const bam1_t* b);
+
+  /** Return a pointer to the tag as bam_aux_get would, or NULL if absent */
+  uint8_t* Find(const bam1_t* b, const char* tag) const;
+
+  uint16_t keys[MAX_TAGS];    ///< Two tag characters packed into 16 bits
+  uint32_t offsets[MAX_TAGS]; ///< Offset of the tag type byte from bam_get_aux
+  int n;                      ///< Number of indexed tags
+  bool overflow;              ///< True if there were more than MAX_TAGS tags
+
+};
+
+/** Intrusively reference-counted owner of a single bam1_t
+ *
+ * For records made with Create (as by BamRecord::init and BamReader), the 
+ * bam1_t, its reference count and its cached CigarSummary live in one
+ * allocation, so there is no separate control block as with a shared_ptr.
+ * Copies share the same record. Under C++11, moves transfer ownership
+ * without touching the count.
+ *
+ * The count is atomic, so handles to one record (including the shared_ptr
+ * views from shared()) can be copied and destroyed from different threads,
+ * and the cached CigarSummary is filled at most once under concurrent reads.
+ * Code that never shares a record between threads can define
+ * SEQLIB_NONATOMIC_REFCOUNT to use plain counts and an unsynchronized cache.
+ */
+class BamPointer {
+
+  // set on a dummy member to provide safe-bool conversion in c++98
+  struct BoolHelper { int x; };
+  typedef int BoolHelper::* unspecified_bool_type;
+
+ public:
+
+  /** Construct a null handle */
+  BamPointer() : m_block(NULL) {}
+
+  /** Take ownership of a bam1_t allocated with bam_init1. It will be freed with bam_destroy1 */
+  explicit BamPointer(bam1_t* a);
+
+  /** Share ownership with another handle */
+  BamPointer(const BamPointer& o) : m_block(o.m_block) { acquire(); }
+
+  /** Share ownership with another handle */
+  BamPointer& operator=(const BamPointer& o) {
+    if (m_block != o.m_block) {
+      o.acquire();
+      release();
+      m_block = o.m_block;
+    }
+    return *this;
+  }
+
+#ifdef HAVE_C11
+  /** Take ownership from another handle, leaving it null */
+  BamPointer(BamPointer&& o) noexcept : m_block(o.m_block) { o.m_block = nullptr; }
+
+  /** Take ownership from another handle, leaving it null */
+  BamPointer& operator=(BamPointer&& o) noexcept {
+    if (this != &o) {
+      release();
+      m_block = o.m_block;
+      o.m_block = nullptr;
+    }
+    return *this;
+  }
+#endif
+
+  ~BamPointer() { release(); }
+
+  /** Allocate a new, empty bam1_t (same as bam_init1) */
+  static BamPointer Create();
+
+  /** Make a bam1_t over record data owned by someone else (eg a BamRecordStore).
+   * 
+   * The data is not copied and is not freed with the handle. BamRecord
+   * setters call OwnData first, but the data must not be modified directly
+   * through raw().
+   * @param core Core fields of the record
+   * @param data Variable length data (qname, cigar, seq, qual, aux)
+   * @param l_data Length of data
+   */
+  static BamPointer Borrow(const bam1_core_t& core, uint8_t* data, int l_data);
+
+  /** Return the raw bam1_t, or NULL for a null handle */
+  inline bam1_t* get() const { return m_block ? m_block->ptr : NULL; }
+
+  inline bam1_t* operator->() const { return m_block->ptr; } ///< Access the bam1_t
+  inline bam1_t& operator*() const { return *m_block->ptr; } ///< Access the bam1_t
+
+  /** Return true if the handle holds a record */
+  operator unspecified_bool_type() const { return m_block ? &BoolHelper::x : 0; }
+
+  /** Return true if the handle is null */
+  inline bool operator!() const { return !m_block; }
+
+  /** Return the number of handles sharing this record (0 if null) */
+  inline long use_count() const { return m_block ? load_count(&m_block->refs) : 0; }
+
+  /** Return true if this is the only handle to the record */
+  inline bool unique() const { return use_count() == 1; }
+
+  /** Release the record, leaving a null handle */
+  void reset() { release(); m_block = NULL; }
+
+  /** Exchange records with another handle, without touching either count */
+  void swap(BamPointer& o) { Block* t = m_block; m_block = o.m_block; o.m_block = t; }
+
+  /** Return a shared_ptr view of the record, for code written against SeqPointer<bam1_t>.
+   *
+   * The shared_ptr holds a reference on this handle, so the record
+   * stays alive as long as either one does.
+   */
+  SeqPointer<bam1_t> shared() const;
+
+  /** Return the CigarSummary for the record, computing it if needed. 
+   * Shared by all handles to the same record. Safe to call from several
+   * threads at once, as long as none of them modifies the record.
+   */
+  inline const CigarSummary& GetCigarSummary() const {
+    if (load_count(&m_block->summary_state) != SUMMARY_READY)
+      fill_summary();
+    return m_block->summary;
+  }
+
+  /** Drop the cached CigarSummary, so it is recomputed on next use.
+   * Must not race with readers of the same record.
+   */
+  inline void InvalidateCigarSummary() const { 
+    if (m_block) 
+      m_block->summary_state = SUMMARY_STALE;
+  }
+
+  /** Attach a TagIndex to the record and build it, if not already present */
+  void EnableTagIndex() const;
+
+  /** Return true if a TagIndex is attached to the record */
+  inline bool HasTagIndex() const { return m_block && m_block->tag_index; }
+
+  /** Find a tag as bam_aux_get would, through the TagIndex if one is attached.
+   * Does not modify the record, so it is safe from several threads at once.
+   */
+  inline uint8_t* FindTag(const char* tag) const {
+    const TagIndex* ti = m_block->tag_index;
+    return ti ? ti->Find(m_block->ptr, tag) : bam_aux_get(m_block->ptr, tag);
+  }
+
+  /** Give a Borrow-ed record its own copy of the data, so it can be modified */
+  inline void OwnData() const {
+    if (m_block && !m_block->owns_data) {
+      uint8_t* d = (uint8_t*)malloc(m_block->rec.l_data);
+      memcpy(d, m_block->rec.data, m_block->rec.l_data);
+      m_block->rec.data = d;
+      m_block->rec.m_data = m_block->rec.l_data;
+      m_block->owns_data = true;
+    }
+  }
+
+  /** Rebuild the TagIndex (if any) after the tags were edited */
+  inline void RebuildTagIndex() const {
+    if (m_block && m_block->tag_index)
+      m_block->tag_index->Build(m_block->ptr);
+  }
+
+ private:
+
+  struct Block {
+    bam1_t* ptr; // &rec, or an adopted bam1_t
+    bam1_t rec;
+    CigarSummary summary;
+    TagIndex* tag_index; // opt-in, see EnableTagIndex
+    long refs;
+    long summary_state; // SUMMARY_STALE, SUMMARY_BUSY or SUMMARY_READY
+    bool owns_data; // false for Borrow
+  };
+
+  enum { SUMMARY_STALE = 0, SUMMARY_BUSY = 1, SUMMARY_READY = 2 };
+
+  Block* m_block;
+
+  // acquire load of a count or state, so a READY summary is seen in full
+  static inline long load_count(const long* p) {
+#ifdef SEQLIB_NONATOMIC_REFCOUNT
+    return *p;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+  }
+
+  inline void acquire() const {
+    if (m_block) {
+#ifdef SEQLIB_NONATOMIC_REFCOUNT
+      ++m_block->refs;
+#else
+      __sync_add_and_fetch(&m_block->refs, 1);
+#endif
+    }
+  }
+
+  inline void release() {
+    if (!m_block)
+      return;
+#ifdef SEQLIB_NONATOMIC_REFCOUNT
+    if (--m_block->refs == 0)
+#else
+    if (__sync_sub_and_fetch(&m_block->refs, 1) == 0)
+#endif
+      destroy(m_block);
+  }
+
+  static void destroy(Block* blk);
+
+  // compute the CigarSummary, or wait for the thread that is computing it
+  void fill_summary() const;
+
+  // shared_ptr deleter that holds a reference, for shared()
+  struct SharedRef;
+
+};
+
 /** Class to store and interact with a SAM alignment record
  *
  * HTSLibrary reads are stored in the bam1_t struct. Memory allocation
@@ -207,6 +877,8 @@ class BamRecord {
 
   friend class BLATWraper;
   friend class BWAWrapper;
+  friend class BamTagEditor;
+  friend class BamRecordStore;
 
  public:
 
@@ -330,6 +1002,14 @@ class BamRecord {
   /** Retrieve the quality trimmed seqeuence from QT tag if made. Otherwise return normal seq */
   std::string QualitySequence() const;
 
+  /** Fill a caller-provided string with QualitySequence(), reusing its memory
+   * @param out String to be filled in. Does not allocate once it has grown to the read length.
+   */
+  void QualitySequence(std::string& out) const;
+
+  /** Return the length of QualitySequence(), without building it */
+  int32_t QualitySequenceLength() const;
+
   /** Get the alignment position */
   inline int32_t Position() const { return b ? b->core.pos : -1; }
 
@@ -378,6 +1058,14 @@ class BamRecord {
       b->core.flag &= ~BAM_FQCFAIL;
   }
 
+  /** Set the duplicate flag on/off (true -> on) */
+  inline void SetDuplicateFlag(bool f) {
+    if (f)
+      b->core.flag |= BAM_FDUP;
+    else
+      b->core.flag &= ~BAM_FDUP;
+  }
+
   /** Set the mapping quality */
   inline void SetMapQuality(int32_t m) { if (b) b->core.qual = m; }
 
@@ -417,6 +1105,29 @@ class BamRecord {
   
   /** Get the qname of this read as a char array */
   inline char* QnameChar() const { return bam_get_qname(b); }
+
+  /** Get a non-owning view of the read name
+   * @note The view is invalidated if the record is modified or destroyed
+   */
+  inline QnameView GetQnameView() const { 
+    const char* q = bam_get_qname(b);
+    return QnameView(q, strlen(q)); 
+  }
+
+  /** Get a non-owning view of the cigar ops, without copying into a Cigar
+   * @note The view is invalidated if the record is modified or destroyed
+   */
+  inline CigarView GetCigarView() const { return CigarView(bam_get_cigar(b), b->core.n_cigar); }
+
+  /** Get a non-owning view of the packed sequence, without decoding into a string
+   * @note The view is invalidated if the record is modified or destroyed
+   */
+  inline SequenceView GetSequenceView() const { return SequenceView(bam_get_seq(b), b->core.l_qseq); }
+
+  /** Get a non-owning view of the raw phred scores (no offset applied)
+   * @note The view is invalidated if the record is modified or destroyed
+   */
+  inline QualityView GetQualityView() const { return QualityView(bam_get_qual(b), b->core.l_qseq); }
   
   /** Get the full alignment flag for this read */
   inline uint32_t AlignmentFlag() const { return b->core.flag; }
@@ -446,7 +1157,7 @@ class BamRecord {
     if (b->core.tid != b->core.mtid || !PairMappedFlag())
       return 0;
 
-    return std::abs(b->core.pos - b->core.mpos) + GetCigar().NumQueryConsumed();
+    return std::abs(b->core.pos - b->core.mpos) + GetCigarView().NumQueryConsumed();
 
   }
   
@@ -501,13 +1212,12 @@ class BamRecord {
   inline int NumAlignedBases() const {
     int out = 0;
     uint32_t* c = bam_get_cigar(b);
-    for (size_t i = 0; i < b->core.n_cigar; i++) 
-      if (bam_cigar_opchr(c[i]) == 'M' || 
-	  bam_cigar_opchr(c[i]) == 'I' || 
-	  bam_cigar_opchr(c[i]) == '=' || 
-	  bam_cigar_opchr(c[i]) == 'X' || 
-	  bam_cigar_opchr(c[i]) == 'D')
+    for (size_t i = 0; i < b->core.n_cigar; i++) {
+      const int op = bam_cigar_op(c[i]);
+      if (op == BAM_CMATCH || op == BAM_CINS || op == BAM_CEQUAL || 
+	  op == BAM_CDIFF || op == BAM_CDEL)
 	out += bam_cigar_oplen(c[i]);
+    }
     return out;
   }
   
@@ -517,7 +1227,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     uint32_t imax = 0;
     for (size_t i = 0; i < b->core.n_cigar; i++) 
-      if (bam_cigar_opchr(c[i]) == 'I')
+      if (bam_cigar_op(c[i]) == BAM_CINS)
 	imax = std::max(bam_cigar_oplen(c[i]), imax);
     return imax;
   }
@@ -527,7 +1237,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     uint32_t dmax = 0;
     for (size_t i = 0; i < b->core.n_cigar; i++) 
-      if (bam_cigar_opchr(c[i]) == 'D')
+      if (bam_cigar_op(c[i]) == BAM_CDEL)
 	dmax = std::max(bam_cigar_oplen(c[i]), dmax);
     return dmax;
   }
@@ -537,7 +1247,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     uint32_t dmax = 0;
     for (size_t i = 0; i < b->core.n_cigar; i++) 
-      if (bam_cigar_opchr(c[i]) == 'M')
+      if (bam_cigar_op(c[i]) == BAM_CMATCH)
 	dmax += bam_cigar_oplen(c[i]);
     return dmax;
   }
@@ -545,18 +1255,14 @@ class BamRecord {
 
   /** Retrieve the CIGAR as a more managable Cigar structure */
   Cigar GetCigar() const {
-    uint32_t* c = bam_get_cigar(b);
-    Cigar cig;
-    for (size_t k = 0; k < b->core.n_cigar; ++k) {
-      cig.add(CigarField(c[k]));
-    }
-    return cig;
+    return Cigar(bam_get_cigar(b), b->core.n_cigar);
   }
 
   /** Retrieve the inverse of the CIGAR as a more managable Cigar structure */
   Cigar GetReverseCigar() const {
     uint32_t* c = bam_get_cigar(b);
     Cigar cig;
+    cig.reserve(b->core.n_cigar);
     for (int k = b->core.n_cigar - 1; k >= 0; --k) 
       cig.add(CigarField(c[k]));
     return cig;
@@ -570,6 +1276,16 @@ class BamRecord {
   /** Retrieve the sequence of this read as a string (ACTGN) */
   std::string Sequence() const;
 
+  /** Decode the sequence of this read (ACTGN) into a caller-provided string
+   * @param out String to write to. Resized to the read length, re-using its capacity.
+   */
+  void Sequence(std::string& out) const;
+
+  /** Decode the sequence of this read (ACTGN) into a caller-provided buffer
+   * @param out Buffer of at least Length() bytes. Not null-terminated.
+   */
+  void Sequence(char* out) const;
+
   /** Return the mean quality score 
    */
   double MeanPhred() const;
@@ -587,17 +1303,19 @@ class BamRecord {
    * @param offset Encoding offset for phred quality scores. Default 33
    * @return Qualties scores after converting offset. If first char is empty, returns empty string
    */
-  inline std::string Qualities(int offset = 33) const { 
-    uint8_t * p = bam_get_qual(b);
-    if (!p)
-      return std::string();
-    //if (!p[0])
-    //  return std::string();
-    std::string out(b->core.l_qseq, ' ');
-    for (int32_t i = 0; i < b->core.l_qseq; ++i) 
-      out[i] = (char)(p[i] + offset);
-    return out;
-  }
+  std::string Qualities(int offset = 33) const;
+
+  /** Get the quality scores of this read into a caller-provided string
+   * @param out String to write to. Resized to the read length, re-using its capacity.
+   * @param offset Encoding offset for phred quality scores. Default 33
+   */
+  void Qualities(std::string& out, int offset = 33) const;
+
+  /** Get the quality scores of this read into a caller-provided buffer
+   * @param out Buffer of at least Length() bytes. Not null-terminated.
+   * @param offset Encoding offset for phred quality scores. Default 33
+   */
+  void Qualities(char* out, int offset = 33) const;
 
   /** Get the start of the alignment on the read, by removing soft-clips
    * Do this in the reverse orientation though.
@@ -606,7 +1324,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     int32_t p = 0;
     for (int32_t i = b->core.n_cigar - 1; i >= 0; --i) {
-      if ( (bam_cigar_opchr(c[i]) == 'S') || (bam_cigar_opchr(c[i]) == 'H'))
+      if ( (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(c[i]) == BAM_CHARD_CLIP))
 	p += bam_cigar_oplen(c[i]);
       else // not a clip, so stop counting
 	break;
@@ -621,7 +1339,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     int32_t p = 0;
     for (size_t i = 0; i < b->core.n_cigar; ++i) { // loop from the end
-      if ( (bam_cigar_opchr(c[i]) == 'S') || (bam_cigar_opchr(c[i]) == 'H'))
+      if ( (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(c[i]) == BAM_CHARD_CLIP))
 	p += bam_cigar_oplen(c[i]);
       else // not a clip, so stop counting
 	break;
@@ -636,7 +1354,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     int32_t p = 0;
     for (size_t i = 0; i < b->core.n_cigar; ++i) {
-      if ( (bam_cigar_opchr(c[i]) == 'S') || (bam_cigar_opchr(c[i]) == 'H'))
+      if ( (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(c[i]) == BAM_CHARD_CLIP))
 	p += bam_cigar_oplen(c[i]);
       else // not a clip, so stop counting
 	break;
@@ -650,7 +1368,7 @@ class BamRecord {
     uint32_t* c = bam_get_cigar(b);
     int32_t p = 0;
     for (int32_t i = b->core.n_cigar - 1; i >= 0; --i) { // loop from the end
-      if ( (bam_cigar_opchr(c[i]) == 'S') || (bam_cigar_opchr(c[i]) == 'H'))
+      if ( (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(c[i]) == BAM_CHARD_CLIP))
 	p += bam_cigar_oplen(c[i]);
       else // not a clip, so stop counting
 	break;
@@ -663,7 +1381,7 @@ class BamRecord {
       int32_t p = 0;
       uint32_t* c = bam_get_cigar(b);
       for (size_t i = 0; i < b->core.n_cigar; ++i)
-	if (bam_cigar_opchr(c[i]) == 'S')
+	if (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP)
 	  p += bam_cigar_oplen(c[i]);
       return p;
     }
@@ -673,7 +1391,7 @@ class BamRecord {
       int32_t p = 0;
       uint32_t* c = bam_get_cigar(b);
       for (size_t i = 0; i < b->core.n_cigar; ++i) 
-	if (bam_cigar_opchr(c[i]) == 'H')
+	if (bam_cigar_op(c[i]) == BAM_CHARD_CLIP)
 	  p += bam_cigar_oplen(c[i]);
       return p;
     }
@@ -684,7 +1402,7 @@ class BamRecord {
     int32_t p = 0;
     uint32_t* c = bam_get_cigar(b);
     for (size_t i = 0; i < b->core.n_cigar; ++i)
-      if ( (bam_cigar_opchr(c[i]) == 'S') || (bam_cigar_opchr(c[i]) == 'H') )
+      if ( (bam_cigar_op(c[i]) == BAM_CSOFT_CLIP) || (bam_cigar_op(c[i]) == BAM_CHARD_CLIP) )
 	p += bam_cigar_oplen(c[i]);
     return p;
   }
@@ -695,6 +1413,16 @@ class BamRecord {
    * @return Returns true if the tag is present, even if empty. Return false if no tag or not a Z tag.
    */
   bool GetZTag(const std::string& tag, std::string& s) const;
+
+  /** Get a string (Z) tag without copying it
+   * @param tag Name of the tag. eg "RG"
+   * @return Pointer to the null-terminated value inside the record, or NULL if
+   * no tag or not a Z tag. Only valid until the record is modified.
+   */
+  inline const char* GetZTagChar(const char* tag) const {
+    const uint8_t* p = b.FindTag(tag);
+    return p && *p == 'Z' ? (const char*)p + 1 : NULL;
+  }
   
   /** Get a string of either Z, f or i type. Useful if tag type not known at compile time.
    * @param tag Name of the tag. eg "XP"
@@ -735,7 +1463,16 @@ class BamRecord {
    * @return Return true if the tag exists.
    */
   inline bool GetIntTag(const std::string& tag, int32_t& t) const {
-    uint8_t* p = bam_aux_get(b.get(),tag.c_str());
+    return GetIntTag(tag.c_str(), t);
+  }
+
+  /** Get an int (i) tag, without building a std::string for the name
+   * @param tag Name of the tag. eg "NM"
+   * @param t Value to be filled in with the tag value.
+   * @return Return true if the tag exists.
+   */
+  inline bool GetIntTag(const char* tag, int32_t& t) const {
+    uint8_t* p = b.FindTag(tag);
     if (!p)
       return false;
     t = bam_aux2i(p);
@@ -752,7 +1489,7 @@ class BamRecord {
    * @return Return true if the tag exists.
    */
   inline bool GetFloatTag(const std::string& tag, float& t) const {
-    uint8_t* p = bam_aux_get(b.get(),tag.c_str());
+    uint8_t* p = b.FindTag(tag.c_str());
     if (!p)
       return false;
 
@@ -776,7 +1513,9 @@ class BamRecord {
    * @param val Value for the tag
    */
   inline void AddIntTag(const std::string& tag, int32_t val) {
+    b.OwnData();
     bam_aux_append(b.get(), tag.data(), 'i', 4, (uint8_t*)&val);
+    b.RebuildTagIndex();
   }
 
   /** Set the chr id number 
@@ -795,13 +1534,7 @@ class BamRecord {
 
   /** Convert CIGAR to a string
    */
-  inline std::string CigarString() const {
-    std::stringstream cig;
-    uint32_t* c = bam_get_cigar(b);
-    for (size_t k = 0; k < b->core.n_cigar; ++k)
-      cig << bam_cigar_oplen(c[k]) << "MIDNSHP=XB"[c[k]&BAM_CIGAR_MASK];
-    return cig.str();
-  }
+  std::string CigarString() const;
   
   /** Return a human readable chromosome name assuming chr is indexed
    * from 0 (eg id 0 return "1")
@@ -810,11 +1543,9 @@ class BamRecord {
    * any chromosomes, use the full ChrName with BamHeader input.
    */
   inline std::string ChrName() const {
-    std::stringstream ss;
-    ss << (b->core.tid + 1);
-
-    return ss.str();
-    //return std::to_string(b->core.tid + 1); //c++11
+    std::string s;
+    AppendDecimal(s, b->core.tid + 1);
+    return s;
   }
 
   /** Retrieve the human readable chromosome name. 
@@ -829,55 +1560,40 @@ class BamRecord {
     if (h.isEmpty())
       return h.IDtoName(b->core.tid);
 
-    // c++98    
-    std::stringstream ss;
-    ss << b->core.tid;
-    
     // no header, assume zero based
-    return ss.str(); //std::to_string(b->core.tid + 1);
+    std::string s;
+    AppendDecimal(s, b->core.tid);
+    return s;
     
   }
 
   /** Return a short description (chr:pos) of this read */
-  inline std::string Brief() const {
-    //if (!h)
-    // c++11
-    //  return(std::to_string(b->core.tid + 1) + ":" + AddCommas<int32_t>(b->core.pos) + "(" + ((b->core.flag&BAM_FREVERSE) != 0 ? "+" : "-") + ")");
-    // c++98
-    std::stringstream ss;
-    ss << (b->core.tid + 1) << ":" << AddCommas(b->core.pos) << "(" << ((b->core.flag&BAM_FREVERSE) != 0 ? "+" : "-") << ")";
-    return ss.str();
-    //else
-    // return(std::string(h->target_name[b->core.tid]) + ":" + AddCommas<int32_t>(b->core.pos) + "(" + ((b->core.flag&BAM_FREVERSE) != 0 ? "+" : "-") + ")");      
-  }
+  std::string Brief() const;
 
   /** Return a short description (chr:pos) of this read's mate */
-  inline std::string BriefMate() const {
-    //if (!h)
-    // c++11
-    // return(std::to_string(b->core.mtid + 1) + ":" + AddCommas<int32_t>(b->core.mpos) + "(" + ((b->core.flag&BAM_FMREVERSE) != 0 ? "+" : "-") + ")");
-    std::stringstream ss;
-    ss << (b->core.mtid + 1) << ":" << AddCommas(b->core.mpos) << "(" << ((b->core.flag&BAM_FMREVERSE) != 0 ? "+" : "-") << ")";
-    return ss.str();
-    //else
-    //  return(std::string(h->target_name[b->core.mtid]) + ":" + AddCommas<int32_t>(b->core.mpos) + "(" + ((b->core.flag&BAM_FMREVERSE) != 0 ? "+" : "-") + ")");      
-  }
+  std::string BriefMate() const;
 
   /** Strip a particular alignment tag 
    * @param tag Tag to remove
    */
   inline void RemoveTag(const char* tag) {
-    uint8_t* p = bam_aux_get(b.get(), tag);
-    if (p)
+    uint8_t* p = b.FindTag(tag);
+    if (p) {
+      b.OwnData();
+      p = b.FindTag(tag);
       bam_aux_del(b.get(), p);
+      b.RebuildTagIndex();
+    }
   }
 
   /** Strip all of the alignment tags */
   inline void RemoveAllTags() {
+    b.OwnData();
     size_t keep = (b->core.n_cigar<<2) + b->core.l_qname + ((b->core.l_qseq + 1)>>1) + b->core.l_qseq;
     b->data = (uint8_t*)realloc(b->data, keep); // free the end, which has aux data
     b->l_data = keep;
     b->m_data = b->l_data;
+    b.RebuildTagIndex();
   }
 
   /** Return the raw pointer */
@@ -890,15 +1606,171 @@ class BamRecord {
    */
   int OverlappingCoverage(const BamRecord& r) const;
   
-  /** Return the shared pointer */
-  SeqPointer<bam1_t> shared_pointer() const { return b; }
+  /** Return a shared pointer to the bam1_t
+   * @note The returned pointer keeps this record alive. See BamPointer::shared
+   */
+  SeqPointer<bam1_t> shared_pointer() const { return b.shared(); }
+
+  /** Get a summary of the CIGAR, computed in one pass and cached with the record.
+   *
+   * Cheaper than calling NumClip(), MaxInsertionBases() etc separately when
+   * several are needed. The cache is shared by all copies of this BamRecord,
+   * and is reset by SetCigar.
+   * @note If the cigar is changed directly through raw(), call InvalidateCigarSummary()
+   */
+  inline const CigarSummary& GetCigarSummary() const { return b.GetCigarSummary(); }
+
+  /** Drop the cached CigarSummary, so it is recomputed on next use */
+  inline void InvalidateCigarSummary() const { b.InvalidateCigarSummary(); }
+
+  /** Build an index of the aux tag offsets, and use it for all later lookups 
+   * on this record (and its copies).
+   *
+   * Worth it when several tags are read from each record (eg NM, AS, RG, XA, SA, MD).
+   * The index is rebuilt as part of any tag edit made through BamRecord, so
+   * lookups never modify the record. Must not be called while another thread
+   * reads tags from the same record.
+   * @note If the tags are changed directly through raw(), call RebuildTagIndex()
+   */
+  inline void IndexTags() const { b.EnableTagIndex(); }
+
+  /** Return true if IndexTags has been called for this record */
+  inline bool HasTagIndex() const { return b.HasTagIndex(); }
+
+  /** Rebuild the tag index (if any) after the tags were changed through raw() */
+  inline void RebuildTagIndex() const { b.RebuildTagIndex(); }
+
+  /** Look up several tags in a single pass over the aux data
+   * @param tags Two-character tag names, eg "NM", "AS"
+   * @param out Resized to tags.size() and filled with pointers as returned by 
+   * bam_aux_get (NULL if a tag is absent), for use with bam_aux2i, bam_aux2Z etc
+   */
+  void FindTags(const std::vector<std::string>& tags, std::vector<uint8_t*>& out) const;
+
+  /** Make a deep copy of this record, that shares no memory with the original
+   *
+   * Copying a BamRecord is cheap but shares the underlying bam1_t, so edits
+   * to one copy are seen by the other. Use Clone to get an independent record,
+   * eg to hand it to another thread.
+   */
+  BamRecord Clone() const;
+
+  /** Exchange the records held by two BamRecord objects, without copying */
+  void swap(BamRecord& r) { b.swap(r.b); }
 
   protected:
   
-  SeqPointer<bam1_t> b; // bam1_t shared pointer
+  BamPointer b; // bam1_t reference-counted handle
 
 };
 
+ /** Batch of aux tag edits, applied to a record with a single rewrite of its aux data
+  *
+  * Each of BamRecord::AddZTag, AddIntTag and RemoveTag reallocates or shifts
+  * the record data. A BamTagEditor instead collects the edits, then Apply 
+  * compacts the kept tags in place and appends the new ones, growing the 
+  * record data at most once. The editor keeps its buffers between records, 
+  * so a single one can be reused (with clear) for a whole re-tagging pass.
+  *
+  * Adding a tag replaces any copy already on the record; if the same tag is
+  * added twice to the editor, the last value wins. Edits to the same tag
+  * take effect in the order they are made: RemoveTag drops any earlier add
+  * of the tag, and an add after RemoveTag puts the tag back.
+  */
+ class BamTagEditor {
+
+ public:
+
+  /** Construct an empty set of edits */
+  BamTagEditor() : m_remove_all(false) {}
+
+  /** Set an int (i) tag */
+  void AddIntTag(const std::string& tag, int32_t val);
+
+  /** Set a float (f) tag */
+  void AddFloatTag(const std::string& tag, float val);
+
+  /** Set a string (Z) tag. Empty values are ignored, as in BamRecord::AddZTag */
+  void AddZTag(const std::string& tag, const std::string& val);
+
+  /** Remove a tag from the record, if present, and drop any earlier add of it */
+  void RemoveTag(const std::string& tag);
+
+  /** Remove all of the tags already on the record before adding new ones */
+  void RemoveAllTags() { m_remove_all = true; }
+
+  /** Return true if there are no edits */
+  bool empty() const { return !m_remove_all && m_add_keys.empty() && m_remove_keys.empty(); }
+
+  /** Forget all edits, keeping allocated capacity for reuse */
+  void clear();
+
+  /** Rewrite the aux data of a record with all of the collected edits
+   * @param r Record to modify. Its tag index (if any) is marked stale.
+   */
+  void Apply(BamRecord& r) const;
+
+ private:
+
+  // serialized tags to add (tag, type, value), with the key and start of each
+  std::vector<uint8_t> m_add;
+  std::vector<uint16_t> m_add_keys;
+  std::vector<size_t> m_add_offsets;
+
+  std::vector<uint16_t> m_remove_keys;
+  bool m_remove_all;
+
+  void add(const std::string& tag, char type, const uint8_t* data, size_t len);
+
+ };
+
+ /** Reusable buffer for writing alignments as SAM text
+  *
+  * Wraps FormatSamRecord around a kstring that is kept between records,
+  * so formatting a stream of records does no allocation once the buffer
+  * has grown to the longest line.
+  */
+ class SamFormatter {
+
+ public:
+
+  /** Construct an empty formatter, with no header (see FormatSamRecord) */
+  SamFormatter() { m_str.l = m_str.m = 0; m_str.s = NULL; }
+
+  SamFormatter(const SamFormatter& f);
+
+  SamFormatter& operator=(const SamFormatter& f);
+
+  ~SamFormatter() { free(m_str.s); }
+
+  /** Set the header used to write reference names */
+  void SetHeader(const BamHeader& h) { m_hdr = h; }
+
+  /** Append a record as one SAM line, including the trailing newline */
+  void Append(const BamRecord& r);
+
+  /** Format a single record, replacing the buffer contents
+   * @return Null-terminated SAM line (no trailing newline), valid until the next call
+   */
+  const char* Format(const BamRecord& r);
+
+  /** Return the buffer contents (null-terminated) */
+  const char* data() const { return m_str.s ? m_str.s : ""; }
+
+  /** Return the number of characters in the buffer */
+  size_t size() const { return m_str.l; }
+
+  /** Empty the buffer, keeping its capacity */
+  void clear() { m_str.l = 0; if (m_str.s) m_str.s[0] = '\0'; }
+
+ private:
+
+  kstring_t m_str;
+
+  BamHeader m_hdr;
+
+ };
+
  typedef std::vector<BamRecord> BamRecordVector; ///< Store a vector of alignment records
  
  typedef std::vector<BamRecordVector> BamRecordClusterVector; ///< Store a vector of alignment vectors
@@ -0,0 +1,186 @@
+#ifndef SEQLIB_BAM_RECORD_BATCH_H
+#define SEQLIB_BAM_RECORD_BATCH_H
+
+#include <vector>
+#include <string>
+
+#include "SeqLib/BamRecord.h"
+
+namespace SeqLib {
+
+  class BamRecordStore;
+
+  /** Selection mask over the rows of a BamRecordBatch (1 = selected) */
+  typedef std::vector<uint8_t> BatchMask;
+
+  /** Non-owning span over one row of a variable-length batch column */
+  struct BatchSpan {
+
+    BatchSpan() : data(NULL), length(0) {}
+
+    BatchSpan(const char* d, size_t l) : data(d), length(l) {}
+
+    const char* data; ///< First byte of the span
+    size_t length;    ///< Number of bytes in the span
+
+    /** Return a copy of the span as a string */
+    std::string str() const { return std::string(data, length); }
+  };
+
+  /** Columnar (struct-of-arrays) batch of alignment records
+   *
+   * Each alignment field is decoded once into its own contiguous array,
+   * so that stats and filtering passes can scan tight arrays instead of
+   * following a pointer per read. Predicates narrow a BatchMask, and
+   * reductions summarize the rows selected by a mask (an empty mask
+   * selects every row).
+   *
+   * The fixed-width columns are always filled. Sequence (decoded ACTGN)
+   * and quality (raw phred, no offset) are stored only if requested at
+   * construction, as one byte buffer per column plus row offsets.
+   */
+  class BamRecordBatch {
+
+  public:
+
+    /** Optional variable-length columns */
+    enum BatchColumns {
+      BATCH_SEQ  = 1, ///< Store decoded sequences
+      BATCH_QUAL = 2  ///< Store raw base qualities
+    };
+
+    /** Create an empty batch
+     * @param columns Bitwise OR of BatchColumns to store, in addition
+     * to the fixed-width columns
+     */
+    explicit BamRecordBatch(int columns = 0);
+
+    /** Append one record
+     * @exception Throws an invalid_argument if the record is empty
+     */
+    void Add(const BamRecord& r);
+
+    /** Append one raw htslib record */
+    void Add(const bam1_t* b);
+
+    /** Append every record of a vector */
+    void Add(const BamRecordVector& brv);
+
+    /** Append every record of a store, in store order */
+    void Add(const BamRecordStore& store);
+
+    /** Return the number of rows */
+    size_t size() const { return m_pos.size(); }
+
+    /** Return true if there are no rows */
+    bool empty() const { return m_pos.empty(); }
+
+    /** Remove all rows (keeps the column capacity) */
+    void clear();
+
+    /** Pre-allocate room for n rows */
+    void reserve(size_t n);
+
+    /** Return true if this batch stores the given BatchColumns */
+    bool HasColumn(int c) const { return (m_columns & c) == c; }
+
+    const std::vector<int32_t>& ChrID() const { return m_tid; }          ///< Chromosome ids
+    const std::vector<int32_t>& Position() const { return m_pos; }       ///< Left-most aligned positions
+    const std::vector<int32_t>& PositionEnd() const { return m_end; }    ///< End positions, as BamRecord::PositionEnd
+    const std::vector<int32_t>& MateChrID() const { return m_mtid; }     ///< Mate chromosome ids
+    const std::vector<int32_t>& MatePosition() const { return m_mpos; }  ///< Mate positions
+    const std::vector<int32_t>& InsertSize() const { return m_isize; }   ///< Signed insert sizes
+    const std::vector<uint16_t>& AlignmentFlag() const { return m_flag; } ///< Alignment flags
+    const std::vector<uint8_t>& MapQuality() const { return m_mapq; }    ///< Mapping qualities
+    const std::vector<int32_t>& SoftClip() const { return m_sclip; }     ///< Number of soft-clipped bases
+    const std::vector<int32_t>& HardClip() const { return m_hclip; }     ///< Number of hard-clipped bases
+    const std::vector<uint32_t>& CigarSize() const { return m_ncigar; }  ///< Number of cigar operations
+
+    /** Return the decoded sequence of row i
+     * @exception Throws a logic_error if sequences are not stored
+     */
+    BatchSpan Sequence(size_t i) const;
+
+    /** Return the raw phred qualities of row i (0xff if missing)
+     * @exception Throws a logic_error if qualities are not stored
+     */
+    BatchSpan Qualities(size_t i) const;
+
+    /** Select rows that have all flag bits in require on and all bits in exclude off
+     *
+     * Like all of the Select functions, this narrows m (ANDs with it). An
+     * empty mask is first set to select every row.
+     * @exception Throws an invalid_argument if m is not empty or size()
+     */
+    void SelectFlag(uint16_t require, uint16_t exclude, BatchMask& m) const;
+
+    /** Select rows with min <= mapping quality <= max */
+    void SelectMapQuality(int min, int max, BatchMask& m) const;
+
+    /** Select rows with min <= |insert size| <= max */
+    void SelectInsertSize(int32_t min, int32_t max, BatchMask& m) const;
+
+    /** Select rows whose alignment [pos, end] overlaps a region (strand is ignored) */
+    void SelectRegion(const GenomicRegion& gr, BatchMask& m) const;
+
+    /** Return the number of rows selected by m */
+    size_t CountSelected(const BatchMask& m) const;
+
+    /** Return the number of selected rows with all flag bits in f on */
+    size_t CountFlag(uint16_t f, const BatchMask& m) const;
+
+    /** Return the mean mapping quality of the selected rows (0 if none) */
+    double MeanMapQuality(const BatchMask& m) const;
+
+    /** Return the total reference span (end - pos) of the selected mapped rows */
+    uint64_t TotalAlignedSpan(const BatchMask& m) const;
+
+    /** Fill a 256-bin histogram of mapping quality over the selected rows */
+    void MapQualityHistogram(std::vector<size_t>& hist, const BatchMask& m) const;
+
+    /** Write the batch to a binary columnar file
+     *
+     * Layout (all integers in host byte order):
+     * - magic "SLCB", uint32 version (1), uint64 number of rows, uint32 number of columns
+     * - per column: uint32 name length, name, uint32 dtype length, numpy dtype
+     *   string (eg "<i4"), uint64 byte length, data, zero padding to 8 bytes
+     *
+     * Sequence and quality columns are written as "seq" / "qual" ("|u1")
+     * with a matching "seq_offsets" / "qual_offsets" ("<u8", size()+1 entries).
+     * Each column can be read directly with numpy.frombuffer.
+     * @param file Path to write to
+     * @return false if the file could not be written
+     */
+    bool WriteColumns(const std::string& file) const;
+
+  private:
+
+    int m_columns;
+
+    std::vector<int32_t> m_tid;
+    std::vector<int32_t> m_pos;
+    std::vector<int32_t> m_end;
+    std::vector<int32_t> m_mtid;
+    std::vector<int32_t> m_mpos;
+    std::vector<int32_t> m_isize;
+    std::vector<uint16_t> m_flag;
+    std::vector<uint8_t> m_mapq;
+    std::vector<int32_t> m_sclip;
+    std::vector<int32_t> m_hclip;
+    std::vector<uint32_t> m_ncigar;
+
+    std::vector<char> m_seq;
+    std::vector<uint64_t> m_seq_offsets;
+    std::vector<char> m_qual;
+    std::vector<uint64_t> m_qual_offsets;
+
+    void add(const bam1_t* b, const CigarSummary& cs);
+
+    // set an empty mask to all-selected, and check the size otherwise
+    void init_mask(BatchMask& m) const;
+
+  };
+
+}
+
+#endif
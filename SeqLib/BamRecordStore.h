@@ -0,0 +1,188 @@
+#ifndef SEQLIB_BAM_RECORD_STORE_H
+#define SEQLIB_BAM_RECORD_STORE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "SeqLib/BamRecord.h"
+
+namespace SeqLib {
+
+  /** Compact in-memory store of many alignment records
+   *
+   * A BamRecordVector holds one bam1_t, one data buffer and one handle per read.
+   * A BamRecordStore instead copies the raw bytes of each record (core fields and
+   * data) back-to-back into large arena chunks, and keeps a single 64-bit offset
+   * per record. Records can be read back as BamRecord objects that point into
+   * the arena without copying.
+   *
+   * Records are append-only. Reordering (eg sorting) is done by permuting the
+   * offset index, so the record bytes never move.
+   */
+  class BamRecordStore {
+
+  public:
+
+    static const size_t DEFAULT_CHUNK_SIZE = 1 << 24; ///< 16 MB arena chunks
+
+    /** Iterator over the records of a store, yielding BamRecord views */
+    class const_iterator {
+    public:
+      typedef std::random_access_iterator_tag iterator_category; ///< Iterator traits
+      typedef BamRecord value_type; ///< Iterator traits
+      typedef std::ptrdiff_t difference_type; ///< Iterator traits
+      typedef const BamRecord* pointer; ///< Iterator traits
+      typedef BamRecord reference; ///< Iterator traits (returned by value)
+
+      const_iterator() : m_store(NULL), m_i(0) {}
+      const_iterator(const BamRecordStore* s, size_t i) : m_store(s), m_i(i) {}
+
+      BamRecord operator*() const { return m_store->View(m_i); }
+      BamRecord operator[](difference_type n) const { return m_store->View(m_i + n); }
+      const_iterator& operator++() { ++m_i; return *this; }
+      const_iterator operator++(int) { const_iterator t = *this; ++m_i; return t; }
+      const_iterator& operator--() { --m_i; return *this; }
+      const_iterator operator--(int) { const_iterator t = *this; --m_i; return t; }
+      const_iterator& operator+=(difference_type n) { m_i += n; return *this; }
+      const_iterator& operator-=(difference_type n) { m_i -= n; return *this; }
+      const_iterator operator+(difference_type n) const { return const_iterator(m_store, m_i + n); }
+      const_iterator operator-(difference_type n) const { return const_iterator(m_store, m_i - n); }
+      difference_type operator-(const const_iterator& o) const { return (difference_type)m_i - (difference_type)o.m_i; }
+      bool operator==(const const_iterator& o) const { return m_i == o.m_i && m_store == o.m_store; }
+      bool operator!=(const const_iterator& o) const { return !(*this == o); }
+      bool operator<(const const_iterator& o) const { return m_i < o.m_i; }
+
+      /** Return the index of the current record in the store */
+      size_t index() const { return m_i; }
+
+    private:
+      const BamRecordStore* m_store;
+      size_t m_i;
+    };
+
+    /** Create an empty store
+     * @param chunk_size Size in bytes of each arena chunk. Records larger than
+     * this get a chunk of their own.
+     */
+    explicit BamRecordStore(size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    ~BamRecordStore();
+
+    /** Append a copy of a record
+     * @return Index of the new record
+     * @exception Throws an invalid_argument if the record is empty
+     */
+    size_t Add(const BamRecord& r);
+
+    /** Append a copy of a raw htslib record
+     * @return Index of the new record
+     */
+    size_t Add(const bam1_t* b);
+
+    /** Return the number of records */
+    size_t size() const { return m_offsets.size(); }
+
+    /** Return true if there are no records */
+    bool empty() const { return m_offsets.empty(); }
+
+    /** Remove all records and free the arena */
+    void clear();
+
+    /** Pre-allocate room in the index for n records */
+    void reserve(size_t n) { m_offsets.reserve(n); }
+
+    /** Return the number of bytes held by the arena and index */
+    size_t MemoryUsage() const;
+
+    /** Return a BamRecord over the i'th record, without copying its data.
+     *
+     * The view stays valid as long as the store is not cleared or destroyed.
+     * Modifying it (eg SetQname) gives it a private copy of the data first,
+     * so the store is never changed.
+     * @exception Throws an out_of_range if i >= size()
+     */
+    BamRecord View(size_t i) const;
+
+    /** Return a BamRecord holding its own copy of the i'th record
+     * @exception Throws an out_of_range if i >= size()
+     */
+    BamRecord Copy(size_t i) const;
+
+    /** Return a BamRecord view of the i'th record (no bounds check) */
+    BamRecord operator[](size_t i) const { return View(i); }
+
+    /** Fill a stack bam1_t that points at the i'th record, without any allocation.
+     *
+     * Useful for reading fields with the htslib macros in hot loops. The bam1_t
+     * does not own its data and must not be modified or passed to bam_destroy1.
+     */
+    void Fill(size_t i, bam1_t& b) const;
+
+    /** Return the core fields (tid, pos, flag etc) of the i'th record */
+    const bam1_core_t& Core(size_t i) const { return header(i)->core; }
+
+    const_iterator begin() const { return const_iterator(this, 0); } ///< Iterator to the first record
+    const_iterator end() const { return const_iterator(this, m_offsets.size()); } ///< Iterator to one past the last record
+
+    /** Compute the order that sorts the records by a 64-bit key
+     *
+     * @param key Functor taking a const bam1_t* and returning a uint64_t key
+     * @param perm Filled with record indices, in ascending key order (stable)
+     */
+    template <class KeyFunc>
+    void SortPermutation(KeyFunc key, std::vector<size_t>& perm) const {
+      std::vector<std::pair<uint64_t, size_t> > keys(m_offsets.size());
+      bam1_t b;
+      for (size_t i = 0; i < m_offsets.size(); ++i) {
+	Fill(i, b);
+	keys[i] = std::pair<uint64_t, size_t>(key(&b), i);
+      }
+      std::sort(keys.begin(), keys.end()); // index breaks ties, so this is stable
+      perm.resize(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i)
+	perm[i] = keys[i].second;
+    }
+
+    /** Compute the order that sorts the records by chromosome then position */
+    void CoordinateSortPermutation(std::vector<size_t>& perm) const;
+
+    /** Reorder the records, so that new record i is old record perm[i]
+     *
+     * Only the index is permuted. The record bytes are not moved.
+     * @exception Throws an invalid_argument if perm is not the same size as the store
+     */
+    void Permute(const std::vector<size_t>& perm);
+
+    /** Sort the records by chromosome then position */
+    void CoordinateSort();
+
+  private:
+
+    // stored in front of the data of each record
+    struct RecordHeader {
+      bam1_core_t core;
+      int32_t l_data;
+    };
+
+    size_t m_chunk_size;
+    std::vector<uint8_t*> m_chunks;
+    size_t m_chunk_used; // bytes used in the last chunk
+    size_t m_arena_bytes; // total bytes allocated for chunks
+
+    // chunk index in the top 24 bits, byte offset in the lower 40
+    std::vector<uint64_t> m_offsets;
+
+    inline const RecordHeader* header(size_t i) const {
+      const uint64_t o = m_offsets[i];
+      return (const RecordHeader*)(m_chunks[o >> 40] + (o & 0xFFFFFFFFFFULL));
+    }
+
+    // no copying, the arena is owned
+    BamRecordStore(const BamRecordStore&);
+    BamRecordStore& operator=(const BamRecordStore&);
+
+  };
+
+}
+
+#endif
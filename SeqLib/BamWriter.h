@@ -18,9 +18,12 @@ class BamWriter  {
  public:
 
   /** Construct an empty BamWriter to write BAM */
- BamWriter() : output_format("wb") {}
+ BamWriter() : output_format("wb"), m_fast_sam(false) {}
 
   /** Construct an empty BamWriter and specify output format 
+   *
+   * SAM output is formatted by SeqLib (see SamFormatter) and written 
+   * straight to the output stream, rather than through htslib sam_write1.
    * @param o One of SeqLib::BAM, SeqLib::CRAM, SeqLib::SAM
    * @exception Throws an invalid_argument if not one of accepted values
    */
@@ -115,6 +118,10 @@ class BamWriter  {
 
   // for multicore reading/writing
   ThreadPool pool;
+
+  // plain SAM output is formatted here rather than by htslib
+  SamFormatter m_sam;
+  bool m_fast_sam;
   
 };
 
@@ -0,0 +1,104 @@
+#ifndef SEQLIB_COMPACT_REGION_VECTOR_H
+#define SEQLIB_COMPACT_REGION_VECTOR_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "SeqLib/GenomicRegionCollection.h"
+
+namespace SeqLib {
+
+  /** Compact vector of genomic regions stored as packed integer keys
+   *
+   * A GenomicRegion takes 16 bytes (three int32_t and a padded char),
+   * and sorting or merging a GenomicRegionCollection compares it field
+   * by field. Here each region is a 64-bit key holding chr and pos1,
+   * with chr in the high half and the sign bits flipped so that keys
+   * order as (chr, pos1), plus a 32-bit length (pos2 - pos1). That is
+   * 12 bytes per region. Strands are only stored once a region that is
+   * not '*' is added.
+   *
+   * Sort() is a stable byte-wise radix sort on the integer keys, and
+   * Dedup() and MergeOverlappingIntervals() compare integers only.
+   * The order is the same as GenomicRegionCollection::CoordinateSort.
+   * Converting to and from GRC is lossless.
+   */
+  class CompactRegionVector {
+
+  public:
+
+    /** Create an empty vector */
+    CompactRegionVector() : m_sorted(true) {}
+
+    /** Pack the regions of a collection, in the same order */
+    explicit CompactRegionVector(const GRC& g);
+
+    /** Pack chr and pos1 into a key that sorts as (chr, pos1) */
+    static uint64_t PackKey(int32_t chr, int32_t pos1) {
+      return ((uint64_t)((uint32_t)chr ^ 0x80000000u) << 32) | ((uint32_t)pos1 ^ 0x80000000u);
+    }
+
+    /** Add a region to the end
+     * @exception Throws an invalid_argument if pos2 < pos1
+     */
+    void add(const GenomicRegion& gr);
+
+    /** Return the number of regions */
+    size_t size() const { return m_keys.size(); }
+
+    /** Return true if there are no regions */
+    bool IsEmpty() const { return m_keys.empty(); }
+
+    /** Remove all regions */
+    void clear();
+
+    /** Reserve memory for n regions */
+    void reserve(size_t n);
+
+    /** Return the region at index i (unpacked) */
+    GenomicRegion operator[](size_t i) const;
+
+    /** Return the packed (chr, pos1) key of region i */
+    uint64_t Key(size_t i) const { return m_keys[i]; }
+
+    /** Return true if the regions are in coordinate order */
+    bool IsSorted() const;
+
+    /** Stable coordinate sort, by chr, pos1 and then pos2 */
+    void Sort();
+
+    /** Sort, and remove regions with the same chr, pos1 and pos2 as an earlier one
+     * (as GenomicRegion::operator==, which ignores strand)
+     */
+    void Dedup();
+
+    /** Sort and merge overlapping and touching regions (as GenomicRegionCollection::MergeOverlappingIntervals) */
+    void MergeOverlappingIntervals();
+
+    /** Unpack into a GenomicRegionCollection, in the same order */
+    GRC AsGRC() const;
+
+    /** Return the approximate memory used, in bytes */
+    size_t MemoryBytes() const;
+
+  private:
+
+    std::vector<uint64_t> m_keys; // chr and pos1, see PackKey
+
+    std::vector<uint32_t> m_lens; // pos2 - pos1
+
+    std::vector<char> m_strand; // empty while every strand is '*'
+
+    bool m_sorted;
+
+    // move region i to slot w
+    void move(size_t i, size_t w);
+
+    // drop the regions from n on
+    void truncate(size_t n);
+
+  };
+
+}
+
+#endif
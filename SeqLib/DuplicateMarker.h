@@ -0,0 +1,229 @@
+#ifndef SEQLIB_DUPLICATE_MARKER_H
+#define SEQLIB_DUPLICATE_MARKER_H
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "SeqLib/BamRecord.h"
+#include "SeqLib/BamReader.h"
+#include "SeqLib/BamWriter.h"
+
+namespace SeqLib {
+
+  /** Counts collected while marking duplicates */
+  struct DuplicateStats {
+
+    DuplicateStats() : reads(0), fragments(0), pairs(0), duplicate_fragments(0),
+      duplicate_pairs(0), unmatched_mates(0), distant_mates(0), dropped_mates(0), forced(0) {}
+
+    size_t reads;               ///< Records seen
+    size_t fragments;           ///< Mapped primary reads examined as fragments (unpaired, or mate unmapped)
+    size_t pairs;               ///< Read pairs examined (both ends mapped)
+    size_t duplicate_fragments; ///< Fragments marked as duplicate
+    size_t duplicate_pairs;     ///< Pairs marked as duplicate (both reads are flagged)
+    size_t unmatched_mates;     ///< Paired reads whose mate was never seen (or was dropped), passed through unmarked
+    size_t distant_mates;       ///< Pairs decided from their first read, as the mate is on another chromosome or more than the window away
+    size_t dropped_mates;       ///< Reads still waiting for a mate within the window when the memory limit was hit, passed through unmarked
+    size_t forced;              ///< Decisions forced early by the memory limit
+  };
+
+  /** Streaming duplicate marking for coordinate-sorted alignments
+   *
+   * Reads are keyed by library, strand and unclipped 5' position (soft and
+   * hard clips are added back, from the cached CigarSummary). Pairs are keyed on
+   * both of their ends, and are formed by holding the first read of each pair
+   * until its mate arrives. Within a set of reads (or pairs) with the same key,
+   * the one with the highest sum of base qualities is kept and the others get
+   * the duplicate flag. As in Picard, a fragment that shares its key with an
+   * end of a pair is always a duplicate.
+   *
+   * The input is consumed in a single pass. A key is final once the input
+   * has moved more than the window past its 5' position, so only reads within
+   * the window (plus pairs waiting for a mate) are held in memory. If that
+   * exceeds the memory limit, the oldest reads are decided early (see
+   * DuplicateStats::forced). Output order is the same as input order.
+   *
+   * A pair whose mate is on another chromosome, or further than the window,
+   * is not held until the mate arrives (DuplicateStats::distant_mates). Its
+   * key and score are taken from the first read: the unclipped 5' end of the
+   * mate from MPOS and the mate CIGAR (MC tag), and the mate's score from the
+   * ms tag, as added by samtools fixmate -m. Without MC the mate is taken to
+   * be unclipped and as long as the first read, and without ms the first
+   * read's score is counted twice. The decision is kept by read name and
+   * applied to the mate when it arrives, so only the names of these pairs
+   * are held, not their reads.
+   *
+   * Unmapped, secondary and supplementary reads are passed through. Any
+   * duplicate flag already on the input is cleared. Records are held and
+   * flagged in place, not copied, so do not modify a record after adding it.
+   */
+  class DuplicateMarker {
+
+  public:
+
+    /** Create a marker with a 1000 bp window, 512 MB memory limit, and base quality cutoff of 15 */
+    DuplicateMarker();
+
+    /** Set the header, used to map read groups (RG tags) to libraries (LB in @RG) */
+    void SetHeader(const BamHeader& h);
+
+    /** Set how far (bp) the input must move past a 5' position before its key is final
+     *
+     * Should be at least the longest reference span plus clipping of a read.
+     * @exception Throws an invalid_argument if w < 1
+     */
+    void SetWindow(int32_t w);
+
+    /** Set the approximate number of bytes of reads to hold before deciding early */
+    void SetMemoryLimit(size_t bytes) { m_memory_limit = bytes; }
+
+    /** Only count bases with at least this quality towards a read's score */
+    void SetMinBaseQuality(int q) { m_min_base_quality = q; }
+
+    /** Drop duplicates from the output rather than flagging them */
+    void SetRemoveDuplicates(bool r) { m_remove = r; }
+
+    /** Add the next record of the input
+     * @exception Throws a runtime_error if the input is not coordinate sorted
+     */
+    void Add(const BamRecord& r);
+
+    /** Retrieve the next record whose duplicate status is decided, in input order
+     * @return false if no record is ready yet
+     */
+    bool GetNextRecord(BamRecord& r);
+
+    /** Decide all held records. Call at the end of the input, then drain with GetNextRecord */
+    void Flush();
+
+    /** Return the counts so far */
+    const DuplicateStats& Stats() const { return m_stats; }
+
+    /** Mark duplicates on a whole input stream
+     *
+     * For multithreaded compression and decompression, attach a ThreadPool
+     * to the reader and writer before calling. The writer should be opened,
+     * and have its header set and written.
+     * @return false if a record could not be written
+     */
+    bool Run(BamReader& in, BamWriter& out);
+
+    /** Mark duplicates from one file into a new BAM
+     * @param in Coordinate-sorted BAM/SAM/CRAM to read
+     * @param out BAM file to write (or "-" for stdout)
+     * @param threads Number of threads for BGZF compression / decompression
+     * @return false if the input or output could not be opened or written
+     */
+    bool Run(const std::string& in, const std::string& out, int threads = 1);
+
+  private:
+
+    // key of a single read end
+    struct EndKey {
+      int lib;
+      int32_t tid;
+      int32_t pos;
+      bool rev;
+      bool operator<(const EndKey& o) const {
+	if (tid != o.tid) return tid < o.tid;
+	if (pos != o.pos) return pos < o.pos;
+	if (rev != o.rev) return rev < o.rev;
+	return lib < o.lib;
+      }
+    };
+
+    // key of a pair: its two ends, in order
+    struct PairKey {
+      EndKey a, b;
+      bool operator<(const PairKey& o) const {
+	if (a < o.a) return true;
+	if (o.a < a) return false;
+	return b < o.b;
+      }
+    };
+
+    // reads (or pairs) sharing a key. ids index into the queue
+    struct Group {
+      Group() : has_pair(false) {}
+      std::vector<uint64_t> ids;  // one per fragment, two per pair
+      std::vector<int64_t> scores; // one per fragment / pair
+      bool has_pair;               // fragment groups only: an end of a pair has this key
+    };
+
+    // first read of a pair, waiting for its mate
+    struct Mate {
+      uint64_t id;
+      EndKey end;
+      int64_t score;
+    };
+
+    // pair decided from its first read, for the mate to pick up
+    enum { DISTANT_PENDING, DISTANT_KEPT, DISTANT_DUP };
+
+    struct Distant {
+      PairKey key; // group of the pair, while DISTANT_PENDING
+      int state;
+    };
+
+    // group a queued read is in, if any
+    enum { GROUP_NONE, GROUP_FRAG, GROUP_PAIR };
+
+    struct Entry {
+      BamRecord rec;
+      bool decided;
+      bool waiting; // in m_mates
+      int group;    // GROUP_NONE, GROUP_FRAG or GROUP_PAIR
+      PairKey key;  // key of the group (only a is set for a fragment)
+    };
+
+    int32_t m_window;
+    size_t m_memory_limit;
+    int m_min_base_quality;
+    bool m_remove;
+
+    std::deque<Entry> m_queue;
+    uint64_t m_first_id; // id of m_queue.front()
+    size_t m_bytes;
+
+    std::map<EndKey, Group> m_frags;
+    std::map<PairKey, Group> m_pairs;
+
+    // groups by the coordinate at which they become final
+    std::multimap<uint64_t, EndKey> m_frag_close;
+    std::multimap<uint64_t, PairKey> m_pair_close;
+
+    SeqHashMap<std::string, Mate> m_mates;
+
+    SeqHashMap<std::string, Distant> m_distant;
+
+    SeqHashSet<std::string> m_dropped; // names of reads given up on by force_front
+
+    SeqHashMap<std::string, int> m_rg_lib; // read group -> library index
+
+    uint64_t m_last; // coordinate of the last mapped record, to check sorting
+    bool m_unmapped; // reached the unmapped reads at the end
+
+    DuplicateStats m_stats;
+
+    inline Entry& entry(uint64_t id) { return m_queue[id - m_first_id]; }
+
+    EndKey end_key(const BamRecord& r, int lib) const;
+    EndKey mate_key(const BamRecord& r, int lib) const;
+    int64_t score(const BamRecord& r) const;
+    int library(const BamRecord& r) const;
+
+    Group& frag_group(const EndKey& k);
+
+    void close_before(uint64_t coord);
+    void finalize_frag(std::map<EndKey, Group>::iterator g);
+    void finalize_pair(std::map<PairKey, Group>::iterator g);
+    void mark(uint64_t id);
+    void force_front();
+
+  };
+
+}
+
+#endif
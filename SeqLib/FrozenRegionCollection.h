@@ -0,0 +1,189 @@
+#ifndef SEQLIB_FROZEN_REGION_COLLECTION_H
+#define SEQLIB_FROZEN_REGION_COLLECTION_H
+
+#include <vector>
+#include <stdexcept>
+
+#include "SeqLib/GenomicRegionCollection.h"
+
+namespace SeqLib {
+
+  /** Immutable, indexed snapshot of a GenomicRegionCollection
+   *
+   * A GenomicRegionCollection carries mutable state (the iteration
+   * cursor, the sorted flag and the interval tree made by CreateTreeMap),
+   * so it cannot be queried from several threads without copying it per
+   * thread. A FrozenRegionCollection is sorted and indexed once, when it
+   * is made, and has no non-const members after that. Any number of
+   * threads can query one snapshot concurrently, without locks.
+   *
+   * Copies are cheap and share the same regions and index, so a snapshot
+   * can be handed to each worker by value. Later changes to the source
+   * collection do not affect the snapshot.
+   *
+   * IDs returned by the queries are indices into the snapshot, which
+   * holds the regions in coordinate order (the same IDs as the source
+   * collection would give after CreateTreeMap).
+   */
+  template<typename T=GenomicRegion>
+  class FrozenRegionCollection {
+
+  public:
+
+    /** Create an empty snapshot */
+    FrozenRegionCollection() : m_data(new Data()) {}
+
+    /** Sort and index a copy of a collection
+     * @param g Collection to copy. It is not modified, and does not need a tree.
+     * @param threads Number of threads for the sort (see GenomicRegionCollection::CoordinateSort)
+     */
+    explicit FrozenRegionCollection(const GenomicRegionCollection<T>& g, int threads = 1);
+
+    /** Return the number of regions */
+    size_t size() const { return m_data->regions.size(); }
+
+    /** Return true if there are no regions */
+    bool IsEmpty() const { return m_data->regions.empty(); }
+
+    /** Return the region with ID i */
+    const T& operator[](size_t i) const { return m_data->regions[i]; }
+
+    /** Return the region with ID i
+     * @exception Throws an out_of_range if i is past the end
+     */
+    const T& at(size_t i) const { return m_data->regions.at(i); }
+
+    /** Const iterator to the first region */
+    typename std::vector<T>::const_iterator begin() const { return m_data->regions.begin(); }
+
+    /** Const iterator to the end of the regions */
+    typename std::vector<T>::const_iterator end() const { return m_data->regions.end(); }
+
+    /** Call f(id) for each region overlapping gr
+     *
+     * Same contract as GenomicRegionCollection::ForEachOverlap. Allocates nothing.
+     * @return Number of overlapping regions
+     */
+    template<class K, class F>
+    size_t ForEachOverlap(const K& gr, bool ignore_strand, F& f) const;
+
+    /** Return the number of regions overlapping gr */
+    template<class K>
+    size_t CountOverlaps(const K& gr, bool ignore_strand = true) const;
+
+    /** Return the IDs of the regions overlapping gr, in genomic order */
+    template<class K>
+    std::vector<int> FindOverlappedIntervals(const K& gr, bool ignore_strand = true) const;
+
+    /** Return the overlaps between the snapshot and gr
+     * @return The overlapping regions, trimmed to be contained inside gr
+     * (as GenomicRegionCollection::FindOverlaps)
+     */
+    template<class K>
+    GenomicRegionCollection<GenomicRegion> FindOverlaps(const K& gr, bool ignore_strand = true) const;
+
+  private:
+
+    struct Data {
+      std::vector<T> regions; // coordinate sorted
+      std::vector<GenomicIntervalIndex> index; // one per chromosome ID
+    };
+
+    // shared by all copies, never written once made
+    SeqPointer<const Data> m_data;
+
+  };
+
+  template<class T>
+  FrozenRegionCollection<T>::FrozenRegionCollection(const GenomicRegionCollection<T>& g, int threads) {
+
+    GenomicRegionCollection<T> s;
+    s.Concat(g);
+    s.CoordinateSort(threads);
+
+    Data* d = new Data();
+    m_data = SeqPointer<const Data>(d);
+    d->regions.assign(s.begin(), s.end());
+
+    const std::vector<T>& v = d->regions;
+    if (v.empty() || v.back().chr < 0)
+      return;
+    d->index.resize(v.back().chr + 1);
+
+    // each chromosome is one run of the sorted regions
+    size_t b = 0;
+    while (b < v.size()) {
+      size_t e = b + 1;
+      while (e < v.size() && v[e].chr == v[b].chr)
+	++e;
+      if (v[b].chr >= 0) {
+	GenomicIntervalIndex& ix = d->index[v[b].chr];
+	ix.reserve(e - b);
+	for (size_t i = b; i < e; ++i)
+	  ix.add(v[i].pos1, v[i].pos2, i);
+	ix.index();
+      }
+      b = e;
+    }
+  }
+
+  template<class T>
+  template<class K, class F>
+  size_t FrozenRegionCollection<T>::ForEachOverlap(const K& gr, bool ignore_strand, F& f) const {
+    const Data& d = *m_data;
+    if (gr.chr < 0 || (size_t)gr.chr >= d.index.size())
+      return 0;
+    GRCStrandVisitor<T, F> v(d.regions, ignore_strand, gr.strand, f);
+    d.index[gr.chr].visitOverlapping(gr.pos1, gr.pos2, v);
+    return v.count;
+  }
+
+  // counts only
+  struct FRCCounter {
+    void operator()(size_t) {}
+  };
+
+  template<class T>
+  template<class K>
+  size_t FrozenRegionCollection<T>::CountOverlaps(const K& gr, bool ignore_strand) const {
+    FRCCounter c;
+    return ForEachOverlap(gr, ignore_strand, c);
+  }
+
+  template<class T>
+  template<class K>
+  std::vector<int> FrozenRegionCollection<T>::FindOverlappedIntervals(const K& gr, bool ignore_strand) const {
+    std::vector<int> out;
+    GRCIdCollector c(out);
+    ForEachOverlap(gr, ignore_strand, c);
+    return out;
+  }
+
+  // adds the part of each overlapping region that is inside the query
+  template<class T>
+  struct FRCOverlapCollector {
+    FRCOverlapCollector(const FrozenRegionCollection<T>& g, const GenomicRegion& q, GenomicRegionCollection<GenomicRegion>& o)
+      : subject(g), query(q), out(o) {}
+    void operator()(size_t i) {
+      const T& s = subject[i];
+      out.add(GenomicRegion(query.chr, std::max(s.pos1, query.pos1), std::min(s.pos2, query.pos2)));
+    }
+    const FrozenRegionCollection<T>& subject;
+    GenomicRegion query;
+    GenomicRegionCollection<GenomicRegion>& out;
+  };
+
+  template<class T>
+  template<class K>
+  GenomicRegionCollection<GenomicRegion> FrozenRegionCollection<T>::FindOverlaps(const K& gr, bool ignore_strand) const {
+    GenomicRegionCollection<GenomicRegion> out;
+    FRCOverlapCollector<T> c(*this, GenomicRegion(gr.chr, gr.pos1, gr.pos2, gr.strand), out);
+    ForEachOverlap(gr, ignore_strand, c);
+    return out;
+  }
+
+  typedef FrozenRegionCollection<GenomicRegion> FrozenGRC;
+
+}
+
+#endif
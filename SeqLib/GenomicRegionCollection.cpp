@@ -7,8 +7,13 @@
 #include <set>
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
+#include <climits>
+#include <exception>
 #include <zlib.h>
 
+#include "htslib/htslib/tbx.h"
+
 #define GZBUFFER 65472
 
 //#define DEBUG_OVERLAPS 1
@@ -64,11 +69,128 @@ namespace SeqLib {
     }
   }
 
+  // below this size, CoordinateSort uses a comparison sort
+#define GRC_RADIX_MIN 65536
+  // each radix sort thread gets at least this many elements
+#define GRC_RADIX_SLICE 262144
+
+  // 16-bit digit of pass p of the radix sort. pos2 is least significant,
+  // chr most. The sign bit is flipped so that negative values sort first
+  template<class T>
+  static inline uint32_t grc_radix_digit(const T& g, int p) {
+    const int32_t v = p < 2 ? g.pos2 : (p < 4 ? g.pos1 : g.chr);
+    return (((uint32_t)v ^ 0x80000000u) >> ((p & 1) * 16)) & 0xFFFF;
+  }
+
+  template<class T>
+  static void grc_radix_count(const T* src, size_t b, size_t e, int p, size_t* cnt) {
+    for (size_t i = b; i < e; ++i)
+      ++cnt[grc_radix_digit(src[i], p)];
+  }
+
+  template<class T>
+  static void grc_radix_scatter(const T* src, size_t b, size_t e, int p, size_t* off, T* dst) {
+    for (size_t i = b; i < e; ++i)
+      dst[off[grc_radix_digit(src[i], p)]++] = src[i];
+  }
+
+  // the radix sort orders by (chr, pos1, pos2), which is GenomicRegion::operator<.
+  // Other element types may order themselves differently, so they always
+  // use their own operator<
+  template<class T>
+  static inline bool grc_radix_key(const T*) { return false; }
+
+  static inline bool grc_radix_key(const GenomicRegion*) { return true; }
+
+  // stable LSD radix sort on (chr, pos1, pos2). Each thread counts and then
+  // scatters its own slice, so the order within a digit is kept
+  template<class T>
+  static void grc_radix_sort(std::vector<T>& v, int threads) {
+
+    const size_t n = v.size();
+    if (n < GRC_RADIX_MIN || !grc_radix_key((const T*)NULL)) {
+      std::stable_sort(v.begin(), v.end());
+      return;
+    }
+
+    size_t nt = 1;
+#ifdef HAVE_C11
+    if (threads > 1)
+      nt = std::max<size_t>(1, std::min<size_t>(threads, n / GRC_RADIX_SLICE));
+    const size_t slice = (n + nt - 1) / nt;
+#else
+    (void)threads; // single threaded without C++11
+#endif
+
+    // scratch copy, overwritten by the first pass. Copying rather than sizing
+    // it means T need not be default-constructible
+    std::vector<T> buf;
+    buf.reserve(n);
+    buf.insert(buf.end(), v.begin(), v.end());
+    T* src = &v[0];
+    T* dst = &buf[0];
+    std::vector<size_t> cnt(nt << 16);
+
+    for (int p = 0; p < 6; ++p) {
+
+      std::fill(cnt.begin(), cnt.end(), 0);
+#ifdef HAVE_C11
+      if (nt > 1) {
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < nt; ++t)
+	  pool.push_back(std::thread(grc_radix_count<T>, src, t * slice, std::min(n, (t + 1) * slice), p, &cnt[t << 16]));
+	for (size_t t = 0; t < nt; ++t)
+	  pool[t].join();
+      } else
+#endif
+	grc_radix_count(src, 0, n, p, &cnt[0]);
+
+      // skip the pass if every element has the same digit
+      bool skip = false;
+      for (size_t d = 0; d < 65536; ++d) {
+	size_t tot = 0;
+	for (size_t t = 0; t < nt; ++t)
+	  tot += cnt[(t << 16) + d];
+	if (tot) {
+	  skip = tot == n;
+	  break;
+	}
+      }
+      if (skip)
+	continue;
+
+      // offsets, digit-major and then in thread order
+      size_t sum = 0;
+      for (size_t d = 0; d < 65536; ++d)
+	for (size_t t = 0; t < nt; ++t) {
+	  const size_t c = cnt[(t << 16) + d];
+	  cnt[(t << 16) + d] = sum;
+	  sum += c;
+	}
+
+#ifdef HAVE_C11
+      if (nt > 1) {
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < nt; ++t)
+	  pool.push_back(std::thread(grc_radix_scatter<T>, src, t * slice, std::min(n, (t + 1) * slice), p, &cnt[t << 16], dst));
+	for (size_t t = 0; t < nt; ++t)
+	  pool[t].join();
+      } else
+#endif
+	grc_radix_scatter(src, 0, n, p, &cnt[0], dst);
+
+      std::swap(src, dst);
+    }
+
+    if (src != &v[0])
+      v.swap(buf);
+  }
+
   template<class T>
-  void GenomicRegionCollection<T>::CoordinateSort() {
+  void GenomicRegionCollection<T>::CoordinateSort(int threads) {
     
     if (m_grv) {
-      std::sort(m_grv->begin(), m_grv->end());
+      grc_radix_sort(*m_grv, threads);
       m_sorted = true;
     }
   }
@@ -116,69 +238,282 @@ namespace SeqLib {
 
   }
 
+// size of each block of whole lines handed to a parsing thread
+#define GRC_LOAD_CHUNK (4 << 20)
+
+// one block of whole lines, parsed to regions on a worker thread
 template<class T>
-bool GenomicRegionCollection<T>::ReadBED(const std::string & file, const BamHeader& hdr) {
+struct GRCLoadChunk {
+  std::string text;
+  std::vector<T> out;
+#ifdef HAVE_C11
+  std::exception_ptr err; // thrown while parsing, rethrown on the reading thread
+#endif
+};
+
+// chromosome name to id, as the GenomicRegion string constructor does it
+static inline int grc_chr_id(const std::string& name, const BamHeader& hdr) {
+  if (!hdr.isEmpty())
+    return hdr.Name2ID(name);
+  try {
+    return GenomicRegion(name, "0", "0", hdr).chr;
+  } catch (...) {
+    return -1;
+  }
+}
 
-  m_sorted = false;
-  idx = 0;
+// the whitespace that std::istream >> std::string stops at
+static inline bool grc_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
 
-  gzFile fp = NULL;
-  fp = strcmp(file.c_str(), "-")? gzopen(file.c_str(), "r") : gzdopen(fileno(stdin), "r");
+// the first n whitespace-delimited fields of [p, e), as
+// std::istream >> std::string reads them. Missing fields are left empty
+static inline void grc_fields(const char* p, const char* e, std::string* f, int n) {
+  for (int i = 0; i < n; ++i) {
+    while (p < e && grc_is_space(*p))
+      ++p;
+    const char* b = p;
+    while (p < e && !grc_is_space(*p))
+      ++p;
+    f[i].assign(b, p);
+  }
+}
 
-  if (file.empty() || !fp) {
-    std::cerr << "BED file not readable: " << file << std::endl;
-    return false;
+// parse one BED or VCF line (without its newline), shared by the serial and
+// threaded readers. BED lines with a '#' and VCF lines starting with one are
+// skipped, T is built from its string constructor and regions on unknown
+// chromosomes are dropped. A BED line T can't parse throws; a VCF one is
+// reported and skipped. f holds scratch space for three fields
+template<class T>
+static void grc_parse_line(const char* line, const char* le, const BamHeader& hdr, bool vcf,
+			   std::string* f, std::vector<T>& out) {
+
+  if (!vcf) {
+    if (memchr(line, '#', le - line))
+      return;
+    grc_fields(line, le, f, 3);
+    T gr(f[0], f[1], f[2], hdr);
+    if (gr.chr >= 0)
+      out.push_back(gr);
+    return;
   }
 
-  // http://www.lemoda.net/c/gzfile-read/
-  while (1) {
+  if (line < le && *line == '#')
+    return;
+  grc_fields(line, le, f, 2);
+  T gr;
+  try {
+    gr = T(f[0], f[1], f[1], hdr);
+  } catch (...) {
+    // one write, so messages from different threads do not interleave
+    std::cerr << ("...Could not parse pos: " + f[1] + "\n\n...on line " + std::string(line, le) + "\n");
+  }
+  if (gr.chr >= 0)
+    out.push_back(gr);
+}
+
+// parse each line of text into out
+template<class T>
+static void grc_parse_chunk(const std::string& text, const BamHeader& hdr, bool vcf, std::vector<T>& out) {
+
+  const char* p = text.data();
+  const char* const e = p + text.size();
+  std::string f[3];
+
+  while (p < e) {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', e - p));
+    if (!eol)
+      eol = e;
+    grc_parse_line(p, eol, hdr, vcf, f, out);
+    p = eol + 1;
+  }
+}
 
-    int err;                    
-    char buffer[GZBUFFER];
-    gzgets(fp, buffer, GZBUFFER);
-    int bytes_read = strlen(buffer);
+// next line of fp, without its newline. A last line with no newline is
+// still returned. False at the end of input
+static bool grc_gz_line(gzFile fp, std::string& line) {
 
-    // get one line
-    if (bytes_read < GZBUFFER - 1) {
-      if (gzeof (fp)) break;
-      else {
-	const char * error_string;
-	error_string = gzerror (fp, &err);
-	if (err) {
-	  fprintf (stderr, "Error: %s.\n", error_string);
-	  exit (EXIT_FAILURE);
-	}
+  line.clear();
+  char buffer[GZBUFFER];
+  while (gzgets(fp, buffer, GZBUFFER)) {
+    line.append(buffer);
+    if (!line.empty() && line[line.size() - 1] == '\n') {
+      line.resize(line.size() - 1);
+      return true;
+    }
+  }
+
+  int err;
+  const char * error_string = gzerror (fp, &err);
+  if (err) {
+    fprintf (stderr, "Error: %s.\n", error_string);
+    exit (EXIT_FAILURE);
+  }
+  return !line.empty();
+}
+
+// next block of whole lines from fp into text, with the partial last line
+// kept in carry for the following block. False at the end of input
+static bool grc_next_chunk(BGZF* fp, std::string& carry, std::string& text, bool& eof) {
+
+  text.swap(carry);
+  carry.clear();
+  if (eof)
+    return !text.empty();
+
+  const size_t have = text.size();
+  text.resize(have + GRC_LOAD_CHUNK);
+  const ssize_t n = bgzf_read(fp, &text[have], GRC_LOAD_CHUNK);
+  if (n < 0)
+    throw std::runtime_error("GenomicRegionCollection - error decompressing input");
+  text.resize(have + n);
+
+  if (n == 0) {
+    eof = true;
+    return !text.empty();
+  }
+
+  const size_t nl = text.rfind('\n');
+  if (nl == std::string::npos) {
+    // no full line yet, keep reading
+    carry.swap(text);
+    return grc_next_chunk(fp, carry, text, eof);
+  }
+  carry.assign(text, nl + 1, std::string::npos);
+  text.resize(nl + 1);
+  return true;
+}
+
+// fill a batch of chunks. Returns the number filled
+template<class T>
+static size_t grc_fill_batch(BGZF* fp, std::string& carry, bool& eof, std::vector<GRCLoadChunk<T> >& batch) {
+  size_t k = 0;
+  for (; k < batch.size(); ++k) {
+    batch[k].out.clear();
+#ifdef HAVE_C11
+    batch[k].err = std::exception_ptr();
+#endif
+    if (!grc_next_chunk(fp, carry, batch[k].text, eof))
+      break;
+  }
+  return k;
+}
+
+#ifdef HAVE_C11
+// parse every step'th chunk from first. An exception stops its chunk and is
+// kept for the reading thread, which appends the regions before it first
+template<class T>
+static void grc_parse_batch(std::vector<GRCLoadChunk<T> >* batch, size_t n, size_t first, size_t step,
+			    const BamHeader* hdr, bool vcf) {
+  for (size_t i = first; i < n; i += step) {
+    GRCLoadChunk<T>& c = (*batch)[i];
+    try {
+      grc_parse_chunk(c.text, *hdr, vcf, c.out);
+    } catch (...) {
+      c.err = std::current_exception();
+    }
+  }
+}
+#endif
+
+// parallel loader behind ReadBED and ReadVCF. htslib decompresses BGZF
+// blocks on its own threads; whole-line chunks are parsed on worker threads
+// while the next batch is read, and appended in file order. Lines are
+// parsed as the serial readers do, so the regions (and any exception) are
+// the same for every thread count
+template<class T>
+static bool grc_load_regions(const std::string& file, const BamHeader& hdr, bool vcf, int threads, std::vector<T>& out) {
+
+  BGZF* fp = file.empty() ? NULL : bgzf_open(file.c_str(), "r");
+  if (!fp) {
+    std::cerr << (vcf ? "VCF" : "BED") << " file not readable: " << file << std::endl;
+    return false;
+  }
+  if (threads > 1)
+    bgzf_mt(fp, threads, 256);
+
+  const size_t nt = threads > 1 ? threads : 1;
+  std::vector<GRCLoadChunk<T> > cur(nt), next(nt);
+  std::string carry;
+  bool eof = false;
+
+  try {
+    size_t n = grc_fill_batch(fp, carry, eof, cur);
+    while (n) {
+
+      size_t m = 0;
+#ifdef HAVE_C11
+      std::vector<std::thread> pool;
+      for (size_t t = 0; t < nt && t < n; ++t)
+	pool.push_back(std::thread(grc_parse_batch<T>, &cur, n, t, nt, &hdr, vcf));
+      try {
+	m = grc_fill_batch(fp, carry, eof, next);
+      } catch (...) {
+	// the workers still use cur, and a joinable thread must not be destroyed
+	for (size_t t = 0; t < pool.size(); ++t)
+	  pool[t].join();
+	throw;
+      }
+      for (size_t t = 0; t < pool.size(); ++t)
+	pool[t].join();
+
+      for (size_t i = 0; i < n; ++i) {
+	out.insert(out.end(), cur[i].out.begin(), cur[i].out.end());
+	if (cur[i].err)
+	  std::rethrow_exception(cur[i].err);
       }
+#else
+      for (size_t i = 0; i < n; ++i)
+	grc_parse_chunk(cur[i].text, hdr, vcf, out);
+      m = grc_fill_batch(fp, carry, eof, next);
+#endif
+
+      cur.swap(next);
+      n = m;
     }
+  } catch (...) {
+    bgzf_close(fp);
+    throw;
+  }
 
-    // prepare to loop through each field of BED line
-    //size_t counter = 0;
-    std::string chr, pos1, pos2;
-    std::string line(buffer);
-    std::istringstream iss_line(line);
-    std::string val;
-    if (line.find("#") != std::string::npos) 
-      continue;
-    
-    // read first three BED columns
-    iss_line >> chr >> pos1 >> pos2;
+  bgzf_close(fp);
+  return true;
+}
 
-    // construct the GenomicRegion
-    T gr(chr, pos1, pos2, hdr);
-    
-    if (gr.chr >= 0)
-      m_grv->push_back(gr);
+template<class T>
+bool GenomicRegionCollection<T>::ReadBED(const std::string & file, const BamHeader& hdr, int threads) {
+
+  m_sorted = false;
+  idx = 0;
+
+  if (threads > 1)
+    return grc_load_regions(file, hdr, false, threads, *m_grv);
+
+  gzFile fp = NULL;
+  fp = strcmp(file.c_str(), "-")? gzopen(file.c_str(), "r") : gzdopen(fileno(stdin), "r");
+
+  if (file.empty() || !fp) {
+    std::cerr << "BED file not readable: " << file << std::endl;
+    return false;
   }
 
+  std::string line, f[3];
+  while (grc_gz_line(fp, line))
+    grc_parse_line(line.data(), line.data() + line.size(), hdr, false, f, *m_grv);
+
   return true;
 }
 
 template<class T>
-bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr) {
+bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr, int threads) {
 
   m_sorted = false;
   idx = 0;
 
+  if (threads > 1)
+    return grc_load_regions(file, hdr, true, threads, *m_grv);
+
   gzFile fp = NULL;
   fp = strcmp(file.c_str(), "-")? gzopen(file.c_str(), "r") : gzdopen(fileno(stdin), "r");
   
@@ -187,51 +522,130 @@ bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHead
     return false;
   }
 
-  // http://www.lemoda.net/c/gzfile-read/
-  while (1) {
+  std::string line, f[3];
+  while (grc_gz_line(fp, line))
+    grc_parse_line(line.data(), line.data() + line.size(), hdr, true, f, *m_grv);
 
-    int err;                    
-    char buffer[GZBUFFER];
-    gzgets(fp, buffer, GZBUFFER);
-    int bytes_read = strlen(buffer);
+  return true;
+}
 
-    // get one line
-    if (bytes_read < GZBUFFER - 1) {
-      if (gzeof (fp)) break;
-      else {
-	const char * error_string;
-	error_string = gzerror (fp, &err);
-	if (err) {
-	  fprintf (stderr, "Error: %s.\n", error_string);
-	  exit (EXIT_FAILURE);
-	}
-      }
-    }
+// order by start and then end, for hits already on one chromosome
+template<class T>
+static bool grc_by_position(const T& a, const T& b) {
+  return a.pos1 < b.pos1 || (a.pos1 == b.pos1 && a.pos2 < b.pos2);
+}
+
+template<class T>
+template<class K>
+bool GenomicRegionCollection<T>::ReadIndexed(const std::string & file, const BamHeader& hdr, const GenomicRegionCollection<K>& query) {
 
-    // prepare to loop through each field of BED line
-    std::string chr, pos;
-    std::string line(buffer);
-    std::istringstream iss_line(line);
-    std::string val;
-    if (line.empty() || line.at(0) == '#')
+  m_sorted = false;
+  idx = 0;
+
+  htsFile* fp = file.empty() ? NULL : hts_open(file.c_str(), "r");
+  if (!fp) {
+    std::cerr << "Indexed file not readable: " << file << std::endl;
+    return false;
+  }
+
+  tbx_t* tbx = tbx_index_load(file.c_str());
+  if (!tbx) {
+    std::cerr << "Tabix index not found for: " << file << std::endl;
+    hts_close(fp);
+    return false;
+  }
+
+  const bool vcf = (tbx->conf.preset & 0xffff) == TBX_VCF;
+
+  // tabix sequence ids for each chromosome id, with names resolved the
+  // same way as ReadBED / ReadVCF
+  std::vector<std::vector<int> > tids;
+  int nseq = 0;
+  const char** names = tbx_seqnames(tbx, &nseq);
+  for (int i = 0; i < nseq; ++i) {
+    const int c = grc_chr_id(names[i], hdr);
+    if (c < 0)
       continue;
+    if ((size_t)c >= tids.size())
+      tids.resize(c + 1);
+    tids[c].push_back(i);
+  }
+  free(names);
+
+  // sorted, non-overlapping targets, so each record is fetched for as few
+  // targets as possible
+  GenomicRegionCollection<GenomicRegion> q;
+  for (size_t i = 0; i < query.size(); ++i) {
+    GenomicRegion gr;
+    gr.chr = query[i].chr;
+    gr.pos1 = query[i].pos1;
+    gr.pos2 = query[i].pos2;
+    q.add(gr);
+  }
+  q.MergeOverlappingIntervals();
 
-    // read first two columnes
-    iss_line >> chr >> pos;
+  kstring_t str = {0, 0, NULL};
+  GRCLoadChunk<T> chunk;
 
-    // construct the GenomicRegion
-    T gr;
-    try {
-      gr = T(chr, pos, pos, hdr);
-    } catch (...) {
-      std::cerr << "...Could not parse pos: " << pos << std::endl << std::endl
-		<< "...on line " << line << std::endl;
-      
+  try {
+    for (size_t i = 0; i < q.size(); ++i) {
+
+      const GenomicRegion& r = q[i];
+      if (r.chr < 0 || (size_t)r.chr >= tids.size())
+	continue;
+
+      // widen by one base so that either coordinate convention of the
+      // index (0-based BED, 1-based VCF) returns every candidate. Overlap
+      // is then checked exactly on the parsed records
+      const int beg = r.pos1 > 0 ? r.pos1 - 1 : 0;
+      const int end = r.pos2 < INT_MAX ? r.pos2 + 1 : r.pos2;
+
+      // a record that also overlaps the previous target was already taken
+      const bool has_prev = i && q[i-1].chr == r.chr;
+      const int32_t prev = has_prev ? q[i-1].pos2 : 0;
+      const size_t first = m_grv->size();
+
+      for (size_t t = 0; t < tids[r.chr].size(); ++t) {
+
+	hts_itr_t* itr = tbx_itr_queryi(tbx, tids[r.chr][t], beg, end);
+	if (!itr)
+	  continue;
+
+	chunk.text.clear();
+	chunk.out.clear();
+	int ret;
+	while ((ret = tbx_itr_next(fp, tbx, itr, &str)) >= 0) {
+	  chunk.text.append(str.s, str.l);
+	  chunk.text.push_back('\n');
+	}
+	tbx_itr_destroy(itr);
+
+	// -1 is the end of the target, anything lower a read error
+	if (ret < -1)
+	  throw std::runtime_error("GenomicRegionCollection - error reading indexed file: " + file);
+
+	grc_parse_chunk(chunk.text, hdr, vcf, chunk.out);
+
+	for (typename std::vector<T>::const_iterator g = chunk.out.begin(); g != chunk.out.end(); ++g)
+	  if (g->pos1 <= r.pos2 && g->pos2 >= r.pos1 && !(has_prev && g->pos1 <= prev))
+	    m_grv->push_back(*g);
+      }
+
+      // each tabix sequence comes back sorted, but several names (eg "chr1"
+      // and "1") can map to this chromosome. Merge them into one order
+      if (tids[r.chr].size() > 1)
+	std::stable_sort(m_grv->begin() + first, m_grv->end(), grc_by_position<T>);
     }
-    if (gr.chr >= 0) 
-      m_grv->push_back(gr);
+  } catch (...) {
+    free(str.s);
+    tbx_destroy(tbx);
+    hts_close(fp);
+    throw;
   }
 
+  free(str.s);
+  tbx_destroy(tbx);
+  hts_close(fp);
   return true;
 }
 
@@ -260,47 +674,104 @@ GenomicRegionCollection<T>::GenomicRegionCollection(const std::string &file, con
 
 }
 
+template<class T>
+template<class K>
+GenomicRegionCollection<T>::GenomicRegionCollection(const std::string &file, const BamHeader& hdr, const GenomicRegionCollection<K>& query) {
+
+  allocate_grc();
+
+  idx = 0;
+
+  ReadIndexed(file, hdr, query);
+}
+
 // reduce a set of GenomicRegions into the minium overlapping set (same as GenomicRanges "reduce")
 template <class T>
-void GenomicRegionCollection<T>::MergeOverlappingIntervals() {
-
-  // make the list
-  std::list<T> intervals(m_grv->begin(), m_grv->end());
-
-  intervals.sort();
-  typename std::list<T>::iterator inext(intervals.begin());
-  ++inext;
-  for (typename std::list<T>::iterator i(intervals.begin()), iend(intervals.end()); inext != iend;) {
-    if((i->pos2 >= inext->pos1) && (i->chr == inext->chr)) // change >= to > to not overlap touching intervals (eg [4,5][5,6])
-      {
-	if(i->pos2 >= inext->pos2) intervals.erase(inext++);
-	else if(i->pos2 < inext->pos2)
-	  { i->pos2 = inext->pos2; intervals.erase(inext++); }
-      }
-    else { ++i; ++inext; }
+void GenomicRegionCollection<T>::MergeOverlappingIntervals(int threads) {
+
+  // clear the old interval tree
+  m_tree->clear();
+
+  if (m_grv->empty())
+    return;
+
+  CoordinateSort(threads);
+
+  // compact in place. Touching intervals are merged (eg [4,5][5,6])
+  std::vector<T>& v = *m_grv;
+  size_t w = 0;
+  for (size_t i = 1; i < v.size(); ++i) {
+    if (v[i].chr == v[w].chr && v[w].pos2 >= v[i].pos1) {
+      if (v[i].pos2 > v[w].pos2)
+	v[w].pos2 = v[i].pos2;
+    } else if (++w != i) {
+      v[w] = v[i];
+    }
   }
+  v.resize(w + 1);
 
-  // move it over to a grv
-  m_grv->clear(); // clear the old data 
+}
 
-  // c++11
-  //std::vector<T> v{ std::make_move_iterator(std::begin(intervals)), 
-  //    std::make_move_iterator(std::end(intervals)) };
-  //m_grv->insert(m_grv->end(), v.begin(), v.end());
+// sorted, merged copy of the intervals of a collection
+template<class K>
+static void grc_merged_copy(const GenomicRegionCollection<K>& g, GenomicRegionCollection<GenomicRegion>& out) {
+  for (typename std::vector<K>::const_iterator i = g.begin(); i != g.end(); ++i)
+    out.add(GenomicRegion(i->chr, i->pos1, i->pos2, i->strand));
+  out.MergeOverlappingIntervals();
+}
 
-  // non c++11
-  //std::vector<T> v;
-  // v.push_back(std::make_move_iterator(std::begin(intervals)));
-  //v.push_back(std::make_move_iterator(std::end(intervals)));
-  //std::vector<T> v{ std::make_move_iterator(std::begin(intervals)), 
-  //    std::make_move_iterator(std::end(intervals)) };
-  //m_grv->insert(m_grv->end(), v.begin(), v.end());
-  //m_grv->reserve(intervals.size());
-  //m_grv->append(intervals.begin(), intervals.end());
-  m_grv->insert(m_grv->end(), intervals.begin(), intervals.end());
+template<class T>
+template<class K>
+GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::Subtract(const GenomicRegionCollection<K>& other) const {
 
-  // clear the old interval tree
-  m_tree->clear();
+  GenomicRegionCollection<GenomicRegion> q, s, out;
+  for (typename std::vector<T>::const_iterator i = m_grv->begin(); i != m_grv->end(); ++i)
+    q.add(GenomicRegion(i->chr, i->pos1, i->pos2, i->strand));
+  q.CoordinateSort();
+  grc_merged_copy(other, s);
+
+  // s is sorted and disjoint, so the first candidate only moves forward
+  size_t j = 0;
+  for (size_t i = 0; i < q.size(); ++i) {
+    const GenomicRegion& a = q[i];
+    while (j < s.size() && (s[j].chr < a.chr || (s[j].chr == a.chr && s[j].pos2 < a.pos1)))
+      ++j;
+    int32_t cur = a.pos1;
+    for (size_t k = j; k < s.size() && s[k].chr == a.chr && s[k].pos1 <= a.pos2; ++k) {
+      if (s[k].pos1 > cur)
+	out.add(GenomicRegion(a.chr, cur, s[k].pos1 - 1, a.strand));
+      cur = std::max(cur, s[k].pos2 + 1);
+    }
+    if (cur <= a.pos2)
+      out.add(GenomicRegion(a.chr, cur, a.pos2, a.strand));
+  }
+
+  return out;
+}
+
+template<class T>
+GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::Complement(const HeaderSequenceVector& h) const {
+
+  GenomicRegionCollection<GenomicRegion> m, out;
+  grc_merged_copy(*this, m);
+
+  size_t j = 0;
+  for (size_t c = 0; c < h.size(); ++c) {
+    const int32_t len = h[c].Length;
+    int32_t cur = 0;
+    while (j < m.size() && m[j].chr < (int32_t)c)
+      ++j;
+    for (; j < m.size() && m[j].chr == (int32_t)c; ++j)
+      if (cur <= len) {
+	if (m[j].pos1 > cur)
+	  out.add(GenomicRegion(c, cur, std::min(m[j].pos1 - 1, len)));
+	cur = std::max(cur, m[j].pos2 + 1);
+      }
+    if (cur <= len)
+      out.add(GenomicRegion(c, cur, len));
+  }
+
+  return out;
 }
 
 template <class T>
@@ -311,9 +782,22 @@ GenomicRegionVector GenomicRegionCollection<T>::AsGenomicRegionVector() const {
   return gg; 
 } 
   
+// orders the IDs of a chromosome run by end, then by ID
+template<class T>
+struct GRCEndLess {
+  GRCEndLess(const std::vector<T>& g) : v(g) {}
+  bool operator()(int32_t a, int32_t b) const {
+    return v[a].pos2 < v[b].pos2 || (v[a].pos2 == v[b].pos2 && a < b);
+  }
+  const std::vector<T>& v;
+};
+
 template <class T>
 void GenomicRegionCollection<T>::CreateTreeMap() {
 
+  m_tree->clear();
+  m_end_order->clear();
+
   if (!m_grv->size())
     return;
 
@@ -321,21 +805,29 @@ void GenomicRegionCollection<T>::CreateTreeMap() {
   if (!m_sorted)
     CoordinateSort();
 
-  // loop through and make the intervals for each chromosome
-  GenomicIntervalMap map;
-  for (size_t i = 0; i < m_grv->size(); ++i) {
-    map[m_grv->at(i).chr].push_back(GenomicInterval(m_grv->at(i).pos1, m_grv->at(i).pos2, i));
-  }
-
-  // for each chr, make the tree from the intervals
-  //for (auto it : map) {
-  for (GenomicIntervalMap::iterator it = map.begin(); it != map.end(); ++it) {
-    GenomicIntervalTreeMap::iterator ff = m_tree->find(it->first);
-    if (ff != m_tree->end())
-      ff->second = GenomicIntervalTree(it->second);
-    else
-      m_tree->insert(std::pair<int, GenomicIntervalTree>(it->first, GenomicIntervalTree(it->second)));
-    //old //m_tree[it.first] = GenomicIntervalTree(it.second);
+  // each chromosome is a run of the sorted intervals, already in start order
+  std::vector<int32_t>& eo = *m_end_order;
+  eo.resize(m_grv->size());
+  size_t b = 0;
+  while (b < m_grv->size()) {
+    const int32_t chr = m_grv->at(b).chr;
+    size_t e = b + 1;
+    bool ends_sorted = true;
+    while (e < m_grv->size() && m_grv->at(e).chr == chr) {
+      ends_sorted = ends_sorted && (*m_grv)[e].pos2 >= (*m_grv)[e-1].pos2;
+      ++e;
+    }
+    GenomicIntervalIndex& ix = (*m_tree)[chr];
+    ix.reserve(e - b);
+    for (size_t i = b; i < e; ++i) {
+      ix.add((*m_grv)[i].pos1, (*m_grv)[i].pos2, i);
+      eo[i] = i;
+    }
+    ix.index();
+    // the end order, for nearest upstream queries. Usually already sorted
+    if (!ends_sorted)
+      std::sort(eo.begin() + b, eo.begin() + e, GRCEndLess<T>(*m_grv));
+    b = e;
   }
 
 }
@@ -401,13 +893,10 @@ size_t GenomicRegionCollection<T>::CountOverlaps(const T &gr) const {
       return 0;
     }
 
-  GenomicIntervalVector giv;
-
   GenomicIntervalTreeMap::const_iterator ff = m_tree->find(gr.chr);
   if (ff == m_tree->end())
     return 0;
-  ff->second.findOverlapping(gr.pos1, gr.pos2, giv);
-  return (giv.size());
+  return ff->second.countOverlapping(gr.pos1, gr.pos2);
 }
 
   template<class T>
@@ -495,6 +984,7 @@ void GenomicRegionCollection<T>::allocate_grc() {
   m_sorted = false;
   m_grv =  SeqPointer<std::vector<T> >(new std::vector<T>()) ;
   m_tree = SeqPointer<GenomicIntervalTreeMap>(new GenomicIntervalTreeMap()) ;
+  m_end_order = SeqPointer<std::vector<int32_t> >(new std::vector<int32_t>()) ;
 }
 
 template<class T>
@@ -518,33 +1008,288 @@ const T& GenomicRegionCollection<T>::at(size_t i) const
 }  
 
 
-// this is query
+// passes index hits that match the strand on to a ForEachOverlap callback
+template<class T, class F>
+struct GRCStrandVisitor {
+  GRCStrandVisitor(const std::vector<T>& g, bool ignore, char s, F& cb) 
+    : grv(g), ignore_strand(ignore), strand(s), f(cb), count(0) {}
+  void operator()(const GenomicIntervalIndex::Node& n) {
+    if (ignore_strand || grv[n.value].strand == strand) {
+      f(static_cast<size_t>(n.value));
+      ++count;
+    }
+  }
+  const std::vector<T>& grv;
+  bool ignore_strand;
+  char strand;
+  F& f;
+  size_t count;
+};
+
 template<class T>
-template<class K>
-std::vector<int> GenomicRegionCollection<T>::FindOverlappedIntervals(const K& gr, bool ignore_strand) const {  
+template<class K, class F>
+size_t GenomicRegionCollection<T>::ForEachOverlap(const K& gr, bool ignore_strand, F& f) const {
 
   if (m_tree->size() == 0 && m_grv->size() != 0) 
     throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
-  
-  // which chr (if any) are common between query and subject
+
   GenomicIntervalTreeMap::const_iterator ff = m_tree->find(gr.chr);
+  if (ff == m_tree->end())
+    return 0;
+
+  GRCStrandVisitor<T, F> v(*m_grv, ignore_strand, gr.strand, f);
+  ff->second.visitOverlapping(gr.pos1, gr.pos2, v);
+  return v.count;
+}
+
+// collects the ids of overlapping intervals
+struct GRCIdCollector {
+  GRCIdCollector(std::vector<int>& o) : out(o) {}
+  void operator()(size_t i) { out.push_back(i); }
+  std::vector<int>& out;
+};
+
+// this is query
+template<class T>
+template<class K>
+std::vector<int> GenomicRegionCollection<T>::FindOverlappedIntervals(const K& gr, bool ignore_strand) const {  
 
   std::vector<int> output;  
+  GRCIdCollector c(output);
+  ForEachOverlap(gr, ignore_strand, c);
+  return output;
 
-  //must as least share a chromosome  
-  if (ff == m_tree->end())
-    return output;
+}
 
-  // get the subject hits
-  GenomicIntervalVector giv;
-  ff->second.findOverlapping(gr.pos1, gr.pos2, giv);
+// true for intervals starting at or before p (a prefix of a sorted run)
+template<class T>
+struct GRCStartsBy {
+  GRCStartsBy(int32_t q) : p(q) {}
+  bool operator()(const T& g) const { return g.pos1 <= p; }
+  int32_t p;
+};
 
-  for (GenomicIntervalVector::const_iterator i = giv.begin(); i != giv.end(); ++i)
-    if (ignore_strand || m_grv->at(i->value).strand == gr.strand) 
-      output.push_back(i->value);
+// true for IDs of intervals ending before p (a prefix of the end order)
+template<class T>
+struct GRCEndsBefore {
+  GRCEndsBefore(const std::vector<T>& g, int32_t q) : v(g), p(q) {}
+  bool operator()(int32_t i) const { return v[i].pos2 < p; }
+  const std::vector<T>& v;
+  int32_t p;
+};
+
+// first element of [first, last) for which pred is false, where pred is
+// true on a prefix. Gallops out from hint, then binary searches
+template<class It, class P>
+static It grc_partition_point(It first, It last, It hint, P pred) {
+
+  It lo = first, hi = last;
+  if (hint > first && hint < last) {
+    size_t step = 1;
+    if (pred(*hint)) {
+      lo = hint + 1;
+      while ((size_t)(last - lo) > step && pred(*(lo + step - 1))) {
+	lo += step;
+	step <<= 1;
+      }
+      if ((size_t)(last - lo) > step)
+	hi = lo + step;
+    } else {
+      hi = hint;
+      while ((size_t)(hi - first) > step && !pred(*(hi - step))) {
+	hi -= step;
+	step <<= 1;
+      }
+      if ((size_t)(hi - first) > step)
+	lo = hi - step;
+    }
+  }
 
-  return output;
+  while (lo < hi) {
+    It mid = lo + (hi - lo) / 2;
+    if (pred(*mid))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// lowest ID of the overlapping intervals
+struct GRCMinId {
+  GRCMinId() : id(-1) {}
+  void operator()(const GenomicIntervalIndex::Node& n) { if (id < 0 || n.value < id) id = n.value; }
+  int32_t id;
+};
+
+template<class T>
+const GenomicIntervalIndex* GenomicRegionCollection<T>::chr_run(int32_t chr, size_t& b, size_t& e) const {
+
+  if (m_tree->size() == 0 && m_grv->size() != 0)
+    throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing nearest queries");
+
+  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(chr);
+  if (ff == m_tree->end() || ff->second.empty())
+    return NULL;
+
+  // a chromosome is one contiguous run of the sorted collection
+  b = ff->second.nodes()[0].value;
+  e = b + ff->second.size();
+  return &ff->second;
+}
+
+template<class T>
+int GenomicRegionCollection<T>::nearest(const GenomicIntervalIndex& ix, size_t b, size_t e, int32_t pos1, int32_t pos2,
+					size_t& up_hint, size_t& down_hint, int32_t* distance) const {
+
+  const std::vector<T>& v = *m_grv;
+  const std::vector<int32_t>& eo = *m_end_order;
+
+  GRCMinId m;
+  ix.visitOverlapping(pos1, pos2, m);
+  if (m.id >= 0) {
+    if (distance)
+      *distance = 0;
+    return m.id;
+  }
+
+  // first interval starting after the query
+  typename std::vector<T>::const_iterator d =
+    grc_partition_point(v.begin() + b, v.begin() + e, v.begin() + down_hint, GRCStartsBy<T>(pos2));
+  down_hint = d - v.begin();
+
+  // first interval (in end order) ending at or after the query start
+  std::vector<int32_t>::const_iterator u =
+    grc_partition_point(eo.begin() + b, eo.begin() + e, eo.begin() + up_hint, GRCEndsBefore<T>(v, pos1));
+  up_hint = u - eo.begin();
+
+  int up = -1, down = -1;
+  if (u != eo.begin() + b) {
+    // lowest ID among those with the closest end
+    u = grc_partition_point(eo.begin() + b, u, u - 1, GRCEndsBefore<T>(v, v[*(u - 1)].pos2));
+    up = *u;
+  }
+  if (d != v.begin() + e)
+    down = d - v.begin();
+
+  const int32_t du = up >= 0 ? pos1 - v[up].pos2 : INT_MAX;
+  const int32_t dd = down >= 0 ? v[down].pos1 - pos2 : INT_MAX;
+  const int best = (up >= 0 && (down < 0 || du < dd || (du == dd && up < down))) ? up : down;
+  if (distance)
+    *distance = best < 0 ? -1 : (best == up ? du : dd);
+  return best;
+}
+
+template<class T>
+template<class K>
+int GenomicRegionCollection<T>::FindNearestUpstream(const K& gr) const {
+
+  size_t b, e;
+  if (!chr_run(gr.chr, b, e))
+    return -1;
+
+  const std::vector<int32_t>& eo = *m_end_order;
+  std::vector<int32_t>::const_iterator u =
+    grc_partition_point(eo.begin() + b, eo.begin() + e, eo.begin() + b, GRCEndsBefore<T>(*m_grv, gr.pos1));
+  if (u == eo.begin() + b)
+    return -1;
+  u = grc_partition_point(eo.begin() + b, u, u - 1, GRCEndsBefore<T>(*m_grv, (*m_grv)[*(u - 1)].pos2));
+  return *u;
+}
+
+template<class T>
+template<class K>
+int GenomicRegionCollection<T>::FindNearestDownstream(const K& gr) const {
+
+  size_t b, e;
+  if (!chr_run(gr.chr, b, e))
+    return -1;
 
+  typename std::vector<T>::const_iterator d =
+    grc_partition_point(m_grv->begin() + b, m_grv->begin() + e, m_grv->begin() + b, GRCStartsBy<T>(gr.pos2));
+  return d == m_grv->begin() + e ? -1 : d - m_grv->begin();
+}
+
+template<class T>
+template<class K>
+int GenomicRegionCollection<T>::FindNearest(const K& gr, int32_t* distance) const {
+
+  size_t b, e;
+  const GenomicIntervalIndex* ix = chr_run(gr.chr, b, e);
+  if (!ix) {
+    if (distance)
+      *distance = -1;
+    return -1;
+  }
+
+  size_t up = b, down = b;
+  return nearest(*ix, b, e, gr.pos1, gr.pos2, up, down, distance);
+}
+
+template<class T>
+template<class K>
+std::vector<int> GenomicRegionCollection<T>::FindNearest(const GenomicRegionCollection<K>& queries, std::vector<int32_t>* distances) const {
+
+  std::vector<int> out(queries.size(), -1);
+  if (distances)
+    distances->assign(queries.size(), -1);
+
+  const GenomicIntervalIndex* ix = NULL;
+  size_t b = 0, e = 0, up = 0, down = 0;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    const K& q = queries[i];
+    if (i == 0 || q.chr != queries[i-1].chr) {
+      ix = chr_run(q.chr, b, e);
+      up = down = b;
+    }
+    if (ix)
+      out[i] = nearest(*ix, b, e, q.pos1, q.pos2, up, down, distances ? &(*distances)[i] : NULL);
+  }
+  return out;
+}
+
+template<class T>
+template<class K>
+int32_t GenomicRegionCollection<T>::DistanceToNearest(const K& gr) const {
+  int32_t d;
+  FindNearest(gr, &d);
+  return d;
+}
+
+template<class T>
+template<class K>
+std::vector<int> GenomicRegionCollection<T>::FindKNearest(const K& gr, size_t k) const {
+
+  std::vector<int> out;
+  size_t b, e;
+  const GenomicIntervalIndex* ix = chr_run(gr.chr, b, e);
+  if (!ix || !k)
+    return out;
+
+  GRCIdCollector c(out);
+  GRCStrandVisitor<T, GRCIdCollector> sv(*m_grv, true, gr.strand, c);
+  ix->visitOverlapping(gr.pos1, gr.pos2, sv);
+  std::sort(out.begin(), out.end());
+  if (out.size() >= k) {
+    out.resize(k);
+    return out;
+  }
+
+  // walk outwards: upstream down the end order, downstream up the start order
+  const std::vector<T>& v = *m_grv;
+  const std::vector<int32_t>& eo = *m_end_order;
+  size_t u = grc_partition_point(eo.begin() + b, eo.begin() + e, eo.begin() + b, GRCEndsBefore<T>(v, gr.pos1)) - eo.begin();
+  size_t d = grc_partition_point(v.begin() + b, v.begin() + e, v.begin() + b, GRCStartsBy<T>(gr.pos2)) - v.begin();
+
+  while (out.size() < k && (u > b || d < e)) {
+    const int32_t du = u > b ? gr.pos1 - v[eo[u-1]].pos2 : INT_MAX;
+    const int32_t dd = d < e ? v[d].pos1 - gr.pos2 : INT_MAX;
+    if (u > b && du <= dd)
+      out.push_back(eo[--u]);
+    else
+      out.push_back(d++);
+  }
+  return out;
 }
 
 template<class T>
@@ -565,6 +1310,20 @@ size_t GenomicRegionCollection<T>::FindOverlapWidth(const K& gr, bool ignore_str
   return val;
 }
 
+// adds the part of each overlapping interval that is inside the query
+template<class T>
+struct GRCOverlapCollector {
+  GRCOverlapCollector(const GenomicRegionCollection<T>& g, const GenomicRegion& q, GenomicRegionCollection<GenomicRegion>& o) 
+    : subject(g), query(q), out(o) {}
+  void operator()(size_t i) {
+    const T& s = subject[i];
+    out.add(GenomicRegion(query.chr, std::max(s.pos1, query.pos1), std::min(s.pos2, query.pos2)));
+  }
+  const GenomicRegionCollection<T>& subject;
+  GenomicRegion query;
+  GenomicRegionCollection<GenomicRegion>& out;
+};
+
 // this is query
 template<class T>
 template<class K>
@@ -572,43 +1331,164 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
 {  
 
   GenomicRegionCollection<GenomicRegion> output;
-
-  if (m_tree->size() == 0 && m_grv->size() != 0) 
-    throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
+  GRCOverlapCollector<T> c(*this, GenomicRegion(gr.chr, gr.pos1, gr.pos2, gr.strand), output);
+  ForEachOverlap(gr, ignore_strand, c);
+  return output;
   
-  // which chr (if any) are common between query and subject
-  GenomicIntervalTreeMap::const_iterator ff = m_tree->find(gr.chr);
-
-  //must as least share a chromosome  
-  if (ff == m_tree->end())
-    return output;
+}
 
-  // get the subject hits
-  GenomicIntervalVector giv;
-  ff->second.findOverlapping(gr.pos1, gr.pos2, giv);
-  
-#ifdef DEBUG_OVERLAPS
-  std::cerr << "ff->second.intervals.size() " << ff->second.intervals.size() << std::endl;
-  for (auto& k : ff->second.intervals)
-    std::cerr << " intervals " << k.start << " to " << k.stop << " value " << k.value << std::endl;
-  std::cerr << "GIV NUMBER OF HITS " << giv.size() << " for query " << gr << std::endl;
-#endif
+template<class T>
+bool GenomicRegionCollection<T>::IsSorted() const {
+  for (size_t i = 1; i < m_grv->size(); ++i)
+    if ((*m_grv)[i] < (*m_grv)[i-1])
+      return false;
+  return true;
+}
 
-  // loop through the hits and define the GenomicRegion
-  for (GenomicIntervalVector::const_iterator j = giv.begin(); j != giv.end(); ++j) {
-    //for (auto& j : giv) { // giv points to positions on subject
-    if (ignore_strand || (m_grv->at(j->value).strand == gr.strand) ) {
-#ifdef DEBUG_OVERLAPS
-	std::cerr << "find overlaps hit " << j->start << " " << j->stop << " -- " << j->value << std::endl;
-#endif
-	output.add(GenomicRegion(gr.chr, std::max(static_cast<int32_t>(j->start), gr.pos1), std::min(static_cast<int32_t>(j->stop), gr.pos2)));
+// forwards the subject hits of one query to a pair callback
+template<class F>
+struct GRCPairAdapter {
+  GRCPairAdapter(F& cb) : f(cb), qid(0) {}
+  void operator()(size_t j) { f(qid, j); }
+  F& f;
+  size_t qid;
+};
+
+// sweep-line join of the sorted runs q[qb,qe) and s[sb,se) (one chromosome).
+// active holds the subjects that started at or before the furthest query end
+// seen, and drops each one once a query starts past its end
+template<class T, class K, class F>
+size_t grc_sweep_join(const T* q, size_t qb, size_t qe, const K* s, size_t sb, size_t se,
+		      bool ignore_strand, F& f, std::vector<size_t>& active) {
+  size_t n = 0;
+  size_t next = sb;
+  active.clear();
+  for (size_t i = qb; i < qe; ++i) {
+    const T& a = q[i];
+    while (next < se && s[next].pos1 <= a.pos2)
+      active.push_back(next++);
+    size_t w = 0;
+    for (size_t k = 0; k < active.size(); ++k) {
+      const K& b = s[active[k]];
+      if (b.pos2 < a.pos1)
+	continue;
+      active[w++] = active[k];
+      if (b.pos1 <= a.pos2 && (ignore_strand || b.strand == a.strand)) {
+	f(i, active[k]);
+	++n;
       }
+    }
+    active.resize(w);
   }
+  return n;
+}
 
-  return output;
-  
+// matching chromosome runs of two sorted collections
+struct GRCChrRun {
+  size_t qb, qe, sb, se;
+};
+
+template<class T, class K>
+void grc_chr_runs(const T* q, size_t nq, const K* s, size_t ns, std::vector<GRCChrRun>& runs) {
+  size_t i = 0, j = 0;
+  while (i < nq && j < ns) {
+    if (q[i].chr < s[j].chr) {
+      ++i;
+    } else if (s[j].chr < q[i].chr) {
+      ++j;
+    } else {
+      GRCChrRun r;
+      const int32_t chr = q[i].chr;
+      r.qb = i;
+      r.sb = j;
+      while (i < nq && q[i].chr == chr)
+	++i;
+      while (j < ns && s[j].chr == chr)
+	++j;
+      r.qe = i;
+      r.se = j;
+      runs.push_back(r);
+    }
+  }
 }
 
+template<class T>
+template<class K, class F>
+size_t GenomicRegionCollection<T>::ForEachOverlapPair(const GenomicRegionCollection<K>& subject, bool ignore_strand, F& f, int threads) const {
+
+  if (m_grv->empty() || !subject.size())
+    return 0;
+
+  // fall back to index lookups
+  if (!IsSorted() || !subject.IsSorted()) {
+    size_t n = 0;
+    GRCPairAdapter<F> a(f);
+    for (size_t i = 0; i < m_grv->size(); ++i) {
+      a.qid = i;
+      n += subject.ForEachOverlap((*m_grv)[i], ignore_strand, a);
+    }
+    return n;
+  }
+
+  const T* q = &(*m_grv)[0];
+  const K* s = &*subject.begin();
+  std::vector<GRCChrRun> runs;
+  grc_chr_runs(q, m_grv->size(), s, subject.size(), runs);
+
+#ifdef HAVE_C11
+  if (threads > 1 && runs.size() > 1) {
+    // hand out chromosomes, largest first
+    std::vector<size_t> order(runs.size());
+    for (size_t r = 0; r < runs.size(); ++r)
+      order[r] = r;
+    std::sort(order.begin(), order.end(), [&runs](size_t x, size_t y) {
+	return runs[x].qe - runs[x].qb + runs[x].se - runs[x].sb > runs[y].qe - runs[y].qb + runs[y].se - runs[y].sb;
+      });
+    std::atomic<size_t> next(0), total(0);
+    std::vector<std::thread> pool;
+    const size_t nt = std::min<size_t>(threads, runs.size());
+    for (size_t t = 0; t < nt; ++t)
+      pool.push_back(std::thread([&]() {
+	    std::vector<size_t> active;
+	    size_t r;
+	    while ((r = next++) < runs.size()) {
+	      const GRCChrRun& c = runs[order[r]];
+	      total += grc_sweep_join(q, c.qb, c.qe, s, c.sb, c.se, ignore_strand, f, active);
+	    }
+	  }));
+    for (size_t t = 0; t < pool.size(); ++t)
+      pool[t].join();
+    return total;
+  }
+#endif
+
+  size_t n = 0;
+  std::vector<size_t> active;
+  for (size_t r = 0; r < runs.size(); ++r)
+    n += grc_sweep_join(q, runs[r].qb, runs[r].qe, s, runs[r].sb, runs[r].se, ignore_strand, f, active);
+  return n;
+}
+
+// adds the part of each overlapping pair that is inside the query, and records the ids
+template<class T, class K>
+struct GRCPairCollector {
+  GRCPairCollector(const GenomicRegionCollection<T>& qq, const GenomicRegionCollection<K>& ss, GenomicRegionCollection<GenomicRegion>& o, 
+		   std::vector<int32_t>& qi, std::vector<int32_t>& si) 
+    : query(qq), subject(ss), out(o), query_id(qi), subject_id(si) {}
+  void operator()(size_t i, size_t j) {
+    const T& q = query[i];
+    const K& s = subject[j];
+    out.add(GenomicRegion(q.chr, std::max(s.pos1, q.pos1), std::min(s.pos2, q.pos2)));
+    query_id.push_back(i);
+    subject_id.push_back(j);
+  }
+  const GenomicRegionCollection<T>& query;
+  const GenomicRegionCollection<K>& subject;
+  GenomicRegionCollection<GenomicRegion>& out;
+  std::vector<int32_t>& query_id;
+  std::vector<int32_t>& subject_id;
+};
+
   // this is query
   template<class T>
   template<class K>
@@ -616,6 +1496,14 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
 {  
 
   GenomicRegionCollection<GenomicRegion> output;
+  GRCPairCollector<T, K> c(*this, subject, output, query_id, subject_id);
+
+  // sorted inputs don't need the tree
+  if (IsSorted() && subject.IsSorted()) {
+    ForEachOverlapPair(subject, ignore_strand, c);
+    return output;
+  }
+
   if (subject.NumTree() == 0 && subject.size() != 0) {
     std::cerr << "!!!!!! findOverlaps: WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
     return output;
@@ -625,50 +1513,7 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
   if (subject.size() < m_grv->size() && m_grv->size() - subject.size() > 20) 
     std::cerr << "findOverlaps warning: Suggest switching query and subject for efficiency." << std::endl;
 
-#ifdef DEBUG_OVERLAPS
-  std::cerr << "OVERLAP SUBJECT: " << std::endl;
-  for (auto& i : subject)
-    std::cerr << i << std::endl;
-#endif
-
-  // loop through the query GRanges (this) and overlap with subject
-  for (size_t i = 0; i < m_grv->size(); ++i) 
-    {
-      // which chr (if any) are common between query and subject
-      GenomicIntervalTreeMap::const_iterator ff = subject.GetTree()->find(m_grv->at(i).chr);
-
-      GenomicIntervalVector giv;
-
-#ifdef DEBUG_OVERLAPS
-      std::cerr << "TRYING OVERLAP ON QUERY " << m_grv->at(i) << std::endl;
-#endif
-      //must as least share a chromosome
-      if (ff != m_tree->end())
-	{
-	  // get the subject hits
-	  ff->second.findOverlapping(m_grv->at(i).pos1, m_grv->at(i).pos2, giv);
-
-#ifdef DEBUG_OVERLAPS
-	  std::cerr << "ff->second.intervals.size() " << ff->second.intervals.size() << std::endl;
-	  for (auto& k : ff->second.intervals)
-	    std::cerr << " intervals " << k.start << " to " << k.stop << " value " << k.value << std::endl;
-	  std::cerr << "GIV NUMBER OF HITS " << giv.size() << " for query " << m_grv->at(i) << std::endl;
-#endif
-	  // loop through the hits and define the GenomicRegion
-	  for (GenomicIntervalVector::const_iterator j = giv.begin(); j != giv.end(); ++j) {
-	    //for (auto& j : giv) { // giv points to positions on subject
-	    if (ignore_strand || (subject.at(j->value).strand == m_grv->at(i).strand) ) {
-	      query_id.push_back(i);
-	      subject_id.push_back(j->value);
-#ifdef DEBUG_OVERLAPS
-	      std::cerr << "find overlaps hit " << j->start << " " << j->stop << " -- " << j->value << std::endl;
-#endif
-	      output.add(GenomicRegion(m_grv->at(i).chr, std::max(static_cast<int32_t>(j->start), m_grv->at(i).pos1), std::min(static_cast<int32_t>(j->stop), m_grv->at(i).pos2)));
-	    }
-	  }
-	}
-    }
-
+  ForEachOverlapPair(subject, ignore_strand, c);
   return output;
   
 }
@@ -7,9 +7,15 @@
 #include <list>
 
 #include "SeqLib/IntervalTree.h"
+#include "SeqLib/IntervalIndex.h"
 #include "SeqLib/GenomicRegionCollection.h"
 #include "SeqLib/BamRecord.h"
 
+#ifdef HAVE_C11
+#include <thread>
+#include <atomic>
+#endif
+
 namespace SeqLib {
 
   /** Simple structure to store overlap results 
@@ -20,14 +26,15 @@ namespace SeqLib {
 typedef TInterval<int32_t> GenomicInterval;
 typedef SeqHashMap<int, std::vector<GenomicInterval> > GenomicIntervalMap;
 typedef TIntervalTree<int32_t> GenomicIntervalTree;
-typedef SeqHashMap<int, GenomicIntervalTree> GenomicIntervalTreeMap;
+typedef TIntervalIndex<int32_t, int32_t> GenomicIntervalIndex;
+typedef SeqHashMap<int, GenomicIntervalIndex> GenomicIntervalTreeMap;
 typedef std::vector<GenomicInterval> GenomicIntervalVector;
 
   /** @brief Template class to store / query a collection of genomic intervals
    *
    * Can hold a collection of GenomicRegion objects, or any object whose
-   * class is a child of GenomicRegion. Contains an implementation of an
-   * interval tree (as provided by Erik Garrison) for fast interval queries.
+   * class is a child of GenomicRegion. Contains a flat interval index
+   * (see TIntervalIndex) for fast interval queries.
    */
 template<typename T=GenomicRegion>
 class GenomicRegionCollection {
@@ -81,17 +88,42 @@ class GenomicRegionCollection {
    //bool ReadMuTect(const std::string &file, const SeqLib::BamHeader& hdr);
 
   /** Read in a BED file and adds to GenomicRegionCollection object
+   *
+   * With threads > 1, BGZF input is decompressed on that many htslib threads and
+   * blocks of lines are parsed in parallel, then appended in file order. Plain
+   * text and ordinary gzip are read serially but still parsed in parallel. In
+   * this mode track and browser lines are skipped.
    * @param file Path to BED file
    * @param hdr Dictionary for converting chromosome strings in BED file to chr indicies
+   * @param threads Number of threads to decompress and parse with
    * @return True if file was succesfully read
+   * @exception Throws an invalid_argument if a line cannot be parsed
    */
-   bool ReadBED(const std::string &file, const SeqLib::BamHeader& hdr);
+   bool ReadBED(const std::string &file, const SeqLib::BamHeader& hdr, int threads = 1);
 
   /** Read in a VCF file and adds to GenomicRegionCollection object
    * @param file Path to VCF file. All elements will be width = 1 (just read start point)
    * @param hdr Dictionary for converting chromosome strings in BED file to chr indicies
+   * @param threads Number of threads to decompress and parse with (see ReadBED)
    */
-  bool ReadVCF(const std::string &file, const SeqLib::BamHeader& hdr);
+  bool ReadVCF(const std::string &file, const SeqLib::BamHeader& hdr, int threads = 1);
+
+  /** Read only the BED or VCF records that overlap a set of query regions
+   *
+   * Uses the tabix index of a bgzipped file to seek to each query region, so
+   * the time taken depends on the size of the query and not of the file.
+   * The records are parsed as by ReadBED or ReadVCF (the format is taken from
+   * the index) and kept if they overlap a query region. Each record is added
+   * once, in coordinate order of the query.
+   * @param file Path to a bgzipped BED or VCF file with a .tbi index
+   * @param hdr Dictionary for converting chromosome strings in the file to chr indicies
+   * @param query Regions to fetch records for, with chr ids from hdr
+   * @return False if the file or its index could not be opened
+   * @exception Throws an invalid_argument if a BED line cannot be parsed, and
+   * a runtime_error if reading the file fails part way
+   */
+  template<class K>
+  bool ReadIndexed(const std::string &file, const SeqLib::BamHeader& hdr, const GenomicRegionCollection<K>& query);
 
   /** Shuffle the order of the intervals */
  void Shuffle();
@@ -108,19 +140,50 @@ class GenomicRegionCollection {
    */
    GenomicRegionCollection(const std::string &file, const BamHeader& hdr);
 
-  /** Create the set of interval trees (one per chromosome) 
+  /** Construct from the records of an indexed BED or VCF file that overlap query
+   * @see ReadIndexed
+   */
+  template<class K>
+  GenomicRegionCollection(const std::string &file, const BamHeader& hdr, const GenomicRegionCollection<K>& query);
+
+  /** Create the set of interval indices (one per chromosome) 
    *
-   * A GenomicIntervalTreeMap is an unordered_map of GenomicIntervalTrees for 
-   * each chromosome. A GenomicIntervalTree is an interval tree on the ranges
-   * defined by the genomic interval, with cargo set at the same GenomicRegion object.
+   * A GenomicIntervalTreeMap is an unordered_map of GenomicIntervalIndex for 
+   * each chromosome. A GenomicIntervalIndex is an array-backed interval tree on
+   * the ranges defined by the genomic intervals, with the value set to the 
+   * position of the GenomicRegion in this collection. This will coordinate 
+   * sort the collection if it is not already sorted.
    */
   void CreateTreeMap();
   
   /** Reduces the GenomicRegion objects to minimal set by merging overlapping intervals
+   *
+   * Sorts with CoordinateSort, then merges in place.
+   * @param threads Number of threads to sort with (see CoordinateSort)
    * @note This will merge intervals that touch. eg [4,6] and [6,8]
-   * @note This will also call CreateTreeMap() at end to re-create the interval tree
+   * @note This clears the interval tree. Call CreateTreeMap() again before range queries
    */
-  void MergeOverlappingIntervals();
+  void MergeOverlappingIntervals(int threads = 1);
+
+  /** Return the parts of this collection not covered by another collection
+   *
+   * Strand is ignored. Neither collection needs to be sorted or have an 
+   * interval tree. The output is sorted, and keeps the strand of the
+   * elements of this collection.
+   * @param other Intervals to remove
+   * @return Pieces of the elements of this collection that overlap nothing in other
+   */
+  template <class K>
+  GenomicRegionCollection<GenomicRegion> Subtract(const GenomicRegionCollection<K>& other) const;
+
+  /** Return the parts of the genome not covered by this collection
+   *
+   * Strand is ignored, and elements on chromosomes not in h are ignored.
+   * Each chromosome spans [0, length], as in the tiling constructor.
+   * @param h Chromosomes and their lengths (chromosome id is the position in h)
+   * @return Sorted, non-overlapping gaps
+   */
+  GenomicRegionCollection<GenomicRegion> Complement(const HeaderSequenceVector& h) const;
 
   /** Return the number of GenomicRegions stored 
    */
@@ -128,7 +191,7 @@ class GenomicRegionCollection {
 
   /** Add a new GenomicRegion (or child of) to end
    */
- void add(const T& g) { m_grv->push_back(g); /*createTreeMap();*/ }
+ void add(const T& g) { m_grv->push_back(g); m_sorted = false; /*createTreeMap();*/ }
 
   /** Is this object empty?
    */
@@ -138,6 +201,7 @@ class GenomicRegionCollection {
    */
   void clear() { m_grv->clear(); 
 		 m_tree->clear(); 
+		 m_end_order->clear();
 		 idx = 0;
   }
 
@@ -158,6 +222,105 @@ class GenomicRegionCollection {
  template<class K>
  std::vector<int> FindOverlappedIntervals(const K& gr, bool ignore_strand) const;
 
+ /** Call f(i) for each element i of this collection that overlaps a query range
+  *
+  * i is the same ID as returned by FindOverlappedIntervals. The elements are
+  * visited in genomic order, and nothing is allocated.
+  * @param gr Query range to check overlaps against
+  * @param ignore_strand Should strandedness be ignore when doing overlaps
+  * @param f Callback, called as f(size_t)
+  * @return Number of overlapping elements
+  * @exception Throws a logic_error if this collection is non-empty, but
+  * CreateTreeMap has not been run
+  */
+ template<class K, class F>
+ size_t ForEachOverlap(const K& gr, bool ignore_strand, F& f) const;
+
+ /** Call f(query_id, subject_id) for each overlapping pair of this collection (query) and subject
+  *
+  * If both collections are coordinate sorted (see IsSorted), this is a 
+  * sweep-line merge join, which needs no interval index. Each query scans the
+  * subjects still open at that point, so the join is close to linear time plus
+  * the number of overlaps when intervals are short relative to their spacing,
+  * but a long query (or subject) keeps its neighbours open and the worst case 
+  * is O(n*m). Otherwise, each query is looked up in the subject's interval
+  * index, which must have been made with CreateTreeMap.
+  * Either way, pairs come grouped by query, with subjects in genomic order.
+  * @param subject Collection to overlap with
+  * @param ignore_strand If true, won't exclude overlap if on different strand
+  * @param f Callback, called as f(size_t, size_t)
+  * @param threads For the sweep join under C++11, number of threads to process 
+  * chromosomes on. With more than one, f is called concurrently from several 
+  * threads (the calls for one chromosome all come from one thread, in order)
+  * @return Number of overlapping pairs
+  * @exception Throws a logic_error if the tree lookup is needed, but subject has no interval index
+  */
+ template<class K, class F>
+ size_t ForEachOverlapPair(const GenomicRegionCollection<K>& subject, bool ignore_strand, F& f, int threads = 1) const;
+
+ /** Return the ID of the closest interval that ends before a query range starts
+  *
+  * Upstream and downstream are in genome coordinates (lower and higher
+  * positions). Strand is ignored, and intervals overlapping gr are not
+  * considered. Uses a binary search on the sorted collection, which needs
+  * CreateTreeMap. Among intervals with the same end, the lowest ID is returned.
+  * @param gr Query range
+  * @return ID (as for FindOverlappedIntervals), or -1 if there is none
+  * @exception Throws a logic_error if CreateTreeMap has not been run
+  */
+ template<class K>
+ int FindNearestUpstream(const K& gr) const;
+
+ /** Return the ID of the closest interval that starts after a query range ends
+  * @see FindNearestUpstream
+  */
+ template<class K>
+ int FindNearestDownstream(const K& gr) const;
+
+ /** Return the ID of the interval closest to a query range
+  *
+  * The distance is 0 for an overlapping interval, otherwise the gap between
+  * the closest ends, so that adjacent intervals (eg [1,5] and [6,9]) are 1 apart.
+  * Overlapping intervals win; between equally close intervals, the lowest ID wins.
+  * Strand is ignored. Needs CreateTreeMap.
+  * @param gr Query range
+  * @param distance If not NULL, set to the distance, or -1 if there is no interval
+  * @return ID (as for FindOverlappedIntervals), or -1 if there is no interval on the chromosome
+  * @exception Throws a logic_error if CreateTreeMap has not been run
+  */
+ template<class K>
+ int FindNearest(const K& gr, int32_t* distance = NULL) const;
+
+ /** Find the closest interval for each range of a query collection
+  *
+  * Each search starts from where the previous one on the same chromosome ended
+  * and gallops, so a coordinate sorted query costs about O(log gap) per range
+  * instead of a full binary search.
+  * @param queries Query ranges
+  * @param distances If not NULL, filled with the distance for each query (see FindNearest)
+  * @return The ID of the closest interval for each query, or -1
+  */
+ template<class K>
+ std::vector<int> FindNearest(const GenomicRegionCollection<K>& queries, std::vector<int32_t>* distances = NULL) const;
+
+ /** Return the distance from a query range to the closest interval, or -1 if there is none
+  * @see FindNearest
+  */
+ template<class K>
+ int32_t DistanceToNearest(const K& gr) const;
+
+ /** Return the IDs of the k intervals closest to a query range, closest first
+  *
+  * Overlapping intervals come first, in genomic order, then the others by
+  * increasing distance. Fewer than k are returned if the chromosome has fewer.
+  * @see FindNearest
+  */
+ template<class K>
+ std::vector<int> FindKNearest(const K& gr, size_t k) const;
+
+ /** Check (in one pass) if the elements are in coordinate order */
+ bool IsSorted() const;
+
  /** Get a const pointer to the genomic interval tree map */
  const GenomicIntervalTreeMap* GetTree() const { return m_tree.get(); }
 
@@ -187,13 +350,13 @@ class GenomicRegionCollection {
  size_t CountContained(const T &gr);
 
  /** Return the overlaps between the collection and the query collection
+  *
+  * Uses the sweep join of ForEachOverlapPair if both collections are sorted
   * @param subject Subject collection of intervals
   * @param query_id Indices of the queries that have an overlap. Will be same size as output and subject_id and in same order
   * @param subject_id Indices of the subject that have an overlap. Will be same size as output and query_id and in same order
   * @param ignore_strand If true, won't exclude overlap if on different strand
   * @return A collection of overlapping intervals from this collection, trimmed to be contained
-  * @exception Throws a logic_error if this tree is non-empty, but the interval tree has not been made with 
-  * CreateTreeMap
   * inside the query collection
   */
  template<class K>
@@ -242,8 +405,16 @@ class GenomicRegionCollection {
    */
   std::string AsBEDString(const BamHeader& h) const;
 
- /** Coordinate sort the interval collection */
-  void CoordinateSort();
+ /** Coordinate sort the interval collection
+  *
+  * Sorts with the element's operator<, stably. Large collections of plain
+  * GenomicRegion are sorted with an LSD radix sort on chr, pos1 and pos2 
+  * instead, which gives the same order and needs one extra copy of the
+  * elements. Other element types always use std::stable_sort, as they may
+  * define their own order.
+  * @param threads Number of threads for the radix sort (C++11 only)
+  */
+  void CoordinateSort(int threads = 1);
 
  /** Expand all the elements so they are sorted and become adjacent 
   * by stretching them to the right up to max 
@@ -292,6 +463,9 @@ class GenomicRegionCollection {
  
  // always construct this object any time m_grv is modifed
  SeqPointer<GenomicIntervalTreeMap> m_tree;
+
+ // IDs of each chromosome run ordered by end, made with the tree (for nearest queries)
+ SeqPointer<std::vector<int32_t> > m_end_order;
  
  // hold the genomic regions
  SeqPointer<std::vector<T> > m_grv; 
@@ -302,6 +476,13 @@ class GenomicRegionCollection {
  // open the memory
  void allocate_grc();
 
+ // chromosome run [b, e) and its index, for the nearest queries
+ const GenomicIntervalIndex* chr_run(int32_t chr, size_t& b, size_t& e) const;
+
+ // nearest search within one chromosome run, starting from the hints
+ int nearest(const GenomicIntervalIndex& ix, size_t b, size_t e, int32_t pos1, int32_t pos2,
+	     size_t& up_hint, size_t& down_hint, int32_t* distance) const;
+
 };
 
 typedef GenomicRegionCollection<GenomicRegion> GRC;
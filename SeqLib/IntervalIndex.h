@@ -0,0 +1,292 @@
+#ifndef SEQLIB_INTERVAL_INDEX_H__
+#define SEQLIB_INTERVAL_INDEX_H__
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include "SeqLib/IntervalTree.h"
+
+namespace SeqLib {
+
+/** Flat, array-backed interval index (implicit augmented interval tree)
+ *
+ * The intervals are stored in one array sorted by start, and the array
+ * itself is the tree: the element at position i sits at level k, where k
+ * is the number of trailing 1 bits of i, and each element also stores the
+ * maximum stop of its subtree. This is the layout used by cgranges. There
+ * are no child pointers or per-node allocations, so building is one sort
+ * plus one linear pass, and a query walks contiguous memory.
+ *
+ * Intervals are closed, as with TIntervalTree: [start, stop] overlaps
+ * [s, e] if start <= e and s <= stop.
+ *
+ * Build with add() and then index(), or from a vector of TInterval. Queries
+ * on an index that is not built return nothing.
+ * @tparam T Type of the value carried with each interval
+ * @tparam K Type of the interval coordinates
+ */
+template <class T, typename K = std::size_t>
+class TIntervalIndex {
+
+ public:
+
+  /** One stored interval */
+  struct Node {
+    K start; ///< Interval start
+    K stop;  ///< Interval stop
+    K max;   ///< Maximum stop in the subtree rooted here
+    T value; ///< Carried value
+
+    bool operator<(const Node& n) const { return start < n.start; }
+  };
+
+  /** Create an empty index */
+  TIntervalIndex() : m_max_level(-1) {}
+
+  /** Create and build an index from a set of intervals */
+  template <class V, typename S>
+  explicit TIntervalIndex(const std::vector<TInterval<V,S> >& intervals) : m_max_level(-1) {
+    m_nodes.reserve(intervals.size());
+    for (typename std::vector<TInterval<V,S> >::const_iterator i = intervals.begin(); i != intervals.end(); ++i)
+      add(i->start, i->stop, i->value);
+    index();
+  }
+
+  /** Add an interval. index() must be called before querying */
+  void add(K start, K stop, const T& value) {
+    Node n;
+    n.start = start;
+    n.stop = stop;
+    n.max = stop;
+    n.value = value;
+    m_nodes.push_back(n);
+    m_max_level = -1;
+  }
+
+  /** Pre-allocate room for n intervals */
+  void reserve(size_t n) { m_nodes.reserve(n); }
+
+  /** Remove all intervals */
+  void clear() { m_nodes.clear(); m_max_level = -1; }
+
+  /** Return the number of intervals */
+  size_t size() const { return m_nodes.size(); }
+
+  /** Return true if there are no intervals */
+  bool empty() const { return m_nodes.empty(); }
+
+  /** Return the intervals, in index (start-sorted) order */
+  const std::vector<Node>& nodes() const { return m_nodes; }
+
+  /** Sort the intervals (if not already sorted) and compute the subtree maxima */
+  void index() {
+
+    const int64_t n = m_nodes.size();
+    m_max_level = -1;
+    if (!n)
+      return;
+
+    for (int64_t i = 1; i < n; ++i)
+      if (m_nodes[i].start < m_nodes[i-1].start) {
+	std::stable_sort(m_nodes.begin(), m_nodes.end());
+	break;
+      }
+
+    // leaves (even positions) are their own maximum
+    int64_t last_i = 0;
+    K last = m_nodes[0].stop;
+    for (int64_t i = 0; i < n; i += 2) {
+      last_i = i;
+      last = m_nodes[i].max = m_nodes[i].stop;
+    }
+
+    // each level up, combine the children. A missing right child (past the
+    // end of the array) takes the maximum of the last real subtree
+    int k = 1;
+    for (; ((int64_t)1 << k) <= n; ++k) {
+      const int64_t x = (int64_t)1 << (k - 1);
+      const int64_t i0 = (x << 1) - 1;
+      const int64_t step = x << 2;
+      for (int64_t i = i0; i < n; i += step) {
+	const K el = m_nodes[i - x].max;
+	const K er = i + x < n ? m_nodes[i + x].max : last;
+	K e = m_nodes[i].stop;
+	if (e < el) e = el;
+	if (e < er) e = er;
+	m_nodes[i].max = e;
+      }
+      last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+      if (last_i < n && last < m_nodes[last_i].max)
+	last = m_nodes[last_i].max;
+    }
+    m_max_level = k - 1;
+  }
+
+  /** Call v(node) for each interval overlapping [start, stop], in start order
+   *
+   * Allocates nothing.
+   * @return Number of overlapping intervals
+   */
+  template <class Visitor>
+  size_t visitOverlapping(K start, K stop, Visitor& v) const {
+    if (m_max_level < 0)
+      return 0;
+    return visit(&m_nodes[0], m_nodes.size(), m_max_level, start, stop, v);
+  }
+
+  /** Return the level of the root node, or -1 if the index is not built */
+  int maxLevel() const { return m_max_level; }
+
+  /** Query an index laid out in external memory
+   *
+   * a must point to n nodes as left by index() (see nodes()), with
+   * max_level from maxLevel(). This lets an index written to disk be
+   * queried in place, eg from a memory-mapped file.
+   * @return Number of overlapping intervals
+   */
+  template <class Visitor>
+  static size_t visit(const Node* a, int64_t n, int max_level, K start, K stop, Visitor& v) {
+
+    if (max_level < 0 || n <= 0)
+      return 0;
+
+    struct Frame {
+      int64_t x; // node position
+      int k;     // node level
+      bool w;    // left subtree done
+    };
+
+    Frame stack[64];
+    int t = 0;
+    size_t count = 0;
+
+    stack[t].x = ((int64_t)1 << max_level) - 1;
+    stack[t].k = max_level;
+    stack[t].w = false;
+    ++t;
+
+    while (t) {
+      const Frame z = stack[--t];
+      if (z.k <= 3) {
+	// small subtree, scan it
+	const int64_t i0 = z.x >> z.k << z.k;
+	int64_t i1 = i0 + ((int64_t)1 << (z.k + 1)) - 1;
+	if (i1 > n)
+	  i1 = n;
+	for (int64_t i = i0; i < i1 && a[i].start <= stop; ++i)
+	  if (start <= a[i].stop) {
+	    v(a[i]);
+	    ++count;
+	  }
+      } else if (!z.w) {
+	// come back to this node after its left subtree
+	const int64_t y = z.x - ((int64_t)1 << (z.k - 1));
+	stack[t].x = z.x;
+	stack[t].k = z.k;
+	stack[t].w = true;
+	++t;
+	if (y >= n || start <= a[y].max) {
+	  stack[t].x = y;
+	  stack[t].k = z.k - 1;
+	  stack[t].w = false;
+	  ++t;
+	}
+      } else if (z.x < n && a[z.x].start <= stop) {
+	if (start <= a[z.x].stop) {
+	  v(a[z.x]);
+	  ++count;
+	}
+	stack[t].x = z.x + ((int64_t)1 << (z.k - 1));
+	stack[t].k = z.k - 1;
+	stack[t].w = false;
+	++t;
+      }
+    }
+
+    return count;
+  }
+
+  /** Check an index laid out in external memory, as for visit()
+   *
+   * Returns true if the n nodes at a are sorted by start and every
+   * subtree maximum is what index() would have computed. Linear time,
+   * and allocates nothing.
+   */
+  static bool check(const Node* a, int64_t n) {
+
+    if (n <= 0)
+      return true;
+
+    for (int64_t i = 1; i < n; ++i)
+      if (a[i].start < a[i-1].start)
+	return false;
+
+    // same walk as index(), comparing instead of assigning
+    int64_t last_i = 0;
+    K last = a[0].stop;
+    for (int64_t i = 0; i < n; i += 2) {
+      if (a[i].max != a[i].stop)
+	return false;
+      last_i = i;
+      last = a[i].stop;
+    }
+
+    for (int k = 1; ((int64_t)1 << k) <= n; ++k) {
+      const int64_t x = (int64_t)1 << (k - 1);
+      const int64_t i0 = (x << 1) - 1;
+      const int64_t step = x << 2;
+      for (int64_t i = i0; i < n; i += step) {
+	const K el = a[i - x].max;
+	const K er = i + x < n ? a[i + x].max : last;
+	K e = a[i].stop;
+	if (e < el) e = el;
+	if (e < er) e = er;
+	if (a[i].max != e)
+	  return false;
+      }
+      last_i = (last_i >> k & 1) ? last_i - x : last_i + x;
+      if (last_i < n && last < a[last_i].max)
+	last = a[last_i].max;
+    }
+    return true;
+  }
+
+  /** Return the number of intervals overlapping [start, stop] */
+  size_t countOverlapping(K start, K stop) const {
+    NullVisitor v;
+    return visitOverlapping(start, stop, v);
+  }
+
+  /** Append the intervals overlapping [start, stop] to overlapping, in start order
+   *
+   * Same interface as TIntervalTree::findOverlapping
+   */
+  template <class V, typename S>
+  void findOverlapping(K start, K stop, std::vector<TInterval<V,S> >& overlapping) const {
+    CollectVisitor<V,S> v(overlapping);
+    visitOverlapping(start, stop, v);
+  }
+
+ private:
+
+  struct NullVisitor {
+    void operator()(const Node&) {}
+  };
+
+  template <class V, typename S>
+  struct CollectVisitor {
+    CollectVisitor(std::vector<TInterval<V,S> >& o) : out(o) {}
+    void operator()(const Node& n) { out.push_back(TInterval<V,S>(n.start, n.stop, n.value)); }
+    std::vector<TInterval<V,S> >& out;
+  };
+
+  std::vector<Node> m_nodes;
+
+  int m_max_level; // level of the root, or -1 if not indexed
+
+};
+
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef SEQLIB_MAPPED_REGION_COLLECTION_H
+#define SEQLIB_MAPPED_REGION_COLLECTION_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "SeqLib/GenomicRegionCollection.h"
+
+namespace SeqLib {
+
+  /** Read-only, memory-mapped collection of genomic regions with a prebuilt index
+   *
+   * Loading a large BED file means parsing text, sorting and building the
+   * interval trees on every start. Write() instead stores a GenomicRegionCollection
+   * in a binary file together with its per-chromosome interval index
+   * (the array layout of TIntervalIndex). Open() maps that file and queries
+   * run directly on the mapped pages, so opening is O(1) regardless of the
+   * number of regions, and several processes opening the same file share one
+   * copy of it in the page cache.
+   *
+   * The file holds regions in the order of the collection that was written,
+   * so ids returned by the queries are indices into that collection.
+   * Files are in the byte order of the machine that wrote them; Open()
+   * rejects a file with the other byte order.
+   */
+  class MappedRegionCollection {
+
+  public:
+
+    /** Create an empty (closed) collection */
+    MappedRegionCollection();
+
+    ~MappedRegionCollection();
+
+    /** Write a collection and its interval index to a binary file
+     * @param grc Collection to write. It does not need to be sorted or have a tree.
+     * @param file Path of the file to create
+     * @return false if the file could not be written
+     */
+    static bool Write(const GenomicRegionCollection<GenomicRegion>& grc, const std::string& file);
+
+    /** Map a file made by Write()
+     *
+     * Checks the header and the chromosome table, but not the index nodes,
+     * so that the nodes are not read until a query needs them. Call Verify()
+     * on a file that may be corrupt.
+     * @return false if the file could not be opened or mapped
+     * @exception Throws a runtime_error if the file is not a valid region file
+     */
+    bool Open(const std::string& file);
+
+    /** Check every index node of the mapped file (linear time)
+     *
+     * Each node must name a region, and carry the subtree maximum that the
+     * index would be built with. A file that fails can make queries read
+     * outside the mapping, or miss overlaps.
+     * @return false if the index is corrupt (true if no file is mapped)
+     */
+    bool Verify() const;
+
+    /** Unmap the file */
+    void Close();
+
+    /** Return true if a file is mapped */
+    bool IsOpen() const { return m_map != NULL; }
+
+    /** Return the number of regions */
+    size_t size() const { return m_num_regions; }
+
+    /** Return true if there are no regions */
+    bool IsEmpty() const { return m_num_regions == 0; }
+
+    /** Return the region at index i */
+    GenomicRegion operator[](size_t i) const;
+
+    /** Return the region at index i
+     * @exception Throws an out_of_range if i is past the end
+     */
+    GenomicRegion at(size_t i) const;
+
+    /** Call f(id) for each region overlapping gr
+     *
+     * Same contract as GenomicRegionCollection::ForEachOverlap. Allocates nothing.
+     * @return Number of overlapping regions
+     */
+    template <class F>
+    size_t ForEachOverlap(const GenomicRegion& gr, bool ignore_strand, F& f) const;
+
+    /** Return the number of regions overlapping gr */
+    size_t CountOverlaps(const GenomicRegion& gr, bool ignore_strand = true) const;
+
+    /** Return true if any region overlaps gr */
+    bool OverlapSameInterval(const GenomicRegion& gr, bool ignore_strand = true) const;
+
+    /** Return the indices of the regions overlapping gr */
+    std::vector<int> FindOverlappedIntervals(const GenomicRegion& gr, bool ignore_strand = true) const;
+
+    /** Copy the regions into a GenomicRegionCollection (linear time) */
+    GenomicRegionCollection<GenomicRegion> AsCollection() const;
+
+    /** On-disk region record */
+    struct Region {
+      int32_t chr;    ///< Chromosome ID
+      int32_t pos1;   ///< Start position
+      int32_t pos2;   ///< End position
+      char strand;    ///< Strand
+      char pad[3];    ///< Unused
+    };
+
+    /** On-disk index entry for one chromosome */
+    struct Chrom {
+      uint64_t offset; ///< First node of this chromosome
+      uint64_t count;  ///< Number of nodes
+      int32_t level;   ///< Root level of the index, or -1 if no regions
+      int32_t pad;     ///< Unused
+    };
+
+  private:
+
+    template <class F>
+    struct Visitor {
+      Visitor(const Region* r, bool i, char s, F& cb) : regions(r), ignore_strand(i), strand(s), f(cb), count(0) {}
+      void operator()(const GenomicIntervalIndex::Node& n) {
+	if (ignore_strand || regions[n.value].strand == strand) {
+	  f(static_cast<size_t>(n.value));
+	  ++count;
+	}
+      }
+      const Region* regions;
+      bool ignore_strand;
+      char strand;
+      F& f;
+      size_t count;
+    };
+
+    void* m_map;
+    size_t m_map_size;
+
+    const Region* m_regions;
+    const Chrom* m_chroms;
+    const GenomicIntervalIndex::Node* m_nodes;
+
+    uint64_t m_num_regions;
+    uint64_t m_num_chroms;
+    uint64_t m_num_nodes;
+
+    // not copyable, the mapping is owned
+    MappedRegionCollection(const MappedRegionCollection&);
+    MappedRegionCollection& operator=(const MappedRegionCollection&);
+
+  };
+
+  template <class F>
+  size_t MappedRegionCollection::ForEachOverlap(const GenomicRegion& gr, bool ignore_strand, F& f) const {
+    if (gr.chr < 0 || (uint64_t)gr.chr >= m_num_chroms)
+      return 0;
+    const Chrom& c = m_chroms[gr.chr];
+    Visitor<F> v(m_regions, ignore_strand, gr.strand, f);
+    GenomicIntervalIndex::visit(m_nodes + c.offset, c.count, c.level, gr.pos1, gr.pos2, v);
+    return v.count;
+  }
+
+}
+
+#endif
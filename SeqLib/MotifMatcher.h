@@ -0,0 +1,179 @@
+#ifndef SEQLIB_MOTIF_MATCHER_H
+#define SEQLIB_MOTIF_MATCHER_H
+
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "SeqLib/BamRecord.h"
+
+namespace SeqLib {
+
+  /** Exact multi-motif search over nucleotide sequence, as a dense Aho-Corasick DFA
+   *
+   * The motifs are compiled by Build() into one transition table with a
+   * row per automaton state and a column per 4-bit BAM base code, with the
+   * failure links already followed. A scan is one table
+   * lookup per base, with no branching on failures. The sequence of a read
+   * is scanned in its 4-bit packed form, without decoding it to a string,
+   * and Contains() stops at the first hit.
+   *
+   * After Build() the matcher is not modified by queries, so one matcher
+   * can be queried from any number of threads at once.
+   *
+   * Motifs are case sensitive, and may use the IUPAC codes of the BAM
+   * alphabet (ACMGRSVTWYHKDBN). A code matches only the same code, so an R
+   * in a motif matches an R in a read, not an A or a G. A motif with any
+   * other character (including '=') is not added. Adding the same motif
+   * twice has no effect.
+   */
+  class MotifMatcher {
+
+  public:
+
+    /** Create a matcher with no motifs */
+    MotifMatcher();
+
+    /** Add a motif. Build() must be called again before querying
+     * @return false if the motif was empty or had a character outside ACMGRSVTWYHKDBN
+     */
+    bool AddMotif(const std::string& m);
+
+    /** Compile the motifs added so far into the transition table */
+    void Build();
+
+    /** Return true if Build() has been called since the last motif was added */
+    bool IsBuilt() const { return m_built; }
+
+    /** Return the number of distinct motifs */
+    size_t NumMotifs() const { return m_motifs.size(); }
+
+    /** Return the number of states of the automaton (0 before Build()) */
+    size_t NumStates() const { return m_out.size(); }
+
+    /** Return true if any motif occurs in a packed sequence
+     * @exception Throws a runtime_error if Build() has not been called
+     */
+    bool Contains(const SequenceView& s) const;
+
+    /** Return true if any motif occurs in a string */
+    bool Contains(const std::string& t) const;
+
+    /** Return true if any motif occurs in the read, as trimmed
+     *
+     * Scans the GV tag if it holds a trimmed sequence (see BamRecord::QualitySequence),
+     * otherwise the packed sequence.
+     */
+    bool Contains(const BamRecord& r) const;
+
+    /** Return the number of motif occurrences in a packed sequence (overlaps included) */
+    size_t Count(const SequenceView& s) const;
+
+    /** Return the number of motif occurrences in a string (overlaps included) */
+    size_t Count(const std::string& t) const;
+
+    /** Return the approximate memory used, in bytes */
+    size_t MemoryBytes() const;
+
+  private:
+
+    std::set<std::string> m_motifs;
+
+    // NUM_SYMBOLS columns per state. An entry is the next state, with
+    // HIT set if a motif ends there
+    std::vector<uint32_t> m_next;
+
+    std::vector<uint32_t> m_out; // number of motifs ending at each state
+
+    bool m_built;
+
+    void check_built() const;
+
+  };
+
+  /** Approximate multi-motif search, with a bound on the edit distance
+   *
+   * Finds whether any motif occurs in a sequence with at most max_edits
+   * substitutions, insertions and deletions, using the bit-parallel
+   * algorithm of Myers (1999) for searching text. Each motif is one
+   * 64-bit word of edit distance state, so motifs can be at most 64 bases.
+   * Motifs are run in groups of four, one per 64-bit lane of an AVX2
+   * register when the CPU has it (chosen at runtime), and the scan of a
+   * group ends at the first hit.
+   *
+   * Sequences are read in their 4-bit packed form. As for MotifMatcher, an
+   * IUPAC code (N included) in a read only matches the same code in a
+   * motif. The matcher is not modified by queries, so one matcher can be
+   * queried from any number of threads at once.
+   */
+  class ApproximateMotifMatcher {
+
+  public:
+
+    /** Lanes run together in one group */
+    static const int LANES = 4;
+
+    /** Create a matcher with no motifs
+     * @param max_edits Largest edit distance that counts as a hit
+     * @exception Throws an invalid_argument if max_edits is negative
+     */
+    explicit ApproximateMotifMatcher(int max_edits);
+
+    /** Add a motif
+     * @return false if the motif was empty or had a character outside ACMGRSVTWYHKDBN
+     * @exception Throws an invalid_argument if the motif is longer than 64 bases,
+     * or is not longer than max_edits (it would match any sequence)
+     */
+    bool AddMotif(const std::string& m);
+
+    /** Return the number of motifs */
+    size_t NumMotifs() const { return m_count; }
+
+    /** Return the largest edit distance that counts as a hit */
+    int MaxEdits() const { return m_max_edits; }
+
+    /** Return true if any motif occurs in a packed sequence within the edit distance */
+    bool Contains(const SequenceView& s) const;
+
+    /** Return true if any motif occurs in a string within the edit distance */
+    bool Contains(const std::string& t) const;
+
+    /** Return true if any motif occurs in the read (as trimmed) within the edit distance
+     *
+     * Scans the GV tag if it holds a trimmed sequence (see BamRecord::QualitySequence),
+     * otherwise the packed sequence.
+     */
+    bool Contains(const BamRecord& r) const;
+
+    /** Match vectors and lengths of one group of motifs */
+    struct Group {
+      uint64_t peq[16][LANES]; ///< Bit i of peq[s][l] is set if base i of motif l is symbol s
+      uint64_t high[LANES];    ///< Bit of the last base of each motif (0 for an unused lane)
+      int64_t len[LANES];      ///< Motif lengths (a large value for an unused lane)
+    };
+
+    /** Edit distance state of one group, carried between chunks of a sequence */
+    struct State {
+      uint64_t pv[LANES]; ///< Positive vertical deltas
+      uint64_t mv[LANES]; ///< Negative vertical deltas
+      int64_t score[LANES]; ///< Edit distance at the last base of each motif
+    };
+
+  private:
+
+    std::vector<Group> m_groups;
+
+    size_t m_count;
+
+    int m_max_edits;
+
+    // scan a sequence of symbols, given as up to 256 symbols at a time by next()
+    template <class S>
+    bool scan(S& next) const;
+
+  };
+
+}
+
+#endif
@@ -10,7 +10,10 @@
 #include "json/json.h"
 
 #include "SeqLib/GenomicRegionCollection.h"
+#include "SeqLib/RegionMask.h"
 #include "SeqLib/BamRecord.h"
+#include "SeqLib/BamRecordBatch.h"
+#include "SeqLib/MotifMatcher.h"
 
 #ifdef HAVE_C11
 #include "SeqLib/aho_corasick.hpp"
@@ -31,6 +34,10 @@ namespace SeqLib {
 #ifdef HAVE_C11
   /** Tool for using the Aho-Corasick method for substring queries of 
    * using large dictionaries 
+   *
+   * Queries run on a MotifMatcher, a dense DFA that scans the packed
+   * read sequence. The node-based trie is still filled, for callers
+   * that use it directly.
    * @note Trie construction / searching implemented by https://github.com/blockchaindev/aho_corasick
    */
   struct AhoCorasick {
@@ -38,6 +45,8 @@ namespace SeqLib {
     /** Allocate a new empty trie */
     AhoCorasick() { 
       aho_trie = SeqPointer<aho_corasick::trie>(new aho_corasick::trie()); 
+      matcher = SeqPointer<MotifMatcher>(new MotifMatcher());
+      matcher->Build();
       inv = false;
       count = 0;
     } 
@@ -46,12 +55,16 @@ namespace SeqLib {
     ~AhoCorasick() { }
 
     /** Add a motif to the trie 
-     * @note Trie construction is lazy. Won't build trie until 
-     * first query. Therefore first query is slow, the rest are
-     * O(n) where (n) is length of query string.
+     * @note The matcher is rebuilt on each call, so that queries
+     * never modify it and can run from several threads. To add
+     * many motifs, use TrieFromFile, which builds once at the end.
+     * @return false if the matcher could not take the motif (see MotifMatcher::AddMotif)
      */
-    void AddMotif(const std::string& m) { 
+    bool AddMotif(const std::string& m) { 
       aho_trie->insert(m);
+      const bool added = matcher->AddMotif(m);
+      matcher->Build();
+      return added;
     } 
     
     /** Add a set of motifs to the trie from a file 
@@ -63,10 +76,19 @@ namespace SeqLib {
     /** Query if a string is in the trie 
      * @param t Text to query
      * @return Returns number of substrings in tree that are in t
+     * @exception Throws a runtime_error if motifs were added to the matcher without a Build()
      */
     int QueryText(const std::string& t) const;
 
+    /** Query if any motif is in the read (as trimmed, see BamRecord::QualitySequence)
+     * @note Scans the packed sequence and stops at the first hit
+     * @exception Throws a runtime_error if motifs were added to the matcher without a Build()
+     */
+    bool QueryRead(const BamRecord& r) const;
+
     SeqPointer<aho_corasick::trie> aho_trie; ///< The trie for the Aho-Corasick search
+
+    SeqPointer<MotifMatcher> matcher; ///< DFA compiled from the same motifs, shared by copies
     
     std::string file; ///< Name of the file holding the motifs
 
@@ -77,6 +99,36 @@ namespace SeqLib {
   };
 #endif
 
+  /** Motifs to be found within an edit distance, for the approximate motif rule
+   * @note Searching is done by an ApproximateMotifMatcher
+   */
+  struct ApproximateMotifs {
+
+    /** Create an empty set of motifs */
+    ApproximateMotifs() : inv(false), count(0) {}
+
+    /** Load the motifs from a file
+     * @param f File storing the motifs (new line separated)
+     * @param edits Largest edit distance that counts as a match
+     * @exception Throws a runtime_error if file cannot be opened, and an
+     * invalid_argument if edits < 0, or a motif is longer than 64 bases
+     * or not longer than edits
+     */
+    void FromFile(const std::string& f, int edits);
+
+    /** Query if any motif is in the read (as trimmed) within the edit distance */
+    bool QueryRead(const BamRecord& r) const { return matcher && matcher->Contains(r); }
+
+    SeqPointer<ApproximateMotifMatcher> matcher; ///< The compiled motifs, shared by copies
+
+    std::string file; ///< Name of the file holding the motifs
+
+    bool inv; ///< Is this an inverted dictionary (ie exclude hits)
+
+    int count; ///< Number of motifs in dictionary
+
+  };
+
 /** Stores a rule for a single alignment flag.
  *
  * Rules for alignment flags can be one of three states:
@@ -190,6 +242,8 @@ private:
  */
 class FlagRule {
 
+  friend class FilterProgram;
+
  public:
 
   FlagRule() {
@@ -265,6 +319,15 @@ class FlagRule {
    */
   bool isValid(const BamRecord &r);
 
+  /** Narrow a mask to the rows of a batch that pass the alignment flag rules
+   *
+   * Same result as calling isValid on each record, but scans the flag,
+   * position and clip columns of the batch directly.
+   * @param batch Columnar batch of records to query
+   * @param pass Mask to narrow (see BamRecordBatch::SelectFlag)
+   */
+  void isValid(const BamRecordBatch& batch, BatchMask& pass) const;
+
   /** Print the flag rule */
   friend std::ostream& operator<<(std::ostream &out, const FlagRule &fr);
 
@@ -294,6 +357,7 @@ class AbstractRule {
 
   friend class ReadFilter;
   friend class ReadFilterCollection;
+  friend class FilterProgram;
 
  public:
 
@@ -310,6 +374,14 @@ class AbstractRule {
    */
   void addMotifRule(const std::string& f, bool inverted);
 
+  /** Add a list of motifs that will be searched for in the read
+   * sequence, allowing substitutions, insertions and deletions
+   * @param f Path to new-line separated file of motifs, each at most 64 bases
+   * @param edits Largest edit distance that counts as a match
+   * @param inverted If true, the reads that have a matching motif will fail isValid
+   */
+  void addMotifRule(const std::string& f, int edits, bool inverted);
+
   /** Query a read against this rule. If the
    * read passes this rule, return true.
    * @param r An aligned sequencing read to query against filter
@@ -374,6 +446,9 @@ class AbstractRule {
   AhoCorasick aho;
 #endif
 
+  // motifs matched within an edit distance
+  ApproximateMotifs approx;
+
   // id for this rule
   std::string id;
 
@@ -398,6 +473,7 @@ class ReadFilterCollection;
 class ReadFilter {
   
   friend class ReadFilterCollection;
+  friend class FilterProgram;
 
   public:
 
@@ -467,6 +543,10 @@ class ReadFilter {
 
   GRC m_grv; // the interval tree with the regions this rule applies to. Empty is whole-genome
 
+  SeqPointer<RegionMask> m_mask; // bitmask of m_grv, for large region sets. Null if not built
+
+  void build_mask(); // (re)build m_mask if m_grv is large
+
   std::string id; // set a unique id for this filter
  
   bool excluder; // this filter is such that if read passes, it gets excluded
@@ -483,6 +563,110 @@ class ReadFilter {
 
 };
 
+/** A ReadFilterCollection compiled into a flat list of tests
+ *
+ * Each AbstractRule becomes a clause: a run of tests in one array that
+ * must all pass. The alignment flag conditions of a rule (named flags,
+ * allflag/anyflag, and the pairing needed by orientation rules) collapse
+ * into one bitmask test, the orientation rules into one lookup, and
+ * ranges on the same field into one range. Ranges that accept every
+ * possible value are dropped, and rules that can never pass are removed.
+ *
+ * Tests in a clause start in order of a fixed cost estimate. After a
+ * warm-up of reads, Optimize() reorders them by cost per rejection
+ * measured on those reads, so cheap tests that reject most reads run
+ * first. Excluder filters are checked before includer filters, so a read
+ * stops at the first filter that decides it.
+ *
+ * The result for a read is the same as the uncompiled collection. Made by
+ * ReadFilterCollection::Compile.
+ */
+class FilterProgram {
+
+ public:
+
+  /** Create an empty program */
+ FilterProgram() : m_profile(0) {}
+
+  /** Reorder the tests of each clause, and the clauses of each filter,
+   * by the pass and reject rates measured so far */
+  void Optimize();
+
+  /** Return the total number of tests */
+  size_t size() const { return m_ops.size(); }
+
+  /** Print the program */
+  friend std::ostream& operator<<(std::ostream& out, const FilterProgram& p);
+
+ private:
+
+  friend class ReadFilterCollection;
+
+  // test codes
+  enum { OP_FLAG, OP_HARDCLIP, OP_ORIENT, OP_ISIZE, OP_MAPQ, OP_INS, OP_DEL, OP_LEN, OP_CLIP,
+	 OP_SUBSAMPLE, OP_NBASES, OP_NM, OP_RG, OP_XP, OP_MOTIF, OP_APPROX_MOTIF };
+
+  struct Op {
+    int code;
+    int32_t min, max; // range bounds, or the argument of other tests
+    bool inverted;    // range passes values outside [min, max]
+    uint32_t on, off, any, notall; // flag bits: all on, all off, any on, not all on
+    double frac;      // subsample rate
+    uint32_t seed;    // subsample seed
+    double cost;      // estimated cost
+    uint64_t evals, rejects; // measured during the warm-up
+  };
+
+  struct Clause {
+    size_t begin, end; // ops
+    size_t filter, rule; // source AbstractRule
+    uint64_t evals, passes;
+  };
+
+  struct Block {
+    size_t filter;
+    size_t begin, end; // clauses
+    bool excluder;
+  };
+
+  // per read values shared by several tests
+  struct ReadCache {
+    ReadCache() : trimmed(-1) {}
+    int32_t trimmed;
+  };
+
+  void compile(const std::vector<ReadFilter>& filters);
+
+  // add the tests of one rule. Returns false if the rule can never pass
+  bool compile_rule(const AbstractRule& ar, std::vector<Op>& ops);
+
+  bool add_range(std::vector<Op>& ops, int code, const Range& r) const;
+
+  // values a ranged test code can see
+  static void domain(int code, int32_t& lo, int32_t& hi);
+
+  static bool cost_less(const Op& a, const Op& b);
+
+  static bool rank_less(const Op& a, const Op& b);
+
+  bool isValid(const BamRecord& r);
+
+  bool run_clause(Clause& c, const BamRecord& r, ReadCache& rc);
+
+  bool run_op(const Op& op, const Clause& c, const BamRecord& r, ReadCache& rc) const;
+
+  std::vector<ReadFilter> m_filters; // copies, for regions, read groups and motifs
+
+  std::vector<Op> m_ops;
+
+  std::vector<Clause> m_clauses;
+
+  std::vector<Block> m_blocks; // excluders first
+
+  size_t m_profile; // reads left in the warm-up
+
+};
+
 /** A full set of rules across any number of regions
  *
  * Stores the entire set of ReadFilter, each defined on a unique interval.
@@ -506,6 +690,14 @@ class ReadFilterCollection {
    */
   ReadFilterCollection(const std::string& script, const SeqLib::BamHeader& h);
 
+  /** Copy the filters. A compiled program is copied too, so the copies
+   * profile and reorder their tests independently (eg one per thread)
+   */
+  ReadFilterCollection(const ReadFilterCollection& o);
+
+  /** Copy the filters, and the compiled program if any */
+  ReadFilterCollection& operator=(const ReadFilterCollection& o);
+
   /** Add a new rule to the collection. 
    * If a read passes this rule, it will be included,
    * even if it fails the other filters. Or, if this filter
@@ -520,8 +712,26 @@ class ReadFilterCollection {
   void addGlobalRule(const std::string& rule);
 
   /** Query a read to see if it passes any one of the
-   * filters contained in this collection */
+   * filters contained in this collection 
+   * @note Uses the compiled program if there is one (see Compile)
+   */
   bool isValid(const BamRecord &r);
+
+  /** Compile the filters into a FilterProgram, which isValid then uses
+   *
+   * Collections made from JSON are compiled by the constructor. Adding a
+   * filter drops the program, so call this again afterwards.
+   */
+  void Compile();
+
+  /** Drop the compiled program, so isValid checks each rule as written */
+  void ClearProgram() { m_program.reset(); }
+
+  /** Return true if isValid is using a compiled program */
+  bool IsCompiled() const { return m_program.get() != NULL; }
+
+  /** Return the compiled program, or NULL if not compiled */
+  const FilterProgram* GetProgram() const { return m_program.get(); }
   
   /** Print some basic information about this object */
   friend std::ostream& operator<<(std::ostream& out, const ReadFilterCollection &mr);
@@ -571,6 +781,9 @@ class ReadFilterCollection {
   // store all of the individual filters
   std::vector<ReadFilter> m_regions;
 
+  // m_regions compiled, or null
+  SeqPointer<FilterProgram> m_program;
+
   bool ParseFilterObject(const std::string& filterName, const Json::Value& filterObject);
 
 };
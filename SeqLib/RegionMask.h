@@ -0,0 +1,85 @@
+#ifndef SEQLIB_REGION_MASK_H
+#define SEQLIB_REGION_MASK_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "SeqLib/GenomicRegionCollection.h"
+
+namespace SeqLib {
+
+  /** Genome-wide bitmask of the positions covered by a set of regions
+   *
+   * Answers "is this position covered" and "does this span touch a
+   * covered position" without an interval tree query. Intended for
+   * large, static masks such as blacklists or mappability tracks.
+   *
+   * The layout follows roaring bitmaps. Each chromosome is split into
+   * blocks of 65536 positions, and each block is stored in the cheapest
+   * of four forms: empty, full, a sorted list of covered runs (sparse
+   * masks), or a 65536-bit bitmap (fragmented masks). Span queries on a
+   * bitmap test whole 64-bit words, and counts use popcount.
+   *
+   * Strand is ignored, and positions below 0 are never covered. Regions
+   * are closed intervals, as in GenomicRegionCollection. The mask is
+   * immutable once built.
+   */
+  class RegionMask {
+
+  public:
+
+    /** Create an empty mask */
+    RegionMask() {}
+
+    /** Create a mask covering the regions of a collection */
+    explicit RegionMask(const GRC& g);
+
+    /** Return true if position pos on chromosome chr is covered */
+    bool Contains(int32_t chr, int32_t pos) const;
+
+    /** Return true if any position of gr is covered */
+    bool Overlaps(const GenomicRegion& gr) const;
+
+    /** Return the number of covered positions in gr */
+    uint64_t CountCovered(const GenomicRegion& gr) const;
+
+    /** Return true if no position is covered */
+    bool IsEmpty() const { return m_chr.empty(); }
+
+    /** Return the approximate memory used by the mask, in bytes */
+    size_t MemoryBytes() const;
+
+  private:
+
+    // block slots: 0 is empty, 1 is full, otherwise m_blocks[slot - 2]
+    enum { EMPTY = 0, FULL = 1 };
+
+    struct Block {
+      uint32_t offset; // first word in m_bits, or first run in m_runs
+      uint32_t n;      // number of runs, or 0 for a bitmap
+    };
+
+    struct Run {
+      uint16_t start; // first covered position in the block
+      uint16_t last;  // last covered position in the block
+    };
+
+    // add the runs of one block, choosing its form
+    void add_block(std::vector<uint32_t>& slots, size_t k, const std::vector<Run>& runs);
+
+    // number of covered positions in [lo, hi] of a stored block
+    uint32_t count_block(const Block& b, int lo, int hi, bool any) const;
+
+    std::vector<std::vector<uint32_t> > m_chr; // block slots per chromosome
+
+    std::vector<Block> m_blocks;
+
+    std::vector<uint64_t> m_bits; // bitmap blocks, 1024 words each
+
+    std::vector<Run> m_runs; // run blocks
+
+  };
+
+}
+
+#endif
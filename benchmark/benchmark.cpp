@@ -2,6 +2,8 @@
 
 //#define JUMPING_TEST 1
 #define READ_TEST 1
+//#define CIGAR_SUMMARY_TEST 1 // requires READ_TEST and USE_BOOST
+//#define OVERLAP_JOIN_TEST 1 // requires USE_BOOST
 
 #include "SeqLib/SeqLibUtils.h"
 
@@ -10,6 +12,7 @@
 #endif
 
 #include <cmath>
+#include <atomic>
 
 //#define RUN_SEQAN 1
 //#define RUN_BAMTOOLS 1
@@ -25,6 +28,7 @@ using namespace seqan;
 #ifdef RUN_SEQLIB
 #include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
+#include "SeqLib/ReadFilter.h"
 #endif
 
 #ifdef RUN_HTSLIB
@@ -128,6 +132,107 @@ int main()
   }
 #endif
 
+#ifdef CIGAR_SUMMARY_TEST
+  // separate cigar accessors (one scan each) vs one cached CigarSummary
+  {
+    size_t sum = 0;
+    boost::timer::cpu_timer ct;
+    for (SeqLib::BamRecordVector::const_iterator i = bav.begin(); i != bav.end(); ++i)
+      sum += i->NumSoftClip() + i->NumHardClip() + i->NumClip() + i->AlignmentPosition() + 
+	i->AlignmentEndPosition() + i->MaxInsertionBases() + i->MaxDeletionBases() + 
+	i->NumMatchBases() + i->NumAlignedBases() + i->PositionEnd();
+    std::cerr << " cigar accessors:       " << ct.format();
+
+    size_t sum2 = 0;
+    ct.start();
+    for (SeqLib::BamRecordVector::const_iterator i = bav.begin(); i != bav.end(); ++i) {
+      i->InvalidateCigarSummary();
+      const SeqLib::CigarSummary& cs = i->GetCigarSummary();
+      sum2 += cs.num_soft_clip + cs.num_hard_clip + cs.NumClip() + cs.leading_clip + 
+	(i->Length() - cs.trailing_clip) + cs.max_insertion + cs.max_deletion + 
+	cs.num_match + cs.num_aligned + i->PositionEnd();
+    }
+    std::cerr << " cigar summary:         " << ct.format();
+    if (sum != sum2)
+      std::cerr << " WARNING: cigar summary mismatch " << sum << " vs " << sum2 << std::endl;
+
+    // baseline for the filter run below: the same cigar conditions read the
+    // way the rules did before the summary, one cigar scan per accessor,
+    // next to the same conditions read from a freshly computed summary
+    size_t hit_acc = 0, hit_sum = 0;
+    ct.start();
+    for (SeqLib::BamRecordVector::const_iterator i = bav.begin(); i != bav.end(); ++i)
+      hit_acc += (i->NumClip() >= 5) + (i->MaxInsertionBases() > 0) + 
+	(i->MaxDeletionBases() > 0) + (i->CigarSize() > 1 && i->NumHardClip() > 0);
+    std::cerr << " rule inputs, accessors: " << ct.format();
+    ct.start();
+    for (SeqLib::BamRecordVector::const_iterator i = bav.begin(); i != bav.end(); ++i) {
+      i->InvalidateCigarSummary();
+      const SeqLib::CigarSummary& cs = i->GetCigarSummary();
+      hit_sum += (cs.NumClip() >= 5) + (cs.max_insertion > 0) + 
+	(cs.max_deletion > 0) + (i->CigarSize() > 1 && cs.num_hard_clip > 0);
+    }
+    std::cerr << " rule inputs, summary:   " << ct.format();
+    if (hit_acc != hit_sum)
+      std::cerr << " WARNING: rule input mismatch " << hit_acc << " vs " << hit_sum << std::endl;
+
+    // filter throughput on cigar-heavy rules. Each rule now shares one cigar scan
+    std::string rules = "{\"\" : { \"rules\" : [{\"clip\" : 5}, {\"ins\" : true}, {\"del\" : true}, {\"hardclip\" : true}]}}";
+    SeqLib::Filter::ReadFilterCollection rfc(rules, r.Header());
+    size_t pass = 0;
+    ct.start();
+    for (SeqLib::BamRecordVector::const_iterator i = bav.begin(); i != bav.end(); ++i) {
+      i->InvalidateCigarSummary();
+      pass += rfc.isValid(*i);
+    }
+    std::cerr << " filter (" << pass << " pass): " << ct.format();
+  }
+#endif
+
+#ifdef OVERLAP_JOIN_TEST
+  // sorted sweep join vs per-query index lookups, on random intervals
+  {
+    const int nq = 2000000, ns = 2000000;
+    SeqLib::GRC qgrc, sgrc;
+    srand(42);
+    for (int i = 0; i < nq; ++i) {
+      int p = rand() % 100000000;
+      qgrc.add(SeqLib::GenomicRegion(rand() % 24, p, p + rand() % 500));
+    }
+    for (int i = 0; i < ns; ++i) {
+      int p = rand() % 100000000;
+      sgrc.add(SeqLib::GenomicRegion(rand() % 24, p, p + rand() % 2000));
+    }
+    qgrc.CoordinateSort();
+
+    boost::timer::cpu_timer ct;
+    sgrc.CreateTreeMap();
+    std::cerr << " index build:           " << ct.format();
+
+    // tree path: look up each query in the subject index
+    struct Count { size_t n; Count() : n(0) {} void operator()(size_t) { ++n; } } tc;
+    ct.start();
+    for (std::vector<SeqLib::GenomicRegion>::const_iterator i = qgrc.begin(); i != qgrc.end(); ++i)
+      sgrc.ForEachOverlap(*i, true, tc);
+    std::cerr << " tree join (" << tc.n << "): " << ct.format();
+
+    struct PairCount { std::atomic<size_t> n; PairCount() : n(0) {} void operator()(size_t, size_t) { ++n; } } sc;
+    ct.start();
+    qgrc.ForEachOverlapPair(sgrc, true, sc);
+    std::cerr << " sweep join (" << sc.n << "): " << ct.format();
+
+    PairCount pc;
+    ct.start();
+    qgrc.ForEachOverlapPair(sgrc, true, pc, 8);
+    std::cerr << " sweep join, 8 threads (" << pc.n << "): " << ct.format();
+
+    std::vector<int32_t> qid, sid;
+    ct.start();
+    SeqLib::GRC out = qgrc.FindOverlaps(sgrc, qid, sid, true);
+    std::cerr << " FindOverlaps (" << out.size() << "): " << ct.format();
+  }
+#endif
+
 #ifdef JUMPING_TEST
   // perform jumping test
   for (int i = 0; i < jump_limit; ++i) {
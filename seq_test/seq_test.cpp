@@ -29,7 +29,16 @@ using namespace SeqLib::Filter;
 using namespace SeqLib;
 
 #include <fstream>
+#include <mutex>
 #include "SeqLib/BFC.h"
+#include "SeqLib/BamRecordStore.h"
+#include "SeqLib/BamRecordBatch.h"
+#include "SeqLib/DuplicateMarker.h"
+#include "SeqLib/MappedRegionCollection.h"
+#include "SeqLib/RegionMask.h"
+#include "SeqLib/FrozenRegionCollection.h"
+#include "SeqLib/CompactRegionVector.h"
+#include "SeqLib/MotifMatcher.h"
 
 BOOST_AUTO_TEST_CASE( read_gzbed ) {
 
@@ -1571,3 +1580,1688 @@ BOOST_AUTO_TEST_CASE ( set_cigar ) {
 
 
 }
+
+BOOST_AUTO_TEST_CASE ( sequence_quality_decode ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM); 
+  SeqLib::BamRecord rec;
+  std::string seq, qual;
+  size_t count = 0;
+  while (rr.GetNextRecord(rec) && ++count < 1000) {
+
+    // compare against per-base lookup
+    const uint8_t * p = bam_get_seq(rec.raw());
+    std::string exp(rec.Length(), 'N');
+    for (int i = 0; i < rec.Length(); ++i)
+      exp[i] = BASES[bam_seqi(p, i)];
+    rec.Sequence(seq);
+    BOOST_CHECK_EQUAL(seq, exp);
+    BOOST_CHECK_EQUAL(rec.Sequence(), exp);
+
+    const uint8_t * q = bam_get_qual(rec.raw());
+    std::string qexp(rec.Length(), ' ');
+    for (int i = 0; i < rec.Length(); ++i)
+      qexp[i] = (char)(q[i] + 33);
+    rec.Qualities(qual, 33);
+    BOOST_CHECK_EQUAL(qual, qexp);
+    BOOST_CHECK_EQUAL(rec.Qualities(), qexp);
+  }
+
+  // odd lengths that exercise the vector tails
+  const std::string nt = "ACGTN";
+  for (int len = 1; len < 200; len += 7) {
+    std::string s(len, 'A'), qs(len, 'I');
+    for (int i = 0; i < len; ++i) {
+      s[i] = nt[(i * 7 + len) % 5];
+      qs[i] = (char)(33 + (i % 41));
+    }
+    SeqLib::BamRecord r;
+    r.init();
+    r.SetQname("decode");
+    r.SetSequence(s);
+    r.SetQualities(qs, 33);
+    std::vector<char> buf(len);
+    r.Sequence(&buf[0]);
+    BOOST_CHECK_EQUAL(std::string(buf.begin(), buf.end()), s);
+    r.Qualities(&buf[0], 33);
+    BOOST_CHECK_EQUAL(std::string(buf.begin(), buf.end()), qs);
+  }
+}
+
+BOOST_AUTO_TEST_CASE ( record_views ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM); 
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (rr.GetNextRecord(rec) && ++count < 1000) {
+
+    SeqLib::QnameView qv = rec.GetQnameView();
+    BOOST_CHECK(qv == rec.Qname());
+    BOOST_CHECK_EQUAL(qv.str(), rec.Qname());
+    BOOST_CHECK_EQUAL(qv.size(), rec.Qname().length());
+
+    SeqLib::CigarView cv = rec.GetCigarView();
+    SeqLib::Cigar cig = rec.GetCigar();
+    BOOST_CHECK_EQUAL(cv.size(), cig.size());
+    BOOST_CHECK(cv.AsCigar() == cig);
+    BOOST_CHECK_EQUAL(cv.NumQueryConsumed(), cig.NumQueryConsumed());
+    BOOST_CHECK_EQUAL(cv.NumReferenceConsumed(), cig.NumReferenceConsumed());
+    size_t k = 0;
+    for (SeqLib::CigarView::const_iterator c = cv.begin(); c != cv.end(); ++c, ++k)
+      BOOST_CHECK(*c == cig[k]);
+
+    SeqLib::SequenceView sv = rec.GetSequenceView();
+    std::string seq = rec.Sequence();
+    BOOST_CHECK_EQUAL(sv.size(), seq.length());
+    BOOST_CHECK_EQUAL(sv.str(), seq);
+    BOOST_CHECK(std::equal(sv.begin(), sv.end(), seq.begin()));
+    BOOST_CHECK_EQUAL(std::count(sv.begin(), sv.end(), 'N'), rec.CountNBases());
+
+    SeqLib::QualityView qual = rec.GetQualityView();
+    BOOST_CHECK_EQUAL(qual.str(), rec.Qualities());
+    BOOST_CHECK_EQUAL(qual.size(), seq.length());
+  }
+  
+}
+
+BOOST_AUTO_TEST_CASE ( cigar_summary ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM); 
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (rr.GetNextRecord(rec) && ++count < 1000) {
+    const SeqLib::CigarSummary& cs = rec.GetCigarSummary();
+    BOOST_CHECK_EQUAL(cs.num_soft_clip, rec.NumSoftClip());
+    BOOST_CHECK_EQUAL(cs.num_hard_clip, rec.NumHardClip());
+    BOOST_CHECK_EQUAL(cs.NumClip(), rec.NumClip());
+    BOOST_CHECK_EQUAL(cs.leading_clip, rec.AlignmentPosition());
+    BOOST_CHECK_EQUAL(rec.Length() - cs.trailing_clip, rec.AlignmentEndPosition());
+    BOOST_CHECK_EQUAL(cs.max_insertion, rec.MaxInsertionBases());
+    BOOST_CHECK_EQUAL(cs.max_deletion, rec.MaxDeletionBases());
+    BOOST_CHECK_EQUAL(cs.num_match, rec.NumMatchBases());
+    BOOST_CHECK_EQUAL(cs.num_aligned, rec.NumAlignedBases());
+    BOOST_CHECK_EQUAL(cs.query_consumed, rec.GetCigar().NumQueryConsumed());
+    BOOST_CHECK_EQUAL(cs.reference_consumed, rec.GetCigar().NumReferenceConsumed());
+    if (rec.MappedFlag() && rec.CigarSize())
+      BOOST_CHECK_EQUAL(rec.Position() + cs.reference_consumed, rec.PositionEnd());
+  }
+
+  // cache is dropped when the cigar changes
+  SeqLib::Cigar c;
+  c.add(SeqLib::CigarField('S', 10));
+  c.add(SeqLib::CigarField('M', 20));
+  c.add(SeqLib::CigarField('I', 5));
+  c.add(SeqLib::CigarField('M', 20));
+  c.add(SeqLib::CigarField('H', 3));
+  rec.SetCigar(c);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().num_soft_clip, 10);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().num_hard_clip, 3);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().leading_clip, 10);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().trailing_clip, 3);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().max_insertion, 5);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().num_match, 40);
+
+  // all clips
+  SeqLib::CigarSummary allclip(bam_get_cigar(rec.raw()), 1);
+  BOOST_CHECK_EQUAL(allclip.leading_clip, 10);
+  BOOST_CHECK_EQUAL(allclip.trailing_clip, 10);
+}
+
+BOOST_AUTO_TEST_CASE ( record_handle ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM); 
+  SeqLib::BamRecord rec;
+  BOOST_CHECK(rr.GetNextRecord(rec));
+  std::string qn = rec.Qname();
+
+  // copies share, clones do not
+  SeqLib::BamRecord shared = rec;
+  SeqLib::BamRecord clone = rec.Clone();
+  BOOST_CHECK(shared.raw() == rec.raw());
+  BOOST_CHECK(clone.raw() != rec.raw());
+  BOOST_CHECK_EQUAL(clone.Qname(), qn);
+  BOOST_CHECK_EQUAL(clone.Sequence(), rec.Sequence());
+  BOOST_CHECK(clone.GetCigar() == rec.GetCigar());
+  clone.SetQname("cloned");
+  BOOST_CHECK_EQUAL(rec.Qname(), qn);
+  shared.SetQname("shared");
+  BOOST_CHECK_EQUAL(rec.Qname(), "shared");
+
+  // cached cigar summary is shared between copies
+  SeqLib::Cigar c;
+  c.add(SeqLib::CigarField('S', 1));
+  c.add(SeqLib::CigarField('M', rec.Length() - 1));
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().NumClip(), rec.NumClip());
+  shared.SetCigar(c);
+  BOOST_CHECK_EQUAL(rec.GetCigarSummary().num_soft_clip, 1);
+
+  // shared_ptr stays valid after the record is dropped
+  SeqPointer<bam1_t> sp = rec.shared_pointer();
+  rec = SeqLib::BamRecord();
+  shared = SeqLib::BamRecord();
+  BOOST_CHECK_EQUAL(std::string(bam_get_qname(sp)), "shared");
+
+  // swap
+  SeqLib::BamRecord a, b;
+  a.init();
+  a.SetQname("a");
+  a.swap(b);
+  BOOST_CHECK(a.isEmpty());
+  BOOST_CHECK_EQUAL(b.Qname(), "a");
+
+  // empty clone
+  BOOST_CHECK(a.Clone().isEmpty());
+
+  // one record shared by several threads: copies, shared_ptr views and the
+  // cigar summary cache
+  SeqLib::BamRecord t;
+  t.init();
+  t.SetQname("threaded");
+  SeqLib::Cigar tc;
+  tc.add(SeqLib::CigarField('S', 5));
+  tc.add(SeqLib::CigarField('M', 10));
+  t.SetCigar(tc);
+  BOOST_CHECK_EQUAL(t.GetCigarSummary().num_soft_clip, 5);
+  t.SetCigar(tc); // leave the summary stale, so the threads race to fill it
+  std::vector<int> clips(4, 0);
+  std::vector<std::thread> workers;
+  for (int k = 0; k < 4; ++k)
+    workers.push_back(std::thread([&t, &clips, k]() {
+	  for (int i = 0; i < 10000; ++i) {
+	    SeqLib::BamRecord mine = t;
+	    SeqPointer<bam1_t> view = mine.shared_pointer();
+	    clips[k] += mine.GetCigarSummary().num_soft_clip;
+	  }
+	}));
+  for (size_t k = 0; k < workers.size(); ++k)
+    workers[k].join();
+  for (int k = 0; k < 4; ++k)
+    BOOST_CHECK_EQUAL(clips[k], 50000);
+  BOOST_CHECK_EQUAL(t.Qname(), "threaded");
+}
+
+BOOST_AUTO_TEST_CASE ( tag_index ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM); 
+  SeqLib::BamRecord rec;
+  std::vector<std::string> tags;
+  tags.push_back("NM");
+  tags.push_back("AS");
+  tags.push_back("XA");
+  tags.push_back("RG");
+  tags.push_back("MD");
+  tags.push_back("ZZ");
+  std::vector<uint8_t*> found;
+  size_t count = 0;
+  while (rr.GetNextRecord(rec) && ++count < 1000) {
+
+    // one-pass multi tag fetch matches bam_aux_get
+    rec.FindTags(tags, found);
+    BOOST_CHECK_EQUAL(found.size(), tags.size());
+    for (size_t i = 0; i < tags.size(); ++i)
+      BOOST_CHECK(found[i] == bam_aux_get(rec.raw(), tags[i].c_str()));
+
+    int32_t nm = -1, nm_idx = -2;
+    std::string md, md_idx;
+    bool has_nm = rec.GetIntTag("NM", nm);
+    bool has_md = rec.GetZTag("MD", md);
+
+    rec.IndexTags();
+    BOOST_CHECK(rec.HasTagIndex());
+    BOOST_CHECK_EQUAL(rec.GetIntTag("NM", nm_idx), has_nm);
+    BOOST_CHECK_EQUAL(rec.GetZTag("MD", md_idx), has_md);
+    if (has_nm) 
+      BOOST_CHECK_EQUAL(nm, nm_idx);
+    BOOST_CHECK_EQUAL(md, md_idx);
+
+    rec.FindTags(tags, found);
+    for (size_t i = 0; i < tags.size(); ++i)
+      BOOST_CHECK(found[i] == bam_aux_get(rec.raw(), tags[i].c_str()));
+  }
+
+  // index is rebuilt after tag edits
+  rec.AddIntTag("XX", 42);
+  rec.AddZTag("YY", "foo");
+  int32_t xx = 0;
+  std::string yy;
+  BOOST_CHECK(rec.GetIntTag("XX", xx));
+  BOOST_CHECK_EQUAL(xx, 42);
+  BOOST_CHECK(rec.GetZTag("YY", yy));
+  BOOST_CHECK_EQUAL(yy, "foo");
+  rec.RemoveTag("XX");
+  BOOST_CHECK(!rec.GetIntTag("XX", xx));
+  BOOST_CHECK(rec.GetZTag("YY", yy));
+  rec.RemoveAllTags();
+  BOOST_CHECK(!rec.GetZTag("YY", yy));
+
+  // edits made through raw() are picked up after RebuildTagIndex
+  int32_t zz = 7;
+  bam_aux_append(rec.raw(), "ZZ", 'i', 4, (uint8_t*)&zz);
+  rec.RebuildTagIndex();
+  zz = 0;
+  BOOST_CHECK(rec.GetIntTag("ZZ", zz));
+  BOOST_CHECK_EQUAL(zz, 7);
+}
+
+BOOST_AUTO_TEST_CASE ( tag_editor ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM); 
+  SeqLib::BamRecord rec;
+  SeqLib::BamTagEditor ed;
+  size_t count = 0;
+  while (rr.GetNextRecord(rec) && ++count < 1000) {
+
+    std::string seq = rec.Sequence();
+    int32_t as = 0;
+    bool has_as = rec.GetIntTag("AS", as);
+
+    ed.clear();
+    ed.RemoveTag("XA");
+    ed.RemoveTag("MD");
+    ed.AddIntTag("NM", 99);
+    ed.AddZTag("CO", "edited");
+    ed.AddFloatTag("XF", 0.5);
+    ed.Apply(rec);
+
+    int32_t nm = 0, as2 = 0;
+    float xf = 0;
+    std::string co, tmp;
+    BOOST_CHECK(rec.GetIntTag("NM", nm));
+    BOOST_CHECK_EQUAL(nm, 99);
+    BOOST_CHECK(rec.GetZTag("CO", co));
+    BOOST_CHECK_EQUAL(co, "edited");
+    BOOST_CHECK(rec.GetFloatTag("XF", xf));
+    BOOST_CHECK_EQUAL(xf, 0.5);
+    BOOST_CHECK(!rec.GetZTag("XA", tmp));
+    BOOST_CHECK(!rec.GetZTag("MD", tmp));
+    BOOST_CHECK_EQUAL(rec.GetIntTag("AS", as2), has_as);
+    BOOST_CHECK_EQUAL(as, as2);
+    BOOST_CHECK_EQUAL(rec.Sequence(), seq);
+  }
+
+  // last add wins, and remove all
+  ed.clear();
+  ed.AddIntTag("NM", 1);
+  ed.AddIntTag("NM", 2);
+  ed.Apply(rec);
+  int32_t nm = 0;
+  BOOST_CHECK(rec.GetIntTag("NM", nm));
+  BOOST_CHECK_EQUAL(nm, 2);
+
+  // the later of an add and a remove of the same tag wins
+  ed.clear();
+  ed.AddIntTag("XN", 5);
+  ed.AddZTag("CO", "kept");
+  ed.RemoveTag("XN");
+  ed.Apply(rec);
+  std::string co;
+  BOOST_CHECK(!rec.GetIntTag("XN", nm));
+  BOOST_CHECK(rec.GetZTag("CO", co));
+  BOOST_CHECK_EQUAL(co, "kept");
+  ed.clear();
+  ed.RemoveTag("CO");
+  ed.AddZTag("CO", "back");
+  ed.Apply(rec);
+  BOOST_CHECK(rec.GetZTag("CO", co));
+  BOOST_CHECK_EQUAL(co, "back");
+
+  ed.clear();
+  ed.RemoveAllTags();
+  ed.Apply(rec);
+  BOOST_CHECK_EQUAL(bam_get_l_aux(rec.raw()), 0);
+
+  BOOST_CHECK_THROW(ed.AddIntTag("NMX", 1), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE ( record_store ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM);
+  SeqLib::BamRecord rec;
+  SeqLib::BamRecordVector brv;
+  SeqLib::BamRecordStore store(1 << 16); // small chunks to exercise chunk rollover
+  while (rr.GetNextRecord(rec) && brv.size() < 2000) {
+    brv.push_back(rec);
+    BOOST_CHECK_EQUAL(store.Add(rec), brv.size() - 1);
+  }
+  BOOST_CHECK_EQUAL(store.size(), brv.size());
+  BOOST_CHECK_THROW(store.Add(SeqLib::BamRecord()), std::invalid_argument);
+  BOOST_CHECK_THROW(store.View(store.size()), std::out_of_range);
+
+  // views match the original records
+  for (size_t i = 0; i < brv.size(); ++i) {
+    SeqLib::BamRecord v = store[i];
+    BOOST_CHECK_EQUAL(v.Qname(), brv[i].Qname());
+    BOOST_CHECK_EQUAL(v.Sequence(), brv[i].Sequence());
+    BOOST_CHECK_EQUAL(v.CigarString(), brv[i].CigarString());
+    BOOST_CHECK_EQUAL(v.Position(), brv[i].Position());
+    BOOST_CHECK_EQUAL(store.Core(i).flag, brv[i].AlignmentFlag());
+  }
+
+  // modifying a view or a copy leaves the store untouched
+  SeqLib::BamRecord v = store.View(0);
+  v.SetQname("changed");
+  v.AddIntTag("XX", 1);
+  BOOST_CHECK_EQUAL(v.Qname(), "changed");
+  BOOST_CHECK_EQUAL(store[0].Qname(), brv[0].Qname());
+  SeqLib::BamRecord c = store.Copy(1);
+  c.SetQname("changed");
+  BOOST_CHECK_EQUAL(store[1].Qname(), brv[1].Qname());
+
+  // coordinate sort permutes the index only
+  store.CoordinateSort();
+  BOOST_CHECK_EQUAL(store.size(), brv.size());
+  int32_t last_chr = -1, last_pos = -1;
+  for (SeqLib::BamRecordStore::const_iterator it = store.begin(); it != store.end(); ++it) {
+    SeqLib::BamRecord r = *it;
+    if (r.ChrID() < 0) // unmapped go last
+      continue;
+    BOOST_CHECK(r.ChrID() > last_chr || (r.ChrID() == last_chr && r.Position() >= last_pos));
+    last_chr = r.ChrID();
+    last_pos = r.Position();
+  }
+
+  store.clear();
+  BOOST_CHECK(store.empty());
+}
+
+BOOST_AUTO_TEST_CASE ( record_batch ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM);
+  SeqLib::BamRecord rec;
+  SeqLib::BamRecordVector brv;
+  while (rr.GetNextRecord(rec) && brv.size() < 2000)
+    brv.push_back(rec);
+
+  SeqLib::BamRecordBatch batch(SeqLib::BamRecordBatch::BATCH_SEQ);
+  batch.Add(brv);
+  BOOST_CHECK_EQUAL(batch.size(), brv.size());
+  BOOST_CHECK(batch.HasColumn(SeqLib::BamRecordBatch::BATCH_SEQ));
+  BOOST_CHECK_THROW(batch.Qualities(0), std::logic_error);
+  for (size_t i = 0; i < brv.size(); ++i) {
+    BOOST_CHECK_EQUAL(batch.ChrID()[i], brv[i].ChrID());
+    BOOST_CHECK_EQUAL(batch.PositionEnd()[i], brv[i].PositionEnd());
+    BOOST_CHECK_EQUAL(batch.MapQuality()[i], brv[i].MapQuality());
+    BOOST_CHECK_EQUAL(batch.Sequence(i).str(), brv[i].Sequence());
+  }
+
+  // predicates and reductions match a per-record scan
+  SeqLib::BatchMask m;
+  batch.SelectFlag(0, BAM_FDUP | BAM_FUNMAP, m);
+  batch.SelectMapQuality(10, 60, m);
+  size_t count = 0;
+  double mapq = 0;
+  for (size_t i = 0; i < brv.size(); ++i)
+    if (!brv[i].DuplicateFlag() && brv[i].MappedFlag() && brv[i].MapQuality() >= 10 && brv[i].MapQuality() <= 60) {
+      ++count;
+      mapq += brv[i].MapQuality();
+    }
+  BOOST_CHECK_EQUAL(batch.CountSelected(m), count);
+  BOOST_CHECK_CLOSE(batch.MeanMapQuality(m), count ? mapq / count : 0, 0.0001);
+  std::vector<size_t> hist;
+  batch.MapQualityHistogram(hist, m);
+  size_t hsum = 0;
+  for (size_t i = 0; i < hist.size(); ++i)
+    hsum += hist[i];
+  BOOST_CHECK_EQUAL(hsum, count);
+  SeqLib::BatchMask bad(3, 1);
+  BOOST_CHECK_THROW(batch.SelectMapQuality(0, 60, bad), std::invalid_argument);
+
+  // FlagRule over a batch gives the same answer as per record
+  SeqLib::Filter::FlagRule fr;
+  fr.setAllOffFlag(BAM_FDUP);
+  fr.setAnyOnFlag(BAM_FPAIRED | BAM_FREVERSE);
+  SeqLib::BatchMask pass;
+  fr.isValid(batch, pass);
+  for (size_t i = 0; i < brv.size(); ++i)
+    BOOST_CHECK_EQUAL((bool)pass[i], fr.isValid(brv[i]));
+
+  BOOST_CHECK(batch.WriteColumns("tmp_batch.slcb"));
+}
+
+BOOST_AUTO_TEST_CASE ( cigar_inline_storage ) {
+
+  // short and long cigars behave the same
+  std::string s_short = "5S10M2I3D15M3S";
+  std::string s_long;
+  for (int i = 0; i < 20; ++i)
+    s_long += "3M1I";
+  s_long += "10=2X4N1P6H";
+  const std::string strs[] = {"", s_short, s_long};
+  for (int k = 0; k < 3; ++k) {
+    SeqLib::Cigar c(strs[k]);
+    std::stringstream ss;
+    ss << c;
+    BOOST_CHECK_EQUAL(ss.str(), strs[k]);
+
+    SeqLib::Cigar copy = c;
+    SeqLib::Cigar assigned;
+    assigned = c;
+    BOOST_CHECK(copy == c);
+    BOOST_CHECK(assigned == c);
+    copy.add(SeqLib::CigarField('S', 5));
+    BOOST_CHECK(copy != c);
+    BOOST_CHECK_EQUAL(copy.size(), c.size() + 1);
+  }
+  BOOST_CHECK_EQUAL(SeqLib::Cigar(s_long).size(), 83);
+
+  // "*" is the SAM value for no CIGAR
+  BOOST_CHECK_EQUAL(SeqLib::Cigar("*").size(), 0);
+  BOOST_CHECK(SeqLib::Cigar("*") == SeqLib::Cigar());
+  BOOST_CHECK_THROW(SeqLib::Cigar("**"), std::invalid_argument);
+
+  // parser rejects malformed strings
+  BOOST_CHECK_THROW(SeqLib::Cigar("M"), std::invalid_argument);
+  BOOST_CHECK_THROW(SeqLib::Cigar("10M5"), std::invalid_argument);
+  BOOST_CHECK_THROW(SeqLib::Cigar("10L"), std::invalid_argument);
+  uint32_t ops[2];
+  BOOST_CHECK_EQUAL(SeqLib::ParseCigarString("3M4I5D", 6, ops, 2), 3);
+  BOOST_CHECK_EQUAL(SeqLib::CigarField(ops[1]).Type(), 'I');
+  BOOST_CHECK_EQUAL(SeqLib::CigarField(ops[1]).Length(), 4);
+
+  // views compare against owning cigars without copying
+  SeqLib::BamReader rr;
+  rr.Open(SBAM);
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (rr.GetNextRecord(rec) && ++count < 500) {
+    SeqLib::Cigar c = rec.GetCigar();
+    BOOST_CHECK(rec.GetCigarView() == c);
+    BOOST_CHECK(SeqLib::Cigar(rec.CigarString()) == c);
+    SeqLib::Cigar rc = rec.GetReverseCigar();
+    BOOST_CHECK_EQUAL(rc.size(), c.size());
+    if (c.size())
+      BOOST_CHECK(rc.front() == c.back());
+  }
+}
+
+BOOST_AUTO_TEST_CASE ( sam_formatter ) {
+
+  SeqLib::BamReader rr;
+  rr.Open(SBAM);
+  SeqLib::BamHeader h = rr.Header();
+  SeqLib::SamFormatter fm;
+  fm.SetHeader(h);
+
+  // write through the SeqLib SAM path
+  SeqLib::BamWriter w(SeqLib::SAM);
+  BOOST_CHECK(w.Open("tmp_formatter.sam"));
+  w.SetHeader(h);
+  w.WriteHeader();
+
+  SeqLib::BamRecordVector brv;
+  SeqLib::BamRecord rec;
+  while (rr.GetNextRecord(rec) && brv.size() < 1000) {
+    brv.push_back(rec);
+    BOOST_CHECK(w.WriteRecord(rec));
+
+    // check the fixed fields of the formatted line
+    std::string line = fm.Format(rec);
+    std::vector<std::string> f;
+    std::istringstream iss(line);
+    std::string field;
+    while (std::getline(iss, field, '\t'))
+      f.push_back(field);
+    BOOST_REQUIRE(f.size() >= 11);
+    BOOST_CHECK_EQUAL(f[0], rec.Qname());
+    BOOST_CHECK_EQUAL(atoi(f[1].c_str()), rec.AlignmentFlag());
+    BOOST_CHECK_EQUAL(f[2], rec.ChrID() < 0 ? std::string("*") : h.IDtoName(rec.ChrID()));
+    BOOST_CHECK_EQUAL(atoi(f[3].c_str()), rec.Position() + 1);
+    BOOST_CHECK_EQUAL(f[4], SeqLib::tostring(rec.MapQuality()));
+    BOOST_CHECK_EQUAL(f[5], rec.CigarSize() ? rec.CigarString() : std::string("*"));
+    BOOST_CHECK_EQUAL(atoi(f[8].c_str()), rec.InsertSize());
+    BOOST_CHECK_EQUAL(f[9], rec.Sequence());
+
+    // whole line matches htslib
+    kstring_t ks = {0, 0, NULL};
+    BOOST_REQUIRE(sam_format1(h.get_(), rec.raw(), &ks) >= 0);
+    BOOST_CHECK_EQUAL(line, std::string(ks.s, ks.l));
+    free(ks.s);
+
+    // operator<< keeps its own layout (1-based chr id, 0-based positions,
+    // MAPQ as the stream writes the htslib field)
+    std::ostringstream oss, mapq;
+    oss << rec;
+    mapq << rec.raw()->core.qual;
+    std::string expected = rec.Qname() + "\t" + SeqLib::tostring(rec.AlignmentFlag()) + "\t" + 
+      SeqLib::tostring(rec.ChrID() + 1) + "\t" + SeqLib::tostring(rec.Position()) + "\t" + 
+      mapq.str() + "\t" + rec.CigarString() + "\t" + 
+      SeqLib::tostring(rec.MateChrID() + 1) + "\t" + SeqLib::tostring(rec.MatePosition()) + "\t" + 
+      SeqLib::tostring(rec.FullInsertSize()) + "\t" + rec.Sequence() + "\t*\n";
+    BOOST_CHECK_EQUAL(oss.str(), expected);
+  }
+  w.Close();
+
+  // reading the SAM back gives the same records
+  SeqLib::BamReader sr;
+  BOOST_REQUIRE(sr.Open("tmp_formatter.sam"));
+  size_t i = 0;
+  while (sr.GetNextRecord(rec) && i < brv.size()) {
+    BOOST_CHECK_EQUAL(rec.Qname(), brv[i].Qname());
+    BOOST_CHECK_EQUAL(rec.Position(), brv[i].Position());
+    BOOST_CHECK_EQUAL(rec.MatePosition(), brv[i].MatePosition());
+    BOOST_CHECK_EQUAL(rec.Qualities(), brv[i].Qualities());
+    ++i;
+  }
+  BOOST_CHECK_EQUAL(i, brv.size());
+
+  std::string s;
+  SeqLib::AppendDecimal(s, -2147483647);
+  BOOST_CHECK_EQUAL(s, "-2147483647");
+}
+
+// make a mapped record with constant base quality
+static SeqLib::BamRecord dup_test_read(const std::string& name, int pos, bool rev, const std::string& cig, int q) {
+  SeqLib::Cigar c(cig);
+  SeqLib::GenomicRegion gr(0, pos, pos + c.NumReferenceConsumed() - 1);
+  SeqLib::BamRecord r(name, std::string(c.NumQueryConsumed(), 'A'), &gr, c);
+  r.SetQualities(std::string(c.NumQueryConsumed(), (char)(33 + q)), 33);
+  if (rev)
+    r.raw()->core.flag |= BAM_FREVERSE;
+  return r;
+}
+
+BOOST_AUTO_TEST_CASE ( duplicate_marker ) {
+
+  // three copies of a pair at 100 / 400. The soft clipped copy has the same unclipped 5' end
+  SeqLib::BamRecordVector in;
+  const int qual[] = {20, 35, 25};
+  for (int i = 0; i < 3; ++i) {
+    const std::string name = "pair" + SeqLib::tostring(i);
+    SeqLib::BamRecord a = dup_test_read(name, i == 2 ? 105 : 100, false, i == 2 ? "5S45M" : "50M", qual[i]);
+    SeqLib::BamRecord b = dup_test_read(name, 400, true, "50M", qual[i]);
+    a.raw()->core.flag |= BAM_FPAIRED | BAM_FMREVERSE;
+    b.raw()->core.flag |= BAM_FPAIRED;
+    a.raw()->core.mtid = b.raw()->core.mtid = 0;
+    a.raw()->core.mpos = 400;
+    b.raw()->core.mpos = a.Position();
+    in.push_back(a);
+    in.push_back(b);
+  }
+
+  // fragments: two copies at 5000, one of which is flagged on input, and one at the pair's start
+  in.push_back(dup_test_read("frag0", 5000, false, "50M", 30));
+  in.push_back(dup_test_read("frag1", 5000, false, "50M", 10));
+  in.back().SetDuplicateFlag(true);
+  in.push_back(dup_test_read("frag2", 100, false, "50M", 40));
+
+  std::stable_sort(in.begin(), in.end(), SeqLib::BamRecordSort::ByReadPosition());
+
+  SeqLib::DuplicateMarker dm;
+  SeqLib::BamRecordVector out;
+  SeqLib::BamRecord r;
+  for (size_t i = 0; i < in.size(); ++i) {
+    dm.Add(in[i]);
+    while (dm.GetNextRecord(r))
+      out.push_back(r);
+  }
+  dm.Flush();
+  while (dm.GetNextRecord(r))
+    out.push_back(r);
+
+  // same order as the input
+  BOOST_REQUIRE_EQUAL(out.size(), in.size());
+  for (size_t i = 0; i < out.size(); ++i) {
+    BOOST_CHECK_EQUAL(out[i].Qname(), in[i].Qname());
+    const std::string n = out[i].Qname();
+    const bool dup = n == "pair0" || n == "pair2" || n == "frag1" || n == "frag2";
+    BOOST_CHECK_EQUAL(out[i].DuplicateFlag(), dup);
+  }
+
+  BOOST_CHECK_EQUAL(dm.Stats().reads, in.size());
+  BOOST_CHECK_EQUAL(dm.Stats().pairs, 3);
+  BOOST_CHECK_EQUAL(dm.Stats().duplicate_pairs, 2);
+  BOOST_CHECK_EQUAL(dm.Stats().fragments, 3);
+  BOOST_CHECK_EQUAL(dm.Stats().duplicate_fragments, 2);
+
+  // remove instead of flag
+  SeqLib::DuplicateMarker rm;
+  rm.SetRemoveDuplicates(true);
+  size_t kept = 0;
+  for (size_t i = 0; i < in.size(); ++i) {
+    rm.Add(in[i].Clone());
+    while (rm.GetNextRecord(r))
+      ++kept;
+  }
+  rm.Flush();
+  while (rm.GetNextRecord(r))
+    ++kept;
+  BOOST_CHECK_EQUAL(kept, 3);
+
+  // unsorted input
+  SeqLib::DuplicateMarker us;
+  us.Add(in.back());
+  BOOST_CHECK_THROW(us.Add(in.front()), std::runtime_error);
+  BOOST_CHECK_THROW(us.SetWindow(0), std::invalid_argument);
+
+  // two copies of a pair with ends on chr 0 and chr 1, with fragments in between
+  SeqLib::BamRecordVector ic;
+  for (int i = 0; i < 2; ++i) {
+    const std::string name = "inter" + SeqLib::tostring(i);
+    SeqLib::BamRecord a = dup_test_read(name, 100, false, "50M", i ? 30 : 20);
+    SeqLib::BamRecord b = dup_test_read(name, 400, true, "50M", i ? 30 : 20);
+    b.raw()->core.tid = 1;
+    a.raw()->core.flag |= BAM_FPAIRED | BAM_FMREVERSE;
+    b.raw()->core.flag |= BAM_FPAIRED;
+    a.raw()->core.mtid = 1;
+    a.raw()->core.mpos = 400;
+    b.raw()->core.mtid = 0;
+    b.raw()->core.mpos = 100;
+    ic.push_back(a);
+    ic.push_back(b);
+  }
+  ic.push_back(dup_test_read("fill0", 5000, false, "50M", 30));
+  ic.push_back(dup_test_read("fill1", 90000, false, "50M", 30));
+  std::stable_sort(ic.begin(), ic.end(), SeqLib::BamRecordSort::ByReadPosition());
+
+  // decided from the first reads, which are not held until the mates arrive
+  SeqLib::DuplicateMarker im;
+  out.clear();
+  size_t before_mates = 0;
+  for (size_t i = 0; i < ic.size(); ++i) {
+    if (ic[i].ChrID() == 1 && !before_mates)
+      before_mates = out.size();
+    im.Add(ic[i].Clone());
+    while (im.GetNextRecord(r))
+      out.push_back(r);
+  }
+  im.Flush();
+  while (im.GetNextRecord(r))
+    out.push_back(r);
+  BOOST_CHECK_EQUAL(before_mates, 3);
+  BOOST_REQUIRE_EQUAL(out.size(), ic.size());
+  for (size_t i = 0; i < out.size(); ++i) {
+    BOOST_CHECK_EQUAL(out[i].Qname(), ic[i].Qname());
+    BOOST_CHECK_EQUAL(out[i].DuplicateFlag(), out[i].Qname() == "inter0");
+  }
+  BOOST_CHECK_EQUAL(im.Stats().distant_mates, 2);
+  BOOST_CHECK_EQUAL(im.Stats().pairs, 2);
+  BOOST_CHECK_EQUAL(im.Stats().duplicate_pairs, 1);
+  BOOST_CHECK_EQUAL(im.Stats().dropped_mates, 0);
+  BOOST_CHECK_EQUAL(im.Stats().unmatched_mates, 0);
+
+  // with no memory, each pair is decided as soon as its first read is in,
+  // but none is given up on
+  SeqLib::DuplicateMarker lm;
+  lm.SetMemoryLimit(1);
+  out.clear();
+  for (size_t i = 0; i < ic.size(); ++i) {
+    lm.Add(ic[i].Clone());
+    while (lm.GetNextRecord(r))
+      out.push_back(r);
+  }
+  lm.Flush();
+  while (lm.GetNextRecord(r))
+    out.push_back(r);
+  BOOST_REQUIRE_EQUAL(out.size(), ic.size());
+  for (size_t i = 0; i < out.size(); ++i)
+    BOOST_CHECK(!out[i].DuplicateFlag());
+  BOOST_CHECK(lm.Stats().forced > 0);
+  BOOST_CHECK_EQUAL(lm.Stats().dropped_mates, 0);
+  BOOST_CHECK_EQUAL(lm.Stats().unmatched_mates, 0);
+  BOOST_CHECK_EQUAL(lm.Stats().pairs, 2);
+
+  // a pair at one position, given up on by the memory limit. The mate is
+  // passed through, not held as the first read of a new pair
+  SeqLib::DuplicateMarker sm;
+  sm.SetMemoryLimit(1);
+  SeqLib::BamRecord s1 = dup_test_read("same", 100, false, "50M", 30);
+  SeqLib::BamRecord s2 = dup_test_read("same", 100, true, "50M", 30);
+  s1.raw()->core.flag |= BAM_FPAIRED | BAM_FMREVERSE;
+  s2.raw()->core.flag |= BAM_FPAIRED;
+  s1.raw()->core.mtid = s2.raw()->core.mtid = 0;
+  s1.raw()->core.mpos = s2.raw()->core.mpos = 100;
+  size_t n = 0;
+  sm.Add(s1);
+  sm.Add(s2);
+  while (sm.GetNextRecord(r))
+    ++n;
+  BOOST_CHECK_EQUAL(n, 2);
+  BOOST_CHECK_EQUAL(sm.Stats().dropped_mates, 1);
+  BOOST_CHECK_EQUAL(sm.Stats().unmatched_mates, 1);
+
+  // the mate's clipped end comes from its CIGAR (MC) and its score from ms
+  SeqLib::BamRecordVector mc;
+  for (int i = 0; i < 2; ++i) {
+    const std::string name = "mc" + SeqLib::tostring(i);
+    SeqLib::BamRecord a = dup_test_read(name, 100, false, "50M", 20);
+    SeqLib::BamRecord b = dup_test_read(name, i ? 405 : 400, true, i ? "5S45M" : "50M", 20);
+    b.raw()->core.tid = 1;
+    a.raw()->core.flag |= BAM_FPAIRED | BAM_FMREVERSE;
+    b.raw()->core.flag |= BAM_FPAIRED;
+    a.raw()->core.mtid = 1;
+    a.raw()->core.mpos = b.Position();
+    b.raw()->core.mtid = 0;
+    b.raw()->core.mpos = 100;
+    a.AddZTag("MC", b.CigarString());
+    a.AddIntTag("ms", i ? 3000 : 1000);
+    mc.push_back(a);
+    mc.push_back(b);
+  }
+  std::stable_sort(mc.begin(), mc.end(), SeqLib::BamRecordSort::ByReadPosition());
+  SeqLib::DuplicateMarker cm;
+  out.clear();
+  for (size_t i = 0; i < mc.size(); ++i) {
+    cm.Add(mc[i].Clone());
+    while (cm.GetNextRecord(r))
+      out.push_back(r);
+  }
+  cm.Flush();
+  while (cm.GetNextRecord(r))
+    out.push_back(r);
+  BOOST_REQUIRE_EQUAL(out.size(), mc.size());
+  for (size_t i = 0; i < out.size(); ++i)
+    BOOST_CHECK_EQUAL(out[i].DuplicateFlag(), out[i].Qname() == "mc0");
+  BOOST_CHECK_EQUAL(cm.Stats().duplicate_pairs, 1);
+}
+
+// counts the callbacks from GenomicRegionCollection::ForEachOverlap
+struct OverlapCounter {
+  OverlapCounter() : n(0) {}
+  void operator()(size_t i) { ++n; ids.push_back(i); }
+  size_t n;
+  std::vector<size_t> ids;
+};
+
+BOOST_AUTO_TEST_CASE ( interval_index ) {
+
+  // index directly, against a brute force scan
+  SeqLib::TIntervalIndex<int, int32_t> ix;
+  std::vector<std::pair<int, int> > iv;
+  for (int i = 0; i < 5000; ++i) {
+    const int s = (i * 7919) % 100000 - 10;
+    const int e = s + (i % 13 == 0 ? 5000 : i % 200);
+    iv.push_back(std::pair<int, int>(s, e));
+    ix.add(s, e, i);
+  }
+  BOOST_CHECK_EQUAL(ix.countOverlapping(0, 100), 0); // not indexed yet
+  ix.index();
+  for (int q = -100; q < 101000; q += 997) {
+    size_t bf = 0;
+    for (size_t i = 0; i < iv.size(); ++i)
+      bf += iv[i].first <= q + 50 && q <= iv[i].second;
+    BOOST_CHECK_EQUAL(ix.countOverlapping(q, q + 50), bf);
+    std::vector<SeqLib::TInterval<int, int32_t> > hits;
+    ix.findOverlapping(q, q + 50, hits);
+    BOOST_CHECK_EQUAL(hits.size(), bf);
+    for (size_t i = 1; i < hits.size(); ++i)
+      BOOST_CHECK(hits[i-1].start <= hits[i].start);
+  }
+
+  // collection queries through the index
+  SeqLib::GRC grc;
+  for (int i = 0; i < 1000; ++i)
+    grc.add(SeqLib::GenomicRegion(i % 3, (i * 131) % 20000, (i * 131) % 20000 + 250, i % 2 ? '+' : '-'));
+  grc.CreateTreeMap();
+  BOOST_CHECK_EQUAL(grc.NumTree(), 3);
+
+  SeqLib::GenomicRegion q(1, 5000, 6000, '+');
+  OverlapCounter c;
+  const size_t n = grc.ForEachOverlap(q, true, c);
+  BOOST_CHECK_EQUAL(n, c.n);
+  BOOST_CHECK_EQUAL(n, grc.CountOverlaps(q));
+  BOOST_CHECK_EQUAL(n, grc.FindOverlaps(q, true).size());
+  for (size_t i = 0; i < c.ids.size(); ++i)
+    BOOST_CHECK(grc[c.ids[i]].GetOverlap(q));
+
+  // stranded
+  OverlapCounter cs;
+  grc.ForEachOverlap(q, false, cs);
+  BOOST_CHECK_EQUAL(cs.n, grc.FindOverlappedIntervals(q, false).size());
+  for (size_t i = 0; i < cs.ids.size(); ++i)
+    BOOST_CHECK_EQUAL(grc[cs.ids[i]].strand, '+');
+  BOOST_CHECK(cs.n < c.n);
+
+  // unbuilt index
+  SeqLib::GRC un;
+  un.add(q);
+  BOOST_CHECK_THROW(un.ForEachOverlap(q, true, c), std::logic_error);
+}
+
+// records the pairs from GenomicRegionCollection::ForEachOverlapPair
+struct OverlapPairs {
+  void operator()(size_t i, size_t j) { pairs.push_back(std::pair<size_t, size_t>(i, j)); }
+  std::vector<std::pair<size_t, size_t> > pairs;
+};
+
+BOOST_AUTO_TEST_CASE ( sweep_overlap_join ) {
+
+  SeqLib::GRC q, s;
+  for (int i = 0; i < 2000; ++i) {
+    q.add(SeqLib::GenomicRegion(i % 4, (i * 7919) % 50000, (i * 7919) % 50000 + (i % 10 ? 100 : 3000), i % 2 ? '+' : '-'));
+    s.add(SeqLib::GenomicRegion(i % 5, (i * 104729) % 50000, (i * 104729) % 50000 + i % 400, i % 3 ? '+' : '-'));
+  }
+  BOOST_CHECK(!q.IsSorted());
+  q.CoordinateSort();
+  s.CreateTreeMap();
+  BOOST_CHECK(q.IsSorted());
+  BOOST_CHECK(s.IsSorted());
+
+  // sweep join (both sorted) against per-query index lookups
+  for (int strand = 0; strand < 2; ++strand) {
+    std::vector<int32_t> qid, sid;
+    SeqLib::GRC out = q.FindOverlaps(s, qid, sid, strand);
+    BOOST_REQUIRE_EQUAL(qid.size(), out.size());
+    size_t k = 0;
+    for (size_t i = 0; i < q.size(); ++i) {
+      std::vector<int> hits = s.FindOverlappedIntervals(q[i], strand);
+      for (size_t j = 0; j < hits.size(); ++j, ++k) {
+	BOOST_REQUIRE(k < qid.size());
+	BOOST_CHECK_EQUAL(qid[k], i);
+	BOOST_CHECK_EQUAL(sid[k], hits[j]);
+      }
+    }
+    BOOST_CHECK_EQUAL(k, qid.size());
+
+    // callback, single and multithreaded
+    OverlapPairs p1, p4;
+    BOOST_CHECK_EQUAL(q.ForEachOverlapPair(s, strand, p1), qid.size());
+    for (size_t i = 0; i < p1.pairs.size(); ++i) {
+      BOOST_CHECK_EQUAL(p1.pairs[i].first, qid[i]);
+      BOOST_CHECK_EQUAL(p1.pairs[i].second, sid[i]);
+    }
+    std::mutex m;
+    std::vector<std::pair<size_t, size_t> > tp;
+    auto f = [&](size_t i, size_t j) { std::lock_guard<std::mutex> l(m); tp.push_back(std::make_pair(i, j)); };
+    BOOST_CHECK_EQUAL(q.ForEachOverlapPair(s, strand, f, 4), qid.size());
+    std::sort(tp.begin(), tp.end());
+    BOOST_CHECK(tp == p1.pairs);
+  }
+}
+
+// region ordered by width first, to check that CoordinateSort uses operator<
+struct ByWidthRegion : public SeqLib::GenomicRegion {
+  ByWidthRegion(const SeqLib::GenomicRegion& g) : SeqLib::GenomicRegion(g) {}
+  bool operator<(const ByWidthRegion& o) const {
+    return Width() < o.Width() || (Width() == o.Width() && SeqLib::GenomicRegion::operator<(o));
+  }
+};
+
+BOOST_AUTO_TEST_CASE ( grc_sort_merge_subtract_complement ) {
+
+  // large enough to use the radix sort, including negative positions
+  SeqLib::GRC g;
+  std::vector<SeqLib::GenomicRegion> v;
+  for (int i = 0; i < 100000; ++i) {
+    const int p = (i * 7919) % 200000 - 1000;
+    SeqLib::GenomicRegion r((i * 31) % 7, p, p + i % 50);
+    g.add(r);
+    v.push_back(r);
+  }
+  std::stable_sort(v.begin(), v.end());
+  g.CoordinateSort(4);
+  BOOST_CHECK(g.IsSorted());
+  for (size_t i = 0; i < v.size(); ++i)
+    BOOST_CHECK(g[i] == v[i]);
+
+  // an element type with its own order keeps it at any size
+  SeqLib::GenomicRegionCollection<ByWidthRegion> wg;
+  std::vector<ByWidthRegion> wv;
+  for (size_t i = 0; i < v.size(); ++i) {
+    wg.add(ByWidthRegion(v[v.size() - 1 - i]));
+    wv.push_back(ByWidthRegion(v[v.size() - 1 - i]));
+  }
+  std::stable_sort(wv.begin(), wv.end());
+  wg.CoordinateSort(4);
+  for (size_t i = 0; i < wv.size(); ++i)
+    BOOST_CHECK(wg[i] == wv[i]);
+
+  // merging leaves sorted, disjoint, non-touching intervals
+  g.MergeOverlappingIntervals();
+  for (size_t i = 1; i < g.size(); ++i)
+    BOOST_CHECK(g[i].chr != g[i-1].chr || g[i].pos1 > g[i-1].pos2);
+
+  // [0,100] minus [10,20] and [50,200]
+  SeqLib::GRC a, b;
+  a.add(SeqLib::GenomicRegion(0, 0, 100, '+'));
+  a.add(SeqLib::GenomicRegion(1, 5, 10));
+  b.add(SeqLib::GenomicRegion(0, 50, 200));
+  b.add(SeqLib::GenomicRegion(0, 10, 20));
+  SeqLib::GRC sub = a.Subtract(b);
+  BOOST_REQUIRE_EQUAL(sub.size(), 3);
+  BOOST_CHECK(sub[0] == SeqLib::GenomicRegion(0, 0, 9));
+  BOOST_CHECK_EQUAL(sub[0].strand, '+');
+  BOOST_CHECK(sub[1] == SeqLib::GenomicRegion(0, 21, 49));
+  BOOST_CHECK(sub[2] == SeqLib::GenomicRegion(1, 5, 10));
+
+  SeqLib::HeaderSequenceVector h;
+  h.push_back(SeqLib::HeaderSequence("1", 300));
+  h.push_back(SeqLib::HeaderSequence("2", 50));
+  h.push_back(SeqLib::HeaderSequence("3", 10));
+  SeqLib::GRC comp = b.Complement(h);
+  BOOST_REQUIRE_EQUAL(comp.size(), 5);
+  BOOST_CHECK(comp[0] == SeqLib::GenomicRegion(0, 0, 9));
+  BOOST_CHECK(comp[1] == SeqLib::GenomicRegion(0, 21, 49));
+  BOOST_CHECK(comp[2] == SeqLib::GenomicRegion(0, 201, 300));
+  BOOST_CHECK(comp[3] == SeqLib::GenomicRegion(1, 0, 50));
+  BOOST_CHECK(comp[4] == SeqLib::GenomicRegion(2, 0, 10));
+}
+
+BOOST_AUTO_TEST_CASE ( mapped_region_collection ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::GRC g(GZBED, br.Header());
+  BOOST_REQUIRE(g.size());
+
+  // a few stranded regions on another chromosome
+  g.add(SeqLib::GenomicRegion(3, 100, 200, '+'));
+  g.add(SeqLib::GenomicRegion(3, 150, 300, '-'));
+
+  BOOST_REQUIRE(SeqLib::MappedRegionCollection::Write(g, "tmp_regions.grcx"));
+  g.CreateTreeMap(); // sorts g, so compare id sets by region
+
+  SeqLib::MappedRegionCollection m;
+  BOOST_CHECK(!m.IsOpen());
+  BOOST_CHECK(!m.Open("tmp_nonexistent.grcx"));
+  BOOST_REQUIRE(m.Open("tmp_regions.grcx"));
+  BOOST_CHECK(m.IsOpen());
+  BOOST_CHECK_EQUAL(m.size(), g.size());
+  BOOST_CHECK_THROW(m.at(m.size()), std::out_of_range);
+
+  for (size_t i = 0; i < g.size(); ++i) {
+    SeqLib::GenomicRegion q = g[i];
+    q.Pad(50);
+    BOOST_CHECK_EQUAL(m.CountOverlaps(q), g.CountOverlaps(q));
+    std::vector<int> ids = m.FindOverlappedIntervals(q);
+    for (size_t j = 0; j < ids.size(); ++j)
+      BOOST_CHECK(m[ids[j]].GetOverlap(q));
+  }
+
+  BOOST_CHECK_EQUAL(m.CountOverlaps(SeqLib::GenomicRegion(3, 160, 170, '+'), false), 1);
+  BOOST_CHECK_EQUAL(m.CountOverlaps(SeqLib::GenomicRegion(3, 160, 170, '+')), 2);
+  BOOST_CHECK(!m.OverlapSameInterval(SeqLib::GenomicRegion(3, 301, 400)));
+  BOOST_CHECK_EQUAL(m.CountOverlaps(SeqLib::GenomicRegion(20, 1, 400)), 0);
+
+  SeqLib::GRC back = m.AsCollection();
+  BOOST_CHECK_EQUAL(back.size(), g.size());
+
+  // not a region file
+  BOOST_CHECK_THROW(m.Open(GZBED), std::runtime_error);
+  BOOST_CHECK(!m.IsOpen());
+
+  // index nodes (start, stop, max, value) are only checked by Verify. The
+  // last node is at the end of the file
+  BOOST_REQUIRE(m.Open("tmp_regions.grcx"));
+  BOOST_CHECK(m.Verify());
+  std::ifstream in("tmp_regions.grcx", std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  BOOST_REQUIRE(bytes.size() > 16);
+  for (int field = 2; field < 4; ++field) {
+    std::string bad = bytes;
+    const int32_t v = field == 3 ? (int32_t)g.size() : -1000; // region past the end, or a wrong subtree max
+    memcpy(&bad[bad.size() - 16 + 4 * field], &v, 4);
+    std::ofstream out("tmp_regions_bad.grcx", std::ios::binary);
+    out.write(bad.data(), bad.size());
+    out.close();
+    BOOST_CHECK(m.Open("tmp_regions_bad.grcx"));
+    BOOST_CHECK(!m.Verify());
+  }
+  m.Close();
+  BOOST_CHECK(m.Verify());
+}
+
+BOOST_AUTO_TEST_CASE ( read_regions_threaded ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+
+  SeqLib::GRC g, gt;
+  BOOST_REQUIRE(g.ReadBED(GZBED, br.Header()));
+  BOOST_REQUIRE(gt.ReadBED(GZBED, br.Header(), 4));
+  BOOST_REQUIRE_EQUAL(gt.size(), 3);
+  BOOST_REQUIRE_EQUAL(gt.size(), g.size());
+  for (size_t i = 0; i < g.size(); ++i)
+    BOOST_CHECK(g[i] == gt[i]);
+
+  SeqLib::GRC v, vt;
+  BOOST_REQUIRE(v.ReadVCF(GZVCF, br.Header()));
+  BOOST_REQUIRE(vt.ReadVCF(GZVCF, br.Header(), 4));
+  BOOST_REQUIRE_EQUAL(vt.size(), 57);
+  BOOST_REQUIRE_EQUAL(vt.size(), v.size());
+  for (size_t i = 0; i < v.size(); ++i)
+    BOOST_CHECK(v[i] == vt[i]);
+  BOOST_CHECK_EQUAL(vt[29].chr, 0);
+
+  // input of several 4 MB chunks, so lines are split across chunk
+  // boundaries and carried over. Includes comments and CRLF line ends
+  std::string big;
+  for (int i = 0; i < 600000; ++i) {
+    big += br.Header().IDtoName(i % 3) + "\t" + SeqLib::tostring(i * 7) + "\t" + SeqLib::tostring(i * 7 + i % 500);
+    big += i % 1000 == 0 ? "\r\n" : "\n";
+    if (i % 50000 == 0)
+      big += "# comment\n";
+  }
+  BOOST_REQUIRE(big.size() > 2 * (4 << 20));
+  BGZF* bfp = bgzf_open("tmp_big.bed.gz", "w");
+  BOOST_REQUIRE(bfp);
+  BOOST_REQUIRE_EQUAL(bgzf_write(bfp, big.c_str(), big.size()), (ssize_t)big.size());
+  BOOST_REQUIRE_EQUAL(bgzf_close(bfp), 0);
+  for (int t = 2; t <= 4; t += 2) {
+    SeqLib::GRC bg;
+    BOOST_REQUIRE(bg.ReadBED("tmp_big.bed.gz", br.Header(), t));
+    BOOST_REQUIRE_EQUAL(bg.size(), 600000);
+    size_t wrong = 0;
+    for (int i = 0; i < 600000; ++i)
+      wrong += bg[i].chr != i % 3 || bg[i].pos1 != i * 7 || bg[i].pos2 != i * 7 + i % 500;
+    BOOST_CHECK_EQUAL(wrong, 0);
+  }
+
+  // uncompressed input, parsed in parallel
+  SeqLib::GRC p;
+  BOOST_REQUIRE(p.ReadVCF(VCFFILE, br.Header(), 2));
+  BOOST_CHECK(p.size() > 0);
+
+  BOOST_CHECK(!gt.ReadBED("test_data/nonexistent.bed", br.Header(), 2));
+}
+
+// ReadBED with the given thread count, noting whether it threw
+static SeqLib::GRC read_bed_threads(const std::string& file, const SeqLib::BamHeader& h, int threads, bool* threw) {
+  SeqLib::GRC g;
+  *threw = false;
+  try {
+    g.ReadBED(file, h, threads);
+  } catch (const std::exception&) {
+    *threw = true;
+  }
+  return g;
+}
+
+BOOST_AUTO_TEST_CASE ( read_regions_threaded_same_as_serial ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+
+  // unknown contigs, comments, a CRLF line and no final newline
+  {
+    std::ofstream os("tmp_parse.bed");
+    os << "1\t100\t200\nHLA-A\t5\t10\n# note\nX\t300\t400\r\nchrUn_gl000220\t1\t2\n2\t50\t60";
+  }
+  // track and browser lines, which ReadBED does not skip
+  {
+    std::ofstream os("tmp_parse_track.bed");
+    os << "1\t10\t20\n2\t30\t40\ntrack name=x\nbrowser position 1:1-100\n3\t50\t60\n";
+  }
+
+  const char* files[] = { "tmp_parse.bed", "tmp_parse_track.bed" };
+  const SeqLib::BamHeader hdr = br.Header(), empty;
+  const SeqLib::BamHeader* hdrs[] = { &hdr, &empty };
+  for (int f = 0; f < 2; ++f)
+    for (int k = 0; k < 2; ++k) {
+      bool threw1, threw4;
+      SeqLib::GRC g1 = read_bed_threads(files[f], *hdrs[k], 1, &threw1);
+      SeqLib::GRC g4 = read_bed_threads(files[f], *hdrs[k], 4, &threw4);
+      BOOST_CHECK_EQUAL(threw1, threw4);
+      BOOST_REQUIRE_EQUAL(g1.size(), g4.size());
+      for (size_t i = 0; i < g1.size(); ++i)
+	BOOST_CHECK(g1[i] == g4[i]);
+    }
+
+  bool threw;
+  SeqLib::GRC g = read_bed_threads("tmp_parse.bed", br.Header(), 4, &threw);
+  BOOST_CHECK(!threw);
+  BOOST_REQUIRE_EQUAL(g.size(), 3);
+  BOOST_CHECK_EQUAL(g[1].chr, 22);
+  BOOST_CHECK_EQUAL(g[1].pos2, 400);
+  BOOST_CHECK_EQUAL(g[2].chr, 1);
+  BOOST_CHECK_EQUAL(g[2].pos1, 50);
+}
+
+BOOST_AUTO_TEST_CASE ( read_indexed_regions ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  const SeqLib::BamHeader& h = br.Header();
+
+  // write a small bgzipped BED and index it
+  std::stringstream ss;
+  for (int c = 0; c < 2; ++c)
+    for (int p = 0; p < 100000; p += 1000)
+      ss << h.IDtoName(c) << "\t" << p << "\t" << p + 500 << "\n";
+  const std::string bed = ss.str();
+  BGZF* fp = bgzf_open("tmp_indexed.bed.gz", "w");
+  BOOST_REQUIRE(fp);
+  BOOST_REQUIRE_EQUAL(bgzf_write(fp, bed.c_str(), bed.size()), (ssize_t)bed.size());
+  BOOST_REQUIRE_EQUAL(bgzf_close(fp), 0);
+  BOOST_REQUIRE_EQUAL(tbx_index_build("tmp_indexed.bed.gz", 0, &tbx_conf_bed), 0);
+
+  SeqLib::GRC q;
+  q.add(SeqLib::GenomicRegion(0, 1400, 2200));  // records at 1000, 2000
+  q.add(SeqLib::GenomicRegion(0, 2100, 2400));  // overlaps the first query
+  q.add(SeqLib::GenomicRegion(0, 2501, 2999));  // between records
+  q.add(SeqLib::GenomicRegion(1, 99500, 99500)); // record at 99000
+  q.add(SeqLib::GenomicRegion(5, 0, 1000));     // not in the file
+
+  SeqLib::GRC g("tmp_indexed.bed.gz", h, q);
+  BOOST_REQUIRE_EQUAL(g.size(), 3);
+  BOOST_CHECK(g[0] == SeqLib::GenomicRegion(0, 1000, 1500));
+  BOOST_CHECK(g[1] == SeqLib::GenomicRegion(0, 2000, 2500));
+  BOOST_CHECK(g[2] == SeqLib::GenomicRegion(1, 99000, 99500));
+
+  // same records as reading the whole file
+  SeqLib::GRC all;
+  BOOST_REQUIRE(all.ReadBED("tmp_indexed.bed.gz", h));
+  all.CreateTreeMap();
+  q.CreateTreeMap();
+  size_t n = 0;
+  for (size_t i = 0; i < all.size(); ++i)
+    n += q.CountOverlaps(all[i]) > 0;
+  BOOST_CHECK_EQUAL(n, g.size());
+
+  // no index
+  SeqLib::GRC x;
+  BOOST_CHECK(!x.ReadIndexed(GZBED, h, q));
+
+  // "1" and "chr1" both map to chr 0 without a header. Their records are
+  // merged into coordinate order
+  std::stringstream s2;
+  for (int p = 0; p < 5000; p += 1000)
+    s2 << "1\t" << p << "\t" << p + 100 << "\n";
+  for (int p = 500; p < 5000; p += 1000)
+    s2 << "chr1\t" << p << "\t" << p + 100 << "\n";
+  const std::string bed2 = s2.str();
+  fp = bgzf_open("tmp_indexed2.bed.gz", "w");
+  BOOST_REQUIRE(fp);
+  BOOST_REQUIRE_EQUAL(bgzf_write(fp, bed2.c_str(), bed2.size()), (ssize_t)bed2.size());
+  BOOST_REQUIRE_EQUAL(bgzf_close(fp), 0);
+  BOOST_REQUIRE_EQUAL(tbx_index_build("tmp_indexed2.bed.gz", 0, &tbx_conf_bed), 0);
+  SeqLib::GRC q2, g2;
+  q2.add(SeqLib::GenomicRegion(0, 0, 10000));
+  BOOST_REQUIRE(g2.ReadIndexed("tmp_indexed2.bed.gz", SeqLib::BamHeader(), q2));
+  BOOST_REQUIRE_EQUAL(g2.size(), 10);
+  for (size_t i = 0; i < g2.size(); ++i)
+    BOOST_CHECK_EQUAL(g2[i].pos1, (int)i * 500);
+}
+
+BOOST_AUTO_TEST_CASE ( region_mask ) {
+
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(0, 10, 20));
+  g.add(SeqLib::GenomicRegion(0, 15, 30));    // overlaps the first
+  g.add(SeqLib::GenomicRegion(0, 31, 40));    // adjacent
+  g.add(SeqLib::GenomicRegion(0, 65530, 131100)); // spans blocks, one full
+  g.add(SeqLib::GenomicRegion(2, 5, 5));
+  for (int i = 0; i < 5000; ++i)             // fragmented block, stored as a bitmap
+    g.add(SeqLib::GenomicRegion(3, 2 * i, 2 * i));
+
+  SeqLib::RegionMask m(g);
+  BOOST_CHECK(!m.IsEmpty());
+  BOOST_CHECK(SeqLib::RegionMask().IsEmpty());
+
+  BOOST_CHECK(!m.Contains(0, 9));
+  BOOST_CHECK(m.Contains(0, 10));
+  BOOST_CHECK(m.Contains(0, 40));
+  BOOST_CHECK(!m.Contains(0, 41));
+  BOOST_CHECK(m.Contains(0, 100000));
+  BOOST_CHECK(!m.Contains(1, 15));
+  BOOST_CHECK(!m.Contains(-1, 15));
+  BOOST_CHECK(m.Contains(3, 9998));
+  BOOST_CHECK(!m.Contains(3, 9999));
+
+  BOOST_CHECK(m.Overlaps(SeqLib::GenomicRegion(0, 0, 10)));
+  BOOST_CHECK(!m.Overlaps(SeqLib::GenomicRegion(0, 41, 65529)));
+  BOOST_CHECK(m.Overlaps(SeqLib::GenomicRegion(2, 0, 100)));
+  BOOST_CHECK(!m.Overlaps(SeqLib::GenomicRegion(2, 6, 100)));
+  BOOST_CHECK(!m.Overlaps(SeqLib::GenomicRegion(5, 0, 100)));
+
+  BOOST_CHECK_EQUAL(m.CountCovered(SeqLib::GenomicRegion(0, 0, 50)), 31);
+  BOOST_CHECK_EQUAL(m.CountCovered(SeqLib::GenomicRegion(0, 0, 200000)), 31 + 131100 - 65530 + 1);
+  BOOST_CHECK_EQUAL(m.CountCovered(SeqLib::GenomicRegion(3, 0, 9999)), 5000);
+  BOOST_CHECK_EQUAL(m.CountCovered(SeqLib::GenomicRegion(3, 1, 100)), 50);
+
+  // a ReadFilter with a large region set answers as the interval tree does
+  SeqLib::GRC big;
+  for (int c = 0; c < 3; ++c)
+    for (int i = 0; i < 1000; ++i)
+      big.add(SeqLib::GenomicRegion(c, i * 20000, i * 20000 + 5000));
+  big.CreateTreeMap();
+
+  SeqLib::Filter::ReadFilter rf;
+  rf.setRegions(big);
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+  SeqLib::BamRecord r;
+  size_t n = 0;
+  while (br.GetNextRecord(r) && n++ < 5000) {
+    if (r.ChrID() < 0)
+      continue;
+    const bool tree = big.CountOverlaps(SeqLib::GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd())) > 0;
+    BOOST_CHECK_EQUAL(rf.isReadOverlappingRegion(r), tree);
+  }
+}
+
+BOOST_AUTO_TEST_CASE ( nearest_intervals ) {
+
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(0, 100, 200)); // 0
+  g.add(SeqLib::GenomicRegion(0, 150, 160)); // 1, inside the first
+  g.add(SeqLib::GenomicRegion(0, 300, 400)); // 2
+  g.add(SeqLib::GenomicRegion(0, 500, 510)); // 3
+  g.add(SeqLib::GenomicRegion(2, 50, 60));   // 4
+
+  SeqLib::GenomicRegion q(0, 250, 260);
+  BOOST_CHECK_THROW(g.FindNearest(q), std::logic_error);
+  g.CreateTreeMap();
+
+  BOOST_CHECK_EQUAL(g.FindNearestUpstream(q), 0);
+  BOOST_CHECK_EQUAL(g.FindNearestDownstream(q), 2);
+  BOOST_CHECK_EQUAL(g.FindNearestUpstream(SeqLib::GenomicRegion(0, 170, 180)), 1);
+  BOOST_CHECK_EQUAL(g.FindNearestUpstream(SeqLib::GenomicRegion(0, 10, 20)), -1);
+  BOOST_CHECK_EQUAL(g.FindNearestDownstream(SeqLib::GenomicRegion(0, 600, 700)), -1);
+
+  int32_t d;
+  BOOST_CHECK_EQUAL(g.FindNearest(q, &d), 2);
+  BOOST_CHECK_EQUAL(d, 40);
+  BOOST_CHECK_EQUAL(g.FindNearest(SeqLib::GenomicRegion(0, 155, 155), &d), 0);
+  BOOST_CHECK_EQUAL(d, 0);
+  BOOST_CHECK_EQUAL(g.FindNearest(SeqLib::GenomicRegion(0, 450, 450), &d), 2); // tie goes upstream
+  BOOST_CHECK_EQUAL(d, 50);
+  BOOST_CHECK_EQUAL(g.FindNearest(SeqLib::GenomicRegion(1, 0, 10), &d), -1);
+  BOOST_CHECK_EQUAL(d, -1);
+
+  BOOST_CHECK_EQUAL(g.DistanceToNearest(SeqLib::GenomicRegion(2, 0, 10)), 40);
+  BOOST_CHECK_EQUAL(g.DistanceToNearest(SeqLib::GenomicRegion(3, 0, 10)), -1);
+
+  std::vector<int> k = g.FindKNearest(q, 3);
+  BOOST_REQUIRE_EQUAL(k.size(), 3);
+  BOOST_CHECK_EQUAL(k[0], 2);
+  BOOST_CHECK_EQUAL(k[1], 0);
+  BOOST_CHECK_EQUAL(k[2], 1);
+  BOOST_CHECK_EQUAL(g.FindKNearest(q, 10).size(), 4);
+  BOOST_CHECK_EQUAL(g.FindKNearest(SeqLib::GenomicRegion(0, 155, 155), 1)[0], 0);
+
+  // batched queries on a sorted collection give the single query answers
+  SeqLib::GRC qs;
+  qs.add(SeqLib::GenomicRegion(0, 10, 20));
+  qs.add(q);
+  qs.add(SeqLib::GenomicRegion(0, 600, 700));
+  qs.add(SeqLib::GenomicRegion(1, 0, 10));
+  qs.add(SeqLib::GenomicRegion(2, 70, 80));
+  std::vector<int32_t> dists;
+  std::vector<int> n = g.FindNearest(qs, &dists);
+  BOOST_REQUIRE_EQUAL(n.size(), qs.size());
+  for (size_t i = 0; i < qs.size(); ++i) {
+    BOOST_CHECK_EQUAL(n[i], g.FindNearest(qs[i], &d));
+    BOOST_CHECK_EQUAL(dists[i], d);
+  }
+  BOOST_CHECK_EQUAL(n[0], 0);
+  BOOST_CHECK_EQUAL(dists[0], 80);
+  BOOST_CHECK_EQUAL(n[3], -1);
+  BOOST_CHECK_EQUAL(n[4], 4);
+
+  // regions added after a sort are sorted again when the tree is rebuilt
+  SeqLib::GRC s;
+  s.add(SeqLib::GenomicRegion(1, 100, 200));
+  s.CreateTreeMap();
+  s.add(SeqLib::GenomicRegion(0, 100, 200));
+  s.add(SeqLib::GenomicRegion(1, 1000, 1100));
+  s.add(SeqLib::GenomicRegion(1, 5000, 5100));
+  s.CreateTreeMap();
+  BOOST_CHECK(s.IsSorted());
+  BOOST_CHECK_EQUAL(s.FindNearest(SeqLib::GenomicRegion(1, 4900, 4950), &d), 3);
+  BOOST_CHECK_EQUAL(d, 50);
+  BOOST_CHECK_EQUAL(s.FindNearestDownstream(SeqLib::GenomicRegion(1, 4900, 4950)), 3);
+  BOOST_CHECK_EQUAL(s.FindNearestUpstream(SeqLib::GenomicRegion(1, 6000, 6000)), 3);
+}
+
+BOOST_AUTO_TEST_CASE ( frozen_region_collection ) {
+
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(1, 300, 400, '-'));
+  g.add(SeqLib::GenomicRegion(0, 100, 200, '+'));
+  g.add(SeqLib::GenomicRegion(0, 150, 250, '-'));
+  g.add(SeqLib::GenomicRegion(-1, 0, 10));
+
+  SeqLib::FrozenGRC f(g);
+  BOOST_CHECK_EQUAL(f.size(), 4);
+  BOOST_CHECK(SeqLib::FrozenGRC().IsEmpty());
+  BOOST_CHECK_EQUAL(SeqLib::FrozenGRC().CountOverlaps(g[0]), 0);
+
+  // sorted copy, with the same IDs as the source after CreateTreeMap
+  BOOST_CHECK_EQUAL(f[0].chr, -1);
+  BOOST_CHECK_EQUAL(f[1].pos1, 100);
+  BOOST_CHECK_EQUAL(f.at(3).chr, 1);
+  BOOST_CHECK_THROW(f.at(4), std::out_of_range);
+
+  SeqLib::GenomicRegion q(0, 180, 190, '-');
+  BOOST_CHECK_EQUAL(f.CountOverlaps(q), 2);
+  BOOST_CHECK_EQUAL(f.CountOverlaps(q, false), 1);
+  std::vector<int> ids = f.FindOverlappedIntervals(q);
+  BOOST_REQUIRE_EQUAL(ids.size(), 2);
+  BOOST_CHECK_EQUAL(ids[0], 1);
+  BOOST_CHECK_EQUAL(ids[1], 2);
+  SeqLib::GRC o = f.FindOverlaps(SeqLib::GenomicRegion(0, 190, 500));
+  BOOST_REQUIRE_EQUAL(o.size(), 2);
+  BOOST_CHECK_EQUAL(o[0].pos1, 190);
+  BOOST_CHECK_EQUAL(o[1].pos2, 250);
+  BOOST_CHECK_EQUAL(f.CountOverlaps(SeqLib::GenomicRegion(5, 0, 1000)), 0);
+
+  // later changes to the source do not reach the snapshot
+  g.add(SeqLib::GenomicRegion(0, 180, 180));
+  g.CreateTreeMap();
+  BOOST_CHECK_EQUAL(g.CountOverlaps(q), 3);
+  BOOST_CHECK_EQUAL(f.CountOverlaps(q), 2);
+
+  // one snapshot, queried from several threads at once
+  SeqLib::GRC big;
+  for (int i = 0; i < 10000; ++i)
+    big.add(SeqLib::GenomicRegion(i % 3, i * 100, i * 100 + 150));
+  SeqLib::FrozenGRC fb(big);
+  std::vector<size_t> counts(4, 0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < 4; ++t)
+    workers.push_back(std::thread([&fb, &counts, t]() {
+	  SeqLib::FrozenGRC mine = fb; // copies share the index
+	  for (int i = 0; i < 10000; ++i)
+	    counts[t] += fb.CountOverlaps(SeqLib::GenomicRegion(i % 3, i * 100, i * 100)) + mine.CountOverlaps(SeqLib::GenomicRegion(0, 0, 0));
+	}));
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  for (int t = 0; t < 4; ++t)
+    BOOST_CHECK_EQUAL(counts[t], counts[0]);
+  BOOST_CHECK(counts[0] > 10000);
+}
+
+BOOST_AUTO_TEST_CASE ( compact_region_vector ) {
+
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(1, 300, 400, '-'));
+  g.add(SeqLib::GenomicRegion(0, 100, 200));
+  g.add(SeqLib::GenomicRegion(0, 150, 250, '+'));
+  g.add(SeqLib::GenomicRegion(0, 100, 200, '+')); // duplicate of the second, other strand
+  g.add(SeqLib::GenomicRegion(-1, -10, INT_MAX));
+  g.add(SeqLib::GenomicRegion(0, 250, 260));     // touches the third
+
+  // lossless round trip, in the same order
+  SeqLib::CompactRegionVector c(g);
+  BOOST_CHECK_EQUAL(c.size(), g.size());
+  BOOST_CHECK(!c.IsSorted());
+  SeqLib::GRC r = c.AsGRC();
+  BOOST_REQUIRE_EQUAL(r.size(), g.size());
+  for (size_t i = 0; i < g.size(); ++i) {
+    BOOST_CHECK(r[i] == g[i]);
+    BOOST_CHECK_EQUAL(r[i].chr, g[i].chr);
+    BOOST_CHECK_EQUAL(r[i].strand, g[i].strand);
+  }
+  BOOST_CHECK(c.Key(1) < c.Key(0));
+  BOOST_CHECK_EQUAL(c.Key(1), SeqLib::CompactRegionVector::PackKey(0, 100));
+  SeqLib::GenomicRegion bad;
+  bad.pos1 = 10;
+  bad.pos2 = 5;
+  BOOST_CHECK_THROW(SeqLib::CompactRegionVector().add(bad), std::invalid_argument);
+
+  // same order as CoordinateSort
+  c.Sort();
+  BOOST_CHECK(c.IsSorted());
+  g.CoordinateSort();
+  for (size_t i = 0; i < g.size(); ++i) {
+    BOOST_CHECK(c[i] == g[i]);
+    BOOST_CHECK_EQUAL(c[i].strand, g[i].strand);
+  }
+
+  SeqLib::CompactRegionVector d(g);
+  d.Dedup();
+  BOOST_REQUIRE_EQUAL(d.size(), 5);
+  BOOST_CHECK_EQUAL(d[1].strand, '*'); // the first of the duplicates is kept
+
+  // same result as MergeOverlappingIntervals
+  c.MergeOverlappingIntervals();
+  g.MergeOverlappingIntervals();
+  BOOST_REQUIRE_EQUAL(c.size(), 3);
+  BOOST_REQUIRE_EQUAL(g.size(), 3);
+  for (size_t i = 0; i < g.size(); ++i)
+    BOOST_CHECK(c[i] == g[i]);
+  BOOST_CHECK_EQUAL(c[1].pos2, 260);
+  BOOST_CHECK_EQUAL(c[0].pos2, INT_MAX);
+
+  // 12 bytes per region without strands
+  SeqLib::CompactRegionVector big;
+  big.reserve(100000);
+  for (int i = 0; i < 100000; ++i)
+    big.add(SeqLib::GenomicRegion(i % 3, 100000 - i, 100000 - i + 10));
+  BOOST_CHECK(big.MemoryBytes() < 100000 * sizeof(SeqLib::GenomicRegion));
+  big.Sort();
+  for (size_t i = 1; i < big.size(); ++i)
+    BOOST_CHECK(big[i-1] < big[i] || big[i-1] == big[i]);
+}
+
+BOOST_AUTO_TEST_CASE ( compiled_read_filter ) {
+
+  SeqLib::BamReader br;
+  br.Open("test_data/small.bam");
+
+  const std::string rules = "{\"global\" : {\"!anyflag\" : 1536}, \"\" : { \"rules\" : [{\"ic\" : true}, {\"clip\" : 5, \"mapq\" : [0, 300]}, {\"ins\" : true, \"mapq\" : 10}, {\"mapped\": true , \"mate_mapped\" : false, \"duplicate\" : false}, {\"length\" : [200, 300]}, {\"mapped\" : true, \"anyflag\" : 4}]}}";
+  ReadFilterCollection compiled(rules, br.Header());
+  ReadFilterCollection plain(rules, br.Header());
+  BOOST_CHECK(compiled.IsCompiled());
+  plain.ClearProgram();
+  BOOST_CHECK(!plain.IsCompiled());
+
+  // flags collapse to one test per rule, a range covering every mapq is
+  // dropped, and the last rule (mapped, but with the unmapped bit) can never pass
+  const SeqLib::Filter::FilterProgram* p = compiled.GetProgram();
+  BOOST_REQUIRE(p);
+  std::stringstream ss;
+  ss << *p;
+  BOOST_CHECK(ss.str().find("mapq") != std::string::npos); // mapq >= 10
+  BOOST_CHECK_EQUAL(ss.str().find("mapq [0"), std::string::npos);
+  BOOST_CHECK_EQUAL(p->size(), 10);
+
+  SeqLib::BamRecord rec;
+  size_t count = 0, passed = 0;
+  while (br.GetNextRecord(rec) && count++ < 10000) {
+    const bool v = compiled.isValid(rec);
+    BOOST_CHECK_EQUAL(v, plain.isValid(rec));
+    passed += v;
+  }
+  BOOST_CHECK(passed > 0 && passed < count);
+
+  // copies get their own program, so profiling one does not touch the other
+  ReadFilterCollection copy = compiled;
+  BOOST_REQUIRE(copy.IsCompiled());
+  BOOST_CHECK(copy.GetProgram() != compiled.GetProgram());
+  ReadFilterCollection assigned;
+  assigned = compiled;
+  BOOST_REQUIRE(assigned.IsCompiled());
+  BOOST_CHECK(assigned.GetProgram() != compiled.GetProgram());
+  SeqLib::BamReader br2;
+  br2.Open("test_data/small.bam");
+  count = 0;
+  while (br2.GetNextRecord(rec) && count++ < 10000)
+    BOOST_CHECK_EQUAL(copy.isValid(rec), plain.isValid(rec));
+
+  // adding a filter drops the program, until compiled again
+  ReadFilter rf;
+  rf.SetExcluder(true);
+  compiled.AddReadFilter(rf);
+  BOOST_CHECK(!compiled.IsCompiled());
+  compiled.Compile();
+  BOOST_CHECK(compiled.IsCompiled());
+  BOOST_CHECK(!compiled.isValid(rec));
+}
+
+BOOST_AUTO_TEST_CASE ( allocation_free_rule_inputs ) {
+
+  const std::string seq = "ACNTGNNACGTACGTACGTN";
+  SeqLib::GenomicRegion gr(0, 100, 119);
+  SeqLib::Cigar cig("20M");
+  SeqLib::BamRecord br("grp:read1", seq, &gr, cig);
+
+  BOOST_CHECK_EQUAL(br.CountNBases(), 4);
+  BOOST_CHECK_EQUAL(br.QualitySequenceLength(), 20);
+  std::string buf;
+  br.QualitySequence(buf);
+  BOOST_CHECK_EQUAL(buf, seq);
+
+  BOOST_CHECK(!br.GetZTagChar("XA"));
+  BOOST_CHECK_EQUAL(br.CountBWASecondaryAlignments(), 0);
+  br.AddZTag("XA", "1,+100,20M,0;2,-300,20M,1;");
+  BOOST_CHECK_EQUAL(std::string(br.GetZTagChar("XA")), "1,+100,20M,0;2,-300,20M,1;");
+  BOOST_CHECK_EQUAL(br.CountBWASecondaryAlignments(), 2);
+
+  br.AddZTag("GV", "ACNTG");
+  BOOST_CHECK_EQUAL(br.QualitySequenceLength(), 5);
+  br.QualitySequence(buf);
+  BOOST_CHECK_EQUAL(buf, br.QualitySequence());
+
+  int32_t nm = -1;
+  BOOST_CHECK(!br.GetIntTag("NM", nm));
+  br.AddIntTag("NM", 3);
+  BOOST_CHECK(br.GetIntTag("NM", nm));
+  BOOST_CHECK_EQUAL(nm, 3);
+
+  // read group from the qname, then from the RG tag
+  SeqLib::Filter::AbstractRule ar;
+  ar.SetReadGroup("grp");
+  BOOST_CHECK(ar.isValid(br));
+  ar.SetReadGroup("gr");
+  BOOST_CHECK(!ar.isValid(br));
+  br.AddZTag("RG", "gr");
+  BOOST_CHECK(ar.isValid(br));
+}
+
+BOOST_AUTO_TEST_CASE ( motif_matcher_dfa ) {
+
+  SeqLib::MotifMatcher mm;
+  BOOST_CHECK(mm.AddMotif("ACGT"));
+  BOOST_CHECK(mm.AddMotif("GTN"));
+  BOOST_CHECK(mm.AddMotif("CG"));
+  BOOST_CHECK(mm.AddMotif("CG")); // same motif, kept once
+  BOOST_CHECK(!mm.AddMotif(""));
+  BOOST_CHECK(!mm.AddMotif("ACXT"));
+  BOOST_CHECK_EQUAL(mm.NumMotifs(), 3);
+
+  BOOST_CHECK_THROW(mm.Contains(std::string("ACGT")), std::runtime_error);
+  mm.Build();
+  BOOST_CHECK(mm.IsBuilt());
+
+  // "CG" inside "ACGT", then "GTN" on the failure path
+  BOOST_CHECK_EQUAL(mm.Count(std::string("ACGTN")), 3);
+  BOOST_CHECK_EQUAL(mm.Count(std::string("TTTAAA")), 0);
+  BOOST_CHECK(!mm.Contains(std::string("AAAAC")));
+
+  // odd and even lengths of packed sequence
+  const std::string seq = "TTTTTTTTTTTTTTTTTTTTTTTTTTTTTTACGTNTTTTTTTTT";
+  SeqLib::GenomicRegion gr(0, 100, 100 + seq.length() - 1);
+  SeqLib::Cigar cig(SeqLib::tostring(seq.length()) + "M");
+  SeqLib::BamRecord br("read", seq, &gr, cig);
+  BOOST_CHECK(mm.Contains(br.GetSequenceView()));
+  BOOST_CHECK_EQUAL(mm.Count(br.GetSequenceView()), 3);
+  BOOST_CHECK(mm.Contains(br));
+
+  const std::string odd = "TTTTTCG";
+  SeqLib::GenomicRegion gr2(0, 100, 100 + odd.length() - 1);
+  SeqLib::BamRecord br2("read", odd, &gr2, SeqLib::Cigar("7M"));
+  BOOST_CHECK(mm.Contains(br2));
+
+  // a trimmed read is scanned through its GV tag
+  br.AddZTag("GV", "TTTTT");
+  BOOST_CHECK(!mm.Contains(br));
+
+  // the filter rule uses the same matcher
+  SeqLib::Filter::AhoCorasick aho;
+  aho.AddMotif("ACGT");
+  BOOST_CHECK(aho.QueryRead(br2) == false);
+  BOOST_CHECK_EQUAL(aho.QueryText("AACGTT"), 1);
+  BOOST_CHECK(aho.matcher->IsBuilt());
+
+  // queries never build the shared matcher
+  aho.matcher->AddMotif("TTT");
+  BOOST_CHECK_THROW(aho.QueryRead(br2), std::runtime_error);
+  BOOST_CHECK(aho.AddMotif("GGG"));
+  BOOST_CHECK(aho.QueryRead(br2));
+
+  // an exact "!motif" rule drops the reads with a hit
+  std::ofstream mf("tmp_exact_motifs.txt");
+  mf << "ACGTN" << std::endl;
+  mf.close();
+  SeqLib::BamHeader h;
+  ReadFilterCollection keep("{\"\" : {\"rules\" : [{\"motif\" : \"tmp_exact_motifs.txt\"}]}}", h);
+  ReadFilterCollection drop("{\"\" : {\"rules\" : [{\"!motif\" : \"tmp_exact_motifs.txt\"}]}}", h);
+  br.RemoveTag("GV");
+  BOOST_CHECK(keep.isValid(br));
+  BOOST_CHECK(!keep.isValid(br2));
+  BOOST_CHECK(!drop.isValid(br));
+  BOOST_CHECK(drop.isValid(br2));
+  drop.ClearProgram();
+  BOOST_CHECK(!drop.isValid(br));
+  BOOST_CHECK(drop.isValid(br2));
+
+  // IUPAC codes match only themselves, in strings and packed reads
+  SeqLib::MotifMatcher iu;
+  BOOST_CHECK(iu.AddMotif("ARG"));
+  BOOST_CHECK(!iu.AddMotif("A=G"));
+  iu.Build();
+  BOOST_CHECK(iu.Contains(std::string("TTARGTT")));
+  BOOST_CHECK(!iu.Contains(std::string("TTAAGTTAGG")));
+  const std::string amb = "TTTANGTTT";
+  SeqLib::GenomicRegion gr3(0, 100, 100 + amb.length() - 1);
+  SeqLib::BamRecord br3("read", amb, &gr3, SeqLib::Cigar("9M"));
+  BOOST_CHECK(!iu.Contains(br3.GetSequenceView()));
+  uint8_t* packed = bam_get_seq(br3.raw()); // the constructor packs non-ACGT as N
+  packed[2] = (packed[2] & 0x0F) | (5 << 4); // R
+  BOOST_CHECK(iu.Contains(br3.GetSequenceView()));
+  BOOST_CHECK(!iu.Contains(br2.GetSequenceView()));
+}
+
+BOOST_AUTO_TEST_CASE ( approximate_motif_filter ) {
+
+  // one substitution, one deletion and one insertion away from the motif
+  SeqLib::ApproximateMotifMatcher am(1);
+  BOOST_CHECK(am.AddMotif("AGATCGGAAGAGC"));
+  BOOST_CHECK(!am.AddMotif(""));
+  BOOST_CHECK_THROW(am.AddMotif(std::string(65, 'A')), std::invalid_argument);
+  BOOST_CHECK_THROW(SeqLib::ApproximateMotifMatcher(-1), std::invalid_argument);
+  BOOST_CHECK_THROW(am.AddMotif("A"), std::invalid_argument); // as many edits as bases
+  SeqLib::ApproximateMotifMatcher am1(1);
+  BOOST_CHECK(am1.AddMotif("AC"));
+  BOOST_CHECK(!am1.Contains(std::string("GGGGGGG")));
+  BOOST_CHECK(am1.Contains(std::string("GGGAGGG")));
+  BOOST_CHECK(am.Contains(std::string("TTTAGATCGGAAGAGCTTT")));
+  BOOST_CHECK(am.Contains(std::string("TTTAGATCGTAAGAGCTTT")));
+  BOOST_CHECK(am.Contains(std::string("TTTAGATCGAAGAGCTTT")));
+  BOOST_CHECK(am.Contains(std::string("TTTAGATCGGCAAGAGCTTT")));
+  BOOST_CHECK(!am.Contains(std::string("TTTAGATCTTAAGAGCTTT")));
+  BOOST_CHECK(!am.Contains(std::string("")));
+
+  // more motifs than lanes, the hit in the last group
+  SeqLib::ApproximateMotifMatcher am2(2);
+  for (int i = 0; i < 9; ++i)
+    am2.AddMotif(std::string(20, "ACGT"[i % 4]) + "GATTACA");
+  BOOST_CHECK_EQUAL(am2.NumMotifs(), 9);
+  const std::string seq = "CCCCCCCCCCCCCCCCCCCCCAAAAAAAAAAAAAAAAAAAAGAATACCCCC";
+  SeqLib::GenomicRegion gr(0, 100, 100 + seq.length() - 1);
+  SeqLib::BamRecord br("read", seq, &gr, SeqLib::Cigar(SeqLib::tostring(seq.length()) + "M"));
+  BOOST_CHECK(am2.Contains(br.GetSequenceView()));
+  BOOST_CHECK(am2.Contains(br));
+  br.AddZTag("GV", "CCCCCCCCCC");
+  BOOST_CHECK(!am2.Contains(br));
+
+  // JSON motif rule with an edit distance, and its inverse
+  std::ofstream mf("tmp_motifs.txt");
+  mf << "AGATCGGAAGAGC" << std::endl;
+  mf.close();
+  SeqLib::GenomicRegion gr3(0, 100, 118);
+  SeqLib::BamRecord hit("read", "TTTAGATCGTAAGAGCTTT", &gr3, SeqLib::Cigar("19M"));
+  SeqLib::BamRecord miss("read", "TTTTTTTTTTTTTTTTTTT", &gr3, SeqLib::Cigar("19M"));
+
+  SeqLib::BamHeader h;
+  ReadFilterCollection keep("{\"\" : {\"rules\" : [{\"motif\" : {\"file\" : \"tmp_motifs.txt\", \"edits\" : 1}}]}}", h);
+  BOOST_CHECK(keep.isValid(hit));
+  BOOST_CHECK(!keep.isValid(miss));
+
+  ReadFilterCollection drop("{\"\" : {\"rules\" : [{\"!motif\" : {\"file\" : \"tmp_motifs.txt\", \"edits\" : 1}}]}}", h);
+  BOOST_CHECK(!drop.isValid(hit));
+  BOOST_CHECK(drop.isValid(miss));
+  drop.ClearProgram();
+  BOOST_CHECK(!drop.isValid(hit));
+  BOOST_CHECK(drop.isValid(miss));
+}
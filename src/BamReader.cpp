@@ -333,8 +333,10 @@ std::string BamReader::PrintRegions() const {
 
   int32_t _Bam::load_read(BamRecord& r) {
 
-  // allocated the memory
-  bam1_t* b = bam_init1(); 
+  // allocate the record. bam1_t and its ref count come from one allocation
+  BamRecord rec;
+  rec.init();
+  bam1_t* b = rec.raw(); 
   int32_t valid = -1; // start with EOF return code
 
   if (hts_itr.get() == NULL) {
@@ -346,7 +348,6 @@ std::string BamReader::PrintRegions() const {
       std::cerr << "ended reading on null hts_itr" << std::endl;
 #endif
       //goto endloop;
-      bam_destroy1(b);
       return valid;
     }
   } else {
@@ -364,10 +365,8 @@ std::string BamReader::PrintRegions() const {
 #endif
       // try next region, return if no others to try
       ++m_region_idx; // increment to next region
-      if (m_region_idx >= m_region->size()) {
-	bam_destroy1(b);
+      if (m_region_idx >= m_region->size()) 
 	return valid;
-      }
 	//goto endloop;
       
       // next region exists, try it
@@ -378,7 +377,7 @@ std::string BamReader::PrintRegions() const {
   
   // if we got here, then we found a read in this BAM
   empty = false;
-  next_read.assign(b); // assign the shared_ptr for the bam1_t
+  next_read.swap(rec); // hand over the record without touching the ref count
   r = next_read;
 
   return valid;
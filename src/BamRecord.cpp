@@ -4,9 +4,19 @@
 #include <bitset>
 #include <cctype>
 #include <stdexcept>
+#include <cstdio>
 
 #include "SeqLib/ssw_cpp.h"
 
+// vectorized seq / qual decoding. Kernels are compiled with per-function
+// target attributes and picked at runtime, so the library itself can still
+// be built for a generic x86-64. Define SEQLIB_NO_SIMD to disable.
+#if !defined(SEQLIB_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+  (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SEQLIB_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #define TAG_DELIMITER "^"
 #define CTAG_DELIMITER '^'
 
@@ -28,17 +38,358 @@ namespace SeqLib {
 
 
 
-  struct free_delete {
-    void operator()(void* x) { bam_destroy1((bam1_t*)x); }
+  typedef void (*SeqDecoder)(const uint8_t*, int32_t, char*);
+  typedef void (*QualDecoder)(const uint8_t*, int32_t, char*, int);
+
+  static void decode_seq_scalar(const uint8_t* p, int32_t len, char* out) {
+    // two bases per packed byte
+    int32_t i = 0;
+    for (; i + 1 < len; i += 2) {
+      const uint8_t c = p[i >> 1];
+      out[i]     = BASES[c >> 4];
+      out[i + 1] = BASES[c & 0xf];
+    }
+    if (i < len)
+      out[i] = BASES[bam_seqi(p, i)];
+  }
+
+  static void decode_qual_scalar(const uint8_t* q, int32_t len, char* out, int offset) {
+    for (int32_t i = 0; i < len; ++i) 
+      out[i] = (char)(q[i] + offset);
+  }
+
+#ifdef SEQLIB_X86_SIMD
+  // 16 packed bytes -> 32 bases. High nibble is the first base of each byte,
+  // so interleave hi/lo nibbles then look up through BASES with pshufb
+  __attribute__((target("ssse3")))
+  static void decode_seq_ssse3(const uint8_t* p, int32_t len, char* out) {
+    const __m128i lut  = _mm_loadu_si128((const __m128i*)BASES);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int32_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+      const __m128i v  = _mm_loadu_si128((const __m128i*)(p + (i >> 1)));
+      const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+      const __m128i lo = _mm_and_si128(v, mask);
+      _mm_storeu_si128((__m128i*)(out + i),      _mm_shuffle_epi8(lut, _mm_unpacklo_epi8(hi, lo)));
+      _mm_storeu_si128((__m128i*)(out + i + 16), _mm_shuffle_epi8(lut, _mm_unpackhi_epi8(hi, lo)));
+    }
+    decode_seq_scalar(p + (i >> 1), len - i, out + i);
+  }
+
+  __attribute__((target("ssse3")))
+  static void decode_qual_ssse3(const uint8_t* q, int32_t len, char* out, int offset) {
+    const __m128i off = _mm_set1_epi8((char)offset);
+    int32_t i = 0;
+    for (; i + 16 <= len; i += 16) 
+      _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(q + i)), off));
+    decode_qual_scalar(q + i, len - i, out + i, offset);
+  }
+
+  // 32 packed bytes -> 64 bases. AVX2 unpack works within 128-bit lanes,
+  // so the two halves are put back in order with a cross-lane permute
+  __attribute__((target("avx2")))
+  static void decode_seq_avx2(const uint8_t* p, int32_t len, char* out) {
+    const __m256i lut  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)BASES));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int32_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+      const __m256i v  = _mm256_loadu_si256((const __m256i*)(p + (i >> 1)));
+      const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+      const __m256i lo = _mm256_and_si256(v, mask);
+      const __m256i a  = _mm256_shuffle_epi8(lut, _mm256_unpacklo_epi8(hi, lo));
+      const __m256i c  = _mm256_shuffle_epi8(lut, _mm256_unpackhi_epi8(hi, lo));
+      _mm256_storeu_si256((__m256i*)(out + i),      _mm256_permute2x128_si256(a, c, 0x20));
+      _mm256_storeu_si256((__m256i*)(out + i + 32), _mm256_permute2x128_si256(a, c, 0x31));
+    }
+    decode_seq_ssse3(p + (i >> 1), len - i, out + i);
+  }
+
+  __attribute__((target("avx2")))
+  static void decode_qual_avx2(const uint8_t* q, int32_t len, char* out, int offset) {
+    const __m256i off = _mm256_set1_epi8((char)offset);
+    int32_t i = 0;
+    for (; i + 32 <= len; i += 32) 
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(q + i)), off));
+    decode_qual_ssse3(q + i, len - i, out + i, offset);
+  }
+#endif
+
+  static SeqDecoder select_seq_decoder() {
+#ifdef SEQLIB_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return &decode_seq_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+      return &decode_seq_ssse3;
+#endif
+    return &decode_seq_scalar;
+  }
+
+  static QualDecoder select_qual_decoder() {
+#ifdef SEQLIB_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return &decode_qual_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+      return &decode_qual_ssse3;
+#endif
+    return &decode_qual_scalar;
+  }
+
+  void DecodeBamSequence(const uint8_t* p, int32_t len, char* out) {
+    // resolved once, on first use
+    static const SeqDecoder decode = select_seq_decoder();
+    if (len > 0)
+      decode(p, len, out);
+  }
+
+  void DecodeBamQualities(const uint8_t* q, int32_t len, char* out, int offset) {
+    static const QualDecoder decode = select_qual_decoder();
+    if (len > 0)
+      decode(q, len, out, offset);
+  }
+
+  CigarSummary::CigarSummary(const uint32_t* c, size_t n) 
+    : num_soft_clip(0), num_hard_clip(0), leading_clip(0), trailing_clip(0),
+      max_insertion(0), max_deletion(0), num_match(0), num_aligned(0),
+      query_consumed(0), reference_consumed(0) {
+
+    bool in_lead = true; // still in the leading run of clips
+    for (size_t i = 0; i < n; ++i) {
+      const uint32_t len = bam_cigar_oplen(c[i]);
+      switch (bam_cigar_op(c[i])) {
+      case BAM_CSOFT_CLIP:
+	num_soft_clip += len;
+	query_consumed += len;
+	if (in_lead) leading_clip += len; else trailing_clip += len;
+	continue; 
+      case BAM_CHARD_CLIP:
+	num_hard_clip += len;
+	if (in_lead) leading_clip += len; else trailing_clip += len;
+	continue;
+      case BAM_CMATCH:
+	num_match += len;
+	// fall through
+      case BAM_CEQUAL:
+      case BAM_CDIFF:
+	num_aligned += len;
+	query_consumed += len;
+	reference_consumed += len;
+	break;
+      case BAM_CINS:
+	num_aligned += len;
+	query_consumed += len;
+	max_insertion = std::max(max_insertion, len);
+	break;
+      case BAM_CDEL:
+	num_aligned += len;
+	reference_consumed += len;
+	max_deletion = std::max(max_deletion, len);
+	break;
+      case BAM_CREF_SKIP:
+	reference_consumed += len;
+	break;
+      default: // P, B
+	break;
+      }
+      // a non-clip op ends the leading run, and restarts the trailing one
+      in_lead = false;
+      trailing_clip = 0;
+    }
+
+    // cigar made only of clips counts from both ends
+    if (in_lead)
+      trailing_clip = leading_clip;
+  }
+
+  BamPointer::BamPointer(bam1_t* a) : m_block(NULL) {
+    if (!a)
+      return;
+    m_block = new Block();
+    m_block->ptr = a;
+    m_block->tag_index = NULL;
+    m_block->refs = 1;
+    m_block->summary_state = SUMMARY_STALE;
+    m_block->owns_data = true;
+  }
+
+  BamPointer BamPointer::Create() {
+    BamPointer p;
+    p.m_block = new Block();
+    memset(&p.m_block->rec, 0, sizeof(bam1_t)); // as bam_init1
+    p.m_block->ptr = &p.m_block->rec;
+    p.m_block->tag_index = NULL;
+    p.m_block->refs = 1;
+    p.m_block->summary_state = SUMMARY_STALE;
+    p.m_block->owns_data = true;
+    return p;
+  }
+
+  BamPointer BamPointer::Borrow(const bam1_core_t& core, uint8_t* data, int l_data) {
+    BamPointer p = Create();
+    p->core = core;
+    p->data = data;
+    p->l_data = l_data;
+    p->m_data = l_data;
+    p.m_block->owns_data = false;
+    return p;
+  }
+
+  void BamPointer::destroy(Block* blk) {
+    delete blk->tag_index;
+    if (blk->ptr == &blk->rec) {
+      if (blk->owns_data)
+	free(blk->rec.data);
+    }
+    else
+      bam_destroy1(blk->ptr);
+    delete blk;
+  }
+
+  void BamPointer::fill_summary() const {
+    Block* blk = m_block;
+#ifdef SEQLIB_NONATOMIC_REFCOUNT
+    blk->summary = CigarSummary(bam_get_cigar(blk->ptr), blk->ptr->core.n_cigar);
+    blk->summary_state = SUMMARY_READY;
+#else
+    for (;;) {
+      long st = load_count(&blk->summary_state);
+      if (st == SUMMARY_READY)
+	return;
+      if (st == SUMMARY_STALE && 
+	  __sync_bool_compare_and_swap(&blk->summary_state, (long)SUMMARY_STALE, (long)SUMMARY_BUSY)) {
+	blk->summary = CigarSummary(bam_get_cigar(blk->ptr), blk->ptr->core.n_cigar);
+	__atomic_store_n(&blk->summary_state, (long)SUMMARY_READY, __ATOMIC_RELEASE);
+	return;
+      }
+      // another thread is filling it; the summary is a single pass over the cigar
+    }
+#endif
+  }
+
+  void BamPointer::EnableTagIndex() const {
+    if (m_block && !m_block->tag_index) {
+      m_block->tag_index = new TagIndex();
+      m_block->tag_index->Build(m_block->ptr);
+    }
+  }
+
+  // number of bytes in an aux value, after its type byte. -1 if malformed
+  static int aux_value_size(const uint8_t* s, const uint8_t* end) {
+    switch (*s) {
+    case 'A': case 'c': case 'C': return 1;
+    case 's': case 'S': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    case 'd': return 8;
+    case 'Z': case 'H': {
+      const uint8_t* e = (const uint8_t*)memchr(s + 1, 0, end - s - 1);
+      return e ? (int)(e - s) : -1; // includes the null
+    }
+    case 'B': {
+      if (end - s < 6)
+	return -1;
+      int sz = aux_value_size(s + 1, end); // size of one element
+      uint32_t n;
+      memcpy(&n, s + 2, 4);
+      return sz < 0 ? -1 : 1 + 4 + sz * (int)n;
+    }
+    default:
+      return -1;
+    }
+  }
+
+  void FindBamTags(const bam1_t* b, const char* const* tags, size_t n, uint8_t** out) {
+    
+    for (size_t i = 0; i < n; ++i)
+      out[i] = NULL;
+
+    uint8_t* s = bam_get_aux(b);
+    const uint8_t* end = b->data + b->l_data;
+    size_t found = 0;
+    while (s + 3 <= end && found < n) {
+      for (size_t i = 0; i < n; ++i)
+	if (!out[i] && s[0] == (uint8_t)tags[i][0] && s[1] == (uint8_t)tags[i][1]) {
+	  out[i] = s + 2;
+	  ++found;
+	}
+      int sz = aux_value_size(s + 2, end);
+      if (sz < 0)
+	break;
+      s += 3 + sz;
+    }
+  }
+
+  void TagIndex::Build(const bam1_t* b) {
+    n = 0;
+    overflow = false;
+    const uint8_t* aux = bam_get_aux(b);
+    const uint8_t* s = aux;
+    const uint8_t* end = b->data + b->l_data;
+    while (s + 3 <= end) {
+      if (n == MAX_TAGS) {
+	overflow = true;
+	break;
+      }
+      keys[n] = (uint16_t)((s[0] << 8) | s[1]);
+      offsets[n] = (uint32_t)(s + 2 - aux);
+      ++n;
+      int sz = aux_value_size(s + 2, end);
+      if (sz < 0)
+	break;
+      s += 3 + sz;
+    }
+  }
+
+  uint8_t* TagIndex::Find(const bam1_t* b, const char* tag) const {
+    const uint16_t key = (uint16_t)(((uint8_t)tag[0] << 8) | (uint8_t)tag[1]);
+    for (int i = 0; i < n; ++i)
+      if (keys[i] == key)
+	return bam_get_aux(b) + offsets[i];
+    return overflow ? bam_aux_get(b, tag) : NULL;
+  }
+
+  void BamRecord::FindTags(const std::vector<std::string>& tags, std::vector<uint8_t*>& out) const {
+    out.resize(tags.size());
+    if (tags.empty())
+      return;
+    if (b.HasTagIndex()) {
+      for (size_t i = 0; i < tags.size(); ++i)
+	out[i] = b.FindTag(tags[i].c_str());
+      return;
+    }
+    std::vector<const char*> t(tags.size());
+    for (size_t i = 0; i < tags.size(); ++i)
+      t[i] = tags[i].c_str();
+    FindBamTags(b.get(), &t[0], t.size(), &out[0]);
+  }
+
+  struct BamPointer::SharedRef {
+    BamPointer p;
+    explicit SharedRef(const BamPointer& q) : p(q) {}
+    void operator()(bam1_t*) const {}
   };
+
+  SeqPointer<bam1_t> BamPointer::shared() const {
+    if (!m_block)
+      return SeqPointer<bam1_t>();
+    return SeqPointer<bam1_t>(m_block->ptr, SharedRef(*this));
+  }
   
   void BamRecord::init() {
-    bam1_t* f = bam_init1();
-    b = SeqPointer<bam1_t>(f, free_delete());
+    b = BamPointer::Create();
   }
 
   void BamRecord::assign(bam1_t* a) { 
-    b = SeqPointer<bam1_t>(a, free_delete()); 
+    b = BamPointer(a);
+  }
+
+  BamRecord BamRecord::Clone() const {
+    BamRecord out;
+    if (!b)
+      return out;
+    out.init();
+    bam_copy1(out.b.get(), b.get());
+    return out;
   }
 
   int32_t BamRecord::PositionWithSClips() const {
@@ -49,7 +400,7 @@ namespace SeqLib {
   }
 
   int32_t BamRecord::PositionEnd() const { 
-    return b ? (b->core.l_qseq > 0 ? bam_endpos(b.get()) : b->core.pos + GetCigar().NumQueryConsumed()) : -1;
+    return b ? (b->core.l_qseq > 0 ? bam_endpos(b.get()) : b->core.pos + GetCigarView().NumQueryConsumed()) : -1;
   }
 
   int32_t BamRecord::PositionEndWithSClips() const {
@@ -60,12 +411,12 @@ namespace SeqLib {
       return ((*cig_last) & 0xF) == BAM_CSOFT_CLIP ? bam_endpos(b.get()) + ((*cig_last) >> 4) :
                                                      bam_endpos(b.get());
     } else {
-      return b->core.pos + GetCigar().NumQueryConsumed();
+      return b->core.pos + GetCigarView().NumQueryConsumed();
     }
   }
 
   int32_t BamRecord::PositionEndMate() const { 
-    return b ? (b->core.mpos + (b->core.l_qseq > 0 ? b->core.l_qseq : GetCigar().NumQueryConsumed())) : -1;
+    return b ? (b->core.mpos + (b->core.l_qseq > 0 ? b->core.l_qseq : GetCigarView().NumQueryConsumed())) : -1;
   }
 
   GenomicRegion BamRecord::AsGenomicRegion() const {
@@ -83,16 +434,49 @@ namespace SeqLib {
   }
 
   std::string BamRecord::Sequence() const {
-    uint8_t * p = bam_get_seq(b);
-    std::string out(b->core.l_qseq, 'N');
-    for (int32_t i = 0; i < b->core.l_qseq; ++i) 
-      out[i] = BASES[bam_seqi(p,i)];
+    std::string out;
+    Sequence(out);
     return out;
-    
+  }
+
+  void BamRecord::Sequence(std::string& out) const {
+    out.resize(b->core.l_qseq);
+    if (b->core.l_qseq)
+      DecodeBamSequence(bam_get_seq(b), b->core.l_qseq, &out[0]);
+  }
+
+  void BamRecord::Sequence(char* out) const {
+    DecodeBamSequence(bam_get_seq(b), b->core.l_qseq, out);
+  }
+
+  std::string BamRecord::Qualities(int offset) const {
+    std::string out;
+    Qualities(out, offset);
+    return out;
+  }
+
+  void BamRecord::Qualities(std::string& out, int offset) const {
+    uint8_t * p = bam_get_qual(b);
+    if (!p) {
+      out.clear();
+      return;
+    }
+    out.resize(b->core.l_qseq);
+    if (b->core.l_qseq)
+      DecodeBamQualities(p, b->core.l_qseq, &out[0], offset);
+  }
+
+  void BamRecord::Qualities(char* out, int offset) const {
+    uint8_t * p = bam_get_qual(b);
+    if (p)
+      DecodeBamQualities(p, b->core.l_qseq, out, offset);
   }
 
   void BamRecord::SetCigar(const Cigar& c) {
 
+    b.OwnData();
+    b.InvalidateCigarSummary();
+
     // case where they are equal, just swap them out
     if (c.size() == b->core.n_cigar) {
       b->core.n_cigar = c.size();
@@ -234,14 +618,19 @@ namespace SeqLib {
 
   void BamRecord::ClearSeqQualAndTags() {
 
+    b.OwnData();
+
     int new_size = b->core.l_qname + ((b)->core.n_cigar<<2);// + 1; ///* 0xff seq */ + 1 /* 0xff qual */;
     b->data = (uint8_t*)realloc(b->data, new_size);
     b->l_data = new_size;
     b->core.l_qseq = 0;
+    b.RebuildTagIndex();
   }
 
   void BamRecord::SetSequence(const std::string& seq) {
 
+    b.OwnData();
+
     int new_size = b->l_data - ((b->core.l_qseq+1)>>1) - b->core.l_qseq + ((seq.length()+1)>>1) + seq.length();    
     int old_aux_spot = (b->core.n_cigar<<2) + b->core.l_qname + ((b->core.l_qseq + 1)>>1) + b->core.l_qseq;
     int old_aux_len = bam_get_l_aux(b); //(b->core.n_cigar<<2) + b->core.l_qname + ((b->core.l_qseq + 1)>>1) + b->core.l_qseq;
@@ -300,6 +689,8 @@ namespace SeqLib {
   
   void BamRecord::SetQname(const std::string& n)
   {
+    b.OwnData();
+
     // copy out the non-qname data
     size_t nonq_len = b->l_data - b->core.l_qname;
     uint8_t* nonq = (uint8_t*)malloc(nonq_len);
@@ -326,6 +717,8 @@ namespace SeqLib {
 
   void BamRecord::SetQualities(const std::string& n, int offset) {
 
+    b.OwnData();
+
     if (!n.empty() && n.length() != b->core.l_qseq)
       throw std::invalid_argument("New quality score should be same as seq length");
     
@@ -364,35 +757,322 @@ namespace SeqLib {
     return seq;
   }
 
+  void BamRecord::QualitySequence(std::string& out) const {
+    const char* gv = GetZTagChar("GV");
+    if (gv && *gv) {
+      out.assign(gv);
+      return;
+    }
+    out.resize(b->core.l_qseq);
+    if (b->core.l_qseq)
+      DecodeBamSequence(bam_get_seq(b), b->core.l_qseq, &out[0]);
+  }
+
+  int32_t BamRecord::QualitySequenceLength() const {
+    const char* gv = GetZTagChar("GV");
+    return gv && *gv ? (int32_t)strlen(gv) : b->core.l_qseq;
+  }
+
+  static const char DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+  // write the decimal digits of v so that they end at end. Returns the first digit
+  static inline char* write_decimal(char* end, int64_t v) {
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    char* p = end;
+    while (u >= 100) {
+      const unsigned r = (unsigned)(u % 100) * 2;
+      u /= 100;
+      *--p = DIGIT_PAIRS[r + 1];
+      *--p = DIGIT_PAIRS[r];
+    }
+    if (u >= 10) {
+      *--p = DIGIT_PAIRS[u * 2 + 1];
+      *--p = DIGIT_PAIRS[u * 2];
+    } else {
+      *--p = (char)('0' + u);
+    }
+    if (v < 0)
+      *--p = '-';
+    return p;
+  }
+
+  void AppendDecimal(kstring_t* s, int64_t v) {
+    char buf[24];
+    const char* p = write_decimal(buf + sizeof(buf), v);
+    kputsn(p, buf + sizeof(buf) - p, s);
+  }
+
+  void AppendDecimal(std::string& s, int64_t v) {
+    char buf[24];
+    const char* p = write_decimal(buf + sizeof(buf), v);
+    s.append(p, buf + sizeof(buf) - p);
+  }
+
+  // the MAPQ field as an ostream writes it. Older htslib declares it as an
+  // unsigned bit-field (a number), newer as a uint8_t (a raw character)
+  static inline void append_stream_mapq(std::string& s, unsigned int q) { AppendDecimal(s, q); }
+  static inline void append_stream_mapq(std::string& s, unsigned char q) { s += (char)q; }
+
+  static inline void append_cigar_string(const uint32_t* c, size_t n, std::string& s) {
+    char buf[24];
+    for (size_t k = 0; k < n; ++k) {
+      char* p = write_decimal(buf + sizeof(buf) - 1, bam_cigar_oplen(c[k]));
+      buf[sizeof(buf) - 1] = "MIDNSHP=XB"[c[k]&BAM_CIGAR_MASK];
+      s.append(p, buf + sizeof(buf) - p);
+    }
+  }
+
+  void AppendCigarString(const uint32_t* c, size_t n, kstring_t* s) {
+    if (!n) {
+      kputc('*', s);
+      return;
+    }
+    char buf[24];
+    for (size_t k = 0; k < n; ++k) {
+      char* p = write_decimal(buf + sizeof(buf) - 1, bam_cigar_oplen(c[k]));
+      buf[sizeof(buf) - 1] = "MIDNSHP=XB"[c[k]&BAM_CIGAR_MASK];
+      kputsn(p, buf + sizeof(buf) - p, s);
+    }
+  }
+
+  static inline void append_ref_name(int32_t tid, const bam_hdr_t* h, kstring_t* s) {
+    if (tid < 0)
+      kputc('*', s);
+    else if (h && tid < h->n_targets)
+      kputs(h->target_name[tid], s);
+    else
+      AppendDecimal(s, tid + 1);
+  }
+
+  static inline void append_float(double f, kstring_t* s) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%g", f);
+    kputsn(buf, n, s);
+  }
+
+  // append one B array element of the given subtype
+  static inline void append_array_value(char type, const uint8_t* p, kstring_t* s) {
+    switch (type) {
+    case 'c': AppendDecimal(s, *(const int8_t*)p); break;
+    case 'C': AppendDecimal(s, *p); break;
+    case 's': { int16_t v; memcpy(&v, p, 2); AppendDecimal(s, v); break; }
+    case 'S': { uint16_t v; memcpy(&v, p, 2); AppendDecimal(s, v); break; }
+    case 'i': { int32_t v; memcpy(&v, p, 4); AppendDecimal(s, v); break; }
+    case 'I': { uint32_t v; memcpy(&v, p, 4); AppendDecimal(s, v); break; }
+    case 'f': { float v; memcpy(&v, p, 4); append_float(v, s); break; }
+    }
+  }
+
+  void FormatSamRecord(const bam1_t* b, const bam_hdr_t* h, kstring_t* s) {
+
+    const bam1_core_t& c = b->core;
+
+    // QNAME FLAG RNAME POS MAPQ CIGAR
+    kputs(bam_get_qname(b), s);
+    kputc('\t', s);
+    AppendDecimal(s, c.flag);
+    kputc('\t', s);
+    append_ref_name(c.tid, h, s);
+    kputc('\t', s);
+    AppendDecimal(s, (int64_t)c.pos + 1);
+    kputc('\t', s);
+    AppendDecimal(s, c.qual);
+    kputc('\t', s);
+    AppendCigarString(bam_get_cigar(b), c.n_cigar, s);
+    kputc('\t', s);
+
+    // RNEXT PNEXT TLEN
+    if (c.mtid >= 0 && c.mtid == c.tid)
+      kputc('=', s);
+    else
+      append_ref_name(c.mtid, h, s);
+    kputc('\t', s);
+    AppendDecimal(s, (int64_t)c.mpos + 1);
+    kputc('\t', s);
+    AppendDecimal(s, c.isize);
+    kputc('\t', s);
+
+    // SEQ QUAL, decoded straight into the buffer
+    if (c.l_qseq) {
+      ks_resize(s, s->l + 2 * c.l_qseq + 3);
+      DecodeBamSequence(bam_get_seq(b), c.l_qseq, s->s + s->l);
+      s->l += c.l_qseq;
+      s->s[s->l++] = '\t';
+      const uint8_t* q = bam_get_qual(b);
+      if (q[0] == 0xff) {
+	s->s[s->l++] = '*';
+      } else {
+	DecodeBamQualities(q, c.l_qseq, s->s + s->l, 33);
+	s->l += c.l_qseq;
+      }
+      s->s[s->l] = '\0';
+    } else {
+      kputsn("*\t*", 3, s);
+    }
+
+    // tags
+    const uint8_t* p = bam_get_aux(b);
+    const uint8_t* end = b->data + b->l_data;
+    while (p + 3 <= end) {
+      const int sz = aux_value_size(p + 2, end);
+      if (sz < 0 || p + 3 + sz > end)
+	break;
+      const char type = p[2];
+      const uint8_t* v = p + 3;
+      kputc('\t', s);
+      kputsn((const char*)p, 2, s);
+      switch (type) {
+      case 'A':
+	kputsn(":A:", 3, s);
+	kputc(*v, s);
+	break;
+      case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+	kputsn(":i:", 3, s);
+	append_array_value(type, v, s);
+	break;
+      case 'f': {
+	float f;
+	memcpy(&f, v, 4);
+	kputsn(":f:", 3, s);
+	append_float(f, s);
+	break;
+      }
+      case 'd': {
+	double d;
+	memcpy(&d, v, 8);
+	kputsn(":d:", 3, s);
+	append_float(d, s);
+	break;
+      }
+      case 'Z': case 'H':
+	kputc(':', s);
+	kputc(type, s);
+	kputc(':', s);
+	kputsn((const char*)v, sz - 1, s);
+	break;
+      case 'B': {
+	const char sub = v[0];
+	uint32_t n;
+	memcpy(&n, v + 1, 4);
+	const int esz = aux_value_size(v, end);
+	kputsn(":B:", 3, s);
+	kputc(sub, s);
+	for (uint32_t i = 0; i < n; ++i) {
+	  kputc(',', s);
+	  append_array_value(sub, v + 5 + i * esz, s);
+	}
+	break;
+      }
+      }
+      p += 3 + sz;
+    }
+  }
+
+  SamFormatter::SamFormatter(const SamFormatter& f) : m_hdr(f.m_hdr) {
+    m_str.l = m_str.m = 0;
+    m_str.s = NULL;
+    if (f.m_str.l)
+      kputsn(f.m_str.s, f.m_str.l, &m_str);
+  }
+
+  SamFormatter& SamFormatter::operator=(const SamFormatter& f) {
+    if (this != &f) {
+      m_hdr = f.m_hdr;
+      clear();
+      if (f.m_str.l)
+	kputsn(f.m_str.s, f.m_str.l, &m_str);
+    }
+    return *this;
+  }
+
+  void SamFormatter::Append(const BamRecord& r) {
+    FormatSamRecord(r.raw(), m_hdr.get(), &m_str);
+    kputc('\n', &m_str);
+  }
+
+  const char* SamFormatter::Format(const BamRecord& r) {
+    clear();
+    FormatSamRecord(r.raw(), m_hdr.get(), &m_str);
+    return m_str.s;
+  }
+
+  std::string BamRecord::CigarString() const {
+    std::string s;
+    s.reserve(b->core.n_cigar * 4);
+    append_cigar_string(bam_get_cigar(b), b->core.n_cigar, s);
+    return s;
+  }
+
+  // format chr:pos(strand), with the pos commas placed as in AddCommas
+  static std::string brief_position(int32_t tid, int32_t pos, bool reverse) {
+    std::string s;
+    AppendDecimal(s, tid + 1);
+    s += ':';
+    std::string p;
+    AppendDecimal(p, pos);
+    if (p.length() > 3)
+      for (int i = p.length() - 3; i > 0; i -= 3)
+	p.insert(i, ",");
+    s += p;
+    s += reverse ? "(+)" : "(-)";
+    return s;
+  }
+
+  std::string BamRecord::Brief() const {
+    return brief_position(b->core.tid, b->core.pos, (b->core.flag&BAM_FREVERSE) != 0);
+  }
+
+  std::string BamRecord::BriefMate() const {
+    return brief_position(b->core.mtid, b->core.mpos, (b->core.flag&BAM_FMREVERSE) != 0);
+  }
+
   std::ostream& operator<<(std::ostream& out, const BamRecord &r)
   {
     if (!r.b) {
       out << "empty read";
       return out;
     }
-    out << bam_get_qname(r.b) << "\t" << r.b->core.flag
-	<< "\t" << (r.b->core.tid+1) << "\t" << r.b->core.pos 
-	<< "\t" << r.b->core.qual << "\t" << r.CigarString() 
-	<< "\t" << (r.b->core.mtid+1) << "\t" << r.b->core.mpos << "\t" 
-        << r.FullInsertSize() //r.b->core.isize 
-	<< "\t" << r.Sequence() << "\t*" << std::endl;
+
+    // same fields as always, but built in one buffer rather than through the stream
+    const bam1_core_t& c = r.b->core;
+    std::string s;
+    s.reserve(c.l_qname + 2 * c.l_qseq + 64);
+    s += bam_get_qname(r.b);
+    s += '\t';
+    AppendDecimal(s, c.flag);
+    s += '\t';
+    AppendDecimal(s, c.tid + 1);
+    s += '\t';
+    AppendDecimal(s, c.pos);
+    s += '\t';
+    append_stream_mapq(s, c.qual);
+    s += '\t';
+    append_cigar_string(bam_get_cigar(r.b), c.n_cigar, s);
+    s += '\t';
+    AppendDecimal(s, c.mtid + 1);
+    s += '\t';
+    AppendDecimal(s, c.mpos);
+    s += '\t';
+    AppendDecimal(s, r.FullInsertSize());
+    s += '\t';
+    const size_t o = s.size();
+    s.resize(o + c.l_qseq);
+    if (c.l_qseq)
+      DecodeBamSequence(bam_get_seq(r.b), c.l_qseq, &s[o]);
+    s += "\t*";
+    out.write(s.data(), s.size());
+    out << std::endl;
     return out;
-      
-    
   }
 
   int32_t BamRecord::CountBWASecondaryAlignments() const 
   {
-    int xp_count = 0;
-    
-    // xa tag
-    std::string xar_s;
-    GetZTag("XA", xar_s);
-    if (xar_s.length()) {
-      xp_count += std::count(xar_s.begin(), xar_s.end(), ';');
-    }
-
-    return xp_count;
+    // one ';' per alignment in the xa tag
+    const char* xa = GetZTagChar("XA");
+    return xa ? std::count(xa, xa + strlen(xa), ';') : 0;
     
   }
 
@@ -401,27 +1081,28 @@ namespace SeqLib {
     int xp_count = 0;
     
     // sa tag (post bwa mem v0.7.5)
-    std::string xar_s;
-    GetZTag("SA", xar_s);
-    if (xar_s.length()) 
-      xp_count += std::count(xar_s.begin(), xar_s.end(), ';');
+    const char* sa = GetZTagChar("SA");
+    if (sa)
+      xp_count += std::count(sa, sa + strlen(sa), ';');
 
     // xp tag (pre bwa mem v0.7.5)
-    std::string xpr_s;
-    GetZTag("XP", xpr_s);
-    if (xpr_s.length()) 
-      xp_count += std::count(xpr_s.begin(), xpr_s.end(), ';');
+    const char* xp = GetZTagChar("XP");
+    if (xp)
+      xp_count += std::count(xp, xp + strlen(xp), ';');
 
     return xp_count;
     
   }
 
   int32_t BamRecord::CountNBases() const {
-    uint8_t* p = bam_get_seq(b); 
+    // two bases per byte, counted without branches so the loop vectorizes
+    const uint8_t* p = bam_get_seq(b); 
+    const int32_t full = b->core.l_qseq >> 1;
     int32_t n = 0;
-    for (int ww = 0; ww < b->core.l_qseq; ww++)
-      if (bam_seqi(p,ww) == 15) 
-	++n; 
+    for (int32_t i = 0; i < full; ++i)
+      n += ((p[i] >> 4) == 15) + ((p[i] & 15) == 15);
+    if (b->core.l_qseq & 1)
+      n += (p[full] >> 4) == 15;
     return n;
   }
 
@@ -468,7 +1149,9 @@ namespace SeqLib {
   void BamRecord::AddZTag(std::string tag, std::string val) {
     if (tag.empty() || val.empty())
       return;
+    b.OwnData();
     bam_aux_append(b.get(), tag.data(), 'Z', val.length()+1, (uint8_t*)val.c_str());
+    b.RebuildTagIndex();
   }
 
   bool BamRecord::GetTag(const std::string& tag, std::string& s) const {
@@ -497,7 +1180,7 @@ namespace SeqLib {
   }
 
   bool BamRecord::GetZTag(const std::string& tag, std::string& s) const {
-    uint8_t* p = bam_aux_get(b.get(),tag.c_str());
+    uint8_t* p = b.FindTag(tag.c_str());
     if (!p)
       return false;
 
@@ -670,43 +1353,116 @@ namespace SeqLib {
   }
 
 
-  Cigar::Cigar(const std::string& cig) {
+  size_t ParseCigarString(const char* cig, size_t len, uint32_t* out, size_t max_ops) {
 
-    //Cigar tc;
+    // SAM writes an unavailable CIGAR as "*"
+    if (len == 1 && cig[0] == '*')
+      return 0;
 
-    // get the ops (MIDSHPN)
-    std::vector<char> ops;
-    for (size_t i = 0; i < cig.length(); ++i)
-      if (!isdigit(cig.at(i))) {
-	ops.push_back(cig.at(i));
-      }
-    
-    std::size_t prev = 0, pos;
-    std::vector<std::string> lens;
-    while ((pos = cig.find_first_of("MIDSHPNX", prev)) != std::string::npos) {
-        if (pos > prev)
-	  lens.push_back(cig.substr(prev, pos-prev));
-        prev = pos+1;
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len) {
+
+      // length, then one op character
+      uint64_t l = 0;
+      const size_t start = i;
+      while (i < len && cig[i] >= '0' && cig[i] <= '9') {
+	l = l * 10 + (cig[i] - '0');
+	if (l > (0xFFFFFFFFU >> BAM_CIGAR_SHIFT))
+	  throw std::invalid_argument("Cigar op length too long in " + std::string(cig, len));
+	++i;
       }
-    if (prev < cig.length())
-      lens.push_back(cig.substr(prev, std::string::npos));
+      if (i == start || i == len)
+	throw std::invalid_argument("Malformed CIGAR string " + std::string(cig, len));
 
-    assert(ops.size() == lens.size());
-    for (size_t i = 0; i < lens.size(); ++i) {
-      add(CigarField(ops[i], std::atoi(lens[i].c_str())));
+      const unsigned char c = cig[i++];
+      const int op = c < 128 ? CigarCharToInt[c] : -1;
+      if (op < 0)
+	throw std::invalid_argument("Cigar type must be one of MIDSHPN=X");
+
+      if (n < max_ops)
+	out[n] = ((uint32_t)l << BAM_CIGAR_SHIFT) | (uint32_t)op;
+      ++n;
     }
-    
-    //return tc;
+    return n;
+  }
+
+  Cigar::Cigar(const std::string& cig) : m_data(m_inline), m_size(0), m_capacity(INLINE_OPS) {
+
+    // parse straight into the inline buffer, and only go to the heap if it is too small
+    size_t n = ParseCigarString(cig.c_str(), cig.length(), (uint32_t*)m_inline, INLINE_OPS);
+    if (n > INLINE_OPS) {
+      reserve(n);
+      ParseCigarString(cig.c_str(), cig.length(), (uint32_t*)m_data, n);
+    }
+    m_size = n;
+  }
+
+  Cigar::Cigar(const uint32_t* c, size_t n) : m_data(m_inline), m_size(0), m_capacity(INLINE_OPS) {
+    assign(c, n);
+  }
+
+  Cigar::Cigar(const Cigar& c) : m_data(m_inline), m_size(0), m_capacity(INLINE_OPS) {
+    assign((const uint32_t*)c.m_data, c.m_size);
+  }
+
+  Cigar& Cigar::operator=(const Cigar& c) {
+    if (this != &c)
+      assign((const uint32_t*)c.m_data, c.m_size);
+    return *this;
+  }
+
+#ifdef HAVE_C11
+  Cigar::Cigar(Cigar&& c) noexcept : m_data(m_inline), m_size(0), m_capacity(INLINE_OPS) {
+    *this = std::move(c);
+  }
+
+  Cigar& Cigar::operator=(Cigar&& c) noexcept {
+    if (this == &c)
+      return *this;
+    if (c.m_data == c.m_inline) {
+      // inline ops have to be copied
+      std::copy(c.m_inline, c.m_inline + c.m_size, m_data);
+      m_size = c.m_size;
+    } else {
+      // steal the heap buffer
+      if (m_data != m_inline)
+	delete[] m_data;
+      m_data = c.m_data;
+      m_size = c.m_size;
+      m_capacity = c.m_capacity;
+      c.m_data = c.m_inline;
+      c.m_capacity = INLINE_OPS;
+    }
+    c.m_size = 0;
+    return *this;
+  }
+#endif
+
+  void Cigar::reserve(size_t n) {
+    if (n <= m_capacity)
+      return;
+    CigarField* d = new CigarField[n];
+    std::copy(m_data, m_data + m_size, d);
+    if (m_data != m_inline)
+      delete[] m_data;
+    m_data = d;
+    m_capacity = n;
+  }
 
+  void Cigar::assign(const uint32_t* c, size_t n) {
+    m_size = 0;
+    reserve(n);
+    for (size_t i = 0; i < n; ++i)
+      m_data[i].data = c[i];
+    m_size = n;
   }
 
   bool Cigar::operator==(const Cigar& c) const { 
-     if (m_data.size() != c.size())
+     if (m_size != c.size())
        return false;
-     if (!m_data.size()) // both empty
-       return true;
-     for (size_t i = 0; i < m_data.size(); ++i)
-       if (m_data[i].Type() != c[i].Type() || m_data[i].Length() != c[i].Length())
+     for (size_t i = 0; i < m_size; ++i)
+       if (m_data[i].raw() != c[i].raw())
 	 return false;
      return true;
   }
@@ -718,7 +1474,7 @@ namespace SeqLib {
     uint32_t* c2 = bam_get_cigar(r.b);
     
     //uint8_t * cov1 = (uint8_t*)calloc(l > 0 ? l : b->core.l_qseq, sizeof(uint8_t));
-    uint8_t * cov1 = (uint8_t*)calloc(GetCigar().NumQueryConsumed(), sizeof(uint8_t));
+    uint8_t * cov1 = (uint8_t*)calloc(GetCigarView().NumQueryConsumed(), sizeof(uint8_t));
     size_t pos = 0;
     for (int k = 0; k < b->core.n_cigar; ++k) {
       if (bam_cigar_opchr(c[k]) == 'M')  // is match, so track locale
@@ -745,4 +1501,120 @@ namespace SeqLib {
   }
 
   
+  static inline uint16_t tag_key(const std::string& tag) {
+    return (uint16_t)(((uint8_t)tag[0] << 8) | (uint8_t)tag[1]);
+  }
+
+  void BamTagEditor::add(const std::string& tag, char type, const uint8_t* data, size_t len) {
+    if (tag.length() != 2)
+      throw std::invalid_argument("BamTagEditor: tag must be two characters: " + tag);
+    m_add_keys.push_back(tag_key(tag));
+    m_add_offsets.push_back(m_add.size());
+    m_add.push_back(tag[0]);
+    m_add.push_back(tag[1]);
+    m_add.push_back(type);
+    m_add.insert(m_add.end(), data, data + len);
+  }
+
+  void BamTagEditor::AddIntTag(const std::string& tag, int32_t val) {
+    add(tag, 'i', (const uint8_t*)&val, 4);
+  }
+
+  void BamTagEditor::AddFloatTag(const std::string& tag, float val) {
+    add(tag, 'f', (const uint8_t*)&val, 4);
+  }
+
+  void BamTagEditor::AddZTag(const std::string& tag, const std::string& val) {
+    if (val.empty())
+      return;
+    add(tag, 'Z', (const uint8_t*)val.c_str(), val.length() + 1);
+  }
+
+  void BamTagEditor::RemoveTag(const std::string& tag) {
+    if (tag.length() != 2)
+      throw std::invalid_argument("BamTagEditor: tag must be two characters: " + tag);
+    const uint16_t key = tag_key(tag);
+    m_remove_keys.push_back(key);
+
+    // the remove comes later, so it wins over any pending add of the tag
+    for (size_t i = m_add_keys.size(); i-- > 0; ) {
+      if (m_add_keys[i] != key)
+	continue;
+      const size_t len = (i + 1 < m_add_offsets.size() ? m_add_offsets[i+1] : m_add.size()) - m_add_offsets[i];
+      m_add.erase(m_add.begin() + m_add_offsets[i], m_add.begin() + m_add_offsets[i] + len);
+      for (size_t j = i + 1; j < m_add_offsets.size(); ++j)
+	m_add_offsets[j] -= len;
+      m_add_keys.erase(m_add_keys.begin() + i);
+      m_add_offsets.erase(m_add_offsets.begin() + i);
+    }
+  }
+
+  void BamTagEditor::clear() {
+    m_add.clear();
+    m_add_keys.clear();
+    m_add_offsets.clear();
+    m_remove_keys.clear();
+    m_remove_all = false;
+  }
+
+  void BamTagEditor::Apply(BamRecord& r) const {
+
+    if (empty())
+      return;
+
+    r.b.OwnData();
+    bam1_t* b = r.raw();
+    uint8_t* aux = bam_get_aux(b);
+    uint8_t* end = b->data + b->l_data;
+
+    // compact the kept tags in place, dropping removed and replaced ones
+    uint8_t* w = aux;
+    if (!m_remove_all) {
+      uint8_t* s = aux;
+      while (s + 3 <= end) {
+	int sz = aux_value_size(s + 2, end);
+	if (sz < 0) // malformed, keep the rest as is
+	  sz = end - s - 3;
+	const size_t flen = 3 + sz;
+	const uint16_t key = (uint16_t)((s[0] << 8) | s[1]);
+	const bool drop = std::find(m_remove_keys.begin(), m_remove_keys.end(), key) != m_remove_keys.end() ||
+	  std::find(m_add_keys.begin(), m_add_keys.end(), key) != m_add_keys.end();
+	if (!drop) {
+	  if (w != s)
+	    memmove(w, s, flen);
+	  w += flen;
+	}
+	s += flen;
+      }
+    }
+    
+    // size of the new tags, skipping any that are added again later
+    size_t add_len = 0;
+    for (size_t i = 0; i < m_add_keys.size(); ++i) 
+      if (std::find(m_add_keys.begin() + i + 1, m_add_keys.end(), m_add_keys[i]) == m_add_keys.end())
+	add_len += (i + 1 < m_add_offsets.size() ? m_add_offsets[i+1] : m_add.size()) - m_add_offsets[i];
+
+    // grow the record data at most once
+    size_t new_len = (w - b->data) + add_len;
+    if (new_len > (size_t)b->m_data) {
+      size_t kept = w - b->data;
+      uint32_t m = new_len;
+      kroundup32(m);
+      b->data = (uint8_t*)realloc(b->data, m);
+      b->m_data = m;
+      w = b->data + kept;
+    }
+
+    for (size_t i = 0; i < m_add_keys.size(); ++i) {
+      if (std::find(m_add_keys.begin() + i + 1, m_add_keys.end(), m_add_keys[i]) != m_add_keys.end())
+	continue;
+      size_t len = (i + 1 < m_add_offsets.size() ? m_add_offsets[i+1] : m_add.size()) - m_add_offsets[i];
+      memcpy(w, &m_add[m_add_offsets[i]], len);
+      w += len;
+    }
+
+    b->l_data = new_len;
+    r.RebuildTagIndex();
+  }
+
 }
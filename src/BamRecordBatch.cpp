@@ -0,0 +1,316 @@
+#include "SeqLib/BamRecordBatch.h"
+#include "SeqLib/BamRecordStore.h"
+
+#include <stdexcept>
+#include <fstream>
+
+namespace SeqLib {
+
+  BamRecordBatch::BamRecordBatch(int columns) : m_columns(columns) {
+    clear();
+  }
+
+  void BamRecordBatch::clear() {
+    m_tid.clear();
+    m_pos.clear();
+    m_end.clear();
+    m_mtid.clear();
+    m_mpos.clear();
+    m_isize.clear();
+    m_flag.clear();
+    m_mapq.clear();
+    m_sclip.clear();
+    m_hclip.clear();
+    m_ncigar.clear();
+    m_seq.clear();
+    m_qual.clear();
+    m_seq_offsets.assign(1, 0);
+    m_qual_offsets.assign(1, 0);
+  }
+
+  void BamRecordBatch::reserve(size_t n) {
+    m_tid.reserve(n);
+    m_pos.reserve(n);
+    m_end.reserve(n);
+    m_mtid.reserve(n);
+    m_mpos.reserve(n);
+    m_isize.reserve(n);
+    m_flag.reserve(n);
+    m_mapq.reserve(n);
+    m_sclip.reserve(n);
+    m_hclip.reserve(n);
+    m_ncigar.reserve(n);
+    if (m_columns & BATCH_SEQ)
+      m_seq_offsets.reserve(n + 1);
+    if (m_columns & BATCH_QUAL)
+      m_qual_offsets.reserve(n + 1);
+  }
+
+  void BamRecordBatch::Add(const BamRecord& r) {
+    if (r.isEmpty())
+      throw std::invalid_argument("BamRecordBatch::Add - cannot add an empty BamRecord");
+    // use the record's cached summary if it has one
+    add(r.raw(), r.GetCigarSummary());
+  }
+
+  void BamRecordBatch::Add(const bam1_t* b) {
+    add(b, CigarSummary(bam_get_cigar(b), b->core.n_cigar));
+  }
+
+  void BamRecordBatch::Add(const BamRecordVector& brv) {
+    reserve(size() + brv.size());
+    for (BamRecordVector::const_iterator i = brv.begin(); i != brv.end(); ++i)
+      Add(*i);
+  }
+
+  void BamRecordBatch::Add(const BamRecordStore& store) {
+    reserve(size() + store.size());
+    bam1_t b;
+    for (size_t i = 0; i < store.size(); ++i) {
+      store.Fill(i, b);
+      Add(&b);
+    }
+  }
+
+  void BamRecordBatch::add(const bam1_t* b, const CigarSummary& cs) {
+
+    const bam1_core_t& c = b->core;
+
+    // same rules as BamRecord::PositionEnd
+    int32_t end;
+    if (c.l_qseq > 0)
+      end = (!(c.flag & BAM_FUNMAP) && c.n_cigar) ? c.pos + cs.reference_consumed : c.pos + 1;
+    else
+      end = c.pos + cs.query_consumed;
+
+    m_tid.push_back(c.tid);
+    m_pos.push_back(c.pos);
+    m_end.push_back(end);
+    m_mtid.push_back(c.mtid);
+    m_mpos.push_back(c.mpos);
+    m_isize.push_back(c.isize);
+    m_flag.push_back(c.flag);
+    m_mapq.push_back(c.qual);
+    m_sclip.push_back(cs.num_soft_clip);
+    m_hclip.push_back(cs.num_hard_clip);
+    m_ncigar.push_back(c.n_cigar);
+
+    if (m_columns & BATCH_SEQ) {
+      const size_t o = m_seq.size();
+      m_seq.resize(o + c.l_qseq);
+      if (c.l_qseq)
+	DecodeBamSequence(bam_get_seq(b), c.l_qseq, &m_seq[o]);
+      m_seq_offsets.push_back(m_seq.size());
+    }
+
+    if (m_columns & BATCH_QUAL) {
+      const uint8_t* q = bam_get_qual(b);
+      m_qual.insert(m_qual.end(), (const char*)q, (const char*)q + c.l_qseq);
+      m_qual_offsets.push_back(m_qual.size());
+    }
+  }
+
+  BatchSpan BamRecordBatch::Sequence(size_t i) const {
+    if (!(m_columns & BATCH_SEQ))
+      throw std::logic_error("BamRecordBatch::Sequence - batch was not created with BATCH_SEQ");
+    if (i >= size())
+      throw std::out_of_range("BamRecordBatch::Sequence - index out of range");
+    const size_t len = m_seq_offsets[i+1] - m_seq_offsets[i];
+    return BatchSpan(len ? &m_seq[m_seq_offsets[i]] : NULL, len);
+  }
+
+  BatchSpan BamRecordBatch::Qualities(size_t i) const {
+    if (!(m_columns & BATCH_QUAL))
+      throw std::logic_error("BamRecordBatch::Qualities - batch was not created with BATCH_QUAL");
+    if (i >= size())
+      throw std::out_of_range("BamRecordBatch::Qualities - index out of range");
+    const size_t len = m_qual_offsets[i+1] - m_qual_offsets[i];
+    return BatchSpan(len ? &m_qual[m_qual_offsets[i]] : NULL, len);
+  }
+
+  void BamRecordBatch::init_mask(BatchMask& m) const {
+    if (m.empty())
+      m.assign(size(), 1);
+    else if (m.size() != size())
+      throw std::invalid_argument("BamRecordBatch - mask size does not match batch size");
+  }
+
+  // The predicate and reduction loops below are written without branches
+  // on the row data, so that the compiler can vectorize them.
+
+  void BamRecordBatch::SelectFlag(uint16_t require, uint16_t exclude, BatchMask& m) const {
+    init_mask(m);
+    const size_t n = size();
+    const uint16_t* f = n ? &m_flag[0] : NULL;
+    uint8_t* s = n ? &m[0] : NULL;
+    for (size_t i = 0; i < n; ++i)
+      s[i] &= (uint8_t)(((f[i] & require) == require) & ((f[i] & exclude) == 0));
+  }
+
+  void BamRecordBatch::SelectMapQuality(int min, int max, BatchMask& m) const {
+    init_mask(m);
+    const size_t n = size();
+    const uint8_t* q = n ? &m_mapq[0] : NULL;
+    uint8_t* s = n ? &m[0] : NULL;
+    for (size_t i = 0; i < n; ++i)
+      s[i] &= (uint8_t)((q[i] >= min) & (q[i] <= max));
+  }
+
+  void BamRecordBatch::SelectInsertSize(int32_t min, int32_t max, BatchMask& m) const {
+    init_mask(m);
+    const size_t n = size();
+    const int32_t* z = n ? &m_isize[0] : NULL;
+    uint8_t* s = n ? &m[0] : NULL;
+    for (size_t i = 0; i < n; ++i) {
+      const int32_t a = z[i] < 0 ? -z[i] : z[i];
+      s[i] &= (uint8_t)((a >= min) & (a <= max));
+    }
+  }
+
+  void BamRecordBatch::SelectRegion(const GenomicRegion& gr, BatchMask& m) const {
+    init_mask(m);
+    const size_t n = size();
+    const int32_t* t = n ? &m_tid[0] : NULL;
+    const int32_t* p = n ? &m_pos[0] : NULL;
+    const int32_t* e = n ? &m_end[0] : NULL;
+    uint8_t* s = n ? &m[0] : NULL;
+    for (size_t i = 0; i < n; ++i)
+      s[i] &= (uint8_t)((t[i] == gr.chr) & (p[i] <= gr.pos2) & (e[i] >= gr.pos1));
+  }
+
+  size_t BamRecordBatch::CountSelected(const BatchMask& m) const {
+    if (m.empty())
+      return size();
+    size_t c = 0;
+    for (size_t i = 0; i < m.size(); ++i)
+      c += m[i];
+    return c;
+  }
+
+  size_t BamRecordBatch::CountFlag(uint16_t f, const BatchMask& m) const {
+    const size_t n = size();
+    size_t c = 0;
+    if (m.empty()) {
+      for (size_t i = 0; i < n; ++i)
+	c += (m_flag[i] & f) == f;
+    } else {
+      if (m.size() != n)
+	throw std::invalid_argument("BamRecordBatch::CountFlag - mask size does not match batch size");
+      for (size_t i = 0; i < n; ++i)
+	c += m[i] & ((m_flag[i] & f) == f);
+    }
+    return c;
+  }
+
+  double BamRecordBatch::MeanMapQuality(const BatchMask& m) const {
+    const size_t n = size();
+    uint64_t sum = 0;
+    size_t c = 0;
+    if (m.empty()) {
+      for (size_t i = 0; i < n; ++i)
+	sum += m_mapq[i];
+      c = n;
+    } else {
+      if (m.size() != n)
+	throw std::invalid_argument("BamRecordBatch::MeanMapQuality - mask size does not match batch size");
+      for (size_t i = 0; i < n; ++i) {
+	sum += m[i] * m_mapq[i];
+	c += m[i];
+      }
+    }
+    return c ? (double)sum / c : 0;
+  }
+
+  uint64_t BamRecordBatch::TotalAlignedSpan(const BatchMask& m) const {
+    const size_t n = size();
+    if (!m.empty() && m.size() != n)
+      throw std::invalid_argument("BamRecordBatch::TotalAlignedSpan - mask size does not match batch size");
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const uint64_t keep = (m.empty() || m[i]) && !(m_flag[i] & BAM_FUNMAP);
+      sum += keep * (uint64_t)(m_end[i] - m_pos[i]);
+    }
+    return sum;
+  }
+
+  void BamRecordBatch::MapQualityHistogram(std::vector<size_t>& hist, const BatchMask& m) const {
+    const size_t n = size();
+    hist.assign(256, 0);
+    if (m.empty()) {
+      for (size_t i = 0; i < n; ++i)
+	++hist[m_mapq[i]];
+    } else {
+      if (m.size() != n)
+	throw std::invalid_argument("BamRecordBatch::MapQualityHistogram - mask size does not match batch size");
+      for (size_t i = 0; i < n; ++i)
+	hist[m_mapq[i]] += m[i];
+    }
+  }
+
+  // write one column of the columnar file, padded to 8 bytes
+  template <class T>
+  static void write_column(std::ofstream& out, const std::string& name, const std::string& kind,
+			   const std::vector<T>& v) {
+
+    // numpy dtype string, eg "<i4"
+    const uint16_t one = 1;
+    std::string dtype(1, sizeof(T) == 1 ? '|' : (*(const uint8_t*)&one ? '<' : '>'));
+    dtype += kind + tostring(sizeof(T));
+
+    const uint32_t nl = name.length();
+    const uint32_t dl = dtype.length();
+    const uint64_t bytes = v.size() * sizeof(T);
+    out.write((const char*)&nl, sizeof(nl));
+    out.write(name.c_str(), nl);
+    out.write((const char*)&dl, sizeof(dl));
+    out.write(dtype.c_str(), dl);
+    out.write((const char*)&bytes, sizeof(bytes));
+    if (bytes)
+      out.write((const char*)&v[0], bytes);
+    static const char pad[8] = {0,0,0,0,0,0,0,0};
+    out.write(pad, (8 - bytes % 8) % 8);
+  }
+
+  bool BamRecordBatch::WriteColumns(const std::string& file) const {
+
+    std::ofstream out(file.c_str(), std::ios::out | std::ios::binary);
+    if (!out)
+      return false;
+
+    const uint32_t version = 1;
+    const uint64_t nrows = size();
+    uint32_t ncols = 11;
+    if (m_columns & BATCH_SEQ)
+      ncols += 2;
+    if (m_columns & BATCH_QUAL)
+      ncols += 2;
+
+    out.write("SLCB", 4);
+    out.write((const char*)&version, sizeof(version));
+    out.write((const char*)&nrows, sizeof(nrows));
+    out.write((const char*)&ncols, sizeof(ncols));
+
+    write_column(out, "tid", "i", m_tid);
+    write_column(out, "pos", "i", m_pos);
+    write_column(out, "end", "i", m_end);
+    write_column(out, "mtid", "i", m_mtid);
+    write_column(out, "mpos", "i", m_mpos);
+    write_column(out, "isize", "i", m_isize);
+    write_column(out, "flag", "u", m_flag);
+    write_column(out, "mapq", "u", m_mapq);
+    write_column(out, "soft_clip", "i", m_sclip);
+    write_column(out, "hard_clip", "i", m_hclip);
+    write_column(out, "n_cigar", "u", m_ncigar);
+    if (m_columns & BATCH_SEQ) {
+      write_column(out, "seq", "u", m_seq);
+      write_column(out, "seq_offsets", "u", m_seq_offsets);
+    }
+    if (m_columns & BATCH_QUAL) {
+      write_column(out, "qual", "u", m_qual);
+      write_column(out, "qual_offsets", "u", m_qual_offsets);
+    }
+
+    return out.good();
+  }
+
+}
@@ -0,0 +1,115 @@
+#include "SeqLib/BamRecordStore.h"
+
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// keep each record header 8-byte aligned in the arena
+#define STORE_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+namespace SeqLib {
+
+  BamRecordStore::BamRecordStore(size_t chunk_size)
+    : m_chunk_size(chunk_size), m_chunk_used(0), m_arena_bytes(0) {
+    if (m_chunk_size < sizeof(RecordHeader))
+      m_chunk_size = DEFAULT_CHUNK_SIZE;
+  }
+
+  BamRecordStore::~BamRecordStore() {
+    clear();
+  }
+
+  void BamRecordStore::clear() {
+    for (std::vector<uint8_t*>::iterator i = m_chunks.begin(); i != m_chunks.end(); ++i)
+      free(*i);
+    m_chunks.clear();
+    m_offsets.clear();
+    m_chunk_used = 0;
+    m_arena_bytes = 0;
+  }
+
+  size_t BamRecordStore::Add(const BamRecord& r) {
+    if (r.isEmpty())
+      throw std::invalid_argument("BamRecordStore::Add - cannot add an empty BamRecord");
+    return Add(r.raw());
+  }
+
+  size_t BamRecordStore::Add(const bam1_t* b) {
+
+    const size_t need = STORE_ALIGN(sizeof(RecordHeader) + b->l_data);
+
+    // start a new chunk if this one is full. Oversized records get their own
+    if (m_chunks.empty() || m_chunk_used + need > m_chunk_size) {
+      const size_t sz = std::max(need, m_chunk_size);
+      uint8_t* c = (uint8_t*)malloc(sz);
+      if (!c)
+	throw std::bad_alloc();
+      m_chunks.push_back(c);
+      m_chunk_used = 0;
+      m_arena_bytes += sz;
+    }
+
+    uint8_t* dest = m_chunks.back() + m_chunk_used;
+    RecordHeader* h = (RecordHeader*)dest;
+    h->core = b->core;
+    h->l_data = b->l_data;
+    memcpy(dest + sizeof(RecordHeader), b->data, b->l_data);
+
+    m_offsets.push_back(((uint64_t)(m_chunks.size() - 1) << 40) | (uint64_t)m_chunk_used);
+    m_chunk_used += need;
+    return m_offsets.size() - 1;
+  }
+
+  size_t BamRecordStore::MemoryUsage() const {
+    return m_arena_bytes + m_offsets.capacity() * sizeof(uint64_t) + m_chunks.capacity() * sizeof(uint8_t*);
+  }
+
+  void BamRecordStore::Fill(size_t i, bam1_t& b) const {
+    const RecordHeader* h = header(i);
+    b.core = h->core;
+    b.l_data = h->l_data;
+    b.m_data = h->l_data;
+    b.data = (uint8_t*)h + sizeof(RecordHeader);
+  }
+
+  BamRecord BamRecordStore::View(size_t i) const {
+    if (i >= m_offsets.size())
+      throw std::out_of_range("BamRecordStore::View - index out of range");
+    const RecordHeader* h = header(i);
+    BamRecord r;
+    r.b = BamPointer::Borrow(h->core, (uint8_t*)h + sizeof(RecordHeader), h->l_data);
+    return r;
+  }
+
+  BamRecord BamRecordStore::Copy(size_t i) const {
+    return View(i).Clone();
+  }
+
+  // tid (unmapped = -1 sorts last) in the top 32 bits, pos in the lower
+  struct CoordinateKey {
+    uint64_t operator()(const bam1_t* b) const {
+      return ((uint64_t)(uint32_t)b->core.tid << 32) | (uint32_t)(b->core.pos + 1);
+    }
+  };
+
+  void BamRecordStore::CoordinateSortPermutation(std::vector<size_t>& perm) const {
+    SortPermutation(CoordinateKey(), perm);
+  }
+
+  void BamRecordStore::Permute(const std::vector<size_t>& perm) {
+    if (perm.size() != m_offsets.size())
+      throw std::invalid_argument("BamRecordStore::Permute - permutation size does not match store size");
+    std::vector<uint64_t> tmp(m_offsets.size());
+    for (size_t i = 0; i < perm.size(); ++i)
+      tmp[i] = m_offsets.at(perm[i]);
+    m_offsets.swap(tmp);
+  }
+
+  void BamRecordStore::CoordinateSort() {
+    std::vector<size_t> perm;
+    CoordinateSortPermutation(perm);
+    Permute(perm);
+  }
+
+}
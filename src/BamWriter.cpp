@@ -3,12 +3,17 @@
 
 #include <stdexcept>
 
+extern "C" {
+#include "htslib/htslib/hfile.h"
+}
+
 //#define DEBUG_WALKER 1
 
 namespace SeqLib {
 
   void BamWriter::SetHeader(const SeqLib::BamHeader& h) {
     hdr = h;
+    m_sam.SetHeader(h);
   }
 
   bool BamWriter::WriteHeader() const {
@@ -38,6 +43,7 @@ namespace SeqLib {
       return false;
 
     fop.reset(); //tr1 compatible
+    m_fast_sam = false;
     //fop = NULL; // this clears shared_ptr, calls sam_close (c++11)
 
     return true;
@@ -85,10 +91,13 @@ bool BamWriter::BuildIndex() const {
       //throw std::runtime_error("BamWriter::Open - Cannot open output file: " + f);
     }
 
+    // uncompressed SAM goes through our own formatter
+    m_fast_sam = !fop->is_bin && !fop->is_cram && fop->format.compression == no_compression;
+
     return true;
   }
 
-  BamWriter::BamWriter(int o) {
+  BamWriter::BamWriter(int o) : m_fast_sam(false) {
 
     switch(o) {
     case BAM :  output_format = "wb"; break;
@@ -104,6 +113,12 @@ bool BamWriter::WriteRecord(const BamRecord &r)
 {
   if (!fop) {
     return false;
+  } else if (m_fast_sam && !pool.IsOpen()) { 
+    // a thread pool hands text output to htslib, so only format here without one
+    m_sam.clear();
+    m_sam.Append(r);
+    if (hwrite(fop->fp.hfile, m_sam.data(), m_sam.size()) != (ssize_t)m_sam.size())
+      return false;
   } else {
     if (sam_write1(fop.get(), hdr.get(), r.raw()) < 0)
       return false;
@@ -0,0 +1,186 @@
+#include "SeqLib/CompactRegionVector.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+namespace SeqLib {
+
+  CompactRegionVector::CompactRegionVector(const GRC& g) : m_sorted(true) {
+    reserve(g.size());
+    for (size_t i = 0; i < g.size(); ++i)
+      add(g[i]);
+  }
+
+  void CompactRegionVector::add(const GenomicRegion& gr) {
+
+    if (gr.pos2 < gr.pos1)
+      throw std::invalid_argument("CompactRegionVector::add - end pos must be >= start pos");
+
+    const uint64_t k = PackKey(gr.chr, gr.pos1);
+    const uint32_t l = (uint32_t)((int64_t)gr.pos2 - gr.pos1);
+    if (!m_keys.empty() && (k < m_keys.back() || (k == m_keys.back() && l < m_lens.back())))
+      m_sorted = false;
+
+    // strands are only kept once one is not '*'
+    if (!m_strand.empty() || gr.strand != '*') {
+      m_strand.resize(m_keys.size(), '*');
+      m_strand.push_back(gr.strand);
+    }
+
+    m_keys.push_back(k);
+    m_lens.push_back(l);
+  }
+
+  void CompactRegionVector::clear() {
+    m_keys.clear();
+    m_lens.clear();
+    m_strand.clear();
+    m_sorted = true;
+  }
+
+  void CompactRegionVector::reserve(size_t n) {
+    m_keys.reserve(n);
+    m_lens.reserve(n);
+  }
+
+  GenomicRegion CompactRegionVector::operator[](size_t i) const {
+    GenomicRegion gr;
+    gr.chr = (int32_t)((uint32_t)(m_keys[i] >> 32) ^ 0x80000000u);
+    gr.pos1 = (int32_t)((uint32_t)m_keys[i] ^ 0x80000000u);
+    gr.pos2 = (int32_t)((int64_t)gr.pos1 + m_lens[i]);
+    gr.strand = m_strand.empty() ? '*' : m_strand[i];
+    return gr;
+  }
+
+  bool CompactRegionVector::IsSorted() const {
+    return m_sorted;
+  }
+
+  // stable LSD radix sort on (key, len): first the length, then the key.
+  // Digits are 16 bits for large vectors and 8 bits for small ones, and
+  // passes where every region has the same digit (eg the high bits of chr)
+  // are skipped
+  void CompactRegionVector::Sort() {
+
+    if (m_sorted)
+      return;
+
+    const size_t n = m_keys.size();
+    const int bits = n >= 65536 ? 16 : 8;
+    const uint64_t digit = (1 << bits) - 1;
+    const bool strands = !m_strand.empty();
+    std::vector<uint64_t> kb(n);
+    std::vector<uint32_t> lb(n);
+    std::vector<char> sb(strands ? n : 0);
+    std::vector<size_t> cnt(1 << bits);
+
+    for (int p = 0; p < 96 / bits; ++p) {
+
+      const bool len = p < 32 / bits;
+      const int shift = (len ? p : p - 32 / bits) * bits;
+      std::fill(cnt.begin(), cnt.end(), 0);
+      if (len)
+	for (size_t i = 0; i < n; ++i)
+	  ++cnt[(m_lens[i] >> shift) & digit];
+      else
+	for (size_t i = 0; i < n; ++i)
+	  ++cnt[(m_keys[i] >> shift) & digit];
+
+      bool skip = false;
+      for (size_t d = 0; d < cnt.size(); ++d)
+	if (cnt[d]) {
+	  skip = cnt[d] == n;
+	  break;
+	}
+      if (skip)
+	continue;
+
+      size_t sum = 0;
+      for (size_t d = 0; d < cnt.size(); ++d) {
+	const size_t c = cnt[d];
+	cnt[d] = sum;
+	sum += c;
+      }
+
+      for (size_t i = 0; i < n; ++i) {
+	const size_t o = cnt[((len ? m_lens[i] : m_keys[i]) >> shift) & digit]++;
+	kb[o] = m_keys[i];
+	lb[o] = m_lens[i];
+	if (strands)
+	  sb[o] = m_strand[i];
+      }
+
+      m_keys.swap(kb);
+      m_lens.swap(lb);
+      if (strands)
+	m_strand.swap(sb);
+    }
+
+    m_sorted = true;
+  }
+
+  void CompactRegionVector::move(size_t i, size_t w) {
+    m_keys[w] = m_keys[i];
+    m_lens[w] = m_lens[i];
+    if (!m_strand.empty())
+      m_strand[w] = m_strand[i];
+  }
+
+  void CompactRegionVector::truncate(size_t n) {
+    m_keys.resize(n);
+    m_lens.resize(n);
+    if (!m_strand.empty())
+      m_strand.resize(n);
+  }
+
+  void CompactRegionVector::Dedup() {
+
+    if (m_keys.empty())
+      return;
+    Sort();
+
+    size_t w = 0;
+    for (size_t i = 1; i < m_keys.size(); ++i)
+      if (m_keys[i] != m_keys[w] || m_lens[i] != m_lens[w])
+	move(i, ++w);
+    truncate(w + 1);
+  }
+
+  void CompactRegionVector::MergeOverlappingIntervals() {
+
+    if (m_keys.empty())
+      return;
+    Sort();
+
+    // keys on one chromosome differ by pos1, so the region ends are key + len.
+    // A merged region ends at most at INT32_MAX, so its length still fits
+    size_t w = 0;
+    uint64_t end = m_keys[0] + m_lens[0];
+    for (size_t i = 1; i < m_keys.size(); ++i) {
+      if ((m_keys[i] >> 32) == (m_keys[w] >> 32) && end >= m_keys[i]) {
+	const uint64_t e = m_keys[i] + m_lens[i];
+	if (e > end) {
+	  end = e;
+	  m_lens[w] = (uint32_t)(end - m_keys[w]);
+	}
+      } else {
+	move(i, ++w);
+	end = m_keys[w] + m_lens[w];
+      }
+    }
+    truncate(w + 1);
+  }
+
+  GRC CompactRegionVector::AsGRC() const {
+    GRC out;
+    for (size_t i = 0; i < m_keys.size(); ++i)
+      out.add((*this)[i]);
+    return out;
+  }
+
+  size_t CompactRegionVector::MemoryBytes() const {
+    return sizeof(*this) + m_keys.capacity() * sizeof(uint64_t) +
+      m_lens.capacity() * sizeof(uint32_t) + m_strand.capacity();
+  }
+
+}
@@ -0,0 +1,453 @@
+#include "SeqLib/DuplicateMarker.h"
+
+#include <stdexcept>
+#include <sstream>
+
+namespace SeqLib {
+
+  // sortable genomic coordinate. pos is offset so that unclipped
+  // positions before the start of a chromosome stay in order
+  static inline uint64_t dup_coord(int32_t tid, int64_t pos) {
+    return ((uint64_t)(uint32_t)tid << 32) + (uint64_t)(pos + 2147483648LL);
+  }
+
+  // second id of a pair whose mate is not queued (decided from its first read)
+  static const uint64_t DUP_NO_MATE = (uint64_t)-1;
+
+  // rough bytes held by one queued record
+  static inline size_t dup_bytes(const BamRecord& r) {
+    return sizeof(bam1_t) + 64 + r.raw()->l_data;
+  }
+
+  DuplicateMarker::DuplicateMarker()
+    : m_window(1000), m_memory_limit((size_t)512 << 20), m_min_base_quality(15),
+      m_remove(false), m_first_id(0), m_bytes(0), m_last(0), m_unmapped(false) {}
+
+  void DuplicateMarker::SetWindow(int32_t w) {
+    if (w < 1)
+      throw std::invalid_argument("DuplicateMarker::SetWindow - window must be > 0");
+    m_window = w;
+  }
+
+  void DuplicateMarker::SetHeader(const BamHeader& h) {
+
+    m_rg_lib.clear();
+
+    // library names to indices. 0 is the unknown library
+    std::map<std::string, int> libs;
+
+    std::istringstream iss(h.AsString());
+    std::string line;
+    while (std::getline(iss, line)) {
+      if (line.compare(0, 3, "@RG") != 0)
+	continue;
+      std::string id, lb;
+      std::istringstream fields(line);
+      std::string f;
+      while (std::getline(fields, f, '\t')) {
+	if (f.compare(0, 3, "ID:") == 0)
+	  id = f.substr(3);
+	else if (f.compare(0, 3, "LB:") == 0)
+	  lb = f.substr(3);
+      }
+      if (id.empty() || lb.empty())
+	continue;
+      std::map<std::string, int>::iterator l = libs.find(lb);
+      if (l == libs.end())
+	l = libs.insert(std::pair<std::string, int>(lb, libs.size() + 1)).first;
+      m_rg_lib[id] = l->second;
+    }
+  }
+
+  int DuplicateMarker::library(const BamRecord& r) const {
+    if (m_rg_lib.empty())
+      return 0;
+    uint8_t* p = bam_aux_get(r.raw(), "RG");
+    if (!p || *p != 'Z')
+      return 0;
+    SeqHashMap<std::string, int>::const_iterator l = m_rg_lib.find(std::string((const char*)(p + 1)));
+    return l == m_rg_lib.end() ? 0 : l->second;
+  }
+
+  int64_t DuplicateMarker::score(const BamRecord& r) const {
+    const bam1_t* b = r.raw();
+    const uint8_t* q = bam_get_qual(b);
+    if (!b->core.l_qseq || q[0] == 0xff)
+      return 0;
+    int64_t s = 0;
+    for (int32_t i = 0; i < b->core.l_qseq; ++i)
+      if (q[i] >= m_min_base_quality)
+	s += q[i];
+    return s;
+  }
+
+  DuplicateMarker::EndKey DuplicateMarker::end_key(const BamRecord& r, int lib) const {
+    const CigarSummary& cs = r.GetCigarSummary();
+    EndKey k;
+    k.lib = lib;
+    k.tid = r.ChrID();
+    k.rev = r.ReverseFlag();
+    k.pos = k.rev ? r.PositionEnd() - 1 + cs.trailing_clip : r.Position() - cs.leading_clip;
+    return k;
+  }
+
+  DuplicateMarker::EndKey DuplicateMarker::mate_key(const BamRecord& r, int lib) const {
+    const bam1_core_t& c = r.raw()->core;
+    EndKey k;
+    k.lib = lib;
+    k.tid = c.mtid;
+    k.rev = (c.flag & BAM_FMREVERSE) != 0;
+
+    // without a usable mate CIGAR, take the mate to be unclipped and as long as this read
+    k.pos = k.rev ? c.mpos + c.l_qseq - 1 : c.mpos;
+    const uint8_t* mc = bam_aux_get(r.raw(), "MC");
+    if (!mc || *mc != 'Z')
+      return k;
+    Cigar cig;
+    try {
+      cig = Cigar(std::string((const char*)(mc + 1)));
+    } catch (const std::invalid_argument&) {
+      return k;
+    }
+    if (!cig.size())
+      return k;
+
+    int32_t lead = 0, trail = 0;
+    Cigar::const_iterator i = cig.begin();
+    for (; i != cig.end() && (i->Type() == 'S' || i->Type() == 'H'); ++i)
+      lead += i->Length();
+    for (Cigar::const_iterator j = cig.end(); j != i && ((j - 1)->Type() == 'S' || (j - 1)->Type() == 'H'); --j)
+      trail += (j - 1)->Length();
+    k.pos = k.rev ? c.mpos + cig.NumReferenceConsumed() - 1 + trail : c.mpos - lead;
+    return k;
+  }
+
+  DuplicateMarker::Group& DuplicateMarker::frag_group(const EndKey& k) {
+    std::map<EndKey, Group>::iterator g = m_frags.find(k);
+    if (g == m_frags.end()) {
+      g = m_frags.insert(std::pair<EndKey, Group>(k, Group())).first;
+      m_frag_close.insert(std::pair<uint64_t, EndKey>(dup_coord(k.tid, (int64_t)k.pos + m_window), k));
+    }
+    return g->second;
+  }
+
+  void DuplicateMarker::Add(const BamRecord& r) {
+
+    if (r.isEmpty())
+      throw std::invalid_argument("DuplicateMarker::Add - cannot add an empty BamRecord");
+
+    ++m_stats.reads;
+    const bam1_core_t& c = r.raw()->core;
+
+    // check the sort order, and finalize everything that is out of the window
+    if (c.tid >= 0) {
+      const uint64_t here = dup_coord(c.tid, c.pos);
+      if (m_unmapped || here < m_last) {
+	std::stringstream ss;
+	ss << "DuplicateMarker::Add - input is not coordinate sorted at read " << r.Qname();
+	throw std::runtime_error(ss.str());
+      }
+      m_last = here;
+      close_before(here);
+    } else if (!m_unmapped) {
+      m_unmapped = true;
+      close_before((uint64_t)-1);
+    }
+
+    Entry e;
+    e.rec = r;
+    e.decided = true;
+    e.waiting = false;
+    e.group = GROUP_NONE;
+    e.rec.SetDuplicateFlag(false);
+    m_queue.push_back(e);
+    m_bytes += dup_bytes(r);
+    const uint64_t id = m_first_id + m_queue.size() - 1;
+
+    // passed through as is
+    if (c.tid < 0 || (c.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)))
+      return;
+
+    Entry& me = m_queue.back();
+    me.decided = false;
+    const int lib = library(r);
+    const EndKey k = end_key(r, lib);
+    const int64_t s = score(r);
+
+    if ((c.flag & BAM_FPAIRED) && !(c.flag & BAM_FMUNMAP) && c.mtid >= 0) {
+
+      // fragments at either end of a pair are duplicates of it
+      frag_group(k).has_pair = true;
+
+      const std::string qn = r.Qname();
+      SeqHashMap<std::string, Mate>::iterator m = m_mates.find(qn);
+
+      SeqHashMap<std::string, Distant>::iterator d;
+
+      if (m != m_mates.end()) {
+	PairKey pk;
+	pk.a = m->second.end;
+	pk.b = k;
+	if (pk.b < pk.a)
+	  std::swap(pk.a, pk.b);
+	std::map<PairKey, Group>::iterator g = m_pairs.find(pk);
+	if (g == m_pairs.end()) {
+	  g = m_pairs.insert(std::pair<PairKey, Group>(pk, Group())).first;
+	  m_pair_close.insert(std::pair<uint64_t, PairKey>(dup_coord(pk.b.tid, (int64_t)pk.b.pos + m_window), pk));
+	}
+	g->second.ids.push_back(m->second.id);
+	g->second.ids.push_back(id);
+	g->second.scores.push_back(m->second.score + s);
+	Entry& first = entry(m->second.id);
+	first.waiting = false;
+	first.group = me.group = GROUP_PAIR;
+	first.key = me.key = pk;
+	m_mates.erase(m);
+	++m_stats.pairs;
+      } else if ((d = m_distant.find(qn)) != m_distant.end()) {
+	// the pair was decided from the first read, which may still be open
+	if (d->second.state == DISTANT_PENDING) {
+	  std::map<PairKey, Group>::iterator g = m_pairs.find(d->second.key);
+	  if (g != m_pairs.end())
+	    finalize_pair(g);
+	}
+	if (d->second.state == DISTANT_DUP)
+	  mark(id);
+	me.decided = true;
+	m_distant.erase(d);
+      } else if (m_dropped.erase(qn) || dup_coord(c.mtid, c.mpos) < dup_coord(c.tid, c.pos)) {
+	// the first read was given up on, or should have come first but was never seen
+	me.decided = true;
+	++m_stats.unmatched_mates;
+      } else if (c.mtid != c.tid || (int64_t)c.mpos - c.pos > m_window) {
+	// too far to wait for, so the pair is decided from this read
+	PairKey pk;
+	pk.a = k;
+	pk.b = mate_key(r, lib);
+	if (pk.b < pk.a)
+	  std::swap(pk.a, pk.b);
+	std::map<PairKey, Group>::iterator g = m_pairs.find(pk);
+	if (g == m_pairs.end()) {
+	  g = m_pairs.insert(std::pair<PairKey, Group>(pk, Group())).first;
+	  m_pair_close.insert(std::pair<uint64_t, PairKey>(dup_coord(k.tid, (int64_t)k.pos + m_window), pk));
+	}
+	const uint8_t* ms = bam_aux_get(r.raw(), "ms");
+	g->second.ids.push_back(id);
+	g->second.ids.push_back(DUP_NO_MATE);
+	g->second.scores.push_back(s + (ms ? bam_aux2i(ms) : s));
+	me.group = GROUP_PAIR;
+	me.key = pk;
+	Distant dt;
+	dt.key = pk;
+	dt.state = DISTANT_PENDING;
+	m_distant[qn] = dt;
+	++m_stats.pairs;
+	++m_stats.distant_mates;
+      } else {
+	Mate mt;
+	mt.id = id;
+	mt.end = k;
+	mt.score = s;
+	m_mates[qn] = mt;
+	me.waiting = true;
+      }
+
+    } else {
+      Group& g = frag_group(k);
+      g.ids.push_back(id);
+      g.scores.push_back(s);
+      me.group = GROUP_FRAG;
+      me.key.a = k;
+      ++m_stats.fragments;
+    }
+
+    // hold to the memory limit by deciding the oldest reads early
+    while (m_bytes > m_memory_limit && !m_queue.front().decided)
+      force_front();
+  }
+
+  void DuplicateMarker::force_front() {
+
+    ++m_stats.forced;
+    Entry& f = m_queue.front();
+
+    // still waiting for its mate, give up on it
+    if (f.waiting) {
+      const std::string qn = f.rec.Qname();
+      m_mates.erase(qn);
+      m_dropped.insert(qn);
+      f.waiting = false;
+      f.decided = true;
+      ++m_stats.dropped_mates;
+      return;
+    }
+
+    // otherwise close the group it is in. Its entry in the close map is
+    // left behind, and finds nothing (or a later group with the same key,
+    // which closes at the same coordinate anyway)
+    if (f.group == GROUP_FRAG) {
+      std::map<EndKey, Group>::iterator g = m_frags.find(f.key.a);
+      if (g != m_frags.end())
+	finalize_frag(g);
+    } else if (f.group == GROUP_PAIR) {
+      std::map<PairKey, Group>::iterator g = m_pairs.find(f.key);
+      if (g != m_pairs.end())
+	finalize_pair(g);
+    }
+    f.decided = true;
+  }
+
+  void DuplicateMarker::close_before(uint64_t coord) {
+
+    while (!m_frag_close.empty() && m_frag_close.begin()->first < coord) {
+      const EndKey k = m_frag_close.begin()->second;
+      m_frag_close.erase(m_frag_close.begin());
+      std::map<EndKey, Group>::iterator g = m_frags.find(k);
+      if (g != m_frags.end())
+	finalize_frag(g);
+    }
+
+    while (!m_pair_close.empty() && m_pair_close.begin()->first < coord) {
+      const PairKey k = m_pair_close.begin()->second;
+      m_pair_close.erase(m_pair_close.begin());
+      std::map<PairKey, Group>::iterator g = m_pairs.find(k);
+      if (g != m_pairs.end())
+	finalize_pair(g);
+    }
+  }
+
+  void DuplicateMarker::mark(uint64_t id) {
+    entry(id).rec.SetDuplicateFlag(true);
+  }
+
+  void DuplicateMarker::finalize_frag(std::map<EndKey, Group>::iterator g) {
+
+    const Group& gr = g->second;
+
+    // keep the highest scoring read, unless a pair covers this position
+    size_t best = 0;
+    for (size_t i = 1; i < gr.scores.size(); ++i)
+      if (gr.scores[i] > gr.scores[best])
+	best = i;
+
+    for (size_t i = 0; i < gr.ids.size(); ++i) {
+      entry(gr.ids[i]).decided = true;
+      if (gr.has_pair || i != best) {
+	mark(gr.ids[i]);
+	++m_stats.duplicate_fragments;
+      }
+    }
+
+    m_frags.erase(g);
+  }
+
+  void DuplicateMarker::finalize_pair(std::map<PairKey, Group>::iterator g) {
+
+    const Group& gr = g->second;
+
+    size_t best = 0;
+    for (size_t i = 1; i < gr.scores.size(); ++i)
+      if (gr.scores[i] > gr.scores[best])
+	best = i;
+
+    for (size_t i = 0; i < gr.scores.size(); ++i) {
+      Entry& first = entry(gr.ids[2*i]);
+      first.decided = true;
+      if (gr.ids[2*i+1] == DUP_NO_MATE)
+	m_distant[first.rec.Qname()].state = i != best ? DISTANT_DUP : DISTANT_KEPT;
+      else
+	entry(gr.ids[2*i+1]).decided = true;
+      if (i != best) {
+	mark(gr.ids[2*i]);
+	if (gr.ids[2*i+1] != DUP_NO_MATE)
+	  mark(gr.ids[2*i+1]);
+	++m_stats.duplicate_pairs;
+      }
+    }
+
+    m_pairs.erase(g);
+  }
+
+  void DuplicateMarker::Flush() {
+
+    close_before((uint64_t)-1);
+
+    // pairs that never found their mate
+    for (SeqHashMap<std::string, Mate>::iterator m = m_mates.begin(); m != m_mates.end(); ++m) {
+      Entry& e = entry(m->second.id);
+      e.waiting = false;
+      e.decided = true;
+      ++m_stats.unmatched_mates;
+    }
+    m_mates.clear();
+
+    // mates that never arrived
+    m_distant.clear();
+    m_dropped.clear();
+  }
+
+  bool DuplicateMarker::GetNextRecord(BamRecord& r) {
+    while (!m_queue.empty() && m_queue.front().decided) {
+      Entry& f = m_queue.front();
+      const bool drop = m_remove && f.rec.DuplicateFlag();
+      if (!drop)
+	r = f.rec;
+      m_bytes -= dup_bytes(f.rec);
+      m_queue.pop_front();
+      ++m_first_id;
+      if (!drop)
+	return true;
+    }
+    return false;
+  }
+
+  bool DuplicateMarker::Run(BamReader& in, BamWriter& out) {
+
+    SetHeader(in.Header());
+
+    BamRecord r, o;
+    while (in.GetNextRecord(r)) {
+      Add(r);
+      while (GetNextRecord(o))
+	if (!out.WriteRecord(o))
+	  return false;
+    }
+
+    Flush();
+    while (GetNextRecord(o))
+      if (!out.WriteRecord(o))
+	return false;
+
+    return true;
+  }
+
+  bool DuplicateMarker::Run(const std::string& in, const std::string& out, int threads) {
+
+    BamReader reader;
+    if (!reader.Open(in))
+      return false;
+
+    BamWriter writer(BAM);
+    writer.SetHeader(reader.Header());
+    if (!writer.Open(out))
+      return false;
+
+    // one pool shared by decompression and compression
+    ThreadPool pool;
+    if (threads > 1) {
+      pool = ThreadPool(threads);
+      reader.SetThreadPool(pool);
+      writer.SetThreadPool(pool);
+    }
+
+    bool ok = writer.WriteHeader() && Run(reader, writer);
+    ok = writer.Close() && ok;
+    reader.Close();
+
+    if (pool.IsOpen())
+      hts_tpool_destroy(pool.p.pool);
+
+    return ok;
+  }
+
+}
@@ -0,0 +1,276 @@
+#include "SeqLib/MappedRegionCollection.h"
+
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MRC_MAGIC "SLGRCIX"
+#define MRC_VERSION 1
+#define MRC_BYTE_ORDER 0x01020304
+
+namespace SeqLib {
+
+  // fixed-size file header. Sections follow in this order, each a
+  // multiple of 8 bytes: regions, chromosome table, index nodes
+  struct MRCHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_regions;
+    uint64_t num_chroms;
+    uint64_t num_nodes;
+    uint64_t regions_offset;
+    uint64_t chroms_offset;
+    uint64_t nodes_offset;
+  };
+
+  MappedRegionCollection::MappedRegionCollection()
+    : m_map(NULL), m_map_size(0), m_regions(NULL), m_chroms(NULL), m_nodes(NULL),
+      m_num_regions(0), m_num_chroms(0), m_num_nodes(0) {}
+
+  MappedRegionCollection::~MappedRegionCollection() {
+    Close();
+  }
+
+  bool MappedRegionCollection::Write(const GenomicRegionCollection<GenomicRegion>& grc, const std::string& file) {
+
+    const size_t n = grc.size();
+    if (n > 2147483647UL)
+      throw std::invalid_argument("MappedRegionCollection::Write - too many regions");
+
+    // one index per chromosome id, empty for ids with no regions
+    int32_t max_chr = -1;
+    for (size_t i = 0; i < n; ++i)
+      if (grc[i].chr > max_chr)
+	max_chr = grc[i].chr;
+
+    std::vector<GenomicIntervalIndex> idx(max_chr + 1);
+    {
+      std::vector<size_t> counts(max_chr + 1, 0);
+      for (size_t i = 0; i < n; ++i)
+	if (grc[i].chr >= 0)
+	  ++counts[grc[i].chr];
+      for (size_t c = 0; c < counts.size(); ++c)
+	idx[c].reserve(counts[c]);
+    }
+    for (size_t i = 0; i < n; ++i)
+      if (grc[i].chr >= 0)
+	idx[grc[i].chr].add(grc[i].pos1, grc[i].pos2, (int32_t)i);
+
+    MRCHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, MRC_MAGIC, sizeof(h.magic));
+    h.version = MRC_VERSION;
+    h.byte_order = MRC_BYTE_ORDER;
+    h.num_regions = n;
+    h.num_chroms = idx.size();
+
+    std::vector<Chrom> chroms(idx.size());
+    for (size_t c = 0; c < idx.size(); ++c) {
+      idx[c].index();
+      chroms[c].offset = h.num_nodes;
+      chroms[c].count = idx[c].size();
+      chroms[c].level = idx[c].maxLevel();
+      chroms[c].pad = 0;
+      h.num_nodes += idx[c].size();
+    }
+
+    h.regions_offset = sizeof(MRCHeader);
+    h.chroms_offset = h.regions_offset + n * sizeof(Region);
+    h.nodes_offset = h.chroms_offset + chroms.size() * sizeof(Chrom);
+
+    // write to a temporary and rename, so processes that have the old
+    // file mapped keep a consistent copy
+    const std::string tmp = file + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+      return false;
+
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+
+    std::vector<Region> buf;
+    buf.reserve(n < 65536 ? n : 65536);
+    for (size_t i = 0; ok && i < n; ) {
+      buf.clear();
+      for (; i < n && buf.size() < 65536; ++i) {
+	Region r;
+	r.chr = grc[i].chr;
+	r.pos1 = grc[i].pos1;
+	r.pos2 = grc[i].pos2;
+	r.strand = grc[i].strand;
+	r.pad[0] = r.pad[1] = r.pad[2] = 0;
+	buf.push_back(r);
+      }
+      ok = fwrite(&buf[0], sizeof(Region), buf.size(), fp) == buf.size();
+    }
+
+    if (ok && chroms.size())
+      ok = fwrite(&chroms[0], sizeof(Chrom), chroms.size(), fp) == chroms.size();
+
+    for (size_t c = 0; ok && c < idx.size(); ++c)
+      if (idx[c].size())
+	ok = fwrite(&idx[c].nodes()[0], sizeof(GenomicIntervalIndex::Node), idx[c].size(), fp) == idx[c].size();
+
+    ok = (fclose(fp) == 0) && ok;
+    if (ok)
+      ok = rename(tmp.c_str(), file.c_str()) == 0;
+    if (!ok)
+      remove(tmp.c_str());
+    return ok;
+  }
+
+  bool MappedRegionCollection::Open(const std::string& file) {
+
+    Close();
+
+    const int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+    }
+    const size_t size = st.st_size;
+
+    if (size < sizeof(MRCHeader)) {
+      close(fd);
+      throw std::runtime_error("MappedRegionCollection::Open - file is too short: " + file);
+    }
+
+    void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+
+    const MRCHeader* h = static_cast<const MRCHeader*>(p);
+    const char* err = NULL;
+    if (std::memcmp(h->magic, MRC_MAGIC, sizeof(h->magic)) != 0)
+      err = "not a SeqLib region file";
+    else if (h->byte_order != MRC_BYTE_ORDER)
+      err = "file was written with a different byte order";
+    else if (h->version != MRC_VERSION)
+      err = "unsupported file version";
+    else if (h->num_regions > size / sizeof(Region) || h->num_chroms > size / sizeof(Chrom) ||
+	     h->num_nodes > size / sizeof(GenomicIntervalIndex::Node))
+      err = "file is truncated or corrupt";
+    else if (h->regions_offset != sizeof(MRCHeader) ||
+	     h->chroms_offset != h->regions_offset + h->num_regions * sizeof(Region) ||
+	     h->nodes_offset != h->chroms_offset + h->num_chroms * sizeof(Chrom) ||
+	     h->nodes_offset + h->num_nodes * sizeof(GenomicIntervalIndex::Node) != size)
+      err = "file is truncated or corrupt";
+
+    // the chromosome table is small. Check it so a bad file cannot send
+    // a query outside the mapping
+    if (!err) {
+      const Chrom* c = reinterpret_cast<const Chrom*>(static_cast<const char*>(p) + h->chroms_offset);
+      for (uint64_t i = 0; i < h->num_chroms && !err; ++i) {
+	const bool level_ok = c[i].count == 0 ? c[i].level == -1 :
+	  (c[i].level >= 0 && c[i].level < 62 && ((uint64_t)1 << c[i].level) <= c[i].count &&
+	   c[i].count < ((uint64_t)1 << (c[i].level + 1)));
+	if (c[i].offset > h->num_nodes || c[i].count > h->num_nodes - c[i].offset || !level_ok)
+	  err = "file has a corrupt index";
+      }
+    }
+
+    if (err) {
+      munmap(p, size);
+      throw std::runtime_error("MappedRegionCollection::Open - " + std::string(err) + ": " + file);
+    }
+
+    m_map = p;
+    m_map_size = size;
+    m_num_regions = h->num_regions;
+    m_num_chroms = h->num_chroms;
+    m_num_nodes = h->num_nodes;
+    m_regions = reinterpret_cast<const Region*>(static_cast<const char*>(p) + h->regions_offset);
+    m_chroms = reinterpret_cast<const Chrom*>(static_cast<const char*>(p) + h->chroms_offset);
+    m_nodes = reinterpret_cast<const GenomicIntervalIndex::Node*>(static_cast<const char*>(p) + h->nodes_offset);
+
+    return true;
+  }
+
+  void MappedRegionCollection::Close() {
+    if (m_map)
+      munmap(m_map, m_map_size);
+    m_map = NULL;
+    m_map_size = 0;
+    m_regions = NULL;
+    m_chroms = NULL;
+    m_nodes = NULL;
+    m_num_regions = 0;
+    m_num_chroms = 0;
+    m_num_nodes = 0;
+  }
+
+  bool MappedRegionCollection::Verify() const {
+
+    // every node must name a region (queries index the regions with it) and
+    // carry the subtree maximum that index() gives, or queries miss overlaps
+    for (uint64_t i = 0; i < m_num_nodes; ++i)
+      if (m_nodes[i].value < 0 || (uint64_t)m_nodes[i].value >= m_num_regions)
+	return false;
+    for (uint64_t i = 0; i < m_num_chroms; ++i)
+      if (!GenomicIntervalIndex::check(m_nodes + m_chroms[i].offset, m_chroms[i].count))
+	return false;
+    return true;
+  }
+
+  GenomicRegion MappedRegionCollection::operator[](size_t i) const {
+    GenomicRegion gr;
+    gr.chr = m_regions[i].chr;
+    gr.pos1 = m_regions[i].pos1;
+    gr.pos2 = m_regions[i].pos2;
+    gr.strand = m_regions[i].strand;
+    return gr;
+  }
+
+  GenomicRegion MappedRegionCollection::at(size_t i) const {
+    if (i >= m_num_regions)
+      throw std::out_of_range("MappedRegionCollection::at - index out of range");
+    return (*this)[i];
+  }
+
+  // counts only
+  struct MRCCounter {
+    void operator()(size_t) {}
+  };
+
+  size_t MappedRegionCollection::CountOverlaps(const GenomicRegion& gr, bool ignore_strand) const {
+    MRCCounter c;
+    return ForEachOverlap(gr, ignore_strand, c);
+  }
+
+  bool MappedRegionCollection::OverlapSameInterval(const GenomicRegion& gr, bool ignore_strand) const {
+    return CountOverlaps(gr, ignore_strand) > 0;
+  }
+
+  // collects the ids of overlapping regions
+  struct MRCIdCollector {
+    MRCIdCollector(std::vector<int>& o) : out(o) {}
+    void operator()(size_t i) { out.push_back(i); }
+    std::vector<int>& out;
+  };
+
+  std::vector<int> MappedRegionCollection::FindOverlappedIntervals(const GenomicRegion& gr, bool ignore_strand) const {
+    std::vector<int> out;
+    MRCIdCollector c(out);
+    ForEachOverlap(gr, ignore_strand, c);
+    return out;
+  }
+
+  GenomicRegionCollection<GenomicRegion> MappedRegionCollection::AsCollection() const {
+    GenomicRegionCollection<GenomicRegion> out;
+    for (size_t i = 0; i < m_num_regions; ++i)
+      out.add((*this)[i]);
+    return out;
+  }
+
+}
@@ -0,0 +1,386 @@
+#include "SeqLib/MotifMatcher.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <climits>
+
+// AVX2 lanes for the approximate matcher, picked at runtime so the library
+// can still be built for a generic x86-64 (as in BamRecord.cpp). Define
+// SEQLIB_NO_SIMD to disable.
+#if !defined(SEQLIB_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+  (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SEQLIB_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// columns per state, one per 4-bit BAM base code
+#define MOTIF_SHIFT 4
+#define NUM_SYMBOLS (1 << MOTIF_SHIFT)
+
+// symbol for '=' and for characters that are not a BAM base code
+#define MOTIF_OTHER 0
+
+// set on a transition into a state where a motif ends
+#define MOTIF_HIT 0x80000000u
+
+namespace SeqLib {
+
+  // the symbol of a packed base is its 4-bit code ("=ACMGRSVTWYHKDBN"), so
+  // IUPAC codes only match themselves, as they would in the decoded string
+  static inline uint8_t motif_symbol(char c) {
+    switch (c) {
+    case 'A': return 1;
+    case 'C': return 2;
+    case 'M': return 3;
+    case 'G': return 4;
+    case 'R': return 5;
+    case 'S': return 6;
+    case 'V': return 7;
+    case 'T': return 8;
+    case 'W': return 9;
+    case 'Y': return 10;
+    case 'H': return 11;
+    case 'K': return 12;
+    case 'D': return 13;
+    case 'B': return 14;
+    case 'N': return 15;
+    default: return MOTIF_OTHER;
+    }
+  }
+
+  MotifMatcher::MotifMatcher() : m_built(false) {}
+
+  bool MotifMatcher::AddMotif(const std::string& m) {
+    if (m.empty())
+      return false;
+    for (size_t i = 0; i < m.length(); ++i)
+      if (motif_symbol(m[i]) == MOTIF_OTHER)
+	return false;
+    if (m_motifs.insert(m).second)
+      m_built = false;
+    return true;
+  }
+
+  void MotifMatcher::Build() {
+
+    // trie of the motifs, with missing edges as 0 (the root has no parent)
+    m_next.assign(NUM_SYMBOLS, 0);
+    m_out.assign(1, 0);
+    for (std::set<std::string>::const_iterator m = m_motifs.begin(); m != m_motifs.end(); ++m) {
+      uint32_t s = 0;
+      for (size_t i = 0; i < m->length(); ++i) {
+	uint32_t& e = m_next[(s << MOTIF_SHIFT) | motif_symbol((*m)[i])];
+	if (!e) {
+	  e = m_out.size();
+	  m_out.push_back(0);
+	  m_next.resize(m_next.size() + NUM_SYMBOLS, 0);
+	}
+	s = m_next[(s << MOTIF_SHIFT) | motif_symbol((*m)[i])]; // e may be stale after the resize
+      }
+      ++m_out[s];
+    }
+
+    // breadth first, so the failure state of each state is complete before
+    // its children are reached. Missing edges take the edge of the failure
+    // state, and each state also reports the motifs of its failure state
+    std::vector<uint32_t> fail(m_out.size(), 0);
+    std::vector<uint32_t> queue;
+    queue.reserve(m_out.size());
+    for (int c = 0; c < NUM_SYMBOLS; ++c)
+      if (m_next[c])
+	queue.push_back(m_next[c]);
+
+    for (size_t q = 0; q < queue.size(); ++q) {
+      const uint32_t u = queue[q];
+      m_out[u] += m_out[fail[u]];
+      for (int c = 0; c < NUM_SYMBOLS; ++c) {
+	uint32_t& e = m_next[(u << MOTIF_SHIFT) | c];
+	const uint32_t f = m_next[(fail[u] << MOTIF_SHIFT) | c];
+	if (e) {
+	  fail[e] = f;
+	  queue.push_back(e);
+	} else {
+	  e = f;
+	}
+      }
+    }
+
+    for (size_t i = 0; i < m_next.size(); ++i)
+      if (m_out[m_next[i]])
+	m_next[i] |= MOTIF_HIT;
+
+    m_built = true;
+  }
+
+  void MotifMatcher::check_built() const {
+    if (!m_built)
+      throw std::runtime_error("MotifMatcher - Build() must be called after adding motifs");
+  }
+
+  bool MotifMatcher::Contains(const SequenceView& s) const {
+
+    check_built();
+
+    // two bases per byte of the packed sequence. A hit returns before the
+    // HIT bit could reach a row index
+    const uint8_t* p = s.data();
+    const int32_t n = s.size();
+    uint32_t st = 0;
+    for (int32_t i = 0; i < n >> 1; ++i) {
+      st = m_next[(st << MOTIF_SHIFT) | (p[i] >> 4)];
+      if (st & MOTIF_HIT)
+	return true;
+      st = m_next[(st << MOTIF_SHIFT) | (p[i] & 15)];
+      if (st & MOTIF_HIT)
+	return true;
+    }
+    if (n & 1)
+      st = m_next[(st << MOTIF_SHIFT) | (p[n >> 1] >> 4)];
+    return st & MOTIF_HIT;
+  }
+
+  bool MotifMatcher::Contains(const std::string& t) const {
+    check_built();
+    uint32_t st = 0;
+    for (size_t i = 0; i < t.length(); ++i) {
+      st = m_next[(st << MOTIF_SHIFT) | motif_symbol(t[i])];
+      if (st & MOTIF_HIT)
+	return true;
+    }
+    return false;
+  }
+
+  bool MotifMatcher::Contains(const BamRecord& r) const {
+    const char* gv = r.GetZTagChar("GV");
+    if (!gv || !*gv)
+      return Contains(r.GetSequenceView());
+
+    check_built();
+    uint32_t st = 0;
+    for (; *gv; ++gv) {
+      st = m_next[(st << MOTIF_SHIFT) | motif_symbol(*gv)];
+      if (st & MOTIF_HIT)
+	return true;
+    }
+    return false;
+  }
+
+  size_t MotifMatcher::Count(const SequenceView& s) const {
+    check_built();
+    size_t n = 0;
+    uint32_t st = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+      st = m_next[(st << MOTIF_SHIFT) | s.Code(i)] & ~MOTIF_HIT;
+      n += m_out[st];
+    }
+    return n;
+  }
+
+  size_t MotifMatcher::Count(const std::string& t) const {
+    check_built();
+    size_t n = 0;
+    uint32_t st = 0;
+    for (size_t i = 0; i < t.length(); ++i) {
+      st = m_next[(st << MOTIF_SHIFT) | motif_symbol(t[i])] & ~MOTIF_HIT;
+      n += m_out[st];
+    }
+    return n;
+  }
+
+  size_t MotifMatcher::MemoryBytes() const {
+    size_t n = sizeof(*this) + (m_next.capacity() + m_out.capacity()) * sizeof(uint32_t);
+    for (std::set<std::string>::const_iterator m = m_motifs.begin(); m != m_motifs.end(); ++m)
+      n += sizeof(*m) + m->capacity();
+    return n;
+  }
+
+  typedef ApproximateMotifMatcher::Group MyersGroup;
+  typedef ApproximateMotifMatcher::State MyersState;
+  typedef bool (*MyersKernel)(const MyersGroup&, const uint8_t*, int32_t, int64_t, MyersState&);
+
+  // one column of Myers' algorithm per symbol, for each lane of the group. A
+  // search can start anywhere in the text, so no horizontal delta comes in
+  // at the top row
+  static bool myers_scalar(const MyersGroup& g, const uint8_t* sym, int32_t n, int64_t k, MyersState& st) {
+    const int L = ApproximateMotifMatcher::LANES;
+    for (int32_t j = 0; j < n; ++j) {
+      bool hit = false;
+      for (int l = 0; l < L; ++l) {
+	const uint64_t eq = g.peq[sym[j]][l];
+	const uint64_t pv = st.pv[l];
+	const uint64_t mv = st.mv[l];
+	const uint64_t xv = eq | mv;
+	const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+	uint64_t ph = mv | ~(xh | pv);
+	uint64_t mh = pv & xh;
+	st.score[l] += (int64_t)((ph & g.high[l]) != 0) - (int64_t)((mh & g.high[l]) != 0);
+	ph <<= 1;
+	mh <<= 1;
+	st.pv[l] = mh | ~(xv | ph);
+	st.mv[l] = ph & xv;
+	hit |= st.score[l] <= k;
+      }
+      if (hit)
+	return true;
+    }
+    return false;
+  }
+
+#ifdef SEQLIB_X86_SIMD
+  // the four lanes of a group in one register. cmpeq gives -1 for a lane
+  // without a +1 (or -1) at the last row, so adding the +1 mask and taking
+  // the -1 mask moves the score by the delta
+  __attribute__((target("avx2")))
+  static bool myers_avx2(const MyersGroup& g, const uint8_t* sym, int32_t n, int64_t k, MyersState& st) {
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i high = _mm256_loadu_si256((const __m256i*)g.high);
+    const __m256i kv = _mm256_set1_epi64x(k);
+    __m256i pv = _mm256_loadu_si256((const __m256i*)st.pv);
+    __m256i mv = _mm256_loadu_si256((const __m256i*)st.mv);
+    __m256i score = _mm256_loadu_si256((const __m256i*)st.score);
+    bool hit = false;
+    for (int32_t j = 0; j < n && !hit; ++j) {
+      const __m256i eq = _mm256_loadu_si256((const __m256i*)g.peq[sym[j]]);
+      const __m256i xv = _mm256_or_si256(eq, mv);
+      const __m256i xh = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(eq, pv), pv), pv), eq);
+      __m256i ph = _mm256_or_si256(mv, _mm256_xor_si256(_mm256_or_si256(xh, pv), ones));
+      __m256i mh = _mm256_and_si256(pv, xh);
+      score = _mm256_add_epi64(score, _mm256_cmpeq_epi64(_mm256_and_si256(ph, high), zero));
+      score = _mm256_sub_epi64(score, _mm256_cmpeq_epi64(_mm256_and_si256(mh, high), zero));
+      ph = _mm256_slli_epi64(ph, 1);
+      mh = _mm256_slli_epi64(mh, 1);
+      pv = _mm256_or_si256(mh, _mm256_xor_si256(_mm256_or_si256(xv, ph), ones));
+      mv = _mm256_and_si256(ph, xv);
+      hit = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(score, kv))) != 0xF;
+    }
+    _mm256_storeu_si256((__m256i*)st.pv, pv);
+    _mm256_storeu_si256((__m256i*)st.mv, mv);
+    _mm256_storeu_si256((__m256i*)st.score, score);
+    return hit;
+  }
+#endif
+
+  static MyersKernel select_myers_kernel() {
+#ifdef SEQLIB_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return &myers_avx2;
+#endif
+    return &myers_scalar;
+  }
+
+  static MyersKernel myers_kernel() {
+    // resolved once, on first use
+    static const MyersKernel k = select_myers_kernel();
+    return k;
+  }
+
+  // symbols of a packed sequence, 256 at a time
+  struct MotifPackedSource {
+    MotifPackedSource(const uint8_t* d, int32_t len) : p(d), n(len), i(0) {}
+    void reset() { i = 0; }
+    int32_t operator()(uint8_t* out) {
+      int32_t c = 0;
+      for (; i < n && c < 256; ++i, ++c)
+	out[c] = bam_seqi(p, i);
+      return c;
+    }
+    const uint8_t* p;
+    int32_t n;
+    int32_t i;
+  };
+
+  // symbols of a string, 256 at a time
+  struct MotifCharSource {
+    MotifCharSource(const char* d, size_t len) : t(d), n(len), i(0) {}
+    void reset() { i = 0; }
+    int32_t operator()(uint8_t* out) {
+      int32_t c = 0;
+      for (; i < n && c < 256; ++i, ++c)
+	out[c] = motif_symbol(t[i]);
+      return c;
+    }
+    const char* t;
+    size_t n;
+    size_t i;
+  };
+
+  ApproximateMotifMatcher::ApproximateMotifMatcher(int max_edits) : m_count(0), m_max_edits(max_edits) {
+    if (max_edits < 0)
+      throw std::invalid_argument("ApproximateMotifMatcher - max_edits must be >= 0");
+  }
+
+  bool ApproximateMotifMatcher::AddMotif(const std::string& m) {
+
+    if (m.empty())
+      return false;
+    if (m.length() > 64)
+      throw std::invalid_argument("ApproximateMotifMatcher::AddMotif - motif is longer than 64 bases: " + m);
+    // with as many edits as bases, every position of any text is a hit
+    if ((int)m.length() <= m_max_edits)
+      throw std::invalid_argument("ApproximateMotifMatcher::AddMotif - motif is not longer than max_edits: " + m);
+    for (size_t i = 0; i < m.length(); ++i)
+      if (motif_symbol(m[i]) == MOTIF_OTHER)
+	return false;
+
+    const int l = m_count % LANES;
+    if (!l) {
+      // unused lanes never move from a score that cannot hit
+      Group g;
+      memset(&g, 0, sizeof(g));
+      for (int j = 0; j < LANES; ++j)
+	g.len[j] = INT_MAX;
+      m_groups.push_back(g);
+    }
+
+    Group& g = m_groups.back();
+    for (size_t i = 0; i < m.length(); ++i)
+      g.peq[motif_symbol(m[i])][l] |= (uint64_t)1 << i;
+    g.high[l] = (uint64_t)1 << (m.length() - 1);
+    g.len[l] = m.length();
+    ++m_count;
+    return true;
+  }
+
+  template <class S>
+  bool ApproximateMotifMatcher::scan(S& next) const {
+
+    const MyersKernel kernel = myers_kernel();
+    uint8_t buf[256];
+    for (size_t i = 0; i < m_groups.size(); ++i) {
+      const Group& g = m_groups[i];
+      State st;
+      for (int l = 0; l < LANES; ++l) {
+	st.pv[l] = ~(uint64_t)0;
+	st.mv[l] = 0;
+	st.score[l] = g.len[l];
+      }
+      next.reset();
+      int32_t n;
+      while ((n = next(buf)) > 0)
+	if (kernel(g, buf, n, m_max_edits, st))
+	  return true;
+    }
+    return false;
+  }
+
+  bool ApproximateMotifMatcher::Contains(const SequenceView& s) const {
+    MotifPackedSource src(s.data(), s.size());
+    return scan(src);
+  }
+
+  bool ApproximateMotifMatcher::Contains(const std::string& t) const {
+    MotifCharSource src(t.data(), t.length());
+    return scan(src);
+  }
+
+  bool ApproximateMotifMatcher::Contains(const BamRecord& r) const {
+    const char* gv = r.GetZTagChar("GV");
+    if (!gv || !*gv)
+      return Contains(r.GetSequenceView());
+    MotifCharSource src(gv, strlen(gv));
+    return scan(src);
+  }
+
+}
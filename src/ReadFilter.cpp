@@ -1,6 +1,8 @@
 #include "SeqLib/ReadFilter.h"
 
 #include <cassert>
+#include <cstring>
+#include <algorithm>
 #include "htslib/htslib/khash.h"
 
 //#define QNAME "D0EN0ACXX111207:7:2306:6903:136511"
@@ -8,6 +10,9 @@
 
 //#define DEBUG_MINI 1
 
+// region sets at least this large are queried through a RegionMask
+#define READ_FILTER_MASK_MIN 1000
+
 #ifdef QNAME
 #define DEBUGIV(msg, read)				\
   if (read.Qname() == QNAME && (read.AlignmentFlag() == QFLAG || QFLAG == -1)) { std::cerr << (msg) << " read " << r << std::endl; }
@@ -27,7 +32,7 @@ namespace SeqLib {
 #ifdef HAVE_C11
       && !aho.count
 #endif
-      ;
+      && !approx.count;
   }
 
 // define what is a valid condition
@@ -99,11 +104,16 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   if (!m_grv.size()) 
     return true;
 
-  if (m_grv.CountOverlaps(GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd())))
+  if (m_mask) {
+    if (m_mask->Overlaps(GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd())))
+      return true;
+  } else if (m_grv.CountOverlaps(GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd())))
     return true;
   
   if (!m_applies_to_mate)
     return false;
+  if (m_mask)
+    return m_mask->Overlaps(GenomicRegion(r.MateChrID(), r.MatePosition(), r.MatePosition() + r.Length()));
   if (m_grv.CountOverlaps(GenomicRegion(r.MateChrID(), r.MatePosition(), r.MatePosition() + r.Length())))
     return true;
 
@@ -121,6 +131,13 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   if (m_regions.size() == 0)
     return true;
 
+  if (m_program) {
+    if (!m_program->isValid(r))
+      return false;
+    ++m_count;
+    return true;
+  }
+
   DEBUGIV(r, "starting RFC isValid with non-empty regions")
   
     bool is_valid = false;
@@ -266,6 +283,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
     // make sure that there is at least one includer region
     this->CheckHasIncluder();
 
+    Compile();
   }
 
     void ReadFilterCollection::CheckHasIncluder() {
@@ -281,6 +299,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
 	mr.m_abstract_rules.push_back(rule_all);
 	mr.id = "WG_includer";
 	m_regions.push_back(mr);
+	m_program.reset();
       }
 
     }
@@ -288,12 +307,21 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   void ReadFilter::setRegions(const GRC& g) {
     m_grv = g;
     m_grv.CreateTreeMap();
+    build_mask();
   }
 
   void ReadFilter::addRegions(const GRC& g) {
     m_grv.Concat(g);
     m_grv.MergeOverlappingIntervals();
     m_grv.CreateTreeMap();
+    build_mask();
+  }
+
+  void ReadFilter::build_mask() {
+    if (m_grv.size() >= READ_FILTER_MASK_MIN)
+      m_mask = SeqPointer<RegionMask>(new RegionMask(m_grv));
+    else
+      m_mask.reset();
   }
 
 
@@ -332,6 +360,7 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
   void ReadFilterCollection::AddReadFilter(const ReadFilter& rf) {
     m_regions.push_back(rf);
+    m_program.reset();
   }
 
   ReadFilter::~ReadFilter() {}
@@ -452,6 +481,20 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
   }
 
 
+  // read group test of a rule, as ParseReadGroup() but without copying it out:
+  // the RG tag if present, else the qname up to the first ':', else "NA".
+  // An empty read group passes
+  static bool filter_read_group_ok(const BamRecord& r, const std::string& rg) {
+    const char* t = r.GetZTagChar("RG");
+    if (t)
+      return !*t || rg == t;
+    const char* qn = r.QnameChar();
+    const char* c = strchr(qn, ':');
+    if (!c)
+      return rg == "NA";
+    return c == qn || (rg.size() == (size_t)(c - qn) && !rg.compare(0, rg.size(), qn, c - qn));
+  }
+
     // main function for determining if a read is valid
     bool AbstractRule::isValid(const BamRecord &r) {
     
@@ -478,11 +521,8 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
     }
     
     // check for valid read name 
-    if (!read_group.empty()) {
-      std::string RG = r.ParseReadGroup();
-      if (!RG.empty() && RG != read_group)
-	return false;
-    }
+    if (!read_group.empty() && !filter_read_group_ok(r, read_group))
+      return false;
 
     // check for valid mapping quality
     if (!mapq.isEvery())
@@ -499,26 +539,31 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
     
     // check the CIGAR
     if (!ins.isEvery() || !del.isEvery()) {
-      if (!ins.isValid(r.MaxInsertionBases()))
+      const CigarSummary& cs = r.GetCigarSummary();
+      if (!ins.isValid(cs.max_insertion))
 	return false;
-      if (!del.isValid(r.MaxDeletionBases()))
+      if (!del.isValid(cs.max_deletion))
 	return false;
     }
 
     DEBUGIV(r, "cigar pass")
       
-    // get the sequence as trimmed
-    std::string tseq = r.QualitySequence(); //AddZTag("GV", r.Sequence().substr(startpoint, new_len));
-    
 #ifdef HAVE_C11
-    // check for aho corasick motif match
+    // check for aho corasick motif match, on the sequence as trimmed
     if (aho.count) {
-      if (!aho.QueryText(tseq))
+      if (aho.QueryRead(r) == aho.inv)
       return false;
       DEBUGIV(r, "aho pass")
     }
 #endif    
 
+    // check for motifs within an edit distance
+    if (approx.count) {
+      if (approx.QueryRead(r) == approx.inv)
+	return false;
+      DEBUGIV(r, "approximate motif pass")
+    }
+
     // check for valid NM
     if (!nm.isEvery()) {
       int32_t nm_val = 0;
@@ -536,17 +581,22 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
       DEBUGIV(r, "N bases pass")
     }
 
+    // length of the sequence as trimmed, read from the GV tag without a copy
+    const int32_t tlen = (len.isEvery() && clip.isEvery()) ? 0 : r.QualitySequenceLength();
+
     // check for valid length
-    if (!len.isValid(tseq.length())) {
+    if (!len.isValid(tlen)) {
       return false;
       DEBUGIV(r, "len pass")
     }
 
     // check for valid clip
-    int new_clipnum = r.NumClip() - (r.Length() - tseq.length()); // get clips, minus amount trimmed off
-    if (!clip.isValid(new_clipnum)) {
-      return false;
-      DEBUGIV(r, "clip pass with clip size " + tostring(new_clipnum))
+    if (!clip.isEvery()) {
+      int new_clipnum = r.GetCigarSummary().NumClip() - (r.Length() - tlen); // get clips, minus amount trimmed off
+      if (!clip.isValid(new_clipnum)) {
+	return false;
+	DEBUGIV(r, "clip pass with clip size " + tostring(new_clipnum))
+      }
     }
 
     // check for secondary alignments
@@ -605,7 +655,7 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
   // check for hard clips
   if (!hardclip.isNA())  {// check that we want to chuck hard clip
     if (r.CigarSize() > 1) {
-      bool ishclipped = r.NumHardClip() > 0;
+      bool ishclipped = r.GetCigarSummary().num_hard_clip > 0;
       if ( (ishclipped && hardclip.isOff()) || (!ishclipped && hardclip.isOn()) )
 	return false;
     }
@@ -656,6 +706,93 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
   
 }
 
+  // pair orientation from raw columns, as in BamRecord::PairOrientation
+  static inline int batch_pair_orientation(uint16_t f, int32_t pos, int32_t mpos) {
+    const bool rev = f & BAM_FREVERSE;
+    const bool mrev = f & BAM_FMREVERSE;
+    if ( (!rev && pos <= mpos && mrev) || (rev && pos >= mpos && !mrev) )
+      return FRORIENTATION;
+    else if (!rev && !mrev)
+      return FFORIENTATION;
+    else if (rev && mrev)
+      return RRORIENTATION;
+    return RFORIENTATION;
+  }
+
+  void FlagRule::isValid(const BamRecordBatch& batch, BatchMask& pass) const {
+
+    // flag-only conditions first, as one vectorized pass
+    uint16_t require = 0, exclude = 0;
+    if (dup.isOn())    require |= BAM_FDUP;
+    if (dup.isOff())   exclude |= BAM_FDUP;
+    if (supp.isOn())   require |= BAM_FSECONDARY;
+    if (supp.isOff())  exclude |= BAM_FSECONDARY;
+    if (qcfail.isOn()) require |= BAM_FQCFAIL;
+    if (qcfail.isOff()) exclude |= BAM_FQCFAIL;
+    if (mapped.isOn()) exclude |= BAM_FUNMAP;
+    if (mapped.isOff()) require |= BAM_FUNMAP;
+    if (mate_mapped.isOn()) exclude |= BAM_FMUNMAP;
+    if (mate_mapped.isOff()) require |= BAM_FMUNMAP;
+    batch.SelectFlag(isEvery() ? 0 : require, isEvery() ? 0 : exclude, pass);
+
+    if (isEvery() || batch.empty())
+      return;
+
+    const size_t n = batch.size();
+    const uint16_t* flag = &batch.AlignmentFlag()[0];
+    uint8_t* s = &pass[0];
+
+    if (m_all_on_flag || m_all_off_flag || m_any_on_flag || m_any_off_flag) {
+      for (size_t i = 0; i < n; ++i) {
+	const uint32_t f = flag[i];
+	s[i] &= (uint8_t)( (!m_all_on_flag  || (f & m_all_on_flag) == m_all_on_flag) &
+			   (!m_all_off_flag || (f & m_all_off_flag) != m_all_off_flag) &
+			   (!m_any_on_flag  || (f & m_any_on_flag) != 0) &
+			   (!m_any_off_flag || (f & m_any_off_flag) == 0) );
+      }
+    }
+
+    if (!hardclip.isNA()) {
+      const int32_t* hc = &batch.HardClip()[0];
+      const uint32_t* nc = &batch.CigarSize()[0];
+      for (size_t i = 0; i < n; ++i) {
+	const bool ishclipped = hc[i] > 0;
+	s[i] &= (uint8_t)(nc[i] <= 1 || !( (ishclipped && hardclip.isOff()) || (!ishclipped && hardclip.isOn()) ));
+      }
+    }
+
+    if (ff.isNA() && fr.isNA() && rf.isNA() && rr.isNA() && ic.isNA())
+      return;
+
+    const int32_t* tid = &batch.ChrID()[0];
+    const int32_t* mtid = &batch.MateChrID()[0];
+    const int32_t* pos = &batch.Position()[0];
+    const int32_t* mpos = &batch.MatePosition()[0];
+    for (size_t i = 0; i < n; ++i) {
+      if (!s[i])
+	continue;
+      const uint16_t f = flag[i];
+      // orientation needs both reads mapped
+      if ((f & BAM_FUNMAP) || (f & BAM_FMUNMAP) || !(f & BAM_FPAIRED)) {
+	s[i] = 0;
+	continue;
+      }
+      const bool bic = tid[i] != mtid[i];
+      if (!bic) {
+	const int PO = batch_pair_orientation(f, pos[i], mpos[i]);
+	if ( (PO == FRORIENTATION && fr.isOff()) || (PO != FRORIENTATION && fr.isOn()) ||
+	     (PO == RRORIENTATION && rr.isOff()) || (PO != RRORIENTATION && rr.isOn()) ||
+	     (PO == RFORIENTATION && rf.isOff()) || (PO != RFORIENTATION && rf.isOn()) ||
+	     (PO == FFORIENTATION && ff.isOff()) || (PO != FFORIENTATION && ff.isOn()) ) {
+	  s[i] = 0;
+	  continue;
+	}
+      }
+      if ( (bic && ic.isOff()) || (!bic && ic.isOn()) )
+	s[i] = 0;
+    }
+  }
+
 // define how to print
 std::ostream& operator<<(std::ostream &out, const AbstractRule &ar) {
 
@@ -687,8 +824,10 @@ std::ostream& operator<<(std::ostream &out, const AbstractRule &ar) {
       out << "sub:" << ar.subsam_frac << " -- ";
 #ifdef HAVE_C11
     if (ar.aho.count)
-      out << "motif: " << ar.aho.file << " -- ";
+      out << (ar.aho.inv ? "!" : "") << "motif: " << ar.aho.file << " -- ";
 #endif
+    if (ar.approx.count)
+      out << (ar.approx.inv ? "!" : "") << "motif: " << ar.approx.file << " (edits " << ar.approx.matcher->MaxEdits() << ") -- ";
     out << ar.fr;
   }
   return out;
@@ -801,21 +940,30 @@ std::ostream& operator<<(std::ostream &out, const Range &r) {
 
   void AbstractRule::parseSeqLine(const Json::Value& value) {
     
-#ifdef HAVE_C11
     bool i = false; // invert motif?
-#endif
-    std::string motif_file;
     Json::Value null(Json::nullValue);
-    if (value.get("motif", null) != null) 
-      motif_file = value.get("motif", null).asString();
-    else if (value.get("!motif", null) != null) {
-      motif_file = value.get("!motif", null).asString();
-#ifdef HAVE_C11
+    Json::Value m = value.get("motif", null);
+    if (m == null) {
+      m = value.get("!motif", null);
       i = true;
-#endif
     }
-    else
+    if (m == null)
+      return;
+
+    // "motif":"file" for exact matches, or "motif":{"file":"file","edits":2}
+    std::string motif_file;
+    int edits = 0;
+    if (m.isObject()) {
+      motif_file = m.get("file", "").asString();
+      edits = m.get("edits", 0).asInt();
+    } else {
+      motif_file = m.asString();
+    }
+
+    if (edits) {
+      addMotifRule(motif_file, edits, i);
       return;
+    }
 #ifdef HAVE_C11
     addMotifRule(motif_file, i);
 #else
@@ -847,11 +995,39 @@ std::ostream& operator<<(std::ostream &out, const Range &r) {
     // make the Aho-Corasick trie
     std::string pat;
     while (getline(iss, pat, '\n')) {
-      ++count;
-      AddMotif(pat);
+      aho_trie->insert(pat);
+      if (matcher->AddMotif(pat))
+	++count;
+      else if (!pat.empty())
+	std::cerr << "Warning: Skipping motif with a character outside ACMGRSVTWYHKDBN: " << pat << std::endl;
     }
+    matcher->Build();
   }
 #endif
+
+  void AbstractRule::addMotifRule(const std::string& f, int edits, bool inverted) {
+    std::cerr << "...loading motifs from " << f << " to match within " << edits << " edits" << std::endl;
+    approx.FromFile(f, edits);
+    std::cerr << "...finished loading " << AddCommas(approx.count) << " motifs" << std::endl;
+    approx.inv = inverted;
+  }
+
+  void ApproximateMotifs::FromFile(const std::string& f, int edits) {
+
+    file = f;
+
+    std::ifstream iss(f.c_str());
+    if (!iss || !read_access_test(f)) 
+      throw std::runtime_error("ApproximateMotifs::FromFile - Cannot read file: " + f);
+
+    matcher = SeqPointer<ApproximateMotifMatcher>(new ApproximateMotifMatcher(edits));
+    std::string pat;
+    while (getline(iss, pat, '\n'))
+      if (matcher->AddMotif(pat))
+	++count;
+      else if (!pat.empty())
+	std::cerr << "Warning: Skipping motif with a character outside ACMGRSVTWYHKDBN: " << pat << std::endl;
+  }
   
   void AbstractRule::parseSubLine(const Json::Value& value) {
     Json::Value null(Json::nullValue);
@@ -859,6 +1035,399 @@ std::ostream& operator<<(std::ostream &out, const Range &r) {
       subsam_frac = value.get("subample", null).asDouble();
   }
   
+  // reads profiled before a compiled program reorders its tests
+#define FILTER_PROGRAM_WARMUP 4096
+
+  ReadFilterCollection::ReadFilterCollection(const ReadFilterCollection& o) 
+    : rule_all(o.rule_all), m_count(o.m_count), m_count_seen(o.m_count_seen), m_regions(o.m_regions) {
+    // the program is profiled and reordered as it runs, so it is never shared
+    if (o.m_program)
+      m_program = SeqPointer<FilterProgram>(new FilterProgram(*o.m_program));
+  }
+
+  ReadFilterCollection& ReadFilterCollection::operator=(const ReadFilterCollection& o) {
+    if (this != &o) {
+      rule_all = o.rule_all;
+      m_count = o.m_count;
+      m_count_seen = o.m_count_seen;
+      m_regions = o.m_regions;
+      m_program = o.m_program ? SeqPointer<FilterProgram>(new FilterProgram(*o.m_program)) : SeqPointer<FilterProgram>();
+    }
+    return *this;
+  }
+
+  void ReadFilterCollection::Compile() {
+    m_program = SeqPointer<FilterProgram>(new FilterProgram());
+    m_program->compile(m_regions);
+  }
+
+  // rough relative cost of each test, in the order of the test codes
+  static const double FILTER_OP_COST[] = { 1, 3, 2, 2, 1, 3, 3, 4, 4, 6, 8, 10, 12, 20, 50, 200 };
+
+  void FilterProgram::domain(int code, int32_t& lo, int32_t& hi) {
+    lo = INT_MIN;
+    hi = INT_MAX;
+    if (code == OP_MAPQ)
+      hi = 255;
+    if (code == OP_MAPQ || code == OP_ISIZE || code == OP_INS || code == OP_DEL ||
+	code == OP_LEN || code == OP_NBASES || code == OP_XP)
+      lo = 0;
+  }
+
+  bool FilterProgram::add_range(std::vector<Op>& ops, int code, const Range& r) const {
+
+    if (r.isEvery())
+      return true;
+
+    int32_t lo, hi;
+    domain(code, lo, hi);
+    const int32_t a = std::max(r.lowerBound(), lo);
+    const int32_t b = std::min(r.upperBound(), hi);
+
+    if (r.isInverted()) {
+      if (a > b)
+	return true; // excludes nothing the field can hold
+      if (a == lo && b == hi)
+	return false; // excludes everything
+    } else {
+      if (a > b)
+	return false;
+      if (a == lo && b == hi)
+	return true;
+      // merge with a range already on this field
+      for (size_t i = 0; i < ops.size(); ++i)
+	if (ops[i].code == code && !ops[i].inverted) {
+	  ops[i].min = std::max(ops[i].min, a);
+	  ops[i].max = std::min(ops[i].max, b);
+	  return ops[i].min <= ops[i].max;
+	}
+    }
+
+    Op op = Op();
+    op.code = code;
+    op.min = r.isInverted() ? r.lowerBound() : a;
+    op.max = r.isInverted() ? r.upperBound() : b;
+    op.inverted = r.isInverted();
+    ops.push_back(op);
+    return true;
+  }
+
+  bool FilterProgram::compile_rule(const AbstractRule& ar, std::vector<Op>& ops) {
+
+    const FlagRule& f = ar.fr;
+
+    // all the flag conditions as bit masks
+    uint32_t on = f.m_all_on_flag, off = f.m_any_off_flag;
+    uint32_t any = f.m_any_on_flag, notall = f.m_all_off_flag;
+    if (f.dup.isOn()) on |= BAM_FDUP;
+    if (f.dup.isOff()) off |= BAM_FDUP;
+    if (f.supp.isOn()) on |= BAM_FSECONDARY;
+    if (f.supp.isOff()) off |= BAM_FSECONDARY;
+    if (f.qcfail.isOn()) on |= BAM_FQCFAIL;
+    if (f.qcfail.isOff()) off |= BAM_FQCFAIL;
+    if (f.mapped.isOn()) off |= BAM_FUNMAP;
+    if (f.mapped.isOff()) on |= BAM_FUNMAP;
+    if (f.mate_mapped.isOn()) off |= BAM_FMUNMAP;
+    if (f.mate_mapped.isOff()) on |= BAM_FMUNMAP;
+
+    // orientation rules need both reads mapped, then the allowed
+    // orientations are one lookup. Bits 0-3 are the intra-chromosomal
+    // orientations, bit 5 is inter-chromosomal
+    if (!f.ff.isNA() || !f.fr.isNA() || !f.rf.isNA() || !f.rr.isNA() || !f.ic.isNA()) {
+      on |= BAM_FPAIRED;
+      off |= BAM_FUNMAP | BAM_FMUNMAP;
+      const Flag* o[4];
+      o[FRORIENTATION] = &f.fr;
+      o[FFORIENTATION] = &f.ff;
+      o[RFORIENTATION] = &f.rf;
+      o[RRORIENTATION] = &f.rr;
+      int32_t mask = f.ic.isOff() ? 0 : 32;
+      for (int po = 0; po < 4; ++po) {
+	bool ok = !f.ic.isOn();
+	for (int k = 0; k < 4; ++k)
+	  if ((po == k && o[k]->isOff()) || (po != k && o[k]->isOn()))
+	    ok = false;
+	if (ok)
+	  mask |= 1 << po;
+      }
+      if (!mask)
+	return false;
+      if (mask != 47) {
+	Op op = Op();
+	op.code = OP_ORIENT;
+	op.min = mask;
+	ops.push_back(op);
+      }
+    }
+
+    // single-bit "any" and "not all" tests are plain on / off bits
+    if (any && !(any & (any - 1))) {
+      on |= any;
+      any = 0;
+    }
+    if (notall && !(notall & (notall - 1))) {
+      off |= notall;
+      notall = 0;
+    }
+    if (any & on)
+      any = 0;
+    if (notall & off)
+      notall = 0;
+    if ((on & off) || (any && !(any & ~off)) || (notall && !(notall & ~on)))
+      return false;
+
+    if (on || off || any || notall) {
+      Op op = Op();
+      op.code = OP_FLAG;
+      op.on = on;
+      op.off = off;
+      op.any = any;
+      op.notall = notall;
+      ops.push_back(op);
+    }
+
+    if (!f.hardclip.isNA()) {
+      Op op = Op();
+      op.code = OP_HARDCLIP;
+      op.min = f.hardclip.isOn();
+      ops.push_back(op);
+    }
+
+    if (!add_range(ops, OP_ISIZE, ar.isize) || !add_range(ops, OP_MAPQ, ar.mapq) ||
+	!add_range(ops, OP_INS, ar.ins) || !add_range(ops, OP_DEL, ar.del) ||
+	!add_range(ops, OP_LEN, ar.len) || !add_range(ops, OP_CLIP, ar.clip) ||
+	!add_range(ops, OP_NBASES, ar.nbases) || !add_range(ops, OP_NM, ar.nm) ||
+	!add_range(ops, OP_XP, ar.xp))
+      return false;
+
+    if (ar.subsam_frac < 1) {
+      if (ar.subsam_frac <= 0)
+	return false;
+      Op op = Op();
+      op.code = OP_SUBSAMPLE;
+      op.frac = ar.subsam_frac;
+      op.seed = ar.subsam_seed;
+      ops.push_back(op);
+    }
+
+    if (!ar.read_group.empty()) {
+      Op op = Op();
+      op.code = OP_RG;
+      ops.push_back(op);
+    }
+
+#ifdef HAVE_C11
+    if (ar.aho.count) {
+      Op op = Op();
+      op.code = OP_MOTIF;
+      op.inverted = ar.aho.inv;
+      ops.push_back(op);
+    }
+#endif
+
+    if (ar.approx.count) {
+      Op op = Op();
+      op.code = OP_APPROX_MOTIF;
+      op.inverted = ar.approx.inv;
+      ops.push_back(op);
+    }
+
+    return true;
+  }
+
+  bool FilterProgram::cost_less(const Op& a, const Op& b) {
+    return a.cost < b.cost;
+  }
+
+  void FilterProgram::compile(const std::vector<ReadFilter>& filters) {
+
+    m_filters = filters;
+    m_ops.clear();
+    m_clauses.clear();
+    m_blocks.clear();
+    m_profile = FILTER_PROGRAM_WARMUP;
+
+    // excluders, then includers
+    for (int pass = 0; pass < 2; ++pass) {
+      for (size_t i = 0; i < m_filters.size(); ++i) {
+	const ReadFilter& rf = m_filters[i];
+	if (rf.excluder != (pass == 0))
+	  continue;
+
+	Block bl;
+	bl.filter = i;
+	bl.excluder = rf.excluder;
+	bl.begin = m_clauses.size();
+
+	// an empty filter passes every read
+	std::vector<AbstractRule> every(1);
+	const std::vector<AbstractRule>& rules = rf.m_abstract_rules.empty() ? every : rf.m_abstract_rules;
+
+	for (size_t j = 0; j < rules.size(); ++j) {
+	  std::vector<Op> ops;
+	  if (!compile_rule(rules[j], ops))
+	    continue;
+	  for (size_t k = 0; k < ops.size(); ++k)
+	    ops[k].cost = FILTER_OP_COST[ops[k].code];
+	  std::stable_sort(ops.begin(), ops.end(), cost_less);
+
+	  Clause c;
+	  c.begin = m_ops.size();
+	  m_ops.insert(m_ops.end(), ops.begin(), ops.end());
+	  c.end = m_ops.size();
+	  c.filter = i;
+	  c.rule = j;
+	  c.evals = c.passes = 0;
+	  m_clauses.push_back(c);
+	}
+
+	bl.end = m_clauses.size();
+	if (bl.end > bl.begin) // a filter with no rule that can pass never decides a read
+	  m_blocks.push_back(bl);
+      }
+    }
+  }
+
+  bool FilterProgram::run_op(const Op& op, const Clause& c, const BamRecord& r, ReadCache& rc) const {
+
+    int32_t v = 0;
+    switch (op.code) {
+    case OP_FLAG: {
+      const uint32_t f = r.AlignmentFlag();
+      return (f & op.on) == op.on && !(f & op.off) &&
+	(!op.any || (f & op.any)) && (!op.notall || (f & op.notall) != op.notall);
+    }
+    case OP_HARDCLIP:
+      return r.CigarSize() <= 1 || (r.GetCigarSummary().num_hard_clip > 0) == (op.min != 0);
+    case OP_ORIENT:
+      return op.min & (r.Interchromosomal() ? 32 : 1 << r.PairOrientation());
+    case OP_SUBSAMPLE: {
+      const uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(r.QnameChar()) ^ op.seed);
+      return (double)(k&0xffffff) / 0x1000000 < op.frac;
+    }
+    case OP_RG:
+      return filter_read_group_ok(r, m_filters[c.filter].m_abstract_rules[c.rule].read_group);
+#ifdef HAVE_C11
+    case OP_MOTIF:
+      return m_filters[c.filter].m_abstract_rules[c.rule].aho.QueryRead(r) != op.inverted;
+#endif
+    case OP_APPROX_MOTIF:
+      return m_filters[c.filter].m_abstract_rules[c.rule].approx.QueryRead(r) != op.inverted;
+    case OP_ISIZE: v = r.FullInsertSize(); break;
+    case OP_MAPQ: v = r.MapQuality(); break;
+    case OP_INS: v = r.GetCigarSummary().max_insertion; break;
+    case OP_DEL: v = r.GetCigarSummary().max_deletion; break;
+    case OP_NBASES: v = r.CountNBases(); break;
+    case OP_NM: r.GetIntTag("NM", v); break;
+    case OP_XP: v = r.CountBWASecondaryAlignments(); break;
+    case OP_LEN:
+    case OP_CLIP:
+      if (rc.trimmed < 0)
+	rc.trimmed = r.QualitySequenceLength();
+      v = op.code == OP_LEN ? rc.trimmed : r.GetCigarSummary().NumClip() - (r.Length() - rc.trimmed);
+      break;
+    default: break;
+    }
+    return (v >= op.min && v <= op.max) != op.inverted;
+  }
+
+  bool FilterProgram::run_clause(Clause& c, const BamRecord& r, ReadCache& rc) {
+
+    if (!m_profile) {
+      for (size_t i = c.begin; i < c.end; ++i)
+	if (!run_op(m_ops[i], c, r, rc))
+	  return false;
+      return true;
+    }
+
+    ++c.evals;
+    for (size_t i = c.begin; i < c.end; ++i) {
+      ++m_ops[i].evals;
+      if (!run_op(m_ops[i], c, r, rc)) {
+	++m_ops[i].rejects;
+	return false;
+      }
+    }
+    ++c.passes;
+    return true;
+  }
+
+  bool FilterProgram::isValid(const BamRecord& r) {
+
+    if (m_profile && !--m_profile)
+      Optimize();
+
+    ReadCache rc;
+    for (size_t b = 0; b < m_blocks.size(); ++b) {
+      const Block& bl = m_blocks[b];
+      if (!m_filters[bl.filter].isReadOverlappingRegion(r))
+	continue;
+      for (size_t c = bl.begin; c < bl.end; ++c)
+	if (run_clause(m_clauses[c], r, rc))
+	  return !bl.excluder; // excluders come first, so the first hit decides
+    }
+    return false;
+  }
+
+  // cost of a test per read it rejects in the warm-up
+  bool FilterProgram::rank_less(const Op& a, const Op& b) {
+    const double pa = a.evals ? (double)a.rejects / a.evals : 0.5;
+    const double pb = b.evals ? (double)b.rejects / b.evals : 0.5;
+    return a.cost / std::max(pa, 0.001) < b.cost / std::max(pb, 0.001);
+  }
+
+  void FilterProgram::Optimize() {
+
+    for (size_t c = 0; c < m_clauses.size(); ++c)
+      std::stable_sort(m_ops.begin() + m_clauses[c].begin, m_ops.begin() + m_clauses[c].end, rank_less);
+
+    // clauses of a filter by cost per read passed, as any pass decides the filter
+    for (size_t b = 0; b < m_blocks.size(); ++b) {
+      std::vector<std::pair<double, size_t> > rank;
+      for (size_t c = m_blocks[b].begin; c < m_blocks[b].end; ++c) {
+	const Clause& cl = m_clauses[c];
+	double cost = 1;
+	for (size_t i = cl.begin; i < cl.end; ++i)
+	  cost += m_ops[i].cost;
+	const double p = cl.evals ? (double)cl.passes / cl.evals : 0.5;
+	rank.push_back(std::make_pair(cost / std::max(p, 0.001), c));
+      }
+      std::stable_sort(rank.begin(), rank.end());
+      std::vector<Clause> sorted;
+      for (size_t k = 0; k < rank.size(); ++k)
+	sorted.push_back(m_clauses[rank[k].second]);
+      std::copy(sorted.begin(), sorted.end(), m_clauses.begin() + m_blocks[b].begin);
+    }
+  }
+
+  std::ostream& operator<<(std::ostream& out, const FilterProgram& p) {
+    static const char* names[] = { "flag", "hardclip", "orientation", "isize", "mapq", "ins", "del", "length", "clip",
+				   "subsample", "nbases", "nm", "rg", "xp", "motif", "approx_motif" };
+    for (size_t b = 0; b < p.m_blocks.size(); ++b) {
+      const FilterProgram::Block& bl = p.m_blocks[b];
+      out << (bl.excluder ? "exclude" : "include") << " filter " << bl.filter << std::endl;
+      for (size_t c = bl.begin; c < bl.end; ++c) {
+	const FilterProgram::Clause& cl = p.m_clauses[c];
+	out << "  rule " << cl.rule << ":";
+	if (cl.begin == cl.end)
+	  out << " ALL";
+	for (size_t i = cl.begin; i < cl.end; ++i) {
+	  const FilterProgram::Op& op = p.m_ops[i];
+	  out << " " << names[op.code];
+	  if (op.code != FilterProgram::OP_FLAG && op.code != FilterProgram::OP_HARDCLIP &&
+	      op.code != FilterProgram::OP_ORIENT && op.code != FilterProgram::OP_SUBSAMPLE &&
+	      op.code != FilterProgram::OP_RG && op.code != FilterProgram::OP_MOTIF &&
+	      op.code != FilterProgram::OP_APPROX_MOTIF)
+	    out << (op.inverted ? " NOT " : " ") << "[" << op.min << "," << (op.max == INT_MAX ? "MAX" : tostring(op.max)) << "]";
+	  else if (op.inverted)
+	    out << " NOT";
+	}
+	out << std::endl;
+      }
+    }
+    return out;
+  }
+
 GRC ReadFilterCollection::getAllRegions() const
 {
   GRC out;
@@ -871,9 +1440,11 @@ GRC ReadFilterCollection::getAllRegions() const
     
 #ifdef HAVE_C11
     int AhoCorasick::QueryText(const std::string& t) const {
-      auto matches = aho_trie->parse_text(t);
-      return matches.size();
-      return 0;
+      return matcher->Count(t);
+    }
+
+    bool AhoCorasick::QueryRead(const BamRecord& r) const {
+      return matcher->Contains(r);
     }
 #endif
 
@@ -0,0 +1,207 @@
+#include "SeqLib/RegionMask.h"
+
+#include <algorithm>
+
+// 65536 positions per block
+#define MASK_SHIFT 16
+#define MASK_BLOCK (1 << MASK_SHIFT)
+#define MASK_WORDS (MASK_BLOCK / 64)
+
+// a run block is kept while it is no larger than a bitmap
+#define MASK_MAX_RUNS (MASK_WORDS * 8 / 4)
+
+namespace SeqLib {
+
+  // bits lo..hi (inclusive) of a word
+  static inline uint64_t mask_bits(int lo, int hi) {
+    return (~(uint64_t)0 >> (63 - hi)) & (~(uint64_t)0 << lo);
+  }
+
+  RegionMask::RegionMask(const GRC& g) {
+
+    // sorted, non-overlapping copy, without negative positions
+    GRC m;
+    for (size_t i = 0; i < g.size(); ++i) {
+      if (g[i].chr < 0 || g[i].pos2 < 0 || g[i].pos2 < g[i].pos1)
+	continue;
+      GenomicRegion gr;
+      gr.chr = g[i].chr;
+      gr.pos1 = g[i].pos1 < 0 ? 0 : g[i].pos1;
+      gr.pos2 = g[i].pos2;
+      m.add(gr);
+    }
+    m.MergeOverlappingIntervals();
+
+    if (m.size())
+      m_chr.resize(m[m.size() - 1].chr + 1);
+
+    // cut the regions at block boundaries and store each block once
+    std::vector<Run> runs;
+    int32_t chr = -1;
+    size_t block = 0;
+    for (size_t i = 0; i < m.size(); ++i) {
+      const GenomicRegion& gr = m[i];
+      const size_t first = (size_t)gr.pos1 >> MASK_SHIFT;
+      const size_t last = (size_t)gr.pos2 >> MASK_SHIFT;
+      for (size_t k = first; k <= last; ++k) {
+	if (gr.chr != chr || k != block) {
+	  if (!runs.empty())
+	    add_block(m_chr[chr], block, runs);
+	  runs.clear();
+	  chr = gr.chr;
+	  block = k;
+	}
+	Run r;
+	r.start = k == first ? gr.pos1 & (MASK_BLOCK - 1) : 0;
+	r.last = k == last ? gr.pos2 & (MASK_BLOCK - 1) : MASK_BLOCK - 1;
+	// adjacent regions (eg [1,5] [6,9]) are one run
+	if (!runs.empty() && runs.back().last + 1 == r.start)
+	  runs.back().last = r.last;
+	else
+	  runs.push_back(r);
+      }
+    }
+    if (!runs.empty())
+      add_block(m_chr[chr], block, runs);
+  }
+
+  void RegionMask::add_block(std::vector<uint32_t>& slots, size_t k, const std::vector<Run>& runs) {
+
+    if (k >= slots.size())
+      slots.resize(k + 1, EMPTY);
+
+    if (runs.size() == 1 && runs[0].start == 0 && runs[0].last == MASK_BLOCK - 1) {
+      slots[k] = FULL;
+      return;
+    }
+
+    Block b;
+    if (runs.size() <= MASK_MAX_RUNS) {
+      b.offset = m_runs.size();
+      b.n = runs.size();
+      m_runs.insert(m_runs.end(), runs.begin(), runs.end());
+    } else {
+      b.offset = m_bits.size();
+      b.n = 0;
+      m_bits.resize(m_bits.size() + MASK_WORDS, 0);
+      uint64_t* w = &m_bits[b.offset];
+      for (size_t i = 0; i < runs.size(); ++i) {
+	const int lo = runs[i].start, hi = runs[i].last;
+	const int wl = lo >> 6, wh = hi >> 6;
+	if (wl == wh) {
+	  w[wl] |= mask_bits(lo & 63, hi & 63);
+	} else {
+	  w[wl] |= mask_bits(lo & 63, 63);
+	  for (int j = wl + 1; j < wh; ++j)
+	    w[j] = ~(uint64_t)0;
+	  w[wh] |= mask_bits(0, hi & 63);
+	}
+      }
+    }
+
+    slots[k] = m_blocks.size() + 2;
+    m_blocks.push_back(b);
+  }
+
+  // orders runs by their last position, to find the first run reaching lo
+  struct MaskRunLast {
+    template <class R>
+    bool operator()(const R& r, int lo) const { return r.last < lo; }
+  };
+
+  uint32_t RegionMask::count_block(const Block& b, int lo, int hi, bool any) const {
+
+    uint32_t n = 0;
+
+    if (b.n) {
+      const Run* r = &m_runs[b.offset];
+      const Run* e = r + b.n;
+      for (r = std::lower_bound(r, e, lo, MaskRunLast()); r != e && r->start <= hi; ++r) {
+	n += std::min<int>(r->last, hi) - std::max<int>(r->start, lo) + 1;
+	if (any)
+	  return n;
+      }
+      return n;
+    }
+
+    const uint64_t* w = &m_bits[b.offset];
+    const int wl = lo >> 6, wh = hi >> 6;
+    if (wl == wh)
+      return __builtin_popcountll(w[wl] & mask_bits(lo & 63, hi & 63));
+
+    n = __builtin_popcountll(w[wl] & mask_bits(lo & 63, 63));
+    for (int i = wl + 1; i < wh && !(any && n); ++i)
+      n += __builtin_popcountll(w[i]);
+    if (!(any && n))
+      n += __builtin_popcountll(w[wh] & mask_bits(0, hi & 63));
+    return n;
+  }
+
+  bool RegionMask::Contains(int32_t chr, int32_t pos) const {
+    if (chr < 0 || pos < 0 || (size_t)chr >= m_chr.size())
+      return false;
+    const size_t k = (size_t)pos >> MASK_SHIFT;
+    if (k >= m_chr[chr].size())
+      return false;
+    const uint32_t s = m_chr[chr][k];
+    if (s == EMPTY || s == FULL)
+      return s == FULL;
+    const int p = pos & (MASK_BLOCK - 1);
+    return count_block(m_blocks[s - 2], p, p, true) != 0;
+  }
+
+  bool RegionMask::Overlaps(const GenomicRegion& gr) const {
+
+    if (gr.chr < 0 || gr.pos2 < 0 || gr.pos2 < gr.pos1 || (size_t)gr.chr >= m_chr.size())
+      return false;
+
+    const std::vector<uint32_t>& slots = m_chr[gr.chr];
+    const int32_t a = gr.pos1 < 0 ? 0 : gr.pos1;
+    const size_t first = (size_t)a >> MASK_SHIFT;
+    const size_t last = (size_t)gr.pos2 >> MASK_SHIFT;
+
+    for (size_t k = first; k <= last && k < slots.size(); ++k) {
+      const uint32_t s = slots[k];
+      if (s == EMPTY)
+	continue;
+      if (s == FULL)
+	return true;
+      const int lo = k == first ? a & (MASK_BLOCK - 1) : 0;
+      const int hi = k == last ? gr.pos2 & (MASK_BLOCK - 1) : MASK_BLOCK - 1;
+      if (count_block(m_blocks[s - 2], lo, hi, true))
+	return true;
+    }
+    return false;
+  }
+
+  uint64_t RegionMask::CountCovered(const GenomicRegion& gr) const {
+
+    if (gr.chr < 0 || gr.pos2 < 0 || gr.pos2 < gr.pos1 || (size_t)gr.chr >= m_chr.size())
+      return 0;
+
+    const std::vector<uint32_t>& slots = m_chr[gr.chr];
+    const int32_t a = gr.pos1 < 0 ? 0 : gr.pos1;
+    const size_t first = (size_t)a >> MASK_SHIFT;
+    const size_t last = (size_t)gr.pos2 >> MASK_SHIFT;
+
+    uint64_t n = 0;
+    for (size_t k = first; k <= last && k < slots.size(); ++k) {
+      const uint32_t s = slots[k];
+      if (s == EMPTY)
+	continue;
+      const int lo = k == first ? a & (MASK_BLOCK - 1) : 0;
+      const int hi = k == last ? gr.pos2 & (MASK_BLOCK - 1) : MASK_BLOCK - 1;
+      n += s == FULL ? (uint64_t)(hi - lo + 1) : count_block(m_blocks[s - 2], lo, hi, false);
+    }
+    return n;
+  }
+
+  size_t RegionMask::MemoryBytes() const {
+    size_t n = sizeof(*this) + m_blocks.capacity() * sizeof(Block) +
+      m_bits.capacity() * sizeof(uint64_t) + m_runs.capacity() * sizeof(Run);
+    for (size_t c = 0; c < m_chr.size(); ++c)
+      n += sizeof(m_chr[c]) + m_chr[c].capacity() * sizeof(uint32_t);
+    return n;
+  }
+
+}
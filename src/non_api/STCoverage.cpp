@@ -56,7 +56,7 @@ namespace SeqLib {
     int e = -1;
 
     if (full_length) {
-      Cigar c = r.GetCigar();
+      CigarView c = r.GetCigarView();
       // get beginning
       if (c.size() && c[0].RawType() == BAM_CSOFT_CLIP)
 	p = std::max((int32_t)0, r.Position() - (int32_t)c[0].Length()); // get prefixing S